@@ -0,0 +1,26 @@
+#pragma once
+
+#include "system/types.h"
+
+namespace lock
+{
+
+static inline constexpr size_t LOCKSTAT_NAME_MAX = 32;
+
+/// \brief contention statistics of one lock class, that is, all spinlocks sharing a name.
+/// times are in TSC cycles
+struct lockstat_record
+{
+	char name[LOCKSTAT_NAME_MAX];
+
+	uint64_t acquisitions;
+	uint64_t contentions; // acquisitions that had to spin
+
+	uint64_t spin_cycles;
+	uint64_t max_spin_cycles;
+
+	uint64_t hold_cycles;
+	uint64_t max_hold_cycles;
+};
+
+}
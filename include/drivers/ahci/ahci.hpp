@@ -2,6 +2,8 @@
 #include "system/types.h"
 #include "drivers/pci/pci_device.hpp"
 
+#include "task/thread/wait_queue.hpp"
+
 namespace ahci
 {
 	constexpr size_t AHCI_PCI_CLASS = 0x1;
@@ -324,6 +326,12 @@ namespace ahci
 	static_assert(sizeof(ahci_prd) == sizeof(uint32_t) * 4);
 
 	constexpr size_t AHCI_PRD_MAX_SIZE = 8192;
+
+	// each command table has room for this many PRDs
+	constexpr size_t AHCI_PRD_PER_COMMAND = 8;
+
+	// the most bytes a command transfers
+	constexpr size_t AHCI_COMMAND_MAX_SIZE = AHCI_PRD_MAX_SIZE * AHCI_PRD_PER_COMMAND;
 	struct ahci_command_table
 	{
 		union
@@ -347,6 +355,51 @@ namespace ahci
 
 	constexpr size_t AHCI_SPIN_WAIT_MAX = 0xBCAFFE;
 
+	constexpr size_t AHCI_PORT_COUNT = 32;
+
+	constexpr uint32_t AHCI_GHC_IE = 1u << 1u;
+
+	// PxIS and PxIE bits of a command finishing: D2H register FIS, PIO setup FIS, DMA setup FIS,
+	// set device bits FIS and descriptor processed
+	constexpr uint32_t AHCI_PORT_INT_DONE = 0b101111u;
+
+	// PxIS and PxIE bits of the errors that stop the port: interface fatal, host bus data,
+	// host bus fatal and task file error
+	constexpr uint32_t AHCI_PORT_INT_FATAL = (1u << 27u) | (1u << 28u) | (1u << 29u) | (1u << 30u);
+
+	// PxCMD start and command list running, PxTFD busy and data request
+	constexpr uint32_t AHCI_PORT_CMD_ST = 1u << 0u;
+	constexpr uint32_t AHCI_PORT_CMD_CR = 1u << 15u;
+	constexpr uint32_t AHCI_PORT_TFD_BSY = 1u << 7u;
+	constexpr uint32_t AHCI_PORT_TFD_DRQ = 1u << 3u;
+
+	/// \brief what the driver keeps for a port besides its registers
+	struct ahci_port_state
+	{
+		ahci_port* regs{ nullptr };
+
+		// completions are signalled by the controller interrupt, otherwise senders poll for them
+		bool interrupt{ false };
+
+		// command slots taken by senders, until they have collected the result
+		uint32_t busy TA_GUARDED(task::global_thread_lock){ 0 };
+
+		// slots issued to the device and not seen complete yet
+		uint32_t issued TA_GUARDED(task::global_thread_lock){ 0 };
+
+		// slots that completed with an error
+		uint32_t failed TA_GUARDED(task::global_thread_lock){ 0 };
+
+		// the port stopped on a fatal error, and commands fail right away until it is restarted
+		bool error TA_GUARDED(task::global_thread_lock){ false };
+
+		// the next sender restarts the port, which takes too long for the interrupt handler
+		bool needs_recovery TA_GUARDED(task::global_thread_lock){ false };
+
+		// senders waiting for their command to complete, or for a free slot
+		task::wait_queue waiters{};
+	};
+
 	struct ahci_controller
 	{
 		pci_device* pci_dev;
@@ -355,10 +408,19 @@ namespace ahci
 		ahci_device_type type;
 
 		list_head list;
+
+		ahci_port_state ports[AHCI_PORT_COUNT]{};
 	};
 
 	error_code ahci_init();
 
+	/// \brief the state of a port of a controller that has been found, nullptr if there isn't one
+	ahci_port_state* ahci_port_get_state(const ahci_port* port);
+
+	/// \brief collect the commands the port has completed, and wake up their senders.
+	/// It's called by the interrupt handle, and by senders that poll
+	void ahci_port_complete(ahci_port_state* state);
+
 	error_code ahci_port_send_command(ahci_port* port,
 		uint8_t cmd_id,
 		bool atapi,
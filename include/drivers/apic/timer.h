@@ -1,14 +1,29 @@
 #pragma once
 
 #include "system/types.h"
+#include "system/time.hpp"
 
 namespace timer
 {
 
+// the period of the scheduler tick on a CPU running threads, 100Hz
+constexpr duration_type TICK_PERIOD = 10'000'000;
+
 PANIC void init_apic_timer();
 
+/// \brief ticks elapsed since boot, derived from now()
 uint64_t get_ticks();
 
+/// \brief monotonic time in nanoseconds, read from the TSC.
+/// It is consistent among CPUs as long as the TSC is invariant
+time_type now();
+
+uint64_t tsc_frequency();
+
+/// \brief fire the timer interrupt of the current CPU once at the given time.
+/// TIME_INFINITE disarms it. Should be called with interrupts disabled
+void program_event(time_type when);
+
 /// \brief mask current cpu
 /// \param masked
 void mask_cpu_local_timer(bool masked);
@@ -19,4 +34,3 @@ void mask_cpu_local_timer(bool masked);
 void mask_cpu_local_timer(size_t cpuid, bool masked);
 
 } // namespace timer
-
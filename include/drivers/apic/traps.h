@@ -3,6 +3,8 @@
 #include "arch/amd64/cpu/regs.h"
 #include "arch/amd64/cpu/cpu.h"
 
+#include "system/error.hpp"
+
 #if !defined(ARCH_SPINLOCK)
 #include "debug/kdebug.h"
 #endif
@@ -90,6 +92,8 @@ enum irqs
 	IRQ_COM1 = 4,
 	IRQ_IDE = 14,
 	IRQ_ERROR = 19,
+	IRQ_RESCHEDULE = 28,
+	IRQ_TLB_SHOOTDOWN = 29,
 	IRQ_HALT_CPU_HANDLE = 30,
 	IRQ_SPURIOUS = 31,
 };
@@ -115,6 +119,9 @@ PANIC trap_handle trap_handle_register(size_t trapnumber, trap_handle handle);
 // enable the trap handle, returns the old state
 PANIC bool trap_handle_enable(size_t trapnumber, bool enable);
 
+// register the handle on a vector of its own, for a device to send MSIs to. returns the vector
+[[nodiscard]] error_code_with_result<size_t> msi_vector_allocate(trap_handle handle);
+
 PANIC [[deprecated("use arch-dependent interrupt saving")]] void pushcli();
 PANIC [[deprecated("use arch-dependent interrupt saving")]] void popcli();
 
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "system/types.h"
+#include "system/error.hpp"
+
+#include "fs/device/device.hpp"
+
+#include "kbl/lock/adaptive_mutex.hpp"
+
+namespace file_system
+{
+
+// the most buffers the cache keeps
+constexpr size_t BLOCK_CACHE_CAPACITY = 1024;
+
+// dirty buffers beyond this are written back by the next release. Otherwise they are written
+// when evicted, by block_cache_sync, and when the file system is disposed of on unmount
+constexpr size_t BLOCK_CACHE_DIRTY_LIMIT = BLOCK_CACHE_CAPACITY / 4;
+
+/// \brief a cached block of a device. It's returned locked by block_cache_get,
+/// and stays where it is in the cache until it's released.
+struct block_buffer
+{
+	device_class* dev{ nullptr };
+	size_t block{ 0 };
+	size_t block_size{ 0 };
+
+	uint8_t* data{ nullptr };
+
+	// the data matches the disk or has been fully written
+	bool valid{ false };
+	bool dirty{ false };
+
+	// both are protected by the cache lock
+	size_t refs{ 0 };
+	bool accessed{ false };
+
+	block_buffer* hash_next{ nullptr };
+
+	// serializes I/O and accesses to the data
+	kbl::adaptive_mutex lock{};
+};
+
+/// \brief get the buffer of a block, reading it from the device if fill is true and it's not cached.
+/// The buffer is locked, and must be released with block_cache_release
+[[nodiscard]] error_code_with_result<block_buffer*> block_cache_get(device_class* dev,
+	size_t block,
+	size_t block_size,
+	bool fill = true);
+
+/// \brief mark the data dirty. It's written back when evicted or synced
+void block_cache_mark_dirty(block_buffer* buf);
+
+void block_cache_release(block_buffer* buf);
+
+/// \brief copy a part of a block out of the cache
+[[nodiscard]] error_code block_cache_read(device_class* dev,
+	size_t block,
+	size_t block_size,
+	void* buf,
+	size_t offset,
+	size_t len);
+
+/// \brief copy a part of a block into the cache, which is written back later
+[[nodiscard]] error_code block_cache_write(device_class* dev,
+	size_t block,
+	size_t block_size,
+	const void* buf,
+	size_t offset,
+	size_t len);
+
+/// \brief read count contiguous blocks with a single device request.
+/// Blocks in the cache may be newer than the disk, so they are copied from it instead
+[[nodiscard]] error_code block_cache_read_run(device_class* dev,
+	size_t block,
+	size_t count,
+	size_t block_size,
+	void* buf);
+
+/// \brief write back all dirty buffers of a device, or of all devices if dev is null
+[[nodiscard]] error_code block_cache_sync(device_class* dev);
+
+/// \brief write back and forget all buffers of a device, which must not be in use
+[[nodiscard]] error_code block_cache_invalidate(device_class* dev);
+
+}
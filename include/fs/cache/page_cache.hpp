@@ -0,0 +1,118 @@
+#pragma once
+
+#include "system/types.h"
+#include "system/error.hpp"
+#include "system/mmu.h"
+
+#include "kbl/lock/adaptive_mutex.hpp"
+
+namespace file_system
+{
+
+class vnode_base;
+
+/// \brief sequential access state of an open file, kept for readahead
+struct file_readahead
+{
+	// the file offset the last read ended at
+	size_t next_pos{ 0 };
+
+	// pages before it have been read ahead
+	size_t end{ 0 };
+
+	// pages read ahead of the reader, growing while it reads sequentially
+	size_t window{ 0 };
+};
+
+/// \brief the cached content of a file, in small frames indexed by file offset / SMALL_PAGE_SIZE.
+/// Frames are reference counted by the pmm, so they can be mapped into address spaces
+/// and outlive their place in the cache.
+/// Writes go through to the file system first, and then update the pages that are cached.
+class page_cache final
+{
+ public:
+	static constexpr size_t RADIX_SHIFT = 6;
+	static constexpr size_t RADIX_SLOTS = 1ul << RADIX_SHIFT;
+
+	// enough levels to index any offset
+	static constexpr size_t RADIX_MAX_HEIGHT = (64 - 12 + RADIX_SHIFT - 1) / RADIX_SHIFT;
+
+	// pages beyond it are recycled from the same file
+	static constexpr size_t MAX_PAGES = 4096;
+
+	static constexpr size_t READAHEAD_INITIAL = 4;
+	static constexpr size_t READAHEAD_MAX = 32;
+
+	[[nodiscard]] explicit page_cache(vnode_base* owner)
+		: owner_(owner)
+	{
+	}
+
+	~page_cache();
+
+	page_cache(const page_cache&) = delete;
+	page_cache& operator=(const page_cache&) = delete;
+
+	/// \brief get the frame caching the page at index, filling it from the file if it isn't cached.
+	/// \return physical address of the frame, with a reference held for the caller to put
+	[[nodiscard]] error_code_with_result<uintptr_t> get_page(size_t index);
+
+	/// \brief copy [offset, offset+len) of the file out. The caller makes sure it's inside the file
+	[[nodiscard]] error_code read(size_t offset, void* buf, size_t len);
+
+	/// \brief bring in the pages a read of [pos, pos+len) needs, and more after them if the file is read
+	/// sequentially, in as few requests as the file system can make
+	void read_ahead(file_readahead* ra, size_t pos, size_t len, size_t file_size);
+
+	/// \brief copy into the pages of [offset, offset+len) that are cached, after the file has been written
+	void update(size_t offset, const void* buf, size_t len);
+
+	/// \brief forget pages beyond size, and zero the part of the last page beyond it
+	void truncate(size_t size);
+
+ private:
+	struct radix_node
+	{
+		// physical addresses of frames in leaves, child nodes elsewhere
+		uintptr_t slots[RADIX_SLOTS]{};
+		size_t count{ 0 };
+	};
+
+	[[nodiscard]] uintptr_t lookup(size_t index) TA_REQ(lock_);
+
+	[[nodiscard]] error_code insert(size_t index, uintptr_t pa) TA_REQ(lock_);
+
+	/// \return the frame removed, 0 if there isn't one
+	uintptr_t remove(size_t index) TA_REQ(lock_);
+
+	/// \brief find the first cached page at or after index
+	[[nodiscard]] bool next_present(size_t index, OUT size_t* found) TA_REQ(lock_);
+
+	/// \brief drop an unmapped page to make room for another
+	void evict_one() TA_REQ(lock_);
+
+	/// \brief fill the pages from index on that aren't cached, without evicting others for them
+	void fill_range(size_t index, size_t count) TA_REQ(lock_);
+
+	[[nodiscard]] size_t capacity() const TA_REQ(lock_)
+	{
+		return height_ >= RADIX_MAX_HEIGHT ? SIZE_MAX : 1ul << (height_ * RADIX_SHIFT);
+	}
+
+	static bool find_next(radix_node* node, size_t level, size_t base, size_t index, OUT size_t* found);
+
+	static void free_node(radix_node* node, size_t level);
+
+	vnode_base* owner_{ nullptr };
+
+	radix_node* root_ TA_GUARDED(lock_){ nullptr };
+	size_t height_ TA_GUARDED(lock_){ 0 };
+
+	size_t page_count_ TA_GUARDED(lock_){ 0 };
+	size_t evict_hand_ TA_GUARDED(lock_){ 0 };
+
+	// also serializes filling pages, so each page is read only once
+	kbl::adaptive_mutex lock_{};
+};
+
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "system/types.h"
+#include "system/error.hpp"
+
+#include "kbl/lock/adaptive_mutex.hpp"
+
+namespace file_system
+{
+	struct ext2_inode;
+
+	/// \brief where the blocks of recently used inodes are, so that mapping a file offset to a block
+	/// is a memory lookup unless the file is accessed somewhere new.
+	/// Maps are keyed by the in-memory inode, and recycled in LRU order
+	class ext2_block_map_cache final
+	{
+	 public:
+		static constexpr size_t MAP_COUNT = 32;
+
+		// enough for the path through a triple indirect block, and one more
+		static constexpr size_t INDIRECT_PER_MAP = 4;
+
+		struct indirect_block
+		{
+			// the block number, 0 if the slot is unused
+			uint32_t block{ 0 };
+			uint32_t* addrs{ nullptr };
+			size_t last_use{ 0 };
+		};
+
+		struct block_map
+		{
+			const ext2_inode* inode{ nullptr };
+			size_t last_use{ 0 };
+
+			// the last run of logical blocks found contiguous on disk:
+			// [extent_index, extent_index + extent_length) is at [extent_block, extent_block + extent_length)
+			uint32_t extent_index{ 0 };
+			uint32_t extent_block{ 0 };
+			uint32_t extent_length{ 0 };
+
+			indirect_block indirect[INDIRECT_PER_MAP]{};
+		};
+
+		ext2_block_map_cache() = default;
+		~ext2_block_map_cache();
+
+		ext2_block_map_cache(const ext2_block_map_cache&) = delete;
+		ext2_block_map_cache& operator=(const ext2_block_map_cache&) = delete;
+
+		/// \brief the map of an inode, recycling the least recently used one if it has none
+		[[nodiscard]] block_map* get(const ext2_inode* inode) TA_REQ(lock_);
+
+		/// \brief the cached copy of an indirect block of a map, or the least recently used slot
+		/// to read it into, which the caller fills and then sets the block number of
+		[[nodiscard]] error_code_with_result<indirect_block*> get_indirect(block_map* map,
+			uint32_t block,
+			size_t block_size) TA_REQ(lock_);
+
+		/// \brief drop what is known about an inode, after its blocks are freed or it goes away
+		void forget(const ext2_inode* inode) TA_EXCL(lock_);
+
+		/// \brief drop what is known about an inode, with the lock held
+		void forget_locked(const ext2_inode* inode) TA_REQ(lock_);
+
+		[[nodiscard]] kbl::adaptive_mutex& lock() TA_RET_CAP(lock_)
+		{
+			return lock_;
+		}
+
+	 private:
+		static void reset(block_map* map);
+
+		block_map maps_[MAP_COUNT] TA_GUARDED(lock_){};
+		size_t clock_ TA_GUARDED(lock_){ 0 };
+
+		// held across reading indirect blocks, which come from the block cache
+		kbl::adaptive_mutex lock_{};
+	};
+}
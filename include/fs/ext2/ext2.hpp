@@ -5,12 +5,14 @@
 #include "system/kmem.hpp"
 
 #include "fs/vfs/vfs.hpp"
+#include "fs/ext2/block_map.hpp"
 
 #include <optional>
 
 namespace file_system
 {
 	constexpr uint16_t EXT2_SIGNATURE = 0xEF53;
+	constexpr size_t EXT2_SUPERBLOCK_OFFSET = 1024;
 	constexpr size_t EXT2_DIRECT_BLOCK_COUNT = 12;
 
 	enum ext2_inode_type
@@ -262,6 +264,8 @@ namespace file_system
 		ext2_inode* root_inode{};
 		memory::kmem::kmem_cache* inode_cache{};
 
+		ext2_block_map_cache block_maps{};
+
 	 public:
 		[[nodiscard]]  ext2_block_group_desc& get_bgd_by_index(size_t index)
 		{
@@ -308,6 +312,11 @@ namespace file_system
 			return bgdt;
 		}
 
+		[[nodiscard]] ext2_block_map_cache& get_block_maps()
+		{
+			return block_maps;
+		}
+
 		[[nodiscard]] error_code_with_result<ext2_inode*> create_new_inode();
 		void free_inode(ext2_inode* nd);
 	 public:
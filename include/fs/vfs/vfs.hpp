@@ -8,8 +8,10 @@
 #include "kbl/data/list.hpp"
 
 #include "fs/device/device.hpp"
+#include "fs/cache/page_cache.hpp"
 
 #include "kbl/lock/spinlock.h"
+#include "kbl/lock/adaptive_mutex.hpp"
 
 namespace file_system
 {
@@ -142,6 +144,8 @@ struct file_object
 
 	vnode_base* vnode;
 	void* private_data;
+
+	file_readahead readahead{};
 };
 
 struct file_status
@@ -303,7 +307,9 @@ class vnode_base
 
 	void* private_data{};
 
-	lock::spinlock lockable{ "vnode_base" };
+	kbl::adaptive_mutex lockable{};
+
+	page_cache pages{ this };
 
 	kbl::list_link<vnode_base, lock::spinlock> child_link{ this };
 
@@ -432,24 +438,26 @@ class vnode_base
 		vnode_base::type = t;
 	}
 
+	// file descriptors and the address space segments mapping the file both hold it open
+
 	[[nodiscard]] size_t get_open_count() const
 	{
-		return open_count;
+		return __atomic_load_n(&open_count, __ATOMIC_ACQUIRE);
 	}
 
 	void set_open_count(size_t oc)
 	{
-		vnode_base::open_count = oc;
+		__atomic_store_n(&open_count, oc, __ATOMIC_RELEASE);
 	}
 
 	void increase_open_count()
 	{
-		vnode_base::open_count++;
+		__atomic_fetch_add(&open_count, 1, __ATOMIC_ACQ_REL);
 	}
 
 	void decrease_open_count()
 	{
-		vnode_base::open_count--;
+		__atomic_fetch_sub(&open_count, 1, __ATOMIC_ACQ_REL);
 	}
 
 	[[nodiscard]]size_t get_inode_id() const
@@ -462,6 +470,11 @@ class vnode_base
 		return uid;
 	}
 
+	[[nodiscard]] page_cache* get_page_cache()
+	{
+		return &pages;
+	}
+
  public:
 
 	error_code attach(vnode_base* child);
@@ -496,6 +509,27 @@ class vnode_base
 	virtual error_code_with_result<size_t> read(file_object* fd, void* buf, size_t count) = 0;
 	virtual error_code_with_result<size_t> write(file_object* fd, const void* buf, size_t count) = 0;
 
+	/// \brief read the page at index * SMALL_PAGE_SIZE of the file into a zeroed frame of the page cache
+	OPTIONAL_SUPPORT virtual error_code fill_page([[maybe_unused]] size_t index, [[maybe_unused]] void* page)
+	{
+		return -ERROR_UNSUPPORTED;
+	}
+
+	/// \brief fill count consecutive pages from index on. File systems that can read them with fewer
+	/// requests than one per page should override it
+	OPTIONAL_SUPPORT virtual error_code fill_pages(size_t index, void** pages, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			if (auto err = fill_page(index + i, pages[i]);err != ERROR_SUCCESS)
+			{
+				return err;
+			}
+		}
+
+		return ERROR_SUCCESS;
+	}
+
  public:
 
 	friend error_code init_devfs_root();
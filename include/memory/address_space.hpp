@@ -32,6 +32,12 @@
 #include "system/vmm.h"
 
 #include "kbl/data/list.hpp"
+#include "kbl/data/avl_tree.hpp"
+
+namespace file_system
+{
+class vnode_base;
+}
 
 namespace memory
 {
@@ -49,9 +55,17 @@ class address_space_segment final
 {
  public:
 	friend class address_space;
+
+	// the count of small pages mapped by a page fault grows up to it on sequential faults
+	static constexpr size_t FAULT_AROUND_MAX = 16;
+
 	using link_type = kbl::list_link<address_space_segment, lock::spinlock>;
 
-	[[nodiscard]] address_space_segment(uintptr_t vm_start, uintptr_t vm_end, uint64_t vm_flags);
+	[[nodiscard]] address_space_segment(uintptr_t vm_start,
+		uintptr_t vm_end,
+		uint64_t vm_flags,
+		file_system::vnode_base* file = nullptr,
+		size_t file_offset = 0);
 	~address_space_segment();
 	address_space_segment(address_space_segment&& another);
 
@@ -75,6 +89,25 @@ class address_space_segment final
 		return flags_;
 	}
 
+	/// \brief the file mapped by the segment, nullptr if it's anonymous
+	[[nodiscard]] file_system::vnode_base* file() const
+	{
+		return file_;
+	}
+
+	/// \brief offset in the file of the page at start
+	[[nodiscard]] size_t file_offset() const
+	{
+		return file_offset_;
+	}
+
+	/// \brief whether the large page containing addr can be mapped as a whole
+	[[nodiscard]] bool large_page_fit(uintptr_t addr) const;
+
+	/// \brief record a fault on a small page
+	/// \return count of small pages to map from addr on
+	size_t fault_around(uintptr_t addr);
+
  private:
 
 	uintptr_t start_{ 0 };
@@ -82,6 +115,13 @@ class address_space_segment final
 
 	uint64_t flags_{ 0 };
 
+	// pages of a file segment come from the page cache of the file
+	file_system::vnode_base* file_{ nullptr };
+	size_t file_offset_{ 0 };
+
+	uintptr_t next_fault_ TA_GUARDED(lock_){ 0 };
+	size_t fault_around_ TA_GUARDED(lock_){ 1 };
+
 	class address_space* parent_{ nullptr };
 
 	lock::spinlock lock_{ "ass" };
@@ -98,6 +138,9 @@ class address_space final
 	                                                                 &address_space_segment::link_,
 	                                                                 true>;
 
+	// segments indexed by their end address, which is unique because they never overlap
+	using segment_index_type = AVLTree<uintptr_t, address_space_segment*>;
+
 	address_space();
 	address_space(address_space&& another);
 	~address_space();
@@ -109,6 +152,14 @@ class address_space final
 
 	error_code_with_result<address_space_segment*> map(uintptr_t addr, size_t len, uint64_t flags);
 
+	/// \brief map [offset, offset+len) of a file to addr privately. Pages are shared with the page cache
+	/// of the file until they are written.
+	error_code_with_result<address_space_segment*> map(uintptr_t addr,
+		size_t len,
+		uint64_t flags,
+		file_system::vnode_base* file,
+		size_t offset);
+
 	error_code_with_result<address_space_segment*> mm_fpage_map(address_space* to,
 		const task::ipc::fpage& send,
 		const task::ipc::fpage& receive);
@@ -123,7 +174,7 @@ class address_space final
 
 	error_code resize(uintptr_t addr, size_t len);
 
-	void insert_vma(address_space_segment* vma);
+	error_code insert_vma(address_space_segment* vma);
 
 	address_space_segment* find_vma(uintptr_t addr);
 
@@ -183,12 +234,26 @@ class address_space final
 		return pgdir_;
 	}
 
+	/// \brief the lock of the address space, which page faults hold while they change present mappings
+	[[nodiscard]] lock::spinlock& fault_lock() TA_RET_CAP(lock_)
+	{
+		return lock_;
+	}
+
+	/// \brief find_vma for page faults, which hold fault_lock() while they look up and map
+	address_space_segment* find_vma_locked(uintptr_t addr) TA_ASSERT(lock_);
+
  private:
 	void assert_segment_overlap(address_space_segment* prev, address_space_segment* next);
 
-	void insert_vma_locked(address_space_segment* vma) TA_ASSERT(lock_);
+	error_code insert_vma_locked(address_space_segment* vma) TA_ASSERT(lock_);
 
-	address_space_segment* find_vma_locked(uintptr_t addr) TA_ASSERT(lock_);
+	void remove_vma_locked(address_space_segment* vma) TA_ASSERT(lock_);
+
+	/// \brief the first segment which ends above addr
+	address_space_segment* upper_vma_locked(uintptr_t addr) TA_ASSERT(lock_);
+
+	error_code unmap_locked(uintptr_t start, uintptr_t end) TA_ASSERT(lock_);
 
 	error_code resize_locked(uintptr_t addr, size_t len) TA_ASSERT(lock_);
 
@@ -196,7 +261,7 @@ class address_space final
 	uintptr_t uheap_begin_ TA_GUARDED(lock_) { 0 };
 	uintptr_t uheap_end_ TA_GUARDED(lock_){ 0 };
 
-	address_space_segment* search_cache_ TA_GUARDED(lock_) { nullptr };
+	segment_index_type segment_index_ TA_GUARDED(lock_) {};
 
 	vmm::pde_ptr_t pgdir_ TA_GUARDED(lock_) { nullptr };
 
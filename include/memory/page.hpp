@@ -12,12 +12,13 @@ enum [[clang::flag_enum]] page_flags
 	PHYSICAL_PAGE_FLAG_ACTIVE = 0b100,
 	PHYSICAL_PAGE_FLAG_DIRTY = 0b1000,
 	PHYSICAL_PAGE_FLAG_SWAP = 0b1000,
+	PHYSICAL_PAGE_FLAG_SPLIT = 0b10000, // split into small frames
 };
 
 // Physical memory pages
 struct page
 {
-	size_t ref;
+	size_t ref; // mappings and pins of a large page, which only change by page_ref_get/put
 	size_t flags;
 	size_t property;
 	size_t zone_id;
@@ -39,3 +40,21 @@ static inline void page_clear_flag(page* pg, page_flags fl)
 {
 	pg->flags &= ~fl;
 }
+
+// a large page is mapped and pinned by several address spaces at once, and each holds a reference
+static inline void page_ref_get(page* pg)
+{
+	__atomic_add_fetch(&pg->ref, 1, __ATOMIC_RELAXED);
+}
+
+/// \brief drop a reference of the page
+/// \return the references left, and the page can be freed at zero
+static inline size_t page_ref_put(page* pg)
+{
+	return __atomic_sub_fetch(&pg->ref, 1, __ATOMIC_ACQ_REL);
+}
+
+static inline size_t page_ref_count(const page* pg)
+{
+	return __atomic_load_n(&pg->ref, __ATOMIC_ACQUIRE);
+}
@@ -9,6 +9,7 @@
 #include "memory/fpage.hpp"
 #include "memory/pmm_provider.hpp"
 #include "memory/buddy_provider.hpp"
+#include "memory/small_frame_provider.hpp"
 
 namespace memory
 {
@@ -20,6 +21,32 @@ class physical_memory_manager final
  public:
 	using provider_type = buddy_provider;
 
+	// should be equal to CPU_COUNT_LIMIT, which is checked in pmm.cc
+	static constexpr size_t CPU_CACHE_COUNT = 8;
+
+	static constexpr size_t CPU_CACHE_HIGH_DEFAULT = 8;
+	static constexpr size_t CPU_CACHE_LOW_DEFAULT = 4;
+	static constexpr size_t CPU_CACHE_BATCH_DEFAULT = 4;
+
+	// pages zeroed by idle CPUs, which are taken by page faults
+	static constexpr size_t ZEROED_POOL_TARGET = 4;
+	static constexpr size_t ZEROED_SMALL_BUDGET = 16;
+	static constexpr size_t ZEROED_CHUNK_SIZE = 64 * 1024;
+	static_assert(PAGE_SIZE % ZEROED_CHUNK_SIZE == 0);
+
+	// single pages cached by a CPU, which are only touched by the owner with interrupts disabled.
+	// recently freed (hot) pages are at the head, and batch refilled (cold) pages at the tail.
+	struct cpu_page_cache
+	{
+		list_head pages;
+		size_t count;
+
+		size_t alloc_hits;
+		size_t free_hits;
+		size_t refills;
+		size_t drains;
+	};
+
 	physical_memory_manager(const physical_memory_manager&) = delete;
 	physical_memory_manager& operator=(const physical_memory_manager&) = delete;
 
@@ -49,9 +76,39 @@ class physical_memory_manager final
 	void free(page* base);
 	void free(page* base, size_t n);
 
+	/// \brief allocate a zeroed page, which is taken from the pre-zeroed pool if possible
+	[[nodiscard]] page* allocate_zeroed();
+
+	/// \brief zero some free small frames and a piece of a free page ahead of time. called by idle threads.
+	/// \return true if there is more to zero
+	bool zero_idle_pages();
+
+	/// \brief allocate a zeroed small frame
+	/// \return physical address of the frame, 0 if failed
+	[[nodiscard]] uintptr_t allocate_small();
+	[[nodiscard]] error_code_with_result<uintptr_t> allocate_small(uintptr_t va,
+		uint64_t perm,
+		vmm::pde_ptr_t pgdir,
+		bool rewrite_if_exist);
+
+	void get_small(uintptr_t pa);
+	size_t put_small(uintptr_t pa);
+	[[nodiscard]] size_t small_ref(uintptr_t pa) const;
+
 	[[nodiscard]] size_t free_count() const;
 
+	/// \brief tune the per-cpu page caches
+	/// \param high a CPU gives pages back to the provider when it caches more than high pages
+	/// \param low the count of pages left after giving back
+	/// \param batch pages taken from the provider when the cache is empty
+	void set_cpu_cache_watermark(size_t high, size_t low, size_t batch);
+
+	[[nodiscard]] cpu_page_cache cpu_cache_statistics(size_t cpu_id) const;
+
 	error_code insert_page(page* page, uintptr_t va, uint64_t perm, vmm::pde_ptr_t pgdir, bool allow_rewrite);
+	error_code insert_small_page(uintptr_t pa, uintptr_t va, uint64_t perm, vmm::pde_ptr_t pgdir, bool allow_rewrite);
+
+	// remove the mapping of va, no matter it is mapped by a large or small page
 	void remove_page(uintptr_t va, vmm::pde_ptr_t pgdir);
 
 	// TODO: this should belong to VMM
@@ -63,8 +120,29 @@ class physical_memory_manager final
 
 	page* allocate_locked(size_t n);
 
+	page* cpu_cache_allocate();
+	void cpu_cache_free(page* pg);
+
+	void cpu_cache_refill(cpu_page_cache* cache);
+	void cpu_cache_drain(cpu_page_cache* cache, size_t target);
+
 	provider_type provider_{};
 	mutable lock::spinlock lock_{ "pmm" };
+
+	small_frame_provider small_frames_{};
+
+	list_head zeroed_pages_ TA_GUARDED(lock_){};
+	size_t zeroed_count_ TA_GUARDED(lock_){ 0 };
+
+	// the page idle CPUs are zeroing, and how much of it is done
+	page* zeroing_page_ TA_GUARDED(lock_){ nullptr };
+	size_t zeroing_offset_ TA_GUARDED(lock_){ 0 };
+
+	cpu_page_cache cpu_caches_[CPU_CACHE_COUNT]{};
+
+	size_t cpu_cache_high_{ CPU_CACHE_HIGH_DEFAULT };
+	size_t cpu_cache_low_{ CPU_CACHE_LOW_DEFAULT };
+	size_t cpu_cache_batch_{ CPU_CACHE_BATCH_DEFAULT };
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,105 @@
+// Copyright (c) 2021 SmartPolarBear
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "system/types.h"
+#include "system/mmu.h"
+
+#include "kbl/lock/spinlock.h"
+
+#include "memory/page.hpp"
+
+namespace memory
+{
+
+/// \brief provides small frames for 4KiB mappings by splitting physical pages.
+/// The first frame of a split page holds the block header, so that the header
+/// of any small frame is found by rounding its physical address down.
+class small_frame_provider final
+{
+ public:
+	static constexpr size_t FRAMES_PER_PAGE = PAGE_SIZE / SMALL_PAGE_SIZE;
+	static constexpr size_t BITMAP_WORD_BITS = sizeof(uint64_t) * 8;
+
+	// frames zeroed at most by a single prezero() call
+	static constexpr size_t PREZERO_BATCH = 16;
+
+	struct block
+	{
+		list_head block_link;
+		page* backing;
+		size_t free_count;
+		uint64_t bitmap[FRAMES_PER_PAGE / BITMAP_WORD_BITS]; // 1 for in-use
+		uint64_t zeroed[FRAMES_PER_PAGE / BITMAP_WORD_BITS]; // 1 for free frames known to be zero
+		uint16_t refs[FRAMES_PER_PAGE];
+	};
+	static_assert(sizeof(block) <= SMALL_PAGE_SIZE);
+
+ public:
+	small_frame_provider();
+
+	small_frame_provider(const small_frame_provider&) = delete;
+	small_frame_provider& operator=(const small_frame_provider&) = delete;
+
+	/// \brief allocate a zeroed small frame with reference count 1
+	/// \return physical address of the frame, 0 if failed
+	[[nodiscard]] uintptr_t allocate();
+
+	/// \brief increase the reference count
+	void get(uintptr_t pa);
+
+	/// \brief decrease the reference count and free the frame when it drops to 0
+	/// \return the new reference count
+	size_t put(uintptr_t pa);
+
+	[[nodiscard]] size_t ref(uintptr_t pa) const;
+
+	[[nodiscard]] size_t free_count() const;
+
+	/// \brief zero at most budget free frames ahead of time, so that allocate() can skip it.
+	/// the frames are zeroed with the lock dropped, and budget is capped at PREZERO_BATCH
+	/// \return count of frames zeroed
+	size_t prezero(size_t budget);
+
+	[[nodiscard]] size_t zeroed_count() const;
+
+ private:
+	static block* block_of(uintptr_t pa);
+	static size_t index_of(uintptr_t pa);
+
+	block* grow_locked() TA_REQ(lock_);
+
+	/// \brief mark a free frame used with a reference count of 1
+	/// \return physical address of the frame
+	uintptr_t claim_locked(block* blk, size_t index) TA_REQ(lock_);
+
+	/// \brief mark a frame free
+	/// \return the backing page if all frames of it are free, which the caller frees with the lock dropped
+	page* release_locked(block* blk, size_t index) TA_REQ(lock_);
+
+	list_head partial_ TA_GUARDED(lock_){};
+	size_t free_count_ TA_GUARDED(lock_){ 0 };
+	size_t zeroed_count_ TA_GUARDED(lock_){ 0 };
+
+	mutable lock::spinlock lock_{ "small_frame" };
+};
+
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2021 SmartPolarBear
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "system/types.h"
+#include "system/vmm.h"
+
+#include "drivers/apic/traps.h"
+
+#include "memory/page.hpp"
+
+namespace memory
+{
+
+/// \brief record that pgdir is going to be loaded into CR3 of this CPU, which makes it a target of shootdowns.
+/// Must be called with interrupts disabled.
+void tlb_activate(vmm::pde_ptr_t pgdir);
+
+/// \brief invalidate the translations of vas on all CPUs that have pgdir active. The kernel pgdir means all CPUs.
+/// It returns after every target acknowledged.
+/// \param vas addresses to invalidate. nullptr reloads CR3 instead
+/// \param count count of addresses
+void tlb_shootdown(vmm::pde_ptr_t pgdir, const uintptr_t* vas, size_t count);
+
+/// \brief serve a pending shootdown of this CPU. for the ones waiting with interrupts disabled.
+void tlb_shootdown_poll();
+
+error_code tlb_shootdown_handle(trap::trap_frame info);
+
+/// \brief gather invalidations of an operation, and send them as one shootdown.
+/// Frames released by the operation are held until the invalidations are done.
+class tlb_batch final
+{
+ public:
+	// over it, the whole TLB is flushed instead
+	static constexpr size_t MAX_PAGES = 32;
+	static constexpr size_t MAX_RELEASES = 64;
+
+	explicit tlb_batch(vmm::pde_ptr_t pgdir);
+	~tlb_batch();
+
+	tlb_batch(const tlb_batch&) = delete;
+	tlb_batch& operator=(const tlb_batch&) = delete;
+
+	void invalidate(uintptr_t va);
+
+	/// \brief drop a reference of a small frame after flushing
+	void release_small(uintptr_t pa);
+
+	/// \brief drop a reference of a page after flushing
+	void release_page(page* pg);
+
+	/// \brief free a page table after flushing, which the paging-structure caches may still hold.
+	/// With no address to invalidate, the whole TLB is flushed
+	void release_table(vmm::pde_ptr_t table);
+
+	void flush();
+
+ private:
+	vmm::pde_ptr_t pgdir_{ nullptr };
+
+	uintptr_t vas_[MAX_PAGES]{};
+	size_t va_count_{ 0 };
+	bool full_flush_{ false };
+
+	uintptr_t smalls_[MAX_RELEASES]{};
+	size_t small_count_{ 0 };
+
+	page* pages_[MAX_RELEASES]{};
+	size_t page_count_{ 0 };
+
+	vmm::pde_ptr_t tables_[MAX_RELEASES]{};
+	size_t table_count_{ 0 };
+};
+
+}
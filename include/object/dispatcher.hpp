@@ -19,6 +19,7 @@ enum class [[clang::enum_extensibility(closed)]] object_type
 	JOB,
 	THREAD,
 	ADDR_SPACE,
+	CHANNEL,
 };
 
 }
@@ -48,6 +49,7 @@ DECLARE_TAG(task, job, object::object_type::JOB, "JOB_")
 DECLARE_TAG(task, process, object::object_type::PROCESS, "PROC")
 DECLARE_TAG(task, thread, object::object_type::THREAD, "THRD")
 DECLARE_TAG(memory, address_space, object::object_type::ADDR_SPACE, "ASPC");
+DECLARE_TAG(task::ipc, channel, object::object_type::CHANNEL, "CHNL");
 
 #undef DECLARE_TAG
 
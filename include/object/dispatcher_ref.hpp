@@ -0,0 +1,99 @@
+// Copyright (c) 2021 SmartPolarBear
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "object/dispatcher.hpp"
+
+#include <utility>
+
+namespace object
+{
+
+// owns one reference to a dispatcher, as handed out by handle_table::reference_object.
+// the object is deleted when the last reference goes away.
+template<typename T>
+class dispatcher_ref final
+{
+ public:
+	constexpr dispatcher_ref() = default;
+
+	// adopt a reference that has already been counted
+	explicit dispatcher_ref(T* obj) : ptr_{ obj }
+	{
+	}
+
+	~dispatcher_ref()
+	{
+		reset();
+	}
+
+	dispatcher_ref(const dispatcher_ref&) = delete;
+	dispatcher_ref& operator=(const dispatcher_ref&) = delete;
+
+	dispatcher_ref(dispatcher_ref&& another) noexcept
+		: ptr_{ std::exchange(another.ptr_, nullptr) }
+	{
+	}
+
+	dispatcher_ref& operator=(dispatcher_ref&& another) noexcept
+	{
+		if (this != &another)
+		{
+			reset();
+			ptr_ = std::exchange(another.ptr_, nullptr);
+		}
+		return *this;
+	}
+
+	[[nodiscard]] T* get() const
+	{
+		return ptr_;
+	}
+
+	T* operator->() const
+	{
+		return ptr_;
+	}
+
+	explicit operator bool() const
+	{
+		return ptr_ != nullptr;
+	}
+
+	// give up ownership of the reference without dropping it
+	[[nodiscard]] T* release()
+	{
+		return std::exchange(ptr_, nullptr);
+	}
+
+	void reset()
+	{
+		if (auto p = std::exchange(ptr_, nullptr);p && p->release())
+		{
+			delete p;
+		}
+	}
+
+ private:
+	T* ptr_{ nullptr };
+};
+
+}
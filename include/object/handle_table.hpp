@@ -4,7 +4,10 @@
 #include "kbl/lock/spinlock.h"
 #include "object/dispatcher.hpp"
 
+#include "drivers/acpi/cpu.h"
+
 #include "ktl/concepts.hpp"
+#include "ktl/atomic.hpp"
 
 #include "object/handle_entry.hpp"
 
@@ -27,16 +30,17 @@ struct global_handle_table_tag
 
 static inline constexpr global_handle_table_tag create_global_handle_table;
 
+// the low 32 bits of a handle are split into a slot index and the generation of that slot
+// when the handle was made. the generation is bumped whenever the slot is freed, so a handle
+// that outlives its slot is rejected instead of silently resolving to the new occupant.
 union handle
 {
 	handle_type handle_value;
 	struct
 	{
-		uint64_t l4: 8;
-		uint64_t l3: 8;
-		uint64_t l2: 8;
-		uint64_t l1: 8;
-		uint64_t flags: 8;
+		uint64_t index: 20;
+		uint64_t generation: 12;
+		uint64_t flags: 16;
 	} __attribute__ ((__packed__));
 } __attribute__ ((__packed__));
 
@@ -52,17 +56,39 @@ class handle_table final
 
 	friend void object::init_object_manager();
 
-	static constexpr size_t MAX_HANDLE_PER_TABLE = 512;
+	static constexpr size_t HANDLE_INDEX_BITS = 20;
+	static constexpr size_t HANDLE_GENERATION_BITS = 12;
 
-	struct table
+	// entry, object and generation are read without the table lock by reference_object,
+	// everything else is protected by lock_
+	struct alignas(32) slot
 	{
-		size_t count;
-		union
-		{
-			table* next[MAX_HANDLE_PER_TABLE];
-			handle_entry* entry[MAX_HANDLE_PER_TABLE];
-		} __attribute__ ((__packed__));
-	} __attribute__ ((__packed__));
+		ktl::atomic<handle_entry*> entry;
+		ktl::atomic<dispatcher*> object;
+		ktl::atomic<uint32_t> generation;
+		uint32_t next_free;
+	};
+
+	static constexpr size_t SLOTS_PER_PAGE = 128;
+	static constexpr size_t PAGES_PER_DIRECTORY = 512;
+
+	static constexpr size_t MAX_HANDLE_PER_TABLE = SLOTS_PER_PAGE * PAGES_PER_DIRECTORY;
+
+	static_assert(MAX_HANDLE_PER_TABLE <= (1ul << HANDLE_INDEX_BITS));
+
+	// slots live in fixed-size pages that never move once allocated, so an index stays valid
+	// for the lifetime of the table.
+	struct slot_page
+	{
+		slot slots[SLOTS_PER_PAGE];
+	};
+
+	struct directory
+	{
+		slot_page* pages[PAGES_PER_DIRECTORY];
+	};
+
+	static_assert(sizeof(slot_page) == sizeof(directory));
 
 	handle_table();
 
@@ -82,13 +108,14 @@ class handle_table final
 	handle_entry_owner remove_handle(handle_type h);
 	handle_entry_owner remove_handle(handle_entry* e);
 
-	handle_entry_owner remove_handle_locked(handle_type h) TA_REQ(lock_);
-	handle_entry_owner remove_handle_locked(handle_entry* e)TA_REQ(lock_);
-
 	handle_entry* get_handle_entry(handle_type h);
 
 	handle_entry* get_handle_entry_locked(handle_type h) TA_REQ(lock_);
 
+	// resolve a handle to its object without taking lock_. on success the object carries an
+	// extra reference that the caller must drop, see dispatcher_ref
+	dispatcher* reference_object(handle_type h);
+
 	handle_entry* query_handle_by_name(ktl::string_view name);
 	handle_entry* query_handle_by_name_locked(ktl::string_view name)  TA_REQ(lock_);
 
@@ -101,44 +128,89 @@ class handle_table final
 	void clear();
 
  private:
-	[[nodiscard]] static std::tuple<int, int> increase_next_cur(size_t value);
-	[[nodiscard]] error_code increase_next();
+	static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+	// open-addressing map from the dispatcher to the slot holding it, so that removal and
+	// the "already present?" check do not scan the table.
+	struct reverse_entry
+	{
+		dispatcher* key;
+		uint32_t index;
+	};
+
+	static constexpr size_t REVERSE_INDEX_MIN_CAPACITY = 64;
 
 	void initialize_table();
 
-	error_code_with_result<std::tuple<size_t, size_t, size_t, size_t>> allocate_slot();
+	[[nodiscard]] slot* slot_at(uint32_t index) const;
+
+	error_code_with_result<uint32_t> allocate_slot() TA_REQ(lock_);
+
+	void free_slot(uint32_t index) TA_REQ(lock_);
+
+	// the returned entry must be kept alive until wait_for_readers() returns, which is called with lock_ dropped
+	handle_entry_owner remove_handle_locked(handle_type h) TA_REQ(lock_);
+	handle_entry_owner remove_handle_locked(handle_entry* e) TA_REQ(lock_);
 
-	error_code_with_result<std::tuple<size_t, size_t, size_t, size_t>> first_free();
+	void wait_for_readers() const TA_EXCL(lock_);
 
 	explicit handle_table(global_handle_table_tag);
 
 	bool local_exist_locked(handle_entry* owner) TA_REQ(lock_);
 
-	std::optional<std::tuple<size_t, size_t, size_t, size_t>> local_get_locked(handle_entry* owner) TA_REQ(lock_);
+	std::optional<uint32_t> local_get_locked(handle_entry* owner) TA_REQ(lock_);
+
+	[[nodiscard]] static size_t reverse_hash(const dispatcher* key, size_t capacity);
+
+	std::optional<size_t> reverse_find(const dispatcher* key) const TA_REQ(lock_);
+
+	error_code reverse_insert(dispatcher* key, uint32_t index) TA_REQ(lock_);
 
-	static constexpr handle_type MAKE_HANDLE(uint16_t attr, size_t l1, size_t l2, size_t l3, size_t l4)
+	void reverse_erase(const dispatcher* key) TA_REQ(lock_);
+
+	error_code reverse_rehash(size_t new_capacity) TA_REQ(lock_);
+
+	static constexpr handle_type MAKE_HANDLE(uint16_t attr, uint32_t index, uint32_t generation)
 	{
-		return ((uint64_t)attr) << 32u | ((uint64_t)l1) << 24 | ((uint64_t)l2) << 16 | ((uint64_t)l3) << 8
-			| ((uint64_t)l4);
+		return ((uint64_t)attr) << 32u
+			| ((uint64_t)(generation & ((1u << HANDLE_GENERATION_BITS) - 1))) << HANDLE_INDEX_BITS
+			| ((uint64_t)index);
 	}
 
 	static constexpr auto DISASSEMBLE_HANDLE(handle_type h)
 	{
-		return std::make_tuple(h >> 32, (h >> 24) & 0xFF, (h >> 16) & 0xFF, (h >> 8) & 0xFF, h & 0xFF);
+		return std::make_tuple(h >> 32,
+			(uint32_t)(h & ((1u << HANDLE_INDEX_BITS) - 1)),
+			(uint32_t)((h >> HANDLE_INDEX_BITS) & ((1u << HANDLE_GENERATION_BITS) - 1)));
 	}
 
 	bool local_{ true };
 
 	dispatcher* parent_{ nullptr };
 
-	table root_{};
+	directory* directory_{ nullptr };
 
 	memory::kmem::kmem_cache* table_cache_{ nullptr };
 
-	struct
+	// head of the free list threaded through slot::next_free
+	uint32_t free_head_{ NO_SLOT };
+
+	// slots below this index have been handed out at least once. stored with release after
+	// the page holding the slot is published
+	ktl::atomic<uint32_t> high_water_{ 0 };
+
+	// lookups currently inside reference_object, counted per CPU so that they don't bounce a cache line.
+	// a lookup runs with interrupts disabled and so stays on one CPU
+	struct alignas(64) reader_count
 	{
-		size_t l1, l2, l3, l4;
-	} next_{ 0, 0, 0, 0 };
+		ktl::atomic<uint32_t> count{ 0 };
+	};
+
+	mutable reader_count readers_[CPU_COUNT_LIMIT]{};
+
+	reverse_entry* reverse_{ nullptr };
+	size_t reverse_capacity_{ 0 };
+	size_t reverse_count_{ 0 };
 
 	mutable lock::spinlock lock_;
 
@@ -154,21 +226,12 @@ handle_entry* handle_table::query_handle(T&& pred)
 template<typename T>
 handle_entry* handle_table::query_handle_locked(T&& pred) TA_REQ(lock_)
 {
-	for (size_t l1 = 0; l1 <= next_.l1; l1++)
+	for (uint32_t i = 0; i < high_water_.load(ktl::memory_order_relaxed); i++)
 	{
-		for (size_t l2 = 0; l2 <= next_.l2; l2++)
+		auto entry = slot_at(i)->entry.load(ktl::memory_order_relaxed);
+		if (entry && pred(*entry))
 		{
-			for (size_t l3 = 0; l3 <= next_.l3; l3++)
-			{
-				for (size_t l4 = 0; l4 < next_.l4; l4++)
-				{
-					auto slot = root_.next[l1]->next[l2]->next[l3]->entry[l4];
-					if (slot && pred(*slot))
-					{
-						return slot;
-					}
-				}
-			}
+			return entry;
 		}
 	}
 
@@ -176,4 +239,3 @@ handle_entry* handle_table::query_handle_locked(T&& pred) TA_REQ(lock_)
 }
 
 }
-
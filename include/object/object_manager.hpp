@@ -24,6 +24,7 @@
 
 #pragma once
 #include "object/handle_table.hpp"
+#include "object/dispatcher_ref.hpp"
 
 namespace object
 {
@@ -43,6 +44,23 @@ class object_manager final
 
 	static handle_entry* get_global_handle_entry(handle_type handle);
 
+	// resolve a local or global handle without taking the handle table locks and without
+	// promoting local handles into the global table. empty if the handle is stale or does not
+	// refer to a T
+	static dispatcher_ref<dispatcher> reference_object(handle_type handle);
+
+	template<std::derived_from<dispatcher> T>
+	static inline dispatcher_ref<T> reference_object(handle_type handle)
+	{
+		auto obj = reference_object(handle);
+		if (!obj || !downcast_dispatcher<T>(obj.get()))
+		{
+			return {};
+		}
+
+		return dispatcher_ref<T>{ static_cast<T*>(obj.release()) };
+	}
+
 	template<std::derived_from<dispatcher> T>
 	static inline error_code_with_result<T*> object_from_handle(const handle_entry& h)
 	{
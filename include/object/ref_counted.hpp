@@ -5,10 +5,18 @@
 
 namespace object
 {
+
+template<typename T>
+class dispatcher_ref;
+
 class ref_counted
 {
  public:
 	friend class handle_entry;
+	friend class handle_table;
+
+	template<typename T>
+	friend class dispatcher_ref;
  protected:
 	constexpr ref_counted() : ref_count_(PRE_ADOPT_SENTINEL)
 	{
@@ -39,10 +47,28 @@ class ref_counted
 
 	void add_ref() const
 	{
-		auto rc = ref_count_.fetch_and(1, ktl::memory_order_release);
+		auto rc = ref_count_.fetch_add(1, ktl::memory_order_relaxed);
 		KDEBUG_ASSERT(rc >= 1);
 	}
 
+	// take a reference only if the object is still alive, for lookups that race with the
+	// last release
+	[[nodiscard]] bool try_add_ref() const
+	{
+		auto rc = ref_count_.load(ktl::memory_order_relaxed);
+		do
+		{
+			if (rc < 1 || rc == PRE_ADOPT_SENTINEL)
+			{
+				return false;
+			}
+		} while (!ref_count_.compare_exchange_weak(rc, rc + 1,
+			ktl::memory_order_acquire,
+			ktl::memory_order_relaxed));
+
+		return true;
+	}
+
 	[[nodiscard]]bool release() const
 	{
 		auto rc = ref_count_.fetch_sub(1, ktl::memory_order_release);
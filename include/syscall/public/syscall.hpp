@@ -34,6 +34,17 @@ enum SYSCALL_NUMBER
 	SYS_ipc_accept,
 	SYS_ipc_call,
 	SYS_ipc_wait,
+	SYS_ipc_reply_wait,
+	SYS_ipc_call_short,
+	SYS_ipc_reply_wait_short,
+
+	SYS_channel_create,
+	SYS_channel_map,
+	SYS_channel_wait,
+	SYS_channel_notify,
+
+	SYS_lockstat_read,
+	SYS_lockstat_reset,
 };
 
 }
\ No newline at end of file
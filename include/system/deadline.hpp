@@ -45,6 +45,7 @@ class timer_slack final
 	slack_mode slack_;
 };
 
+// a moment on the timeline of timer::now(), in nanoseconds
 class deadline final
 {
  public:
@@ -24,9 +24,46 @@ constexpr size_t KMEM_MAX_SIZED_CACHE_SIZE = 10240;
 constexpr size_t KMEM_MIN_SIZED_CACHE_SIZE = 16;
 constexpr size_t KMEM_SIZED_CACHE_COUNT = log2p1(KMEM_MAX_SIZED_CACHE_SIZE / KMEM_MIN_SIZED_CACHE_SIZE);
 
+// rounds held by a magazine. 15 rounds plus the header fit in 2 cache lines.
+constexpr size_t KMEM_MAGAZINE_SIZE = 15;
+
+// should be equal to CPU_COUNT_LIMIT, which is checked in kmem.cc
+constexpr size_t KMEM_CPU_CACHE_COUNT = 8;
+
+constexpr size_t KMEM_CPU_CACHE_LINE_SIZE = 64;
+
 enum kmem_cache_flags
 {
 	KMEM_CACHE_4KALIGN = 0b1,
+	KMEM_CACHE_NOMAGAZINE = 0b10, // bypass the per-cpu magazine layer
+};
+
+struct kmem_magazine
+{
+	list_head magazine_link;
+	size_t rounds;
+	void* objs[KMEM_MAGAZINE_SIZE];
+};
+
+// per-cpu part of a cache, which is only touched by its owner CPU with interrupts disabled.
+// the loaded magazine can be partially filled, and the previous one is either full or empty
+struct kmem_cpu_cache
+{
+	kmem_magazine* loaded;
+	kmem_magazine* previous;
+
+	// pad to a cache line so that no two CPUs share one
+	uint8_t padding[KMEM_CPU_CACHE_LINE_SIZE - 2 * sizeof(kmem_magazine*)];
+};
+static_assert(sizeof(kmem_cpu_cache) == KMEM_CPU_CACHE_LINE_SIZE);
+
+// magazines shared by all CPUs, exchanged only when a CPU runs out of rounds or space
+struct kmem_depot
+{
+	list_head full, empty;
+	size_t full_count, empty_count;
+
+	lock::spinlock lock{ "kmem_depot" };
 };
 
 struct kmem_cache
@@ -40,6 +77,9 @@ struct kmem_cache
 	list_head cache_link;
 
 	lock::spinlock lock{ "kmem_cache" };
+
+	kmem_cpu_cache cpu_caches[KMEM_CPU_CACHE_COUNT];
+	kmem_depot depot;
 };
 
 void kmem_init();
@@ -50,6 +90,8 @@ kmem_cache* kmem_cache_create(const char* name,
 	size_t flags = 0);
 
 void* kmem_cache_alloc(kmem_cache* cache);
+/// \brief destroy a cache, which must be quiescent: every object has been freed,
+/// and no CPU allocates from it any more. The magazines of all CPUs are drained from the caller
 void kmem_cache_destroy(kmem_cache* cache);
 void kmem_cache_free(kmem_cache* cache, void* obj);
 size_t kmem_cache_shrink(kmem_cache* cache);
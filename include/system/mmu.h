@@ -15,11 +15,16 @@ constexpr size_t PDPT_SIZE = 1_GB;
 
 constexpr size_t PGTABLE_SIZE = 4_KB;
 
+// the size of physical pages managed by pmm, as well as large mappings.
 constexpr size_t PAGE_SIZE = PG_PS_ENABLE ? PG_PS_SIZE : PG_SIZE;
 
+// the size of small mappings, which are made of frames split from a physical page
+constexpr size_t SMALL_PAGE_SIZE = PG_SIZE;
+
 constexpr size_t P4_SHIFT = 39;
 constexpr size_t P3_SHIFT = 30;
 constexpr size_t P2_SHIFT = 21;   // for 2mb paging, this is the lowest level.
+constexpr size_t P1_SHIFT = 12;   // for 4kb paging
 constexpr size_t PX_MASK = 0x1FF; //9bit
 
 static inline constexpr size_t P4X(size_t addr)
@@ -37,6 +42,11 @@ static inline constexpr size_t P2X(size_t addr)
 	return (addr >> P2_SHIFT) & PX_MASK;
 }
 
+static inline constexpr size_t P1X(size_t addr)
+{
+	return (addr >> P1_SHIFT) & PX_MASK;
+}
+
 static inline constexpr size_t PAGE_ROUNDUP(size_t addr)
 {
 	return (((addr) + ((size_t)PAGE_SIZE - 1)) & ~((size_t)(PAGE_SIZE - 1)));
@@ -47,6 +57,16 @@ static inline constexpr size_t PAGE_ROUNDDOWN(size_t addr)
 	return (((addr)) & ~((size_t)(PAGE_SIZE - 1)));
 }
 
+static inline constexpr size_t SMALL_PAGE_ROUNDUP(size_t addr)
+{
+	return (((addr) + ((size_t)SMALL_PAGE_SIZE - 1)) & ~((size_t)(SMALL_PAGE_SIZE - 1)));
+}
+
+static inline constexpr size_t SMALL_PAGE_ROUNDDOWN(size_t addr)
+{
+	return (((addr)) & ~((size_t)(SMALL_PAGE_SIZE - 1)));
+}
+
 // Page table/directory entry flags_
 enum pde_flags
 {
@@ -59,6 +79,7 @@ enum pde_flags
 	PG_D = 0x040,   // Dirty
 	PG_PS = 0x080,  // Page Size
 	PG_MBZ = 0x180, // Bits must be zero
+	PG_COW = 0x200, // Copy-on-write, which is available to software
 };
 
 enum exception_type : uint32_t
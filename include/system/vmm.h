@@ -21,11 +21,17 @@
 #pragma once
 
 #include "system/types.h"
+#include "system/error.hpp"
 
 #include "memory/fpage.hpp"
 
 #include "kbl/lock/spinlock.h"
 
+namespace memory
+{
+class address_space;
+}
+
 namespace vmm
 {
 using pde_t = size_t;
@@ -61,16 +67,42 @@ void duplicate_kernel_pml4t(OUT pde_ptr_t pml4t);
 // get the physical address mapped by a pde
 uintptr_t pde_to_pa(pde_ptr_t pde);
 
+// get the page directory entry of va, which either maps a large page or points to a page table
 pde_ptr_t walk_pgdir(pde_ptr_t pgdir, size_t va, bool create);
 
+// get the page table entry of va for small pages.
+// return nullptr if it doesn't exist, or va is covered by a large page.
+pde_ptr_t walk_pgdir_small(pde_ptr_t pgdir, size_t va, bool create);
+
+// whether the page directory entry maps a large page
+bool pde_is_large(pde_ptr_t pde);
+
+// whether the page directory entry points to a page table of small pages
+bool pde_is_table(pde_ptr_t pde);
+
 // map/nmap or free memory ranges
 error_code map_range(pde_ptr_t pgdir, uintptr_t va_start, uintptr_t pa_start, size_t len);
 
 void free_range(pde_ptr_t pgdir, uintptr_t start, uintptr_t end);
 
-void unmap_range(pde_ptr_t pgdir, uintptr_t start, uintptr_t end);
+error_code unmap_range(pde_ptr_t pgdir, uintptr_t start, uintptr_t end);
+
+// share the pages in the range with to. writable pages are write-protected in both and marked copy-on-write,
+// unless share is set, in which case both keep writing the same pages
+void copy_range(pde_ptr_t from, pde_ptr_t to, uintptr_t start, uintptr_t end, bool share);
+
+// page_fault.cc
+
+// resolve a fault on addr as if the owner of the address space accessed it
+error_code handle_user_fault(memory::address_space* as, uintptr_t addr, bool write);
+
+// get the physical address of a user address, so that the kernel can access it through the direct map
+// even if the address space isn't the current one. it's faulted in first if needed.
+// the frame is pinned so that unmapping it meanwhile doesn't free it, and must be released by user_pa_unpin
+error_code_with_result<uintptr_t> user_va_pin(memory::address_space* as, uintptr_t va, bool write);
 
-void copy_range(pde_ptr_t from, pde_ptr_t to, uintptr_t start, uintptr_t end);
+// release a frame pinned by user_va_pin
+void user_pa_unpin(uintptr_t pa);
 
 } // namespace vmm
 
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "object/dispatcher.hpp"
+
+#include "debug/thread_annotations.hpp"
+
+#include "system/deadline.hpp"
+
+#include "task/thread/wait_queue.hpp"
+#include "task/ipc/public/channel.hpp"
+
+#include "memory/address_space.hpp"
+
+namespace task::ipc
+{
+
+/// \brief an asynchronous channel. its ring lives in pages mapped by the producers and the consumer,
+/// so messages are passed without syscalls, and the kernel is only entered to wait and to notify.
+class channel final
+	: public object::solo_dispatcher<channel, 0>
+{
+ public:
+	static constexpr size_t CAPACITY_MIN = 16;
+	static constexpr size_t CAPACITY_MAX = 8192;
+
+	/// \brief create a channel
+	/// \param capacity count of slots, which must be a power of 2
+	[[nodiscard]] static error_code_with_result<channel*> create(size_t capacity);
+
+	channel(const channel&) = delete;
+	channel& operator=(const channel&) = delete;
+
+	~channel() override;
+
+	object::object_type get_type() const override
+	{
+		return object::object_type::CHANNEL;
+	}
+
+	[[nodiscard]] size_t capacity() const
+	{
+		return capacity_;
+	}
+
+	/// \brief map the ring to an address space
+	/// \param as the address space
+	/// \param addr where to map, which must be page-aligned
+	error_code map(memory::address_space* as, uintptr_t addr);
+
+	/// \brief wait until the ring isn't empty
+	error_code wait(const deadline& ddl) TA_REQ(!global_thread_lock);
+
+	/// \brief wake the waiting consumer up
+	void notify() TA_REQ(!global_thread_lock);
+
+ private:
+	explicit channel(size_t capacity);
+
+	[[nodiscard]] bool empty_locked() const TA_REQ(global_thread_lock);
+
+	size_t capacity_{ 0 };
+
+	size_t frame_count_{ 0 };
+
+	// physical addresses of the small frames backing the ring
+	uintptr_t* frames_{ nullptr };
+
+	task::wait_queue waiters_{};
+};
+
+}
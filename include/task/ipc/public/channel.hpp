@@ -0,0 +1,158 @@
+#pragma once
+
+#include "system/types.h"
+
+#include "task/ipc/public/messages.hpp"
+
+namespace task::ipc
+{
+
+/// \brief count of registers a channel slot carries, which are the tag and untyped items
+static inline constexpr size_t CHANNEL_SLOT_REGS = 7;
+
+/// \brief the header takes the first page of a channel, and slots follow
+static inline constexpr size_t CHANNEL_HEADER_SIZE = 4096;
+
+struct channel_slot
+{
+	uint64_t sequence;
+	message_register_type regs[CHANNEL_SLOT_REGS];
+};
+
+static_assert(sizeof(channel_slot) == 64);
+
+/// \brief the header shared by the producers and the consumer.
+/// indexes written by different sides are kept in separate cache lines
+struct channel_header
+{
+	uint64_t capacity;
+
+	alignas(64) uint64_t tail; // next slot to be reserved by producers
+
+	alignas(64) uint64_t head; // next slot to be taken by the consumer
+
+	uint32_t consumer_waiting; // the consumer is going to wait in the kernel, and should be notified
+};
+
+static_assert(sizeof(channel_header) <= CHANNEL_HEADER_SIZE);
+
+/// \brief bytes a channel of given capacity takes, which is the size to map
+static inline constexpr size_t channel_size(size_t capacity)
+{
+	return CHANNEL_HEADER_SIZE + capacity * sizeof(channel_slot);
+}
+
+/// \brief a bounded ring for many producers and a single consumer over a mapped channel.
+/// each slot carries a sequence number, so that producers only contend on the tail.
+class channel_ring
+{
+ public:
+	explicit channel_ring(void* base)
+		: header_(reinterpret_cast<channel_header*>(base)),
+		  slots_(reinterpret_cast<channel_slot*>(reinterpret_cast<uintptr_t>(base) + CHANNEL_HEADER_SIZE))
+	{
+	}
+
+	/// \brief enqueue a message with no typed items
+	/// \return false if the ring is full or the message doesn't fit in a slot
+	bool try_send(const message_tag& tag, const message_register_type* items)
+	{
+		if (tag.typed_count() != 0 || tag.untyped_count() >= CHANNEL_SLOT_REGS)
+		{
+			return false;
+		}
+
+		auto mask = header_->capacity - 1;
+		auto pos = __atomic_load_n(&header_->tail, __ATOMIC_RELAXED);
+
+		for (;;)
+		{
+			auto slot = &slots_[pos & mask];
+			auto seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+			auto diff = static_cast<int64_t>(seq - pos);
+
+			if (diff == 0)
+			{
+				if (__atomic_compare_exchange_n(&header_->tail,
+					&pos,
+					pos + 1,
+					true,
+					__ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				{
+					slot->regs[0] = tag.raw();
+					for (size_t i = 0; i < tag.untyped_count(); i++)
+					{
+						slot->regs[i + 1] = items[i];
+					}
+
+					__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = __atomic_load_n(&header_->tail, __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	/// \brief dequeue a message. only the consumer may call it
+	/// \param regs where to store the tag followed by untyped items
+	/// \return false if the ring is empty
+	bool try_receive(message_register_type (& regs)[CHANNEL_SLOT_REGS])
+	{
+		auto pos = header_->head;
+		auto slot = &slots_[pos & (header_->capacity - 1)];
+
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1)
+		{
+			return false;
+		}
+
+		for (size_t i = 0; i < CHANNEL_SLOT_REGS; i++)
+		{
+			regs[i] = slot->regs[i];
+		}
+
+		__atomic_store_n(&header_->head, pos + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->sequence, pos + header_->capacity, __ATOMIC_RELEASE);
+
+		return true;
+	}
+
+	/// \brief called by the consumer before waiting in the kernel
+	/// \return false if something arrived meanwhile, so that there's no need to wait
+	bool prepare_wait()
+	{
+		__atomic_store_n(&header_->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+
+		auto pos = header_->head;
+		auto slot = &slots_[pos & (header_->capacity - 1)];
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) == pos + 1)
+		{
+			__atomic_store_n(&header_->consumer_waiting, 0, __ATOMIC_RELAXED);
+			return false;
+		}
+
+		return true;
+	}
+
+	/// \brief called by producers after sending
+	/// \return true if the consumer is waiting and should be notified
+	bool should_notify()
+	{
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		return __atomic_exchange_n(&header_->consumer_waiting, 0, __ATOMIC_SEQ_CST) != 0;
+	}
+
+ private:
+	channel_header* header_;
+	channel_slot* slots_;
+};
+
+}
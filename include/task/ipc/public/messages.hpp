@@ -25,6 +25,10 @@ using buffer_register_type = uint64_t;
 
 static inline constexpr size_t REGS_PER_MESSAGE = 64;
 
+/// \brief a message with no typed items and at most this many untyped ones is passed in registers.
+/// the tag goes in r10, and the items in r8, r9, r12, r13, r14 and r15
+static inline constexpr size_t SHORT_MESSAGE_ITEMS_MAX = 6;
+
 #if defined(_DIONYSUS_KERNEL_)
 namespace _internals
 {
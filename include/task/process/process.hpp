@@ -132,6 +132,10 @@ class process final
 		size_t size,
 		const ktl::shared_ptr<job>& parent);
 
+	static error_code_with_result<process*> create(const char* name,
+		file_system::vnode_base* file,
+		const ktl::shared_ptr<job>& parent);
+
 	process() = delete;
 	process(const process&) = delete;
 
@@ -197,6 +201,9 @@ class process final
 
 	error_code setup_address_space() TA_REQ(lock_);
 
+	/// \brief create the main thread at entry_addr and make it runnable
+	error_code start_main_thread(const char* name, uintptr_t entry_addr);
+
 	Status status_;
 
 	ktl::weak_ptr<job> parent_;
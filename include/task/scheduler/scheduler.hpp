@@ -12,6 +12,7 @@
 #include "kbl/data/list.hpp"
 
 #include "task/scheduler/scheduler_config.hpp"
+#include "task/scheduler/timer_wheel.hpp"
 
 #if defined(_SCHEDULER_FCFS)
 #include "task/scheduler/fcfs/fcfs.hpp"
@@ -26,28 +27,16 @@
 namespace task
 {
 
-using scheduler_timer_callback = void (*)(struct scheduler_timer* timer, time_type time, void* arg);
-
-struct scheduler_timer
-{
-	int64_t expires{ 0 };
-	void* arg;
-	scheduler_timer_callback callback;
-
-	kbl::list_link<scheduler_timer, lock::spinlock> link{ this };
-};
-
 class scheduler
 {
  public:
 	using scheduler_class_type = USE_SCHEDULER_CLASS;
 
-	using timer_list_type = kbl::intrusive_list_with_default_trait<scheduler_timer,
-	                                                               lock::spinlock,
-	                                                               &scheduler_timer::link,
-	                                                               true>;
 	using size_type = size_t;
 
+	// ticks between two load balancing
+	static constexpr size_type BALANCE_INTERVAL = 64;
+
 	friend class thread;
 
 	friend scheduler_class_type;
@@ -75,12 +64,34 @@ class scheduler
 
 	void unblock_locked(thread* t) TA_REQ(global_thread_lock);
 
+	/// \brief switch to a specified blocked thread without going through the run queue.
+	/// The current thread isn't charged a new scheduling decision, so the rest of its time is donated.
+	void handoff_locked(thread* next) TA_REQ(global_thread_lock);
+
 	void insert(thread* t) TA_REQ(!global_thread_lock);
 	void insert_locked(thread* t) TA_REQ(global_thread_lock);
 
-	void add_timer(scheduler_timer* timer);
+	/// \brief hand a ready thread to this scheduler from any CPU.
+	/// It's pushed to a lock-free inbox, and the owner CPU is interrupted to take it.
+	void post(thread* t);
+
+	/// \brief enqueue threads posted by others. must be called by the owner with interrupts disabled
+	void drain_inbox();
+
+	/// \brief register the handle of reschedule IPIs
+	static void init_reschedule_ipi();
 
-	void remove_timer(scheduler_timer* timer);
+	/// \brief arm a timer on this CPU. Its callback is called with global_thread_lock held
+	/// somewhere in [earliest, latest] of the deadline
+	void add_timer(scheduler_timer* timer, const deadline& ddl) TA_REQ(global_thread_lock);
+
+	/// \brief cancel a timer, wherever it's armed
+	/// \return false if it isn't pending, in which case its callback has already finished
+	static bool remove_timer(scheduler_timer* timer) TA_REQ(global_thread_lock);
+
+	/// \brief halt until an interrupt arrives if there is nothing to run.
+	/// The timer isn't armed for the tick in the meantime, only for timers
+	void idle_wait() TA_REQ(!global_thread_lock);
 
  public:
 
@@ -100,6 +111,10 @@ class scheduler
 
 		static void block_locked() TA_REQ(global_thread_lock);
 
+		/// \brief block the current thread and run next instead, falling back to
+		/// an ordinary wakeup if next can't run on this CPU
+		static void handoff_locked(thread* next) TA_REQ(global_thread_lock);
+
 		static void timer_tick_handle() TA_REQ(!global_thread_lock, !timer_lock);
 
 		[[noreturn]]static void enter() TA_EXCL(global_thread_lock);
@@ -113,13 +128,21 @@ class scheduler
 	void enqueue(thread* t);
 	void dequeue(thread* t);
 	thread* fetch();
-	thread* steal();
+	thread* steal(cpu_struct* stealer);
 	void tick(thread* t);
 
-	void check_timers_locked() TA_REQ(timer_lock);
+	/// \brief push a thread from the busiest CPU to the idlest one
+	static void balance();
+
+	void expire_timers(time_type now) TA_REQ(!global_thread_lock, !timer_lock);
+
+	/// \brief program the timer of this CPU for the earliest of the next timer and, unless idle, the next tick
+	void arm_next_event() TA_REQ(!timer_lock);
 
-	[[nodiscard]] size_type workload_size() const TA_REQ(!global_thread_lock);
-	[[nodiscard]] size_type workload_size_locked() const TA_REQ(global_thread_lock);
+	/// \brief make sure the tick is armed when leaving idle
+	void start_tick();
+
+	[[nodiscard]] size_type workload_size() const;
 
 	void timer_tick_handle() TA_REQ(!global_thread_lock, !timer_lock);
 
@@ -127,7 +150,16 @@ class scheduler
 
 	scheduler_class_type scheduler_class{ this };
 
-	timer_list_type timer_list TA_GUARDED(timer_lock) {};
+	// a lock-free stack, which is only emptied by the owner
+	thread* inbox_{ nullptr };
+
+	size_type ticks_{ 0 };
+
+	timer_wheel timers_ TA_GUARDED(timer_lock) {};
+
+	// both are only touched by the owner with interrupts disabled
+	time_type next_tick_{ 0 };
+	time_type armed_{ TIME_INFINITE };
 
 	mutable lock::spinlock timer_lock{ "scheduler_timer" };
 };
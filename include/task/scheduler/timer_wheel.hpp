@@ -0,0 +1,93 @@
+#pragma once
+
+#include "system/types.h"
+#include "system/time.hpp"
+
+namespace task
+{
+
+class scheduler;
+
+using scheduler_timer_callback = void (*)(struct scheduler_timer* timer, time_type now, void* arg);
+
+struct scheduler_timer
+{
+	void* arg{ nullptr };
+	scheduler_timer_callback callback{ nullptr };
+
+	// the moment the timer is going to fire, in nanoseconds
+	time_type expires{ TIME_INFINITE };
+
+	// the scheduler whose wheel holds this timer, null if it's not pending
+	scheduler* owner_{ nullptr };
+
+	// links of the wheel slot, protected by the timer lock of the owner
+	scheduler_timer* next_{ nullptr };
+	scheduler_timer** pprev_{ nullptr };
+	uint64_t jiffy_{ 0 };
+	uint32_t slot_{ 0 };
+};
+
+/// \brief a hierarchical timing wheel. Timers are hashed into slots by their expiry,
+/// so inserting and cancelling is O(1). Lower levels are refilled from upper levels
+/// once every round of theirs.
+class timer_wheel
+{
+ public:
+	// the granularity of the lowest level is 2^20 ns, about 1ms
+	static constexpr size_t JIFFY_SHIFT = 20;
+
+	static constexpr size_t LEVEL_BITS = 6;
+	static constexpr size_t LEVEL_SIZE = 1ull << LEVEL_BITS;
+	static constexpr size_t LEVEL_MASK = LEVEL_SIZE - 1;
+	static constexpr size_t LEVEL_COUNT = 4;
+
+	// timers too far away to be hashed are kept here
+	static constexpr uint32_t OVERFLOW_SLOT = LEVEL_COUNT * LEVEL_SIZE;
+
+	timer_wheel() = default;
+
+	timer_wheel(const timer_wheel&) = delete;
+	timer_wheel& operator=(const timer_wheel&) = delete;
+
+	/// \brief hash a timer into the wheel. The fire time is picked from [earliest, latest]
+	/// so that it falls on as coarse a jiffy boundary as possible, which lets timers
+	/// with overlapping slack expire together.
+	/// \return the time at which the timer will fire
+	time_type insert(scheduler_timer* timer, time_type earliest, time_type latest, time_type now);
+
+	void remove(scheduler_timer* timer);
+
+	/// \brief move the wheel to now
+	/// \return expired timers, linked by next_
+	scheduler_timer* advance(time_type now);
+
+	/// \brief the earliest time the wheel needs to be advanced at, which may be an
+	/// expiry or a refill of a lower level. TIME_INFINITE if it's empty
+	[[nodiscard]] time_type next_event() const;
+
+	[[nodiscard]] bool empty() const
+	{
+		return count_ == 0;
+	}
+
+ private:
+	void enqueue(scheduler_timer* timer);
+	void unlink(scheduler_timer* timer);
+
+	void cascade(uint32_t slot);
+
+	[[nodiscard]] uint64_t next_event_jiffy() const;
+
+	scheduler_timer* slots_[OVERFLOW_SLOT + 1]{};
+
+	// one bit for each non-empty slot of a level
+	uint64_t pending_[LEVEL_COUNT]{};
+
+	// the next jiffy to process
+	uint64_t clock_{ 0 };
+
+	size_t count_{ 0 };
+};
+
+}
@@ -8,10 +8,18 @@ class ule_scheduler_state_base
 	: public scheduler_state_base
 {
  public:
+	friend class ule_scheduler_class;
+
 	using interactivity_score_type = uint64_t;
 	using nice_type = int32_t;
 	using priority_type = int32_t;
 
+	static constexpr nice_type NICE_MIN = -20;
+	static constexpr nice_type NICE_MAX = 19;
+
+	// no queue holds the thread
+	static constexpr size_t QUEUE_NONE = SIZE_MAX;
+
  public:
 	bool nice_available() override
 	{
@@ -26,10 +34,7 @@ class ule_scheduler_state_base
 		return nice_;
 	}
 
-	void set_nice(int32_t nice) override
-	{
-		nice_ = nice;
-	}
+	void set_nice(int32_t nice) override;
 
 	/// \brief calculate interactive score according to runtime and sleep time
 	/// \return
@@ -39,7 +44,19 @@ class ule_scheduler_state_base
 	/// \return
 	[[nodiscard]] priority_type priority() const;
 
+	[[nodiscard]] bool interactive() const;
+
+	/// \brief ticks a slice of the thread lasts, which is shorter for interactive ones
+	[[nodiscard]] size_t time_slice() const;
+
  private:
+	/// \brief account a timer tick the thread runs
+	/// \return true if its slice is used up
+	bool charge_tick();
+
+	/// \brief keep only a recent history so that a thread can change its behaviour
+	void decay_history();
+
 	nice_type nice_{ 0 };
 	interactivity_score_type interactivity_{ 0 };
 
@@ -47,6 +64,12 @@ class ule_scheduler_state_base
 
 	size_t sleep_time_{ 0 };
 	size_t sleep_tick_{ 0 };
+
+	size_t slice_left_{ 0 };
+
+	// where the thread is queued
+	size_t queue_{ QUEUE_NONE };
+	priority_type queued_priority_{ 0 };
 };
 
-}
\ No newline at end of file
+}
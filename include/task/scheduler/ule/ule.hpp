@@ -11,10 +11,45 @@ class ule_scheduler_class
 	: public scheduler_class
 {
  public:
+	friend class thread;
+	friend class scheduler;
+
 	static constexpr uint64_t INTERACT_MAX = 100;
 	static constexpr uint64_t INTERACT_HALF = INTERACT_MAX / 2;
 	static constexpr uint64_t INTERACT_THRESHOLD = 30;
 
+	// priorities, the smaller the more important. interactive threads take the upper half
+	static constexpr size_t PRIORITY_COUNT = 64;
+	static constexpr size_t PRIORITY_INTERACT_MIN = 0;
+	static constexpr size_t PRIORITY_BATCH_MIN = 32;
+
+	// in ticks
+	static constexpr size_t SLICE_MIN = 2;
+	static constexpr size_t SLICE_DEFAULT = 10;
+	static constexpr size_t SLICE_MAX = 20;
+
+	// run time and sleep time are scaled down over it
+	static constexpr size_t HISTORY_MAX = 1000;
+
+	using run_queue_list_type = kbl::intrusive_list_with_default_trait<thread,
+	                                                                   lock::spinlock,
+	                                                                   &thread::run_queue_link,
+	                                                                   false>;
+
+	using zombie_queue_list_type = kbl::intrusive_list_with_default_trait<thread,
+	                                                                      lock::spinlock,
+	                                                                      &thread::zombie_queue_link,
+	                                                                      true>;
+
+	/// \brief a queue for each priority, with a bitmap of non-empty ones for O(1) picking
+	struct run_queue
+	{
+		uint64_t bitmap{ 0 };
+		size_type count{ 0 };
+		run_queue_list_type lists[PRIORITY_COUNT];
+	};
+	static_assert(PRIORITY_COUNT <= sizeof(run_queue::bitmap) * 8);
+
 	ule_scheduler_class() = delete;
 	~ule_scheduler_class() = default;
 	ule_scheduler_class(const ule_scheduler_class&) = delete;
@@ -34,8 +69,21 @@ class ule_scheduler_class
 	thread* steal(cpu_struct* stealer_cpu) override;
 
  private:
+	// queues_[current_] and queues_[current_ ^ 1] are the current and the next queue,
+	// which are swapped when the current one is drained
+	static constexpr size_t QUEUE_IDLE = 2;
+
+	void push_locked(size_t queue, thread* t) TA_REQ(lock_);
+	void remove_locked(thread* t) TA_REQ(lock_);
+
 	class scheduler* parent_{ nullptr };
+
+	run_queue queues_[3] TA_GUARDED(lock_){};
+	size_t current_ TA_GUARDED(lock_){ 0 };
+
+	zombie_queue_list_type zombie_queue_ TA_GUARDED(lock_);
+
 	mutable lock::spinlock lock_;
 };
 
-}
\ No newline at end of file
+}
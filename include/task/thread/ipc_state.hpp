@@ -91,9 +91,43 @@ class ipc_state
 	/// \return error code indicating if it succeeded
 	error_code wait(const deadline& ddl)  TA_REQ(!global_thread_lock);
 
-	void load_message(ipc::message* msg)TA_REQ(!global_thread_lock);
+	/// \brief send the message to a thread and wait for its reply.
+	/// If the target is already waiting in reply_wait, the current thread switches to it directly.
+	/// \param to the thread to call
+	/// \param ddl deadline for both the sending and the reply
+	/// \return error code indicating if it succeeded
+	error_code call(thread* to, const deadline& ddl) TA_REQ(!global_thread_lock);
+
+	/// \brief reply to the pending caller if there is one, then wait for the next call
+	/// \param ddl if wait until ddl and still no message, this method return with a error code
+	/// \return error code indicating if it succeeded
+	error_code reply_wait(const deadline& ddl) TA_REQ(!global_thread_lock);
+
+	/// \brief the thread sent the last received message
+	[[nodiscard]] thread* get_sender() const
+	{
+		return sender_;
+	}
+
+	/// \brief load a message to send
+	/// \param msg the message
+	/// \return -ERROR_INVALID if the items of the tag don't fit in the message registers
+	error_code load_message(ipc::message* msg) TA_REQ(!global_thread_lock);
+
+	/// \brief load a message passed in registers
+	/// \param regs the tag followed by untyped items
+	/// \return -ERROR_INVALID if the items of the tag don't fit in the message registers
+	error_code load_short_message(ktl::span<ipc::message_register_type> regs) TA_REQ(!global_thread_lock);
 
-	void store_message(ipc::message* msg) TA_REQ(!global_thread_lock);
+	/// \brief store the received message to registers if it has no typed items and fits in
+	/// \param regs where to store the tag followed by untyped items. The tag is always stored
+	/// \return false if the message is too long, which should be stored with store_message
+	bool store_short_message(ktl::span<ipc::message_register_type> regs) TA_REQ(!global_thread_lock);
+
+	/// \brief copy the received message out
+	/// \param msg where to store
+	/// \param allow_next_sender let the next sender of send/receive in. call and reply_wait don't need it
+	void store_message(ipc::message* msg, bool allow_next_sender = true) TA_REQ(!global_thread_lock);
 
 	/// \brief set acceptor to brs. will reset mr_count_, which influence exist items
 	/// \param acc
@@ -136,16 +170,37 @@ class ipc_state
 
 	void copy_mrs_to_locked(thread* another, size_t st, size_t cnt) TA_REQ(lock_);
 
-	error_code copy_string_locked([[maybe_unused]] thread* from_t,
-		uintptr_t from,
-		[[maybe_unused]] thread* to_t,
-		uintptr_t to,
-		size_t len)TA_REQ(lock_);
+	/// \brief copy a string between two address spaces, faulting pages in as needed
+	error_code copy_string(thread* from_t, uintptr_t from, thread* to_t, uintptr_t to, size_t len)
+	TA_REQ(!global_thread_lock, !lock_);
 
 	/// \brief set the message tag to mrs. will reset mr_count_, which influence exist items
 	/// \param tag
 	void set_message_tag_locked(const ipc::message_tag* tag) noexcept  TA_REQ(lock_);
 
+	enum class [[clang::enum_extensibility(closed)]] wait_states
+	{
+		NONE,
+		RECEIVING,  // blocked in reply_wait
+		CALLING,    // blocked in call, waiting for the reply
+	};
+
+	/// \brief copy the tag and the used message registers to another thread
+	void transfer_mrs_locked(thread* to) TA_REQ(global_thread_lock);
+
+	/// \brief wait until the owner of target is receiving, and take it off its queue
+	/// \return the receiver, which is blocked until someone wakes or switches to it
+	error_code_with_result<thread*> claim_receiver_locked(thread* to, const deadline& ddl) TA_REQ(global_thread_lock);
+
+	/// \brief take the caller off its queue if it's still waiting for our reply
+	thread* claim_caller_locked() TA_REQ(global_thread_lock);
+
+	/// \brief block for the reply, running receiver in place of the current thread
+	error_code wait_reply_locked(thread* receiver, thread* to, const deadline& ddl) TA_REQ(global_thread_lock);
+
+	/// \brief block for the next call. if next isn't null, it runs in place of the current thread
+	error_code wait_call_locked(thread* next, const deadline& ddl) TA_REQ(global_thread_lock);
+
 	/// \brief handle extended items like strings and map/grant items
 	/// \param to which thread to send extended items
 	/// \return
@@ -165,6 +220,18 @@ class ipc_state
 
 	thread* sender_{};
 
+	wait_states wait_state_ TA_GUARDED(global_thread_lock){ wait_states::NONE };
+
+	thread* caller_ TA_GUARDED(global_thread_lock){ nullptr }; // who is waiting for our reply
+
+	thread* callee_ TA_GUARDED(global_thread_lock){ nullptr }; // whose reply we are waiting for
+
+	error_code transfer_error_ TA_GUARDED(global_thread_lock){ ERROR_SUCCESS }; // extended items failed to arrive
+
+	task::wait_queue ipc_wait_queue_{}; // the owner blocks here in call and reply_wait
+
+	task::wait_queue callers_{}; // callers wait here until the owner is receiving
+
 	kbl::semaphore f_{ 0 }; // indicate that if items has been written but not yet read
 
 	kbl::semaphore e_{ 1 }; // indicate that if there's room to write
@@ -395,6 +395,9 @@ class thread final
 	link_type wait_queue_link{ this };
 	link_type master_list_link{ this };
 	link_type process_link{ this };
+
+	// threads posted to a scheduler from other CPUs
+	thread* inbox_next_{ nullptr };
  public:
 	using master_list_type = kbl::intrusive_list_with_default_trait<thread,
 	                                                                lock::spinlock,
@@ -90,8 +90,16 @@ class wait_queue
 		resource_ownership reason,
 		interruptible intr) TA_REQ(global_thread_lock);
 
+	/// \brief block the current thread, and run next on this CPU without going through the run queue
+	/// \param next a blocked thread that has been taken off its wait queue
+	error_code block_and_switch(thread* next, interruptible intr, const deadline& deadline) TA_REQ(global_thread_lock);
+
 	thread* peek() TA_REQ(global_thread_lock);
 
+	/// \brief take the first thread off the queue without waking it up.
+	/// the caller is responsible for making it run, for example with block_and_switch
+	thread* take_one(error_code code) TA_REQ(global_thread_lock);
+
 	bool wake_one(bool reschedule, error_code code) TA_REQ(global_thread_lock);
 	void wake_all(bool reschedule, error_code code) TA_REQ(global_thread_lock);
 
@@ -102,7 +110,13 @@ class wait_queue
 		return block_list_.size();
 	}
  private:
-	static void timeout_handle(struct scheduler_timer*, time_type now, void* arg) TA_REL(global_thread_lock);
+	static void timeout_handle(struct scheduler_timer*, time_type now, void* arg) TA_REQ(global_thread_lock);
+
+	error_code block_internal(const deadline& deadline,
+		uint32_t signal_mask,
+		resource_ownership reason,
+		interruptible intr,
+		thread* next) TA_REQ(global_thread_lock);
 
 	void dequeue(thread* t, error_code err) TA_REQ(global_thread_lock);
 
@@ -18,6 +18,13 @@ namespace arch
 	asm volatile("mfence":: :"memory");
 }
 
+/// \brief halt until an interrupt arrives, and return with interrupts disabled.
+/// sti takes effect after hlt starts, so a wakeup can't slip in between
+[[maybe_unused]]static inline void wait_for_interrupt()
+{
+	asm volatile("sti; hlt; cli":: :"memory");
+}
+
 [[maybe_unused]]static size_t cycles()
 {
 	return _rdtsc();
@@ -17,6 +17,7 @@ enum MSR_REGISTERS
     MSR_FS_BASE = 0xc0000100,        // 64bit FS base
     MSR_GS_BASE = 0xc0000101,        // 64bit GS base
     MSR_KERNEL_GS_BASE = 0xc0000102, // SwapGS GS shadow
+    MSR_TSC_DEADLINE = 0x6e0,        // TSC-deadline mode of LAPIC timer
 };
 
 static inline void wrmsr(uint64_t msr, uint64_t value)
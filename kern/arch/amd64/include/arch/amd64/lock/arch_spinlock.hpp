@@ -8,6 +8,11 @@
 
 struct cpu_struct;
 
+namespace lock
+{
+struct lockstat_class;
+}
+
 /*
  * architecture-dependent spinlock facility
  *
@@ -26,19 +31,41 @@ struct cpu_struct;
 namespace lock
 {
 
+// a ticket lock: lockers take the next ticket and spin until it is served, so the lock is
+// handed over in FIFO order instead of going to whichever CPU wins the cache line.
 struct TA_CAP("mutex") arch_spinlock
 {
+	union
+	{
+		uint64_t tickets;
+		struct
+		{
+			uint32_t serving;
+			uint32_t next;
+		} ticket;
+	};
+
+	// cpu id + 1 of the holder, or 0 if free
 	uint64_t value;
 
-#ifdef _KERNEL_ENABLE_DEBUG_FACILITY
 	ktl::string_view name;
+
+#ifdef _KERNEL_LOCK_DEBUG
 	uintptr_t pcs[21];
 #endif
+
+#ifdef _KERNEL_LOCKSTAT
+	lockstat_class* stat; // looked up by name on the first acquisition
+	uint64_t acquired_at;
+#endif
 };
 
-constexpr arch_spinlock ARCH_SPINLOCK_INITIAL{ .value=0 };
+constexpr arch_spinlock ARCH_SPINLOCK_INITIAL{ .tickets=0, .value=0 };
 
-void arch_spinlock_lock(arch_spinlock* l) TA_ACQ(l);
+/// \brief lock the given lock
+/// \param l the lock
+/// \param relax called while waiting for our turn, if not null
+void arch_spinlock_lock(arch_spinlock* l, void (* relax)() = nullptr) TA_ACQ(l);
 void arch_spinlock_unlock(arch_spinlock* l) TA_REL(l);
 
 /// \brief try to lock the given lock
@@ -38,38 +38,52 @@ static inline uint8_t this_cpu_id()
 	return *cpuid_ptr;
 }
 
-void lock::arch_spinlock_lock(lock::arch_spinlock* lock)
+void lock::arch_spinlock_lock(lock::arch_spinlock* lock, void (* relax)())
 {
-	__sync_synchronize();
+	auto my_ticket = __atomic_fetch_add(&lock->ticket.next, 1u, __ATOMIC_RELAXED);
 
-	uint64_t expected = 0, val = this_cpu_id() + 1;
-	while (!__atomic_compare_exchange_n(&lock->value, &expected, val, false,
-		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	while (__atomic_load_n(&lock->ticket.serving, __ATOMIC_ACQUIRE) != my_ticket)
 	{
-		expected = 0;
-		do
+		if (relax != nullptr)
 		{
-			arch::cpu_yield();
+			relax();
 		}
-		while (__atomic_load_n(&lock->value, __ATOMIC_RELAXED) != 0);
+
+		arch::cpu_yield();
 	}
+
+	__atomic_store_n(&lock->value, this_cpu_id() + 1ul, __ATOMIC_RELAXED);
 }
 
 bool lock::arch_spinlock_try_lock(lock::arch_spinlock* lock)
 {
-	uint64_t val = this_cpu_id() + 1;
+	auto tickets = __atomic_load_n(&lock->tickets, __ATOMIC_RELAXED);
 
-	uint64_t expected = 0;
+	// little-endian: serving is the low half, next the high half.
+	// only take a ticket if it would be served right away
+	if ((uint32_t)tickets != (uint32_t)(tickets >> 32u))
+	{
+		return true;
+	}
 
-	__atomic_compare_exchange_n(&lock->value, &expected, val, false, __ATOMIC_ACQUIRE,
-		__ATOMIC_RELAXED);
+	auto desired = tickets + (1ull << 32u);
+	if (!__atomic_compare_exchange_n(&lock->tickets, &tickets, desired, false, __ATOMIC_ACQUIRE,
+		__ATOMIC_RELAXED))
+	{
+		return true;
+	}
+
+	__atomic_store_n(&lock->value, this_cpu_id() + 1ul, __ATOMIC_RELAXED);
 
-	return expected != 0;
+	return false;
 }
 
 void lock::arch_spinlock_unlock(lock::arch_spinlock* lock)
 {
-	__atomic_store_n(&lock->value, 0UL, __ATOMIC_RELEASE);
-}
+	__atomic_store_n(&lock->value, 0UL, __ATOMIC_RELAXED);
 
+	// only the holder writes serving, so a plain increment is enough
+	auto serving = __atomic_load_n(&lock->ticket.serving, __ATOMIC_RELAXED);
+	__atomic_store_n(&lock->ticket.serving, serving + 1, __ATOMIC_RELEASE);
+}
 
@@ -22,6 +22,9 @@
 
 #include "memory/pmm.hpp"
 
+#include "drivers/acpi/cpu.h"
+#include "drivers/apic/traps.h"
+
 #include "../../../libs/basic_io/include/builtin_text_io.hpp"
 
 #include <cstring>
@@ -62,6 +65,81 @@ struct pci_achi_devices_struct
 	}
 } ahci_devs;
 
+ahci_port_state* ahci::ahci_port_get_state(const ahci_port* port)
+{
+	list_head* iter = nullptr;
+	list_for(iter, &ahci_devs.dev_head)
+	{
+		auto ctl = list_entry(iter, ahci_controller, list);
+		auto hba = (ahci_hba_mem*)ctl->regs;
+
+		if (port >= hba->ports && port < hba->ports + AHCI_PORT_COUNT)
+		{
+			auto state = &ctl->ports[port - hba->ports];
+			return state->regs != nullptr ? state : nullptr;
+		}
+	}
+
+	return nullptr;
+}
+
+static error_code ahci_trap_handle([[maybe_unused]] trap::trap_frame info)
+{
+	// controllers are few, so each interrupt checks all of them
+	list_head* iter = nullptr;
+	list_for(iter, &ahci_devs.dev_head)
+	{
+		auto ctl = list_entry(iter, ahci_controller, list);
+		auto hba = (ahci_hba_mem*)ctl->regs;
+
+		auto is = reinterpret_cast<volatile uint32_t*>(&hba->ghc.is);
+
+		uint32_t pending = *is;
+		for (size_t i = 0; i < AHCI_PORT_COUNT; i++)
+		{
+			if ((pending & (1u << i)) && ctl->ports[i].regs != nullptr)
+			{
+				ahci_port_complete(&ctl->ports[i]);
+			}
+		}
+
+		// the ports are cleared first, or they would raise it again
+		*is = pending;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static inline error_code ahci_setup_interrupt(ahci_controller* ctl, ahci_hba_mem* hba)
+{
+	auto vector_ret = trap::msi_vector_allocate(trap::trap_handle{
+		.handle = ahci_trap_handle,
+		.enable = true
+	});
+
+	if (has_error(vector_ret))
+	{
+		return get_error_code(vector_ret);
+	}
+
+	// MSIs go to the boot CPU, like the others
+	auto ret = pcie_device_config_msi(ctl->pci_dev, cpu->apicid, get_result(vector_ret));
+	if (ret != ERROR_SUCCESS)
+	{
+		return ret;
+	}
+
+	auto ghc = reinterpret_cast<volatile uint32_t*>(&hba->ghc.ghc);
+	*ghc = *ghc | AHCI_GHC_IE;
+
+	for (auto& state : ctl->ports)
+	{
+		state.interrupt = true;
+	}
+
+	return ERROR_SUCCESS;
+}
+
 __attribute__((always_inline))
 static inline void ahci_port_start(ahci_port* port)
 {
@@ -145,7 +223,7 @@ static inline error_code ahci_port_allocate(ahci_port* port)
 	ahci_command_list_entry* cmd_list = (ahci_command_list_entry*)P2V(cl_paddr);
 	for (size_t i = 0; i < AHCI_COMMAND_LIST_MAX; i++)
 	{
-		cmd_list[i].dw0.prdtl = 8;
+		cmd_list[i].dw0.prdtl = AHCI_PRD_PER_COMMAND;
 
 		uintptr_t ctba_paddr = V2P((uintptr_t)(command_table_base)) + i * 256;
 
@@ -159,6 +237,10 @@ static inline error_code ahci_port_allocate(ahci_port* port)
 
 	ahci_port_start(port);
 
+	// clear what is left from the firmware, and signal the completion of commands and the errors stopping them
+	*reinterpret_cast<volatile uint32_t*>(&port->is) = ~0u;
+	port->ie = AHCI_PORT_INT_DONE | AHCI_PORT_INT_FATAL;
+
 	return ERROR_SUCCESS;
 }
 
@@ -282,6 +364,20 @@ static inline error_code ahci_initialize_controller(ahci_controller* ctl)
 
 	kdebug::kdebug_log("Initialize AHCI controller (ver %d.%d)\n", hba->ghc.vs.major_ver, hba->ghc.vs.minor_ver);
 
+	for (size_t i = 0; i < AHCI_PORT_COUNT; i++)
+	{
+		if (hba->ghc.pi.bits & (1 << i))
+		{
+			ctl->ports[i].regs = &hba->ports[i];
+		}
+	}
+
+	// commands are polled until it works, as they are before the scheduler starts
+	if (auto err = ahci_setup_interrupt(ctl, hba);err != ERROR_SUCCESS)
+	{
+		kdebug::kdebug_warning("ahci: no interrupt for the controller, polling for completions.\n");
+	}
+
 	auto ret = ahci_enumerate_all_ports(ctl, hba);
 
 	return ret;
@@ -329,13 +425,15 @@ error_code ahci::ahci_init()
 				kdebug::kdebug_warning("ahci_init: memory alloc error.\n");
 			}
 
+			// ports are looked up by commands sent while it's being initialized
+			ahci_devs.add(ahci);
+
 			auto err = ahci_initialize_controller(ahci);
-			if (err == ERROR_SUCCESS)
-			{
-				ahci_devs.add(ahci);
-			}
-			else
+			if (err != ERROR_SUCCESS)
 			{
+				list_remove(&ahci->list);
+				ahci_devs.count--;
+
 				delete ahci;
 				kdebug::kdebug_warning("ahci_init: memory alloc error.\n");
 			}
@@ -16,6 +16,12 @@
 #include "drivers/ahci/ata/ata_string.hpp"
 #include "drivers/ahci/atapi/atapi.hpp"
 
+#include "task/thread/thread.hpp"
+
+#include "kbl/lock/lock_guard.hpp"
+
+#include "arch/amd64/cpu/interrupt.h"
+
 #include "../../../libs/basic_io/include/builtin_text_io.hpp"
 
 #include <cstring>
@@ -38,19 +44,182 @@ static inline ahci_command_table* ahci_cmd_entry_table(const ahci_command_list_e
 	return (ahci_command_table*)P2V(entry->ctba);
 }
 
-__attribute__((always_inline))
-static inline size_t ahci_port_find_free_cmd_slot(ahci_port* port)
+static inline uint32_t ahci_port_read(const uint32_t* reg)
+{
+	return *reinterpret_cast<const volatile uint32_t*>(reg);
+}
+
+/// \brief whether the sender can sleep until the controller interrupts, instead of polling
+static inline bool ahci_port_can_sleep(const ahci_port_state* state)
+{
+	return state->interrupt && task::cur_thread != nullptr && (x86_save_flags() & EFLAG_IF) != 0;
+}
+
+/// \brief take a free command slot, waiting for one if all are in flight and the sender can sleep
+static inline error_code_with_result<size_t> ahci_port_claim_slot(ahci_port_state* state)
 {
-	uint32_t slots = port->sact | port->ci;
-	for (size_t i = 0; i < 32; i++)
+	lock::lock_guard g{ task::global_thread_lock };
+
+	for (;;)
 	{
-		if ((slots & (1U << i)) == 0)
+		if (state->error)
+		{
+			return -ERROR_IO;
+		}
+
+		if (state->busy != ~0u)
+		{
+			size_t slot = __builtin_ctz(~state->busy);
+			state->busy |= 1u << slot;
+			return slot;
+		}
+
+		if (!ahci_port_can_sleep(state))
 		{
-			return i;
+			return -ERROR_BUSY;
 		}
+
+		// senders giving back slots wake us up
+		[[maybe_unused]] auto err = state->waiters.block(task::wait_queue::interruptible::No);
+	}
+}
+
+/// \brief wait for the command in the slot to complete, and give the slot back
+static inline error_code ahci_port_wait_slot(ahci_port_state* state, size_t slot)
+{
+	const uint32_t bit = 1u << slot;
+
+	if (!ahci_port_can_sleep(state))
+	{
+		for (;;)
+		{
+			ahci_port_complete(state);
+
+			lock::lock_guard g{ task::global_thread_lock };
+			if ((state->issued & bit) == 0)
+			{
+				break;
+			}
+
+			asm volatile("pause");
+		}
+	}
+
+	lock::lock_guard g{ task::global_thread_lock };
+
+	while (state->issued & bit)
+	{
+		[[maybe_unused]] auto err = state->waiters.block(task::wait_queue::interruptible::No);
 	}
 
-	return (size_t)-1;
+	bool failed = state->failed & bit;
+
+	state->failed &= ~bit;
+	state->busy &= ~bit;
+
+	// somebody may be waiting for a free slot
+	if (!state->waiters.empty())
+	{
+		state->waiters.wake_all(false, ERROR_SUCCESS);
+	}
+
+	if (failed)
+	{
+		kdebug::kdebug_log("AHCI: Task file error signalled.\n");
+		return -ERROR_IO;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+/// \brief restart the port after a fatal error, following the non-queued error recovery of the specification
+/// \return false if the port can't be restarted without resetting the device
+static bool ahci_port_recover(ahci_port* port)
+{
+	auto cmd = reinterpret_cast<volatile uint32_t*>(&port->cmd);
+
+	// clearing ST clears PxCI as well, once the command list stops running
+	*cmd = *cmd & ~AHCI_PORT_CMD_ST;
+
+	size_t spin = 0;
+	while ((*cmd & AHCI_PORT_CMD_CR) && spin < AHCI_SPIN_WAIT_MAX)
+	{
+		asm volatile ("pause");
+		++spin;
+	}
+
+	if (spin == AHCI_SPIN_WAIT_MAX)
+	{
+		return false;
+	}
+
+	// both are write-1-to-clear
+	*reinterpret_cast<volatile uint32_t*>(&port->serr) = ahci_port_read(&port->serr);
+	*reinterpret_cast<volatile uint32_t*>(&port->is) = ahci_port_read(reinterpret_cast<const uint32_t*>(&port->is));
+
+	if (ahci_port_read(reinterpret_cast<const uint32_t*>(&port->tfd)) & (AHCI_PORT_TFD_BSY | AHCI_PORT_TFD_DRQ))
+	{
+		return false;
+	}
+
+	*cmd = *cmd | AHCI_PORT_CMD_ST;
+
+	return true;
+}
+
+void ahci::ahci_port_complete(ahci_port_state* state)
+{
+	auto port = state->regs;
+
+	// clear what has been signalled before looking at the slots, so a completion after that isn't lost
+	uint32_t status = ahci_port_read(reinterpret_cast<const uint32_t*>(&port->is));
+	*reinterpret_cast<volatile uint32_t*>(&port->is) = status;
+
+	lock::lock_guard g{ task::global_thread_lock };
+
+	uint32_t done = state->issued & ~(ahci_port_read(&port->ci) | ahci_port_read(&port->sact));
+
+	// the port stops processing commands on these, so none of those in flight will complete.
+	// new commands fail until a sender restarts the port, which only the first to see it asks for
+	if (status & AHCI_PORT_INT_FATAL)
+	{
+		done = state->issued;
+		state->failed |= done;
+
+		state->needs_recovery = state->needs_recovery || !state->error;
+		state->error = true;
+	}
+
+	if (done != 0)
+	{
+		state->issued &= ~done;
+		state->waiters.wake_all(false, ERROR_SUCCESS);
+	}
+}
+
+/// \brief restart the port if a fatal error stopped it. Only one sender does, and the others fail meanwhile
+static inline void ahci_port_try_recover(ahci_port_state* state)
+{
+	{
+		lock::lock_guard g{ task::global_thread_lock };
+
+		if (!state->needs_recovery)
+		{
+			return;
+		}
+
+		state->needs_recovery = false;
+	}
+
+	if (!ahci_port_recover(state->regs))
+	{
+		// commands keep failing instead of waiting for a port that doesn't run
+		kdebug::kdebug_log("AHCI: Port can't recover from an error without a reset.\n");
+		return;
+	}
+
+	lock::lock_guard g{ task::global_thread_lock };
+	state->error = false;
 }
 
 __attribute__((always_inline))
@@ -69,20 +238,16 @@ static inline error_code make_prd(ahci_prd* prd, uintptr_t addr, size_t sz)
 	return ERROR_SUCCESS;
 }
 
-error_code ahci::ahci_port_send_command(ahci_port* port,
+/// \brief build the command in the slot and issue it
+static inline error_code ahci_port_issue(ahci_port* port,
+	ahci_port_state* state,
+	size_t slot,
 	uint8_t cmd_id,
 	bool atapi,
 	uintptr_t lba,
 	void* data,
 	size_t sz)
 {
-	auto slot = ahci_port_find_free_cmd_slot(port);
-
-	if (slot > 31)
-	{
-		return -ERROR_BUSY;
-	}
-
 	auto cl_entry = &ahci_port_cmd_list(port)[slot];
 	auto cmd_table = ahci_cmd_entry_table(cl_entry);
 
@@ -94,6 +259,10 @@ error_code ahci::ahci_port_send_command(ahci_port* port,
 	}
 
 	size_t prd_count = (sz + ahci::AHCI_PRD_MAX_SIZE - 1) / ahci::AHCI_PRD_MAX_SIZE;
+	if (prd_count > ahci::AHCI_PRD_PER_COMMAND)
+	{
+		return -ERROR_INVALID;
+	}
 
 	ahci_fis_reg_h2d* fis = &cmd_table->fis_reg_h2d;
 	memset(fis, 0, sizeof(ahci_fis_reg_h2d));
@@ -139,9 +308,16 @@ error_code ahci::ahci_port_send_command(ahci_port* port,
 		fis->countl = nsect & 0xFFFFu;
 	}
 
-	// Wait for port to be free for commands
+	// Wait for port to be free for commands. While others are in flight the device is busy with them,
+	// and the port queues this one behind them by itself
+	bool idle = false;
+	{
+		lock::lock_guard g{ task::global_thread_lock };
+		idle = state->issued == 0;
+	}
+
 	size_t spin = 0;
-	while ((port->tfd.sts_bsy || port->tfd.sts_drq) && spin < AHCI_SPIN_WAIT_MAX)
+	while (idle && (port->tfd.sts_bsy || port->tfd.sts_drq) && spin < AHCI_SPIN_WAIT_MAX)
 	{
 		asm volatile ("pause");
 		++spin;
@@ -153,31 +329,68 @@ error_code ahci::ahci_port_send_command(ahci_port* port,
 		return -ERROR_TIMEOUT;
 	}
 
-	port->ci |= (1u << slot);
-
-	while (true)
+	// the completion can't be collected before the slot is marked issued
 	{
-		asm volatile("nop");
-
-		if (((port->sact | port->ci) & (1u << slot)) == 0 && port->is.dps == 0)
-		{
-			break;
-		}
+		lock::lock_guard g{ task::global_thread_lock };
 
-		if (port->is.tfes)
+		// the port may have stopped on an error since the slot was claimed
+		if (state->error)
 		{
-			kdebug::kdebug_log("AHCI: Task file error signalled.\n");
 			return -ERROR_IO;
 		}
+
+		state->issued |= 1u << slot;
+		*reinterpret_cast<volatile uint32_t*>(&port->ci) = 1u << slot; // zeros have no effect
 	}
 
-	if (port->is.tfes)
+	return ERROR_SUCCESS;
+}
+
+error_code ahci::ahci_port_send_command(ahci_port* port,
+	uint8_t cmd_id,
+	bool atapi,
+	uintptr_t lba,
+	void* data,
+	size_t sz)
+{
+	auto state = ahci_port_get_state(port);
+	if (state == nullptr)
 	{
-		kdebug::kdebug_log("AHCI: Task file error signalled.\n");
-		return -ERROR_IO;
+		return -ERROR_INVALID;
 	}
 
-	return ERROR_SUCCESS;
+	// the recovery spins for the port to stop, so it's done here rather than in the interrupt handler
+	ahci_port_try_recover(state);
+
+	auto slot_ret = ahci_port_claim_slot(state);
+	if (has_error(slot_ret))
+	{
+		return get_error_code(slot_ret);
+	}
+
+	auto slot = get_result(slot_ret);
+
+	// the slot is given back however the command ends
+	auto err = ahci_port_issue(port, state, slot, cmd_id, atapi, lba, data, sz);
+	if (err != ERROR_SUCCESS)
+	{
+		lock::lock_guard g{ task::global_thread_lock };
+		state->busy &= ~(1u << slot);
+
+		if (!state->waiters.empty())
+		{
+			state->waiters.wake_all(false, ERROR_SUCCESS);
+		}
+
+		return err;
+	}
+
+	err = ahci_port_wait_slot(state, slot);
+
+	// a command that stopped the port gets it restarted by its own sender as well
+	ahci_port_try_recover(state);
+
+	return err;
 }
 
 error_code common_identify_device(ahci_port* port, bool atapi)
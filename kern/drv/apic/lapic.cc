@@ -56,7 +56,6 @@ PANIC void local_apic::init_lapic()
 	if (ecx & features::ecx_bits::CPUID_ECX_BIT_TSCDeadline)
 	{
 		kdebug::kdebug_log("TSC-Deadline timer mode is supported.\n");
-		// TODO: use TSC-Deadline
 	}
 	else
 	{
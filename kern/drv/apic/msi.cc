@@ -16,6 +16,7 @@
 #include "system/vmm.h"
 #include "task/process/process.hpp"
 
+#include "ktl/atomic.hpp"
 
 #include "../../libs/basic_io/include/builtin_text_io.hpp"
 #include <cstring>
@@ -23,4 +24,19 @@
 error_code msi_base_trap_handle([[maybe_unused]]trap::trap_frame tf)
 {
 	return ERROR_SUCCESS;
-}
\ No newline at end of file
+}
+
+// vectors from TRAP_MSI_BASE up are handed out one by one, and never given back
+static ktl::atomic<size_t> next_msi_vector{ trap::TRAP_MSI_BASE };
+
+error_code_with_result<size_t> trap::msi_vector_allocate(trap_handle handle)
+{
+	auto vector = next_msi_vector.fetch_add(1, ktl::memory_order_relaxed);
+	if (vector >= TRAP_NUMBERMAX)
+	{
+		return -ERROR_BUSY;
+	}
+
+	trap_handle_register(vector, handle);
+	return vector;
+}
@@ -1,4 +1,8 @@
 #include "arch/amd64/cpu/regs.h"
+#include "arch/amd64/cpu/port_io.h"
+#include "arch/amd64/cpu/msr.h"
+#include "arch/amd64/cpu/cpuid.h"
+#include "arch/amd64/cpu/intrinsics.hpp"
 
 #include "system/error.hpp"
 #include "system/scheduler.h"
@@ -8,6 +12,7 @@
 
 #include "drivers/acpi/cpu.h"
 #include "drivers/apic/apic.h"
+#include "drivers/apic/local_apic.hpp"
 #include "drivers/apic/traps.h"
 #include "debug/kdebug.h"
 #include "kbl/lock/spinlock.h"
@@ -18,6 +23,7 @@
 #include "task/process/process.hpp"
 
 #include "ktl/atomic.hpp"
+#include "ktl/algorithm.hpp"
 
 #include "builtin_text_io.hpp"
 
@@ -30,15 +36,77 @@ using namespace lock;
 using trap::IRQ_TIMER;
 using trap::TRAP_IRQ0;
 
-volatile ktl::atomic<uint64_t> ticks{ 0 };
-static_assert(ktl::atomic<uint64_t>::is_always_lock_free);
-
 volatile ktl::atomic<uint64_t> timer_mask{ 0 };
 static_assert(ktl::atomic<uint64_t>::is_always_lock_free);
 
+// the PIT is only used as a reference to calibrate the TSC and the LAPIC timer
+static constexpr uint16_t PIT_CHANNEL2_PORT = 0x42;
+static constexpr uint16_t PIT_COMMAND_PORT = 0x43;
+static constexpr uint16_t PIT_GATE_PORT = 0x61;
+
+static constexpr uint8_t PIT_GATE_CHANNEL2 = 0x01;
+static constexpr uint8_t PIT_GATE_SPEAKER = 0x02;
+static constexpr uint8_t PIT_GATE_OUTPUT2 = 0x20;
+
+// channel 2, lobyte/hibyte, interrupt on terminal count
+static constexpr uint8_t PIT_CHANNEL2_ONESHOT = 0xB0;
+
+static constexpr uint64_t PIT_FREQUENCY = 1193182;
+static constexpr uint64_t PIT_CALIBRATE_LATCH = PIT_FREQUENCY / 100; // 10ms
+
+static constexpr uint64_t NS_PER_SECOND = 1'000'000'000;
+
+static uint64_t tsc_hz = 0;
+static uint64_t lapic_hz = 0;
+
+// now() is (tsc - tsc_base) * ns_mult >> 32
+static uint64_t tsc_base = 0;
+static uint64_t ns_mult = 0;
+
+static bool tsc_deadline_supported = false;
+
 // defined below
 error_code trap_handle_tick(trap::trap_frame info);
 
+static void calibrate()
+{
+	// gate channel 2 on with the speaker off, and let it count down once
+	outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~PIT_GATE_SPEAKER) | PIT_GATE_CHANNEL2);
+	outb(PIT_COMMAND_PORT, PIT_CHANNEL2_ONESHOT);
+	outb(PIT_CHANNEL2_PORT, PIT_CALIBRATE_LATCH & 0xFF);
+	outb(PIT_CHANNEL2_PORT, (PIT_CALIBRATE_LATCH >> 8) & 0xFF);
+
+	// the LAPIC timer counts down in the same window
+	timer_divide_configuration_reg dcr{ .divide_val=TIMER_DIV1 };
+	write_lapic(DCR_ADDR, dcr);
+
+	lvt_timer_reg timer_reg{ .vector=(trap::IRQ_TO_TRAPNUM(IRQ_TIMER)), .mask=true, .timer_mode=TIMER_ONE_SHOT };
+	write_lapic(LVT_TIMER_ADDR, timer_reg);
+	write_lapic(INITIAL_COUNT_ADDR, UINT32_MAX);
+
+	auto tsc_start = arch::cycles();
+
+	while (!(inb(PIT_GATE_PORT) & PIT_GATE_OUTPUT2))
+	{
+	}
+
+	auto tsc_end = arch::cycles();
+	uint64_t lapic_elapsed = UINT32_MAX - read_lapic<uint32_t>(CURRENT_COUNT_ADDR);
+
+	auto window_ns = PIT_CALIBRATE_LATCH * NS_PER_SECOND / PIT_FREQUENCY;
+
+	tsc_hz = (tsc_end - tsc_start) * NS_PER_SECOND / window_ns;
+	lapic_hz = lapic_elapsed * NS_PER_SECOND / window_ns;
+
+	tsc_base = tsc_end;
+	ns_mult = (NS_PER_SECOND << 32) / tsc_hz;
+
+	auto[eax, ebx, ecx, edx]= cpuid(cpuid_requests::CPUID_GETFEATURES);
+	tsc_deadline_supported = ecx & features::ecx_bits::CPUID_ECX_BIT_TSCDeadline;
+
+	kdebug::kdebug_log("TSC runs at %lld Hz, LAPIC timer at %lld Hz.\n", tsc_hz, lapic_hz);
+}
+
 PANIC void timer::init_apic_timer()
 {
 	// register the handle
@@ -49,6 +117,26 @@ PANIC void timer::init_apic_timer()
 				.enable = true
 			});
 
+	// the boot CPU comes here first, others share its result
+	if (tsc_hz == 0)
+	{
+		calibrate();
+	}
+
+	// the timer always runs one-shot, and the scheduler decides when it fires next,
+	// so that an idle CPU isn't woken up by a periodic tick
+	timer_divide_configuration_reg dcr{ .divide_val=TIMER_DIV1 };
+	write_lapic(DCR_ADDR, dcr);
+
+	lvt_timer_reg timer_reg{ .vector=(trap::IRQ_TO_TRAPNUM(IRQ_TIMER)),
+		.mask=false,
+		.timer_mode=tsc_deadline_supported ? TIMER_TSC_DEADLINE : TIMER_ONE_SHOT };
+	write_lapic(LVT_TIMER_ADDR, timer_reg);
+
+	// the write to LVT must be visible before arming the TSC deadline
+	arch::mfence();
+
+	program_event(time_add_duration(now(), TICK_PERIOD));
 }
 
 error_code trap_handle_tick([[maybe_unused]] trap::trap_frame info)
@@ -57,16 +145,58 @@ error_code trap_handle_tick([[maybe_unused]] trap::trap_frame info)
 
 	if (!(timer_mask.load() & (1 << id)))
 	{
-		ticks++;
 		local_apic::write_eoi();
 
 		task::global_thread_lock.assert_not_held();
 		task::scheduler::current::timer_tick_handle();
 	}
+	else
+	{
+		timer::program_event(time_add_duration(timer::now(), timer::TICK_PERIOD));
+	}
 
 	return ERROR_SUCCESS;
 }
 
+time_type timer::now()
+{
+	auto elapsed = arch::cycles() - tsc_base;
+	return (time_type)(((unsigned __int128)elapsed * ns_mult) >> 32);
+}
+
+uint64_t timer::tsc_frequency()
+{
+	return tsc_hz;
+}
+
+void timer::program_event(time_type when)
+{
+	if (tsc_deadline_supported)
+	{
+		// zero disarms the timer, and a deadline in the past fires at once
+		uint64_t deadline = 0;
+		if (when != TIME_INFINITE)
+		{
+			deadline = tsc_base + (uint64_t)(((unsigned __int128)ktl::max(when, (time_type)0) * tsc_hz) / NS_PER_SECOND);
+		}
+
+		wrmsr(MSR_TSC_DEADLINE, deadline);
+		return;
+	}
+
+	uint32_t count = 0;
+	if (when != TIME_INFINITE)
+	{
+		auto delta = ktl::max(time_sub_time(when, now()), (duration_type)0);
+
+		// a count longer than 32 bits fires early, and is programmed again then
+		auto lapic_count = ((unsigned __int128)delta * lapic_hz) / NS_PER_SECOND;
+		count = (uint32_t)ktl::clamp(lapic_count, (unsigned __int128)1, (unsigned __int128)UINT32_MAX);
+	}
+
+	write_lapic(INITIAL_COUNT_ADDR, count);
+}
+
 void timer::mask_cpu_local_timer(bool masked)
 {
 	mask_cpu_local_timer(cpu->id, masked);
@@ -88,5 +218,5 @@ void timer::mask_cpu_local_timer(size_t cpuid, bool masked)
 
 uint64_t timer::get_ticks()
 {
-	return ticks.load(ktl::memory_order_seq_cst);
+	return now() / TICK_PERIOD;
 }
@@ -218,7 +218,9 @@ error_code pci::express::pcie_device_config_msi(IN pci_device* dev, size_t apic_
 		msi_capability->reg1to3.regs32bit.reg3.msg_data = msi_data.first;
 	}
 
-	msi_capability->reg0.msg_control.multiple_msg_ena = true;
+	// a single message, which is sent once the address and the data are set
+	msi_capability->reg0.msg_control.multiple_msg_ena = 0;
+	msi_capability->reg0.msg_control.enable = true;
 
 	return ERROR_SUCCESS;
 }
@@ -2,3 +2,472 @@
 // Created by bear on 10/19/20.
 //
 
+#include "fs/cache/cache.hpp"
+
+#include "kbl/lock/lock_guard.hpp"
+
+#include "ktl/atomic.hpp"
+
+#include "debug/kdebug.h"
+
+#include <cstring>
+
+using namespace file_system;
+
+static constexpr size_t HASH_BUCKET_COUNT = 256;
+
+// the cache lock protects the identity, the reference count and the links of buffers
+static kbl::adaptive_mutex cache_lock{};
+
+static block_buffer* buckets[HASH_BUCKET_COUNT] TA_GUARDED(cache_lock){};
+
+// every buffer ever allocated, swept by the CLOCK hand
+static block_buffer* buffers[BLOCK_CACHE_CAPACITY] TA_GUARDED(cache_lock){};
+static size_t buffer_count TA_GUARDED(cache_lock) = 0;
+static size_t clock_hand TA_GUARDED(cache_lock) = 0;
+
+static ktl::atomic<size_t> dirty_count{ 0 };
+
+// one releaser writes back at a time when over the dirty limit, and the others go on meanwhile
+static ktl::atomic<bool> limit_sync_running{ false };
+
+// bumped after every write back, so uncached reads can tell a buffer may have left the cache meanwhile
+static ktl::atomic<size_t> writeback_count{ 0 };
+
+static inline size_t bucket_of(device_class* dev, size_t block)
+{
+	uint64_t key = (reinterpret_cast<uintptr_t>(dev) >> 4) ^ (block * 0x9E3779B97F4A7C15ull);
+	return ((key >> 32) ^ key) % HASH_BUCKET_COUNT;
+}
+
+static block_buffer* lookup(device_class* dev, size_t block) TA_REQ(cache_lock)
+{
+	for (auto buf = buckets[bucket_of(dev, block)]; buf != nullptr; buf = buf->hash_next)
+	{
+		if (buf->dev == dev && buf->block == block)
+		{
+			return buf;
+		}
+	}
+
+	return nullptr;
+}
+
+static void hash_insert(block_buffer* buf) TA_REQ(cache_lock)
+{
+	auto& head = buckets[bucket_of(buf->dev, buf->block)];
+	buf->hash_next = head;
+	head = buf;
+}
+
+static void hash_remove(block_buffer* buf) TA_REQ(cache_lock)
+{
+	auto pp = &buckets[bucket_of(buf->dev, buf->block)];
+	while (*pp != buf)
+	{
+		KDEBUG_ASSERT(*pp != nullptr);
+		pp = &(*pp)->hash_next;
+	}
+
+	*pp = buf->hash_next;
+	buf->hash_next = nullptr;
+}
+
+/// \brief find a buffer to hold another block. New buffers are allocated until the cache is full,
+/// then unreferenced ones are recycled in CLOCK order.
+static block_buffer* find_victim() TA_REQ(cache_lock)
+{
+	if (buffer_count < BLOCK_CACHE_CAPACITY)
+	{
+		auto buf = new(std::nothrow) block_buffer{};
+		if (buf != nullptr)
+		{
+			buffers[buffer_count++] = buf;
+			return buf;
+		}
+	}
+
+	// the first sweep may do nothing but clear accessed bits
+	for (size_t i = 0; i < 2 * buffer_count; i++)
+	{
+		auto buf = buffers[clock_hand];
+		clock_hand = (clock_hand + 1) % buffer_count;
+
+		if (buf->refs != 0)
+		{
+			continue;
+		}
+
+		if (buf->accessed)
+		{
+			buf->accessed = false;
+			continue;
+		}
+
+		return buf;
+	}
+
+	return nullptr;
+}
+
+static error_code read_in(block_buffer* buf) TA_REQ(buf->lock)
+{
+	auto ret = buf->dev->read(buf->data, buf->block * buf->block_size, buf->block_size);
+	if (has_error(ret))
+	{
+		return get_error_code(ret);
+	}
+
+	if (get_result(ret) != buf->block_size)
+	{
+		return -ERROR_IO;
+	}
+
+	buf->valid = true;
+	return ERROR_SUCCESS;
+}
+
+static error_code write_back(block_buffer* buf) TA_REQ(buf->lock)
+{
+	auto ret = buf->dev->write(buf->data, buf->block * buf->block_size, buf->block_size);
+	if (has_error(ret))
+	{
+		return get_error_code(ret);
+	}
+
+	if (get_result(ret) != buf->block_size)
+	{
+		return -ERROR_IO;
+	}
+
+	buf->dirty = false;
+	dirty_count--;
+	writeback_count++;
+
+	return ERROR_SUCCESS;
+}
+
+/// \brief write back dirty buffers. Buffers locked by others are skipped unless wait is set
+static error_code sync_buffers(device_class* dev, bool wait)
+{
+	error_code ret = ERROR_SUCCESS;
+
+	for (size_t i = 0;; i++)
+	{
+		block_buffer* buf = nullptr;
+		{
+			lock::lock_guard g{ cache_lock };
+			if (i >= buffer_count)
+			{
+				break;
+			}
+
+			buf = buffers[i];
+			if (!buf->dirty || (dev != nullptr && buf->dev != dev))
+			{
+				continue;
+			}
+
+			// pin it so that it isn't recycled while we wait for it
+			buf->refs++;
+		}
+
+		if (wait)
+		{
+			buf->lock.lock();
+		}
+		else if (!buf->lock.try_lock())
+		{
+			lock::lock_guard g{ cache_lock };
+			buf->refs--;
+			continue;
+		}
+
+		if (buf->dirty)
+		{
+			if (auto err = write_back(buf);err != ERROR_SUCCESS)
+			{
+				ret = err;
+			}
+		}
+
+		buf->lock.unlock();
+
+		lock::lock_guard g{ cache_lock };
+		buf->refs--;
+	}
+
+	return ret;
+}
+
+error_code_with_result<block_buffer*> file_system::block_cache_get(device_class* dev,
+	size_t block,
+	size_t block_size,
+	bool fill)
+{
+	block_buffer* buf = nullptr;
+
+	cache_lock.lock();
+	for (;;)
+	{
+		if ((buf = lookup(dev, block)) != nullptr)
+		{
+			KDEBUG_ASSERT(buf->block_size == block_size);
+
+			buf->refs++;
+			buf->accessed = true;
+			break;
+		}
+
+		buf = find_victim();
+		if (buf == nullptr)
+		{
+			cache_lock.unlock();
+			return -ERROR_BUSY;
+		}
+
+		if (buf->dirty)
+		{
+			// it keeps its identity until it's clean, so nobody reads a stale copy from the disk
+			buf->refs++;
+			cache_lock.unlock();
+
+			error_code err = ERROR_SUCCESS;
+			{
+				lock::lock_guard g{ buf->lock };
+				if (buf->dirty)
+				{
+					err = write_back(buf);
+				}
+			}
+
+			cache_lock.lock();
+			buf->refs--;
+
+			if (err != ERROR_SUCCESS)
+			{
+				cache_lock.unlock();
+				return err;
+			}
+
+			// somebody may have brought the block in meanwhile
+			continue;
+		}
+
+		if (buf->dev != nullptr)
+		{
+			hash_remove(buf);
+		}
+
+		if (buf->block_size != block_size)
+		{
+			delete[] buf->data;
+			buf->data = new(std::nothrow) uint8_t[block_size];
+			buf->block_size = buf->data != nullptr ? block_size : 0;
+		}
+
+		if (buf->data == nullptr)
+		{
+			buf->dev = nullptr;
+			cache_lock.unlock();
+			return -ERROR_MEMORY_ALLOC;
+		}
+
+		buf->dev = dev;
+		buf->block = block;
+		buf->valid = false;
+		buf->refs = 1;
+		buf->accessed = true;
+
+		hash_insert(buf);
+		break;
+	}
+	cache_lock.unlock();
+
+	buf->lock.lock();
+
+	if (!buf->valid && fill)
+	{
+		if (auto err = read_in(buf);err != ERROR_SUCCESS)
+		{
+			block_cache_release(buf);
+			return err;
+		}
+	}
+
+	return buf;
+}
+
+void file_system::block_cache_mark_dirty(block_buffer* buf)
+{
+	KDEBUG_ASSERT(buf->lock.holding());
+
+	buf->valid = true;
+
+	if (!buf->dirty)
+	{
+		buf->dirty = true;
+		dirty_count++;
+	}
+}
+
+void file_system::block_cache_release(block_buffer* buf)
+{
+	buf->lock.unlock();
+
+	{
+		lock::lock_guard g{ cache_lock };
+		KDEBUG_ASSERT(buf->refs > 0);
+		buf->refs--;
+	}
+
+	// don't let too much unwritten data pile up. A sync writes back all it can,
+	// so another one before it's done would only walk the buffers again
+	if (dirty_count.load(ktl::memory_order_relaxed) > BLOCK_CACHE_DIRTY_LIMIT &&
+		!limit_sync_running.exchange(true, ktl::memory_order_acquire))
+	{
+		[[maybe_unused]] auto err = sync_buffers(nullptr, false);
+		limit_sync_running.store(false, ktl::memory_order_release);
+	}
+}
+
+error_code file_system::block_cache_read(device_class* dev,
+	size_t block,
+	size_t block_size,
+	void* buf,
+	size_t offset,
+	size_t len)
+{
+	KDEBUG_ASSERT(offset + len <= block_size);
+
+	auto ret = block_cache_get(dev, block, block_size);
+	if (has_error(ret))
+	{
+		return get_error_code(ret);
+	}
+
+	auto cached = get_result(ret);
+	memmove(buf, cached->data + offset, len);
+	block_cache_release(cached);
+
+	return ERROR_SUCCESS;
+}
+
+error_code file_system::block_cache_write(device_class* dev,
+	size_t block,
+	size_t block_size,
+	const void* buf,
+	size_t offset,
+	size_t len)
+{
+	KDEBUG_ASSERT(offset + len <= block_size);
+
+	// a whole block is overwritten, so there is no need to read it first
+	bool whole = offset == 0 && len == block_size;
+
+	auto ret = block_cache_get(dev, block, block_size, !whole);
+	if (has_error(ret))
+	{
+		return get_error_code(ret);
+	}
+
+	auto cached = get_result(ret);
+	memmove(cached->data + offset, buf, len);
+	block_cache_mark_dirty(cached);
+	block_cache_release(cached);
+
+	return ERROR_SUCCESS;
+}
+
+error_code file_system::block_cache_read_run(device_class* dev,
+	size_t block,
+	size_t count,
+	size_t block_size,
+	void* buf)
+{
+	auto dst = reinterpret_cast<uint8_t*>(buf);
+	auto writebacks = writeback_count.load(ktl::memory_order_acquire);
+
+	auto ret = dev->read(dst, block * block_size, count * block_size);
+	if (has_error(ret))
+	{
+		return get_error_code(ret);
+	}
+
+	if (get_result(ret) != count * block_size)
+	{
+		return -ERROR_IO;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		block_buffer* cached = nullptr;
+		{
+			lock::lock_guard g{ cache_lock };
+			if ((cached = lookup(dev, block + i)) == nullptr)
+			{
+				continue;
+			}
+
+			cached->refs++;
+		}
+
+		{
+			lock::lock_guard g{ cached->lock };
+			if (cached->valid)
+			{
+				memmove(dst + i * block_size, cached->data, block_size);
+			}
+		}
+
+		lock::lock_guard g{ cache_lock };
+		cached->refs--;
+	}
+
+	// a dirty block written back and recycled after the device read is missed above, so go the slow way
+	if (writeback_count.load(ktl::memory_order_acquire) != writebacks)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			if (auto err = block_cache_read(dev, block + i, block_size, dst + i * block_size, 0, block_size);
+				err != ERROR_SUCCESS)
+			{
+				return err;
+			}
+		}
+	}
+
+	return ERROR_SUCCESS;
+}
+
+error_code file_system::block_cache_sync(device_class* dev)
+{
+	return sync_buffers(dev, true);
+}
+
+error_code file_system::block_cache_invalidate(device_class* dev)
+{
+	if (auto err = block_cache_sync(dev);err != ERROR_SUCCESS)
+	{
+		return err;
+	}
+
+	lock::lock_guard g{ cache_lock };
+
+	for (size_t i = 0; i < buffer_count; i++)
+	{
+		auto buf = buffers[i];
+		if (buf->dev != dev)
+		{
+			continue;
+		}
+
+		KDEBUG_ASSERT(buf->refs == 0 && !buf->dirty);
+
+		hash_remove(buf);
+		buf->dev = nullptr;
+		buf->valid = false;
+	}
+
+	return ERROR_SUCCESS;
+}
@@ -0,0 +1,449 @@
+#include "fs/cache/page_cache.hpp"
+#include "fs/vfs/vfs.hpp"
+
+#include "memory/pmm.hpp"
+
+#include "system/memlayout.h"
+
+#include "kbl/lock/lock_guard.hpp"
+
+#include "debug/kdebug.h"
+
+#include <cstring>
+#include <algorithm>
+
+using namespace file_system;
+
+using memory::physical_memory_manager;
+
+file_system::page_cache::~page_cache()
+{
+	lock::lock_guard g{ lock_ };
+
+	if (root_ != nullptr)
+	{
+		free_node(root_, height_ - 1);
+	}
+
+	root_ = nullptr;
+	height_ = 0;
+	page_count_ = 0;
+}
+
+error_code_with_result<uintptr_t> file_system::page_cache::get_page(size_t index)
+{
+	auto pmm_instance = physical_memory_manager::instance();
+
+	lock::lock_guard g{ lock_ };
+
+	if (auto pa = lookup(index);pa != 0)
+	{
+		pmm_instance->get_small(pa);
+		return pa;
+	}
+
+	if (page_count_ >= MAX_PAGES)
+	{
+		evict_one();
+	}
+
+	// the frame comes zeroed, so holes and the tail beyond the end of file read as zero
+	auto pa = pmm_instance->allocate_small();
+	if (pa == 0)
+	{
+		return -ERROR_MEMORY_ALLOC;
+	}
+
+	if (auto err = owner_->fill_page(index, reinterpret_cast<void*>(P2V(pa)));err != ERROR_SUCCESS)
+	{
+		pmm_instance->put_small(pa);
+		return err;
+	}
+
+	if (auto err = insert(index, pa);err != ERROR_SUCCESS)
+	{
+		pmm_instance->put_small(pa);
+		return err;
+	}
+
+	// one reference for the cache, and one for the caller
+	pmm_instance->get_small(pa);
+	return pa;
+}
+
+error_code file_system::page_cache::read(size_t offset, void* buf, size_t len)
+{
+	auto pmm_instance = physical_memory_manager::instance();
+	auto dst = reinterpret_cast<uint8_t*>(buf);
+
+	while (len > 0)
+	{
+		size_t in_page = offset % SMALL_PAGE_SIZE;
+		size_t count = std::min(len, SMALL_PAGE_SIZE - in_page);
+
+		auto ret = get_page(offset / SMALL_PAGE_SIZE);
+		if (has_error(ret))
+		{
+			return get_error_code(ret);
+		}
+
+		auto pa = get_result(ret);
+		memmove(dst, reinterpret_cast<uint8_t*>(P2V(pa)) + in_page, count);
+		pmm_instance->put_small(pa);
+
+		dst += count;
+		offset += count;
+		len -= count;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+void file_system::page_cache::read_ahead(file_readahead* ra, size_t pos, size_t len, size_t file_size)
+{
+	if (len == 0)
+	{
+		return;
+	}
+
+	size_t first = pos / SMALL_PAGE_SIZE, last = (pos + len - 1) / SMALL_PAGE_SIZE;
+	size_t file_pages = (file_size + SMALL_PAGE_SIZE - 1) / SMALL_PAGE_SIZE;
+
+	bool sequential = pos == ra->next_pos;
+	ra->next_pos = pos + len;
+
+	lock::lock_guard g{ lock_ };
+
+	if (!sequential)
+	{
+		// a random read only gets the pages it asks for
+		ra->window = 0;
+		ra->end = 0;
+
+		fill_range(first, last - first + 1);
+		return;
+	}
+
+	ra->window = ra->window == 0 ? READAHEAD_INITIAL : std::min(ra->window * 2, READAHEAD_MAX);
+
+	// wait until half of what has been read ahead is consumed, so that requests stay large
+	if (ra->end > last && ra->end - (last + 1) >= ra->window / 2)
+	{
+		return;
+	}
+
+	size_t from = std::max(first, ra->end);
+	size_t to = std::min(last + 1 + ra->window, file_pages);
+
+	if (to > from)
+	{
+		fill_range(from, to - from);
+	}
+
+	ra->end = std::max(ra->end, to);
+}
+
+void file_system::page_cache::update(size_t offset, const void* buf, size_t len)
+{
+	auto src = reinterpret_cast<const uint8_t*>(buf);
+
+	lock::lock_guard g{ lock_ };
+
+	while (len > 0)
+	{
+		size_t in_page = offset % SMALL_PAGE_SIZE;
+		size_t count = std::min(len, SMALL_PAGE_SIZE - in_page);
+
+		if (auto pa = lookup(offset / SMALL_PAGE_SIZE);pa != 0)
+		{
+			memmove(reinterpret_cast<uint8_t*>(P2V(pa)) + in_page, src, count);
+		}
+
+		src += count;
+		offset += count;
+		len -= count;
+	}
+}
+
+void file_system::page_cache::truncate(size_t size)
+{
+	auto pmm_instance = physical_memory_manager::instance();
+
+	lock::lock_guard g{ lock_ };
+
+	// frames still mapped by somebody stay alive until they are unmapped
+	size_t index = 0;
+	while (next_present((size + SMALL_PAGE_SIZE - 1) / SMALL_PAGE_SIZE, &index))
+	{
+		pmm_instance->put_small(remove(index));
+	}
+
+	if (size_t in_page = size % SMALL_PAGE_SIZE;in_page != 0)
+	{
+		if (auto pa = lookup(size / SMALL_PAGE_SIZE);pa != 0)
+		{
+			memset(reinterpret_cast<uint8_t*>(P2V(pa)) + in_page, 0, SMALL_PAGE_SIZE - in_page);
+		}
+	}
+}
+
+uintptr_t file_system::page_cache::lookup(size_t index)
+{
+	if (root_ == nullptr || index >= capacity())
+	{
+		return 0;
+	}
+
+	auto node = root_;
+	for (size_t level = height_ - 1; level > 0; level--)
+	{
+		node = reinterpret_cast<radix_node*>(node->slots[(index >> (level * RADIX_SHIFT)) & (RADIX_SLOTS - 1)]);
+		if (node == nullptr)
+		{
+			return 0;
+		}
+	}
+
+	return node->slots[index & (RADIX_SLOTS - 1)];
+}
+
+error_code file_system::page_cache::insert(size_t index, uintptr_t pa)
+{
+	// grow the tree upwards until the index fits in it
+	while (root_ == nullptr || index >= capacity())
+	{
+		auto node = new(std::nothrow) radix_node{};
+		if (node == nullptr)
+		{
+			return -ERROR_MEMORY_ALLOC;
+		}
+
+		if (root_ != nullptr)
+		{
+			node->slots[0] = reinterpret_cast<uintptr_t>(root_);
+			node->count = 1;
+		}
+
+		root_ = node;
+		height_++;
+	}
+
+	auto node = root_;
+	for (size_t level = height_ - 1; level > 0; level--)
+	{
+		auto& slot = node->slots[(index >> (level * RADIX_SHIFT)) & (RADIX_SLOTS - 1)];
+		if (slot == 0)
+		{
+			auto child = new(std::nothrow) radix_node{};
+			if (child == nullptr)
+			{
+				return -ERROR_MEMORY_ALLOC;
+			}
+
+			slot = reinterpret_cast<uintptr_t>(child);
+			node->count++;
+		}
+
+		node = reinterpret_cast<radix_node*>(slot);
+	}
+
+	auto& leaf = node->slots[index & (RADIX_SLOTS - 1)];
+	KDEBUG_ASSERT(leaf == 0);
+
+	leaf = pa;
+	node->count++;
+	page_count_++;
+
+	return ERROR_SUCCESS;
+}
+
+uintptr_t file_system::page_cache::remove(size_t index)
+{
+	if (root_ == nullptr || index >= capacity())
+	{
+		return 0;
+	}
+
+	radix_node* path[RADIX_MAX_HEIGHT]{};
+	size_t slots[RADIX_MAX_HEIGHT]{};
+
+	auto node = root_;
+	for (size_t depth = 0;; depth++)
+	{
+		size_t level = height_ - 1 - depth;
+
+		path[depth] = node;
+		slots[depth] = (index >> (level * RADIX_SHIFT)) & (RADIX_SLOTS - 1);
+
+		if (level == 0)
+		{
+			break;
+		}
+
+		node = reinterpret_cast<radix_node*>(node->slots[slots[depth]]);
+		if (node == nullptr)
+		{
+			return 0;
+		}
+	}
+
+	auto pa = node->slots[slots[height_ - 1]];
+	if (pa == 0)
+	{
+		return 0;
+	}
+
+	// free the nodes left empty from the leaf up
+	for (size_t depth = height_; depth-- > 0;)
+	{
+		path[depth]->slots[slots[depth]] = 0;
+		if (--path[depth]->count != 0)
+		{
+			break;
+		}
+
+		if (depth == 0)
+		{
+			root_ = nullptr;
+			height_ = 0;
+		}
+
+		delete path[depth];
+	}
+
+	page_count_--;
+	return pa;
+}
+
+bool file_system::page_cache::next_present(size_t index, size_t* found)
+{
+	if (root_ == nullptr || index >= capacity())
+	{
+		return false;
+	}
+
+	return find_next(root_, height_ - 1, 0, index, found);
+}
+
+bool file_system::page_cache::find_next(radix_node* node, size_t level, size_t base, size_t index, size_t* found)
+{
+	// indexes covered by each slot of the node
+	size_t span = 1ul << (level * RADIX_SHIFT);
+
+	for (size_t i = index > base ? (index - base) / span : 0; i < RADIX_SLOTS; i++)
+	{
+		if (node->slots[i] == 0)
+		{
+			continue;
+		}
+
+		size_t slot_base = base + i * span;
+		if (level == 0)
+		{
+			*found = slot_base;
+			return true;
+		}
+
+		if (find_next(reinterpret_cast<radix_node*>(node->slots[i]), level - 1, slot_base, index, found))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void file_system::page_cache::evict_one()
+{
+	auto pmm_instance = physical_memory_manager::instance();
+
+	// pages mapped by address spaces or being copied by callers hold more references than ours
+	for (size_t scanned = 0; scanned < page_count_; scanned++)
+	{
+		size_t index = 0;
+		if (!next_present(evict_hand_, &index) && !next_present(0, &index))
+		{
+			return;
+		}
+
+		evict_hand_ = index + 1;
+
+		if (auto pa = lookup(index);pmm_instance->small_ref(pa) == 1)
+		{
+			pmm_instance->put_small(remove(index));
+			return;
+		}
+	}
+}
+
+void file_system::page_cache::fill_range(size_t index, size_t count)
+{
+	auto pmm_instance = physical_memory_manager::instance();
+
+	uintptr_t frames[READAHEAD_MAX]{};
+	void* pages[READAHEAD_MAX]{};
+
+	while (count > 0 && page_count_ < MAX_PAGES)
+	{
+		// skip pages cached already
+		if (lookup(index) != 0)
+		{
+			index++;
+			count--;
+			continue;
+		}
+
+		// and read the run of missing pages after them at once
+		size_t n = 0;
+		for (; n < std::min(count, READAHEAD_MAX) && page_count_ + n < MAX_PAGES && lookup(index + n) == 0; n++)
+		{
+			if ((frames[n] = pmm_instance->allocate_small()) == 0)
+			{
+				break;
+			}
+
+			pages[n] = reinterpret_cast<void*>(P2V(frames[n]));
+		}
+
+		bool filled = n != 0 && owner_->fill_pages(index, pages, n) == ERROR_SUCCESS;
+
+		for (size_t i = 0; i < n; i++)
+		{
+			if (!filled || insert(index + i, frames[i]) != ERROR_SUCCESS)
+			{
+				pmm_instance->put_small(frames[i]);
+			}
+		}
+
+		// it's only a hint, so failures are left to the reads themselves
+		if (!filled)
+		{
+			return;
+		}
+
+		index += n;
+		count -= n;
+	}
+}
+
+void file_system::page_cache::free_node(radix_node* node, size_t level)
+{
+	for (auto slot : node->slots)
+	{
+		if (slot == 0)
+		{
+			continue;
+		}
+
+		if (level == 0)
+		{
+			physical_memory_manager::instance()->put_small(slot);
+		}
+		else
+		{
+			free_node(reinterpret_cast<radix_node*>(slot), level - 1);
+		}
+	}
+
+	delete node;
+}
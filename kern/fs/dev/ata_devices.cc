@@ -147,11 +147,25 @@ error_code_with_result<size_t> file_system::ata_block_device::write(const void*
 
 	logical_block_address lba = offset / this->block_size;
 
-	auto ret = ahci_port_send_command(port, ATA_CMD_WRITE_DMA_EX, false, lba, const_cast<void*>(buf), sz);
-
-	if (ret != ERROR_SUCCESS)
+	// large transfers take more than one command
+	auto data = reinterpret_cast<uint8_t*>(const_cast<void*>(buf));
+	for (size_t done = 0; done < sz;)
 	{
-		return ret;
+		size_t len = std::min(sz - done, AHCI_COMMAND_MAX_SIZE);
+
+		auto ret = ahci_port_send_command(port,
+			ATA_CMD_WRITE_DMA_EX,
+			false,
+			lba + done / this->block_size,
+			data + done,
+			len);
+
+		if (ret != ERROR_SUCCESS)
+		{
+			return ret;
+		}
+
+		done += len;
 	}
 
 	return sz;
@@ -178,11 +192,25 @@ error_code_with_result<size_t> file_system::ata_block_device::read(void* buf, ui
 
 	logical_block_address lba = offset / this->block_size;
 
-	auto ret = ahci_port_send_command(port, ATA_CMD_READ_DMA_EX, false, lba, buf, sz);
-
-	if (ret != ERROR_SUCCESS)
+	// large transfers take more than one command
+	auto data = reinterpret_cast<uint8_t*>(buf);
+	for (size_t done = 0; done < sz;)
 	{
-		return ret;
+		size_t len = std::min(sz - done, AHCI_COMMAND_MAX_SIZE);
+
+		auto ret = ahci_port_send_command(port,
+			ATA_CMD_READ_DMA_EX,
+			false,
+			lba + done / this->block_size,
+			data + done,
+			len);
+
+		if (ret != ERROR_SUCCESS)
+		{
+			return ret;
+		}
+
+		done += len;
 	}
 
 	return sz;
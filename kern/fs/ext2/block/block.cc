@@ -2,6 +2,7 @@
 
 #include "fs/ext2/ext2.hpp"
 #include "fs/vfs/vfs.hpp"
+#include "fs/cache/cache.hpp"
 
 #include "system/kmalloc.hpp"
 
@@ -18,43 +19,55 @@ error_code ext2_block_read(file_system::fs_instance* fs, uint8_t* buf, size_t bl
 		return -ERROR_INVALID;
 	}
 
-	auto ret = fs->dev->read(buf, block_num * ext2data->get_block_size(), ext2data->get_block_size());
-	if (has_error(ret))
-	{
-		return get_error_code(ret);
-	}
-
-	if (get_result(ret) != ext2data->get_block_size())
-	{
-		return -ERROR_IO;
-	}
+	const size_t block_size = ext2data->get_block_size();
 
-	return ERROR_SUCCESS;
+	return block_cache_read(fs->dev, block_num, block_size, buf, 0, block_size);
 }
 
 error_code ext2_block_write(file_system::fs_instance* fs, const uint8_t* buf, size_t block_num)
 {
 	ext2_data* ext2data = reinterpret_cast<ext2_data*>(fs->private_data);
 
-	const size_t block_size = ext2data->get_block_size();
-
 	if (ext2data == nullptr)
 	{
 		return -ERROR_INVALID;
 	}
 
-	auto ret = fs->dev->write(buf, block_num * block_size, block_size);
-	if (has_error(ret))
+	const size_t block_size = ext2data->get_block_size();
+
+	return block_cache_write(fs->dev, block_num, block_size, buf, 0, block_size);
+}
+
+error_code ext2_block_read_part(file_system::fs_instance* fs,
+	uint8_t* buf,
+	size_t block_num,
+	size_t offset,
+	size_t len)
+{
+	ext2_data* ext2data = reinterpret_cast<ext2_data*>(fs->private_data);
+
+	if (ext2data == nullptr)
 	{
-		return get_error_code(ret);
+		return -ERROR_INVALID;
 	}
 
-	if (get_result(ret) != block_size)
+	return block_cache_read(fs->dev, block_num, ext2data->get_block_size(), buf, offset, len);
+}
+
+error_code ext2_block_write_part(file_system::fs_instance* fs,
+	const uint8_t* buf,
+	size_t block_num,
+	size_t offset,
+	size_t len)
+{
+	ext2_data* ext2data = reinterpret_cast<ext2_data*>(fs->private_data);
+
+	if (ext2data == nullptr)
 	{
-		return -ERROR_IO;
+		return -ERROR_INVALID;
 	}
 
-	return ERROR_SUCCESS;
+	return block_cache_write(fs->dev, block_num, ext2data->get_block_size(), buf, offset, len);
 }
 
 // TODO:Support more than single-block block bitmap
@@ -4,6 +4,7 @@
 #include "fs/ext2/ext2.hpp"
 #include "fs/vfs/vfs.hpp"
 #include "fs/ext2/vnode.hpp"
+#include "fs/cache/cache.hpp"
 
 #include "system/kmalloc.hpp"
 
@@ -23,7 +24,8 @@ ext2_data::ext2_data()
 
 error_code ext2_data::initialize(fs_instance* fs)
 {
-	auto read_ret = fs->dev->read(reinterpret_cast<void*>(&this->superblock_data), 1024, 1024);
+	// the block size isn't known yet, so it's read around the cache
+	auto read_ret = fs->dev->read(reinterpret_cast<void*>(&this->superblock_data), EXT2_SUPERBLOCK_OFFSET, 1024);
 	if (has_error(read_ret))
 	{
 		return -ERROR_IO;
@@ -137,13 +139,13 @@ void ext2_data::print_debug_message()
 
 error_code ext2_data::superblock_write_back(fs_instance* fs)
 {
-	auto ret = fs->dev->write(superblock_data, 1024, 1024);
-	if (has_error(ret))
-	{
-		return get_error_code(ret);
-	}
-
-	return get_result(ret) == 1024 ? ERROR_SUCCESS : ERROR_IO;
+	// the superblock shares block 0 with the boot sector if blocks are larger than 1K
+	return block_cache_write(fs->dev,
+		EXT2_SUPERBLOCK_OFFSET / block_size,
+		block_size,
+		superblock_data,
+		EXT2_SUPERBLOCK_OFFSET % block_size,
+		sizeof(superblock_data));
 }
 
 error_code_with_result<ext2_inode*> ext2_data::create_new_inode()
@@ -158,6 +160,9 @@ error_code_with_result<ext2_inode*> ext2_data::create_new_inode()
 }
 void ext2_data::free_inode(ext2_inode* nd)
 {
+	// the memory may hold another inode next
+	block_maps.forget(nd);
+
 	kmem_cache_free(inode_cache, nd);
 }
 
@@ -204,6 +209,11 @@ error_code file_system::ext2_fs_class::dispose(fs_instance* fs)
 		return -ERROR_INVALID;
 	}
 
+	if (auto err = block_cache_invalidate(fs->dev);err != ERROR_SUCCESS)
+	{
+		return err;
+	}
+
 	delete extdata;
 
 	return ERROR_SUCCESS;
@@ -33,6 +33,23 @@
 	uint32_t index,
 	uint32_t value);
 
+/// \brief allocate a zeroed block for the hole at index of the inode
+/// \return the block
+[[nodiscard]] error_code_with_result<uint32_t> ext2_inode_fill_hole(file_system::fs_instance* fs,
+	file_system::ext2_inode* inode,
+	uint32_t index);
+
+/// \brief free the indirect blocks the first block_count blocks of the inode don't need
+[[nodiscard]] error_code ext2_inode_free_indirect(file_system::fs_instance* fs,
+	file_system::ext2_inode* inode,
+	size_t block_count);
+
+/// \brief how many indirect blocks the first block_count blocks of a file need
+[[nodiscard]] size_t ext2_inode_indirect_count(size_t block_size, size_t block_count);
+
+/// \brief how many blocks the direct and indirect blocks of an inode can address
+[[nodiscard]] size_t ext2_inode_max_block_count(size_t block_size);
+
 [[nodiscard]] error_code_with_result<uint32_t> ext2_inode_alloc(file_system::fs_instance* fs, bool is_dir);
 
 [[nodiscard]] error_code ext2_inode_free(file_system::fs_instance* fs, file_system::ext2_ino_type ino, bool is_dir);
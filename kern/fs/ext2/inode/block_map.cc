@@ -0,0 +1,119 @@
+#include "fs/ext2/block_map.hpp"
+#include "fs/ext2/ext2.hpp"
+
+#include "kbl/lock/lock_guard.hpp"
+
+#include "debug/kdebug.h"
+
+using namespace file_system;
+
+file_system::ext2_block_map_cache::~ext2_block_map_cache()
+{
+	lock::lock_guard g{ lock_ };
+
+	for (auto& map : maps_)
+	{
+		for (auto& ind : map.indirect)
+		{
+			delete[] ind.addrs;
+			ind.addrs = nullptr;
+		}
+	}
+}
+
+ext2_block_map_cache::block_map* file_system::ext2_block_map_cache::get(const ext2_inode* inode)
+{
+	block_map* victim = &maps_[0];
+
+	for (auto& map : maps_)
+	{
+		if (map.inode == inode)
+		{
+			map.last_use = ++clock_;
+			return &map;
+		}
+
+		if (map.last_use < victim->last_use)
+		{
+			victim = &map;
+		}
+	}
+
+	reset(victim);
+
+	victim->inode = inode;
+	victim->last_use = ++clock_;
+
+	return victim;
+}
+
+error_code_with_result<ext2_block_map_cache::indirect_block*> file_system::ext2_block_map_cache::get_indirect(
+	block_map* map,
+	uint32_t block,
+	size_t block_size)
+{
+	indirect_block* victim = &map->indirect[0];
+
+	for (auto& ind : map->indirect)
+	{
+		if (ind.block == block)
+		{
+			ind.last_use = ++clock_;
+			return &ind;
+		}
+
+		if (ind.last_use < victim->last_use)
+		{
+			victim = &ind;
+		}
+	}
+
+	// copies are all the same size, so the buffer of the slot is reused
+	if (victim->addrs == nullptr)
+	{
+		victim->addrs = new(std::nothrow) uint32_t[ADDR_COUNT_PER_BLOCK(block_size)];
+		if (victim->addrs == nullptr)
+		{
+			return -ERROR_MEMORY_ALLOC;
+		}
+	}
+
+	// it holds the block only once the caller has read it in
+	victim->block = 0;
+	victim->last_use = ++clock_;
+
+	return victim;
+}
+
+void file_system::ext2_block_map_cache::forget(const ext2_inode* inode)
+{
+	lock::lock_guard g{ lock_ };
+	forget_locked(inode);
+}
+
+void file_system::ext2_block_map_cache::forget_locked(const ext2_inode* inode)
+{
+	for (auto& map : maps_)
+	{
+		if (map.inode == inode)
+		{
+			reset(&map);
+		}
+	}
+}
+
+void file_system::ext2_block_map_cache::reset(block_map* map)
+{
+	map->inode = nullptr;
+	map->last_use = 0;
+
+	map->extent_index = 0;
+	map->extent_block = 0;
+	map->extent_length = 0;
+
+	for (auto& ind : map->indirect)
+	{
+		ind.block = 0;
+		ind.last_use = 0;
+	}
+}
@@ -4,16 +4,144 @@
 #include "drivers/cmos/rtc.hpp"
 
 #include "fs/ext2/ext2.hpp"
+#include "fs/ext2/block_map.hpp"
 #include "fs/vfs/vfs.hpp"
+#include "fs/cache/cache.hpp"
 
 #include "system/kmalloc.hpp"
 
+#include "kbl/lock/lock_guard.hpp"
+
 #include "debug/kdebug.h"
 
 #include <cstring>
 
 using namespace file_system;
 
+// levels of indirect blocks, the single, double and triple ones
+static constexpr size_t EXT2_INDIRECT_TIERS = 3;
+
+/// \brief the entries leading to a block beyond the direct ones
+struct block_path
+{
+	// 1 for the single indirect block, up to 3 for the triple one
+	size_t tier;
+
+	// the entry to follow in each indirect block, from the top one
+	size_t slots[EXT2_INDIRECT_TIERS];
+};
+
+static bool resolve_path(size_t addr_count, size_t index, OUT block_path* path)
+{
+	size_t rel = index - EXT2_DIRECT_BLOCK_COUNT;
+
+	size_t span = addr_count;
+	for (size_t tier = 1; tier <= EXT2_INDIRECT_TIERS; tier++, span *= addr_count)
+	{
+		if (rel < span)
+		{
+			path->tier = tier;
+			for (size_t level = tier; level-- > 0;)
+			{
+				path->slots[level] = rel % addr_count;
+				rel /= addr_count;
+			}
+
+			return true;
+		}
+
+		rel -= span;
+	}
+
+	return false;
+}
+
+static uint32_t tier_root(const ext2_inode* inode, size_t tier)
+{
+	switch (tier)
+	{
+	case 1:
+		return inode->indirect_block_l1;
+	case 2:
+		return inode->indirect_block_l2;
+	default:
+		return inode->indirect_block_l3;
+	}
+}
+
+static void set_tier_root(ext2_inode* inode, size_t tier, uint32_t block)
+{
+	switch (tier)
+	{
+	case 1:
+		inode->indirect_block_l1 = block;
+		break;
+	case 2:
+		inode->indirect_block_l2 = block;
+		break;
+	default:
+		inode->indirect_block_l3 = block;
+		break;
+	}
+}
+
+/// \brief get the entries of an indirect block, from the map of the inode if they are there
+static error_code_with_result<uint32_t*> read_indirect(fs_instance* fs,
+	ext2_block_map_cache& maps,
+	ext2_block_map_cache::block_map* map,
+	uint32_t block) TA_REQ(maps.lock())
+{
+	auto data = reinterpret_cast<ext2_data*>(fs->private_data);
+
+	auto ret = maps.get_indirect(map, block, data->get_block_size());
+	if (has_error(ret))
+	{
+		return get_error_code(ret);
+	}
+
+	auto ind = get_result(ret);
+	if (ind->block != block)
+	{
+		if (auto err = ext2_block_read(fs, reinterpret_cast<uint8_t*>(ind->addrs), block);err != ERROR_SUCCESS)
+		{
+			return err;
+		}
+
+		ind->block = block;
+	}
+
+	return ind->addrs;
+}
+
+/// \brief allocate an indirect block with no entries
+static error_code_with_result<uint32_t> alloc_indirect(fs_instance* fs)
+{
+	auto data = reinterpret_cast<ext2_data*>(fs->private_data);
+
+	auto ret = ext2_block_alloc(fs);
+	if (has_error(ret))
+	{
+		return get_error_code(ret);
+	}
+
+	auto block = static_cast<uint32_t>(get_result(ret));
+
+	// it may hold anything a freed file left behind, and entries of 0 are holes
+	auto buf_ret = block_cache_get(fs->dev, block, data->get_block_size(), false);
+	if (has_error(buf_ret))
+	{
+		[[maybe_unused]] auto err = ext2_block_free(fs, block);
+		return get_error_code(buf_ret);
+	}
+
+	auto buf = get_result(buf_ret);
+	memset(buf->data, 0, data->get_block_size());
+	block_cache_mark_dirty(buf);
+	block_cache_release(buf);
+
+	return block;
+}
+
 error_code_with_result<uint32_t> ext2_inode_get_index(file_system::fs_instance* fs,
 	file_system::ext2_inode* inode,
 	uint32_t index)
@@ -27,49 +155,65 @@ error_code_with_result<uint32_t> ext2_inode_get_index(file_system::fs_instance*
 
 	if (index < EXT2_DIRECT_BLOCK_COUNT)
 	{
-		return inode->direct_blocks[index];
+		return uint32_t{ inode->direct_blocks[index] };
 	}
 
 	auto addr_count = ADDR_COUNT_PER_BLOCK(data->get_block_size());
 
-	block_address_type* addrs = new (std::nothrow)block_address_type[addr_count];
+	block_path path{};
+	if (!resolve_path(addr_count, index, &path))
+	{
+		return -ERROR_INVALID;
+	}
+
+	auto& maps = data->get_block_maps();
+	lock::lock_guard g{ maps.lock() };
 
-	if (index < EXT2_DIRECT_BLOCK_COUNT + addr_count)
+	auto map = maps.get(inode);
+
+	// wraps around below the run
+	if (index - map->extent_index < map->extent_length)
+	{
+		return map->extent_block + (index - map->extent_index);
+	}
+
+	uint32_t block = tier_root(inode, path.tier);
+	uint32_t* addrs = nullptr;
+
+	for (size_t level = 0; level < path.tier; level++)
 	{
-		if (inode->indirect_block_l1 == 0)
+		// a hole
+		if (block == 0)
 		{
-			delete[] addrs;
-			return -ERROR_OUT_OF_BOUND;
+			return 0u;
 		}
 
-		auto ret = ext2_block_read(fs, reinterpret_cast<uint8_t*>(addrs), inode->indirect_block_l1);
-		if (ret != ERROR_SUCCESS)
+		auto ret = read_indirect(fs, maps, map, block);
+		if (has_error(ret))
 		{
-			delete[] addrs;
-			return ret;
+			return get_error_code(ret);
 		}
 
-		delete[] addrs;
-		return addrs[index - EXT2_DIRECT_BLOCK_COUNT];
-	}
-	else if (index < EXT2_DIRECT_BLOCK_COUNT + addr_count * 2)
-	{
-		delete[] addrs;
-		return -ERROR_NOT_IMPL;// TODO:L2
-	}
-	else if (index < EXT2_DIRECT_BLOCK_COUNT + addr_count * 3)
-	{
-		delete[] addrs;
-		return -ERROR_NOT_IMPL; // TODO:L3
+		addrs = get_result(ret);
+		block = addrs[path.slots[level]];
 	}
-	else
+
+	// the blocks after it in the same indirect block are likely to be asked for next,
+	// so remember how far they follow it on disk
+	if (block != 0)
 	{
-		delete[] addrs;
-		return -ERROR_INVALID;
+		uint32_t length = 1;
+		for (size_t slot = path.slots[path.tier - 1] + 1; slot < addr_count && addrs[slot] == block + length; slot++)
+		{
+			length++;
+		}
+
+		map->extent_index = index;
+		map->extent_block = block;
+		map->extent_length = length;
 	}
 
-	delete[] addrs;
-	return -ERROR_SHOULD_NOT_REACH_HERE;
+	return block;
 }
 
 error_code ext2_inode_set_index(file_system::fs_instance* fs,
@@ -84,67 +228,278 @@ error_code ext2_inode_set_index(file_system::fs_instance* fs,
 		return -ERROR_INVALID;
 	}
 
-	auto addr_count = ADDR_COUNT_PER_BLOCK(data->get_block_size());
-	block_address_type* addrs = new (std::nothrow)block_address_type[addr_count];
-
 	if (index < EXT2_DIRECT_BLOCK_COUNT)
 	{
-		delete[] addrs;
 		inode->direct_blocks[index] = value;
 		return ERROR_SUCCESS;
 	}
-	else if (index < EXT2_DIRECT_BLOCK_COUNT + addr_count)
+
+	auto addr_count = ADDR_COUNT_PER_BLOCK(data->get_block_size());
+
+	block_path path{};
+	if (!resolve_path(addr_count, index, &path))
+	{
+		return -ERROR_INVALID;
+	}
+
+	auto& maps = data->get_block_maps();
+	lock::lock_guard g{ maps.lock() };
+
+	auto map = maps.get(inode);
+
+	// the run must not cover the entry any more
+	if (index - map->extent_index < map->extent_length)
+	{
+		map->extent_length = index - map->extent_index;
+	}
+
+	uint32_t block = tier_root(inode, path.tier);
+	if (block == 0)
+	{
+		auto ret = alloc_indirect(fs);
+		if (has_error(ret))
+		{
+			return get_error_code(ret);
+		}
+
+		block = get_result(ret);
+		set_tier_root(inode, path.tier, block);
+	}
+
+	for (size_t level = 0;; level++)
 	{
-		if (inode->indirect_block_l1 == 0)
+		auto ret = read_indirect(fs, maps, map, block);
+		if (has_error(ret))
 		{
-			auto ret = ext2_block_alloc(fs);
-			if (has_error(ret))
+			return get_error_code(ret);
+		}
+
+		auto addrs = get_result(ret);
+		auto slot = path.slots[level];
+
+		if (level == path.tier - 1)
+		{
+			addrs[slot] = value;
+		}
+		else if (addrs[slot] == 0)
+		{
+			auto alloc_ret = alloc_indirect(fs);
+			if (has_error(alloc_ret))
 			{
-				delete[]addrs;
-				return get_error_code(ret);
+				return get_error_code(alloc_ret);
 			}
 
-			block_device_type block = static_cast<block_device_type>(get_result(ret));
+			addrs[slot] = get_result(alloc_ret);
+		}
+		else
+		{
+			block = addrs[slot];
+			continue;
+		}
 
-			inode->indirect_block_l1 = block;
+		// the copy in the map is updated above, and the block through the block cache
+		if (auto err = ext2_block_write_part(fs,
+				reinterpret_cast<const uint8_t*>(&addrs[slot]),
+				block,
+				slot * sizeof(block_address_type),
+				sizeof(block_address_type));
+			err != ERROR_SUCCESS)
+		{
+			// the copy no longer matches the disk
+			maps.forget_locked(inode);
+			return err;
 		}
 
-		auto ret = ext2_block_read(fs, reinterpret_cast<uint8_t*>(addrs), inode->indirect_block_l1);
-		if (ret != ERROR_SUCCESS)
+		if (level == path.tier - 1)
 		{
-			delete[] addrs;
-			return ret;
+			break;
 		}
 
-		addrs[index - EXT2_DIRECT_BLOCK_COUNT] = value;
+		block = addrs[slot];
+	}
 
-		ret = ext2_block_write(fs, reinterpret_cast<uint8_t*>(addrs), inode->indirect_block_l1);
-		if (ret != ERROR_SUCCESS)
+	// a file growing block by block extends the run
+	if (map->extent_length != 0 &&
+		index == map->extent_index + map->extent_length &&
+		value == map->extent_block + map->extent_length)
+	{
+		map->extent_length++;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+error_code_with_result<uint32_t> ext2_inode_fill_hole(file_system::fs_instance* fs,
+	file_system::ext2_inode* inode,
+	uint32_t index)
+{
+	auto data = reinterpret_cast<ext2_data*>(fs->private_data);
+
+	auto ret = ext2_block_alloc(fs);
+	if (has_error(ret))
+	{
+		return get_error_code(ret);
+	}
+
+	auto block = static_cast<uint32_t>(get_result(ret));
+
+	// a hole reads as zeros, and so must the parts of the block a write doesn't cover
+	auto buf_ret = block_cache_get(fs->dev, block, data->get_block_size(), false);
+	if (has_error(buf_ret))
+	{
+		[[maybe_unused]] auto err = ext2_block_free(fs, block);
+		return get_error_code(buf_ret);
+	}
+
+	auto buf = get_result(buf_ret);
+	memset(buf->data, 0, data->get_block_size());
+	block_cache_mark_dirty(buf);
+	block_cache_release(buf);
+
+	if (auto err = ext2_inode_set_index(fs, inode, index, block);err != ERROR_SUCCESS)
+	{
+		[[maybe_unused]] auto free_err = ext2_block_free(fs, block);
+		return err;
+	}
+
+	return block;
+}
+
+/// \brief free the indirect blocks under block, which is level levels above the data blocks,
+/// that the first kept data blocks under it don't need. block itself is freed if kept is 0
+static error_code trim_indirect(fs_instance* fs, uint32_t block, size_t level, size_t kept, size_t addr_count)
+{
+	if (level > 1)
+	{
+		size_t span = 1;
+		for (size_t i = 1; i < level; i++)
+		{
+			span *= addr_count;
+		}
+
+		block_address_type* addrs = new(std::nothrow) block_address_type[addr_count];
+		if (addrs == nullptr)
+		{
+			return -ERROR_MEMORY_ALLOC;
+		}
+
+		if (auto err = ext2_block_read(fs, reinterpret_cast<uint8_t*>(addrs), block);err != ERROR_SUCCESS)
 		{
 			delete[] addrs;
-			return ret;
+			return err;
+		}
+
+		// children before the one the kept blocks end in are used entirely
+		bool changed = false;
+		for (size_t i = kept / span; i < addr_count; i++)
+		{
+			if (addrs[i] == 0)
+			{
+				continue;
+			}
+
+			size_t child_kept = kept > i * span ? kept - i * span : 0;
+			if (auto err = trim_indirect(fs, addrs[i], level - 1, child_kept, addr_count);err != ERROR_SUCCESS)
+			{
+				delete[] addrs;
+				return err;
+			}
+
+			if (child_kept == 0)
+			{
+				addrs[i] = 0;
+				changed = true;
+			}
+		}
+
+		if (changed && kept != 0)
+		{
+			if (auto err = ext2_block_write(fs, reinterpret_cast<uint8_t*>(addrs), block);err != ERROR_SUCCESS)
+			{
+				delete[] addrs;
+				return err;
+			}
 		}
 
 		delete[] addrs;
-		return ERROR_SUCCESS;
 	}
-	else if (index < EXT2_DIRECT_BLOCK_COUNT + addr_count * 2)
+
+	if (kept == 0)
 	{
-		delete[] addrs;
-		return -ERROR_NOT_IMPL;// TODO:L2
+		return ext2_block_free(fs, block);
 	}
-	else if (index < EXT2_DIRECT_BLOCK_COUNT + addr_count * 3)
+
+	return ERROR_SUCCESS;
+}
+
+error_code ext2_inode_free_indirect(file_system::fs_instance* fs,
+	file_system::ext2_inode* inode,
+	size_t block_count)
+{
+	ext2_data* data = (ext2_data*)fs->private_data;
+
+	if (data == nullptr)
 	{
-		delete[] addrs;
-		return -ERROR_NOT_IMPL; // TODO:L3
+		return -ERROR_INVALID;
 	}
-	else
+
+	auto addr_count = ADDR_COUNT_PER_BLOCK(data->get_block_size());
+
+	auto& maps = data->get_block_maps();
+	lock::lock_guard g{ maps.lock() };
+
+	// what it knows about the freed blocks is stale from now on
+	maps.forget_locked(inode);
+
+	size_t base = EXT2_DIRECT_BLOCK_COUNT, span = addr_count;
+	for (size_t tier = 1; tier <= EXT2_INDIRECT_TIERS; tier++, base += span, span *= addr_count)
 	{
-		delete[] addrs;
-		return -ERROR_INVALID;
+		auto root = tier_root(inode, tier);
+		if (root == 0 || block_count >= base + span)
+		{
+			continue;
+		}
+
+		size_t kept = block_count > base ? block_count - base : 0;
+		if (auto err = trim_indirect(fs, root, tier, kept, addr_count);err != ERROR_SUCCESS)
+		{
+			return err;
+		}
+
+		if (kept == 0)
+		{
+			set_tier_root(inode, tier, 0);
+		}
+	}
+
+	return ERROR_SUCCESS;
+}
+
+size_t ext2_inode_indirect_count(size_t block_size, size_t block_count)
+{
+	auto addr_count = ADDR_COUNT_PER_BLOCK(block_size);
+
+	size_t count = 0;
+	size_t base = EXT2_DIRECT_BLOCK_COUNT, span = addr_count;
+	for (size_t tier = 1; tier <= EXT2_INDIRECT_TIERS && block_count > base; tier++, base += span, span *= addr_count)
+	{
+		size_t blocks = block_count - base < span ? block_count - base : span;
+
+		// the indirect blocks of each level, from the one above the data blocks up to the top one
+		for (size_t level = 1, per = addr_count; level <= tier; level++, per *= addr_count)
+		{
+			count += (blocks + per - 1) / per;
+		}
 	}
 
-	delete[] addrs;
-	return -ERROR_INVALID;
+	return count;
 }
 
+size_t ext2_inode_max_block_count(size_t block_size)
+{
+	auto addr_count = ADDR_COUNT_PER_BLOCK(block_size);
+	size_t count = EXT2_DIRECT_BLOCK_COUNT + addr_count + addr_count * addr_count + addr_count * addr_count * addr_count;
+
+	// blocks are indexed by 32-bit numbers
+	return count < UINT32_MAX ? count : UINT32_MAX;
+}
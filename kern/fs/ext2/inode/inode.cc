@@ -276,6 +276,14 @@ error_code ext2_inode_free(file_system::fs_instance* fs, file_system::ext2_ino_t
 		return get_error_code(block_ret);
 	}
 
+	// a hole reads as zeros
+	if (auto block = get_result(block_ret);block == 0)
+	{
+		auto data = reinterpret_cast<file_system::ext2_data*>(fs->private_data);
+		memset(buf, 0, data->get_block_size());
+		return ERROR_SUCCESS;
+	}
+
 	return ext2_block_read(fs, buf, get_result(block_ret));
 }
 
@@ -290,7 +298,21 @@ error_code ext2_inode_free(file_system::fs_instance* fs, file_system::ext2_ino_t
 		return get_error_code(block_ret);
 	}
 
-	return ext2_block_write(fs, buf, get_result(block_ret));
+	auto block = get_result(block_ret);
+
+	// a hole gets a block of its own on the first write
+	if (block == 0)
+	{
+		auto fill_ret = ext2_inode_fill_hole(fs, inode, index);
+		if (has_error(fill_ret))
+		{
+			return get_error_code(fill_ret);
+		}
+
+		block = get_result(fill_ret);
+	}
+
+	return ext2_block_write(fs, buf, block);
 }
 
 
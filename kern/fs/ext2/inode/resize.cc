@@ -30,12 +30,9 @@ error_code ext2_inode_resize(file_system::fs_instance* fs,
 	size_t new_block_count = roundup(new_size, block_size) / block_size;
 	size_t old_block_count = roundup(EXT2_INODE_SIZE(inode), block_size) / block_size;
 
-	// TODO: support more indirect block
+	auto max_block_count = ext2_inode_max_block_count(block_size);
 
-	auto addr_count = ADDR_COUNT_PER_BLOCK(block_size);
-
-	if (new_block_count > EXT2_DIRECT_BLOCK_COUNT + addr_count ||
-		old_block_count > EXT2_DIRECT_BLOCK_COUNT + addr_count)
+	if (new_block_count > max_block_count || old_block_count > max_block_count)
 	{
 		return -ERROR_INVALID;
 	}
@@ -52,7 +49,12 @@ error_code ext2_inode_resize(file_system::fs_instance* fs,
 				return get_error_code(ret);
 			}
 
+			// a hole has nothing to free
 			auto block = get_result(ret);
+			if (block == 0)
+			{
+				continue;
+			}
 
 			auto err = ext2_block_free(fs, block);
 			if (err != ERROR_SUCCESS)
@@ -61,24 +63,9 @@ error_code ext2_inode_resize(file_system::fs_instance* fs,
 			}
 		}
 
-		// task L1
-		if (old_block_count > EXT2_DIRECT_BLOCK_COUNT
-			&& new_block_count <= EXT2_DIRECT_BLOCK_COUNT + addr_count)
+		if (auto err = ext2_inode_free_indirect(fs, inode, new_block_count);err != ERROR_SUCCESS)
 		{
-			if (inode->indirect_block_l1 == 0)
-			{
-				return -ERROR_INVALID;
-			}
-
-			auto err = ext2_block_free(fs, inode->indirect_block_l1);
-			inode->indirect_block_l1 = 0;
-
-			if (err != ERROR_SUCCESS)
-			{
-				return err;
-			}
-
-			// TODO: l2 and l3
+			return err;
 		}
 	}
 	else if (new_block_count >= old_block_count) // expand
@@ -102,7 +89,7 @@ error_code ext2_inode_resize(file_system::fs_instance* fs,
 
 	ext2_inode_set_size(inode, new_size);
 
-	auto real_block_count = new_block_count + (new_block_count > EXT2_DIRECT_BLOCK_COUNT);
+	auto real_block_count = new_block_count + ext2_inode_indirect_count(block_size, new_block_count);
 
 	inode->sector_count = real_block_count;
 
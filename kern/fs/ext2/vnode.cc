@@ -5,6 +5,7 @@
 #include "fs/fs.hpp"
 #include "fs/vfs/vfs.hpp"
 #include "fs/ext2/vnode.hpp"
+#include "fs/cache/cache.hpp"
 
 #include "drivers/cmos/rtc.hpp"
 
@@ -420,6 +421,8 @@ error_code file_system::ext2_vnode::truncate(size_t size)
 		return ret;
 	}
 
+	pages.truncate(size);
+
 	inode->mtime = cmos::cmos_read_rtc_timestamp();
 
 	return ext2_inode_write(this->fs, this->inode_id, inode);
@@ -481,6 +484,8 @@ error_code file_system::ext2_vnode::unlink()
 		return ret;
 	}
 
+	pages.truncate(0);
+
 	inode->hard_link_count = 0;
 	inode->dtime = cmos::cmos_read_rtc_timestamp();
 
@@ -672,8 +677,6 @@ error_code_with_result<size_t> file_system::ext2_vnode::read(file_system::file_o
 		return -ERROR_INVALID;
 	}
 
-	uint8_t* buf = reinterpret_cast<uint8_t*>(_buf);
-
 	auto inode = reinterpret_cast<ext2_inode*>(this->private_data);
 	auto ext2_fs = this->fs;
 
@@ -682,54 +685,72 @@ error_code_with_result<size_t> file_system::ext2_vnode::read(file_system::file_o
 		return -ERROR_INTERNAL;
 	}
 
-	ext2_data* data = reinterpret_cast<ext2_data*>(ext2_fs->private_data);
-
-	size_t full_size = EXT2_INODE_SIZE(inode), has_read = 0;
+	size_t full_size = EXT2_INODE_SIZE(inode);
 
 	if (fd->pos >= full_size)
 	{
 		return -ERROR_EOF;
 	}
 
-	uint8_t* block_buf = new(std::nothrow) uint8_t[data->get_block_size()];
-	if (block_buf == nullptr)
+	size_t has_read = min(sz, full_size - fd->pos);
+
+	pages.read_ahead(&fd->readahead, fd->pos, has_read, full_size);
+
+	if (auto err = pages.read(fd->pos, _buf, has_read);err != ERROR_SUCCESS)
 	{
-		return -ERROR_MEMORY_ALLOC;
+		return err;
 	}
 
-	for (size_t size = min(sz, full_size - fd->pos); size > 0;)
-	{
-		size_t block_off = fd->pos % data->get_block_size();
-		size_t block_idx = fd->pos / data->get_block_size();
+	fd->pos += has_read;
+	return has_read;
+}
+
+// write [pos, pos+len) of the file through the block cache
+static error_code write_blocks(file_system::fs_instance* fs,
+	file_system::ext2_inode* inode,
+	size_t pos,
+	const uint8_t* buf,
+	size_t len)
+{
+	auto data = reinterpret_cast<file_system::ext2_data*>(fs->private_data);
+	const size_t block_size = data->get_block_size();
 
-		size_t readable = min(size, data->get_block_size() - block_off);
+	while (len > 0)
+	{
+		size_t block_offset = pos % block_size;
+		size_t writable = min(len, block_size - block_offset);
 
-		auto ret = ext2_inode_read_block(ext2_fs, inode, block_buf, block_idx);
-		if (ret != ERROR_SUCCESS)
+		auto block_ret = ext2_inode_get_index(fs, inode, pos / block_size);
+		if (has_error(block_ret))
 		{
-			delete[]block_buf;
-			return ret;
+			return get_error_code(block_ret);
 		}
 
-		memmove(buf, block_buf + block_off, readable);
-
-		buf += readable;
-		fd->pos += readable;
-		has_read += readable;
-
-		// To avoid overflow
-		if (readable >= size)
+		// block 0 is a hole, which gets a block of its own on the first write
+		auto block = get_result(block_ret);
+		if (block == 0)
 		{
-			size = 0;
+			auto fill_ret = ext2_inode_fill_hole(fs, inode, pos / block_size);
+			if (has_error(fill_ret))
+			{
+				return get_error_code(fill_ret);
+			}
+
+			block = get_result(fill_ret);
 		}
-		else
+
+		if (auto err = ext2_block_write_part(fs, buf, block, block_offset, writable);
+			err != ERROR_SUCCESS)
 		{
-			size -= readable;
+			return err;
 		}
+
+		buf += writable;
+		pos += writable;
+		len -= writable;
 	}
 
-	delete[]block_buf;
-	return has_read;
+	return ERROR_SUCCESS;
 }
 
 error_code_with_result<size_t> file_system::ext2_vnode::write(file_system::file_object* fd,
@@ -741,7 +762,7 @@ error_code_with_result<size_t> file_system::ext2_vnode::write(file_system::file_
 		return -ERROR_INVALID;
 	}
 
-	auto buf = const_cast< uint8_t*>((const uint8_t*)_buf);
+	auto buf = reinterpret_cast<const uint8_t*>(_buf);
 
 	if (buf == nullptr)
 	{
@@ -756,82 +777,169 @@ error_code_with_result<size_t> file_system::ext2_vnode::write(file_system::file_
 		return -ERROR_INTERNAL;
 	}
 
-	ext2_data* data = reinterpret_cast<ext2_data*>(ext2_fs->private_data);
-
 	// acquire the lock
 	lock::lock_guard lk{ this->lockable };
 
 	const size_t full_size = EXT2_INODE_SIZE(inode);
-	const size_t block_size = data->get_block_size();
 
 	if (fd->pos > full_size)
 	{
 		return -ERROR_EOF;
 	}
 
-	size_t request_size = max(fd->pos + sz, full_size);
-	size_t offset = 0;
+	if (auto err = ext2_inode_resize(ext2_fs, inode, max(fd->pos + sz, full_size));err != ERROR_SUCCESS)
+	{
+		return err;
+	}
 
-	if (auto err = ext2_inode_resize(ext2_fs, inode, request_size);err != ERROR_SUCCESS)
+	if (auto err = write_blocks(ext2_fs, inode, fd->pos, buf, sz);err != ERROR_SUCCESS)
+	{
+		return err;
+	}
+
+	// pages that aren't cached will be filled with the new content when they are read
+	pages.update(fd->pos, buf, sz);
+
+	fd->pos += sz;
+
+	inode->mtime = cmos::cmos_read_rtc_timestamp();
+
+	if (auto err = ext2_inode_write(ext2_fs, this->inode_id, inode);err != ERROR_SUCCESS)
 	{
 		return err;
 	}
 
-	uint8_t* block_buf = new(std::nothrow)uint8_t[1024];
+	return sz;
+}
+
+error_code file_system::ext2_vnode::fill_page(size_t index, void* page)
+{
+	auto inode = reinterpret_cast<ext2_inode*>(this->private_data);
+	auto ext2_fs = this->fs;
+
+	if (inode == nullptr || ext2_fs == nullptr)
+	{
+		return -ERROR_INTERNAL;
+	}
+
+	ext2_data* data = reinterpret_cast<ext2_data*>(ext2_fs->private_data);
+
+	const size_t full_size = EXT2_INODE_SIZE(inode);
+	const size_t block_size = data->get_block_size();
+
+	const size_t start = index * SMALL_PAGE_SIZE;
+	const size_t end = min(start + SMALL_PAGE_SIZE, full_size);
 
-	for (offset = 0; sz;)
+	auto dst = reinterpret_cast<uint8_t*>(page);
+
+	for (size_t pos = start; pos < end;)
 	{
-		auto block_index = fd->pos / block_size;
-		auto block_offset = fd->pos % block_size;
-		size_t writable = min(sz, block_size - block_offset);
+		size_t block_offset = pos % block_size;
+		size_t readable = min(end - pos, block_size - block_offset);
 
-		if (writable == 0)
+		auto block_ret = ext2_inode_get_index(ext2_fs, inode, pos / block_size);
+		if (has_error(block_ret))
 		{
-			delete[] block_buf;
-			return -ERROR_INTERNAL;
+			return get_error_code(block_ret);
 		}
 
-		if (writable != data->get_block_size())
+		// a hole reads as zero, which the page already is
+		if (auto block = get_result(block_ret);block != 0)
 		{
-
-			if (auto err = ext2_inode_read_block(ext2_fs, inode, block_buf, block_index);err != ERROR_SUCCESS)
+			if (auto err = ext2_block_read_part(ext2_fs, dst + (pos - start), block, block_offset, readable);
+				err != ERROR_SUCCESS)
 			{
-				delete[] block_buf;
 				return err;
 			}
+		}
 
-			memmove(block_buf + block_offset, buf + offset, writable);
+		pos += readable;
+	}
 
-			if (auto err = ext2_inode_write_block(ext2_fs, inode, block_buf, block_index);err != ERROR_SUCCESS)
-			{
-				delete[] block_buf;
-				return err;
-			}
+	return ERROR_SUCCESS;
+}
+
+error_code file_system::ext2_vnode::fill_pages(size_t index, void** pages, size_t count)
+{
+	auto inode = reinterpret_cast<ext2_inode*>(this->private_data);
+	auto ext2_fs = this->fs;
+
+	if (inode == nullptr || ext2_fs == nullptr)
+	{
+		return -ERROR_INTERNAL;
+	}
+
+	ext2_data* data = reinterpret_cast<ext2_data*>(ext2_fs->private_data);
+
+	const size_t full_size = EXT2_INODE_SIZE(inode);
+	const size_t block_size = data->get_block_size();
+
+	const size_t start = index * SMALL_PAGE_SIZE;
+	const size_t end = min(start + count * SMALL_PAGE_SIZE, full_size);
+
+	if (start >= end)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	const size_t first_block = start / block_size, end_block = (end + block_size - 1) / block_size;
+
+	uint8_t* run_buf = new(std::nothrow) uint8_t[(end_block - first_block) * block_size];
+	if (run_buf == nullptr)
+	{
+		return -ERROR_MEMORY_ALLOC;
+	}
+
+	error_code err = ERROR_SUCCESS;
+
+	// blocks following each other on the disk are read with one request
+	for (size_t block_idx = first_block; block_idx < end_block && err == ERROR_SUCCESS;)
+	{
+		auto block_ret = ext2_inode_get_index(ext2_fs, inode, block_idx);
+		if (has_error(block_ret))
+		{
+			err = get_error_code(block_ret);
+			break;
 		}
-		else
+
+		// a hole reads as zero, which the pages already are
+		size_t run_start = get_result(block_ret), run_len = 1;
+		if (run_start == 0)
 		{
-			if (auto err = ext2_inode_write_block(ext2_fs, inode, buf + offset, block_index);err != ERROR_SUCCESS)
+			block_idx++;
+			continue;
+		}
+
+		for (; block_idx + run_len < end_block; run_len++)
+		{
+			auto next_ret = ext2_inode_get_index(ext2_fs, inode, block_idx + run_len);
+			if (has_error(next_ret) || get_result(next_ret) != run_start + run_len)
 			{
-				delete[] block_buf;
-				return err;
+				break;
 			}
 		}
 
-		sz -= writable;
-		offset += writable;
-		fd->pos += writable;
-	}
+		if ((err = block_cache_read_run(ext2_fs->dev, run_start, run_len, block_size, run_buf)) != ERROR_SUCCESS)
+		{
+			break;
+		}
 
-	inode->mtime = cmos::cmos_read_rtc_timestamp();
+		// scatter the part of the run inside [start, end) to the pages
+		const size_t run_off = block_idx * block_size, run_end = min(run_off + run_len * block_size, end);
+		for (size_t pos = max(run_off, start); pos < run_end;)
+		{
+			size_t page = (pos - start) / SMALL_PAGE_SIZE, in_page = (pos - start) % SMALL_PAGE_SIZE;
+			size_t copy = min(SMALL_PAGE_SIZE - in_page, run_end - pos);
 
-	if (auto err = ext2_inode_write(ext2_fs, this->inode_id, inode);err != ERROR_SUCCESS)
-	{
-		delete[] block_buf;
-		return err;
+			memmove(reinterpret_cast<uint8_t*>(pages[page]) + in_page, run_buf + (pos - run_off), copy);
+			pos += copy;
+		}
+
+		block_idx += run_len;
 	}
 
-	delete[] block_buf;
-	return offset;
+	delete[] run_buf;
+	return err;
 }
 
 [[nodiscard]]error_code file_system::ext2_vnode::initialize_from_inode(file_system::ext2_ino_type ino,
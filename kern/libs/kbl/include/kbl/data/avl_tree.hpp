@@ -1,7 +1,10 @@
 #pragma once
 #include "system/types.h"
 
+#include "kbl/checker/allocate_checker.hpp"
+
 #include <algorithm>
+#include <utility>
 
 using std::max;
 
@@ -32,7 +35,13 @@ class AVLTree
 
 	inline node* new_node(TKey key, TData data)
 	{
-		node* n = new node;
+		kbl::allocate_checker ck{};
+		node* n = new(&ck) node;
+
+		if (!ck.check())
+		{
+			return nullptr;
+		}
 
 		n->key = key;
 		n->data = data;
@@ -95,8 +104,12 @@ class AVLTree
 	{
 		if (root == nullptr)
 		{
-			m_size++;
-			return new_node(key, data);
+			auto n = new_node(key, data);
+			if (n != nullptr)
+			{
+				m_size++;
+			}
+			return n;
 		}
 
 		if (key < root->key)
@@ -189,6 +202,7 @@ class AVLTree
 				node* victim = min_node(root->right);
 
 				root->key = victim->key;
+				root->data = victim->data;
 				root->right = remove(root->right, victim->key);
 			}
 		}
@@ -253,8 +267,53 @@ class AVLTree
 		return nullptr;
 	}
 
+	// the node with the smallest key greater than key
+	node* upper_bound(node* root, TKey key)
+	{
+		node* ret = nullptr;
+		for (node* iter = root; iter;)
+		{
+			if (key < iter->key)
+			{
+				ret = iter;
+				iter = iter->left;
+			}
+			else
+			{
+				iter = iter->right;
+			}
+		}
+
+		return ret;
+	}
+
+	// the node with the greatest key less than key
+	node* predecessor(node* root, TKey key)
+	{
+		node* ret = nullptr;
+		for (node* iter = root; iter;)
+		{
+			if (iter->key < key)
+			{
+				ret = iter;
+				iter = iter->right;
+			}
+			else
+			{
+				iter = iter->left;
+			}
+		}
+
+		return ret;
+	}
+
 	void clear(node* n)
 	{
+		if (n == nullptr)
+		{
+			return;
+		}
+
 		if (n->left != nullptr)
 		{
 			clear(n->left);
@@ -279,15 +338,50 @@ class AVLTree
 
 	}
 
+	AVLTree(AVLTree&& another) noexcept
+		: root(std::exchange(another.root, nullptr)),
+		  m_size(std::exchange(another.m_size, 0))
+	{
+
+	}
+
+	AVLTree(const AVLTree&) = delete;
+	AVLTree& operator=(const AVLTree&) = delete;
+
 	~AVLTree()
 	{
 		clear();
 	}
 
-
-	void insert(TKey key, TData data)
+	/// \brief insert the key
+	/// \return false if the key exists or the node can't be allocated
+	bool insert(TKey key, TData data)
 	{
+		auto old_size = m_size;
 		root = insert(root, key, data);
+		return m_size != old_size;
+	}
+
+	/// \brief change the key of an entry. it's done in place if the order of keys doesn't change
+	/// \return false if old_key doesn't exist or the entry can't be re-inserted
+	bool update_key(TKey old_key, TKey new_key)
+	{
+		auto n = find(root, old_key);
+		if (n == nullptr)
+		{
+			return false;
+		}
+
+		auto prev = predecessor(root, old_key), next = upper_bound(root, old_key);
+		if ((prev == nullptr || prev->key < new_key) && (next == nullptr || new_key < next->key))
+		{
+			n->key = new_key;
+			return true;
+		}
+
+		TData data = n->data;
+		root = remove(root, old_key);
+		return insert(new_key, data);
 	}
 
 	void clear()
@@ -314,6 +408,22 @@ class AVLTree
 		return node->data;
 	}
 
+	/// \brief the data of the smallest key greater than key
+	/// \return nullptr if there's no such key
+	TData* upper_bound(TKey key)
+	{
+		auto node = upper_bound(root, key);
+		return node == nullptr ? nullptr : &node->data;
+	}
+
+	/// \brief the data of the exact key
+	/// \return nullptr if there's no such key
+	TData* find_exact(TKey key)
+	{
+		auto node = find(root, key);
+		return node == nullptr ? nullptr : &node->data;
+	}
+
 	TData& operator[](TKey key)
 	{
 		return find(key);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "debug/thread_annotations.hpp"
+
+#include "kbl/lock/mutex.hpp"
+
+#include "task/thread/wait_queue.hpp"
+
+#include "ktl/atomic.hpp"
+
+namespace kbl
+{
+
+/// \brief a sleeping mutex for thread context. A contender spins for a short while as long as
+/// the owner is running on another CPU, and then blocks. The owner hands the mutex straight to
+/// the first waiter on release, so it's taken in FIFO order once anybody sleeps on it.
+/// It can be taken before the scheduler runs too, and only spins then.
+class TA_CAP("mutex") adaptive_mutex final
+{
+ public:
+	// bits of the state besides the owner pointer
+	static constexpr uintptr_t HAS_WAITERS = 1;
+
+	// the owner before there is a current thread, which is never a thread pointer
+	static constexpr uintptr_t BOOT_OWNER = 2;
+
+	// how long a contender spins before going to sleep
+	static constexpr uint64_t SPIN_CYCLES = 50'000;
+
+	[[nodiscard]] adaptive_mutex() = default;
+	~adaptive_mutex();
+
+	adaptive_mutex(const adaptive_mutex&) = delete;
+	adaptive_mutex& operator=(const adaptive_mutex&) = delete;
+
+	void lock() noexcept TA_ACQ() TA_REQ(!task::global_thread_lock);
+
+	void unlock() noexcept TA_REL() TA_REQ(!task::global_thread_lock);
+
+	/// \brief Try to lock
+	/// \return true if succeeded
+	bool try_lock() noexcept TA_TRY_ACQ(true);
+
+	void assert_held() TA_ASSERT(this);
+
+	bool holding() noexcept;
+
+	[[nodiscard]] task::thread* owner() const
+	{
+		return reinterpret_cast<task::thread*>(state_.load(ktl::memory_order_relaxed) & ~HAS_WAITERS);
+	}
+
+ private:
+	void lock_slow(uintptr_t self) TA_REQ(!task::global_thread_lock);
+	void unlock_slow() TA_REQ(!task::global_thread_lock);
+
+	// the owner thread, or 0 if unlocked
+	ktl::atomic<uintptr_t> state_{ 0 };
+
+	task::wait_queue wait_queue_{};
+};
+
+static_assert(lock::Mutex<adaptive_mutex>, "adaptive_mutex should satisfy the requirement of Mutex");
+
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "system/types.h"
+
+#include "debug/public/lockstat.hpp"
+
+#include "ktl/string_view.hpp"
+
+// lock contention profiling, compiled in with the KERNEL_LOCKSTAT build option.
+// spinlocks are grouped into classes by their names.
+
+namespace lock
+{
+
+struct lockstat_class;
+
+static inline constexpr size_t LOCKSTAT_CLASS_MAX = 256;
+
+// the classes and the one shared by locks that don't fit in
+static inline constexpr size_t LOCKSTAT_RECORD_MAX = LOCKSTAT_CLASS_MAX + 1;
+
+lockstat_class* lockstat_class_of(ktl::string_view name);
+
+void lockstat_record_acquire(lockstat_class* cls, bool contended, uint64_t spin_cycles);
+void lockstat_record_release(lockstat_class* cls, uint64_t hold_cycles);
+
+/// \brief copy statistics of at most count classes to buf
+/// \return the number of classes that have been seen
+size_t lockstat_read(lockstat_record* buf, size_t count);
+
+/// \brief zero all counters, keeping the classes
+void lockstat_reset();
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "debug/thread_annotations.hpp"
+
+#include "kbl/lock/mutex.hpp"
+
+#include "task/thread/wait_queue.hpp"
+
+#include "ktl/atomic.hpp"
+
+namespace kbl
+{
+
+/// \brief a sleeping reader-writer lock for thread context.
+/// Once anybody sleeps on it, new readers queue up behind them so writers aren't starved,
+/// and a release hands the lock to the first writer or to all the readers at the front.
+class TA_CAP("mutex") rw_lock final
+{
+ public:
+	static constexpr uint64_t WRITER = 1ull << 0;
+	static constexpr uint64_t HAS_WAITERS = 1ull << 1;
+	static constexpr uint64_t READER = 1ull << 2;
+
+	// how long a contender spins before going to sleep
+	static constexpr uint64_t SPIN_CYCLES = 50'000;
+
+	[[nodiscard]] rw_lock() = default;
+	~rw_lock();
+
+	rw_lock(const rw_lock&) = delete;
+	rw_lock& operator=(const rw_lock&) = delete;
+
+	/// \brief acquire for writing
+	void lock() noexcept TA_ACQ() TA_REQ(!task::global_thread_lock);
+
+	void unlock() noexcept TA_REL() TA_REQ(!task::global_thread_lock);
+
+	/// \brief Try to lock for writing
+	/// \return true if succeeded
+	bool try_lock() noexcept TA_TRY_ACQ(true);
+
+	void lock_shared() noexcept TA_ACQ_SHARED() TA_REQ(!task::global_thread_lock);
+
+	void unlock_shared() noexcept TA_REL_SHARED() TA_REQ(!task::global_thread_lock);
+
+	/// \brief Try to lock for reading
+	/// \return true if succeeded
+	bool try_lock_shared() noexcept TA_TRY_ACQ(true);
+
+	/// \brief if the current thread holds it for writing
+	bool holding() noexcept;
+
+	[[nodiscard]] size_t reader_count() const
+	{
+		return state_.load(ktl::memory_order_relaxed) / READER;
+	}
+
+ private:
+	void lock_slow() TA_REQ(!task::global_thread_lock);
+	void lock_shared_slow() TA_REQ(!task::global_thread_lock);
+
+	void release_slow(uint64_t held) TA_REQ(!task::global_thread_lock);
+
+	void hand_over() TA_REQ(task::global_thread_lock);
+
+	ktl::atomic<uint64_t> state_{ 0 };
+
+	// the writer, so contenders can tell whether it's running
+	ktl::atomic<task::thread*> writer_{ nullptr };
+
+	task::wait_queue wait_queue_{};
+};
+
+static_assert(lock::Mutex<rw_lock>, "rw_lock should satisfy the requirement of Mutex");
+
+/// \brief RAII wrapper for holding a rw_lock for reading
+class TA_SCOPED_CAP shared_lock_guard
+{
+ public:
+	[[nodiscard]] explicit shared_lock_guard(rw_lock& lk) noexcept TA_ACQ_SHARED(lk)
+		: lk_(&lk)
+	{
+		lk_->lock_shared();
+	}
+
+	~shared_lock_guard() noexcept TA_REL()
+	{
+		lk_->unlock_shared();
+	}
+
+	shared_lock_guard(const shared_lock_guard&) = delete;
+	shared_lock_guard& operator=(const shared_lock_guard&) = delete;
+
+ private:
+	rw_lock* lk_;
+};
+
+}
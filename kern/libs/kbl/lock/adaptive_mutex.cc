@@ -0,0 +1,162 @@
+#include "kbl/lock/adaptive_mutex.hpp"
+
+#include "kbl/lock/lock_guard.hpp"
+
+#include "task/thread/thread.hpp"
+
+#include "arch/amd64/cpu/intrinsics.hpp"
+
+using namespace task;
+
+// before the scheduler runs, such as while the first file systems are mounted, there is no
+// current thread. The mutex is owned by the boot context then, which can only spin
+static inline uintptr_t current_self()
+{
+	auto self = reinterpret_cast<uintptr_t>(cur_thread.get());
+	return self != 0 ? self : kbl::adaptive_mutex::BOOT_OWNER;
+}
+
+// threads come from the kernel heap, which stays mapped, so reading the state
+// of an owner that has just gone away costs no more than one wasted iteration
+static inline bool running_elsewhere(uintptr_t state)
+{
+	auto owner_state = state & ~kbl::adaptive_mutex::HAS_WAITERS;
+	if (owner_state == kbl::adaptive_mutex::BOOT_OWNER)
+	{
+		return true;
+	}
+
+	auto owner = reinterpret_cast<thread*>(owner_state);
+	return owner->state == thread::thread_states::RUNNING;
+}
+
+kbl::adaptive_mutex::~adaptive_mutex()
+{
+	KDEBUG_ASSERT(state_.load(ktl::memory_order_relaxed) == 0);
+}
+
+void kbl::adaptive_mutex::lock() noexcept
+{
+	auto self = current_self();
+
+	uintptr_t expected = 0;
+	if (state_.compare_exchange_strong(expected, self, ktl::memory_order_acquire, ktl::memory_order_relaxed))
+	{
+		return;
+	}
+
+	lock_slow(self);
+}
+
+bool kbl::adaptive_mutex::try_lock() noexcept
+{
+	uintptr_t expected = 0;
+	return state_.compare_exchange_strong(expected,
+		current_self(),
+		ktl::memory_order_acquire,
+		ktl::memory_order_relaxed);
+}
+
+void kbl::adaptive_mutex::unlock() noexcept
+{
+	auto expected = current_self();
+	KDEBUG_ASSERT((state_.load(ktl::memory_order_relaxed) & ~HAS_WAITERS) == expected);
+
+	if (state_.compare_exchange_strong(expected, 0, ktl::memory_order_release, ktl::memory_order_relaxed))
+	{
+		return;
+	}
+
+	unlock_slow();
+}
+
+void kbl::adaptive_mutex::assert_held()
+{
+	KDEBUG_ASSERT(holding());
+}
+
+bool kbl::adaptive_mutex::holding() noexcept
+{
+	return reinterpret_cast<uintptr_t>(owner()) == current_self();
+}
+
+void kbl::adaptive_mutex::lock_slow(uintptr_t self)
+{
+	KDEBUG_ASSERT((state_.load(ktl::memory_order_relaxed) & ~HAS_WAITERS) != self);
+
+	// spinning is worth it only if the owner is making progress on another CPU
+	auto start = arch::cycles();
+	for (;;)
+	{
+		auto state = state_.load(ktl::memory_order_relaxed);
+		if (state == 0)
+		{
+			if (state_.compare_exchange_weak(state, self, ktl::memory_order_acquire, ktl::memory_order_relaxed))
+			{
+				return;
+			}
+			continue;
+		}
+
+		// the boot context has nothing to sleep on, so it spins until the owner lets go
+		if (self == BOOT_OWNER)
+		{
+			arch::cpu_yield();
+			continue;
+		}
+
+		// somebody is already sleeping, so the mutex will be handed to them, not to us
+		if ((state & HAS_WAITERS) || !running_elsewhere(state) || arch::cycles() - start > SPIN_CYCLES)
+		{
+			break;
+		}
+
+		arch::cpu_yield();
+	}
+
+	lock::lock_guard g{ global_thread_lock };
+
+	for (;;)
+	{
+		auto state = state_.load(ktl::memory_order_relaxed);
+		if (state == 0)
+		{
+			if (state_.compare_exchange_weak(state, self, ktl::memory_order_acquire, ktl::memory_order_relaxed))
+			{
+				return;
+			}
+			continue;
+		}
+
+		// the owner can't release without global_thread_lock once this bit is set
+		if (!(state & HAS_WAITERS) &&
+			!state_.compare_exchange_weak(state, state | HAS_WAITERS, ktl::memory_order_relaxed))
+		{
+			continue;
+		}
+
+		[[maybe_unused]] auto err = wait_queue_.block(wait_queue::interruptible::No);
+		KDEBUG_ASSERT(err == ERROR_SUCCESS);
+
+		// the releaser made us the owner before waking us up
+		KDEBUG_ASSERT((state_.load(ktl::memory_order_acquire) & ~HAS_WAITERS) == self);
+		return;
+	}
+}
+
+void kbl::adaptive_mutex::unlock_slow()
+{
+	lock::lock_guard g{ global_thread_lock };
+
+	auto next = wait_queue_.peek();
+	if (next == nullptr)
+	{
+		state_.store(0, ktl::memory_order_release);
+		return;
+	}
+
+	auto state = reinterpret_cast<uintptr_t>(next) | (wait_queue_.size() > 1 ? HAS_WAITERS : 0);
+	state_.store(state, ktl::memory_order_release);
+
+	wait_queue_.wake_one(true, ERROR_SUCCESS);
+}
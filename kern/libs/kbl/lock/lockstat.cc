@@ -0,0 +1,200 @@
+#include "kbl/lock/lockstat.hpp"
+
+#include "ktl/atomic.hpp"
+
+#include "arch/amd64/cpu/intrinsics.hpp"
+
+#include <cstring>
+
+#ifdef _KERNEL_LOCKSTAT
+
+using namespace lock;
+
+// everything here is lock-free, because it runs inside spinlock acquisition and release
+namespace lock
+{
+
+struct lockstat_class
+{
+	enum class_state : uint32_t
+	{
+		EMPTY, FILLING, READY
+	};
+
+	ktl::atomic<uint32_t> state{ EMPTY };
+
+	char name[LOCKSTAT_NAME_MAX]{};
+
+	ktl::atomic<uint64_t> acquisitions{ 0 };
+	ktl::atomic<uint64_t> contentions{ 0 };
+	ktl::atomic<uint64_t> spin_cycles{ 0 };
+	ktl::atomic<uint64_t> max_spin_cycles{ 0 };
+	ktl::atomic<uint64_t> hold_cycles{ 0 };
+	ktl::atomic<uint64_t> max_hold_cycles{ 0 };
+};
+
+}
+
+static lockstat_class classes[LOCKSTAT_CLASS_MAX]{};
+
+// locks that do not fit in the table share this class
+static lockstat_class overflow_class{};
+
+static inline void copy_name(char* dst, ktl::string_view name)
+{
+	if (name.empty())
+	{
+		name = "(unnamed)";
+	}
+
+	size_t len = name.size() < LOCKSTAT_NAME_MAX - 1 ? name.size() : LOCKSTAT_NAME_MAX - 1;
+	memmove(dst, name.data(), len);
+	dst[len] = '\0';
+}
+
+static inline bool name_equal(const char* stored, ktl::string_view name)
+{
+	char truncated[LOCKSTAT_NAME_MAX]{};
+	copy_name(truncated, name);
+	return strcmp(stored, truncated) == 0;
+}
+
+static inline size_t name_hash(ktl::string_view name)
+{
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < name.size() && i < LOCKSTAT_NAME_MAX - 1; i++)
+	{
+		h ^= (uint8_t)name[i];
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+static inline void update_max(ktl::atomic<uint64_t>& target, uint64_t value)
+{
+	auto cur = target.load(ktl::memory_order_relaxed);
+	while (value > cur && !target.compare_exchange_weak(cur, value, ktl::memory_order_relaxed))
+	{
+	}
+}
+
+lockstat_class* lock::lockstat_class_of(ktl::string_view name)
+{
+	auto start = name_hash(name) % LOCKSTAT_CLASS_MAX;
+
+	for (size_t probe = 0; probe < LOCKSTAT_CLASS_MAX; probe++)
+	{
+		auto& cls = classes[(start + probe) % LOCKSTAT_CLASS_MAX];
+
+		auto state = cls.state.load(ktl::memory_order_acquire);
+		if (state == lockstat_class::EMPTY)
+		{
+			uint32_t expected = lockstat_class::EMPTY;
+			if (cls.state.compare_exchange_strong(expected, lockstat_class::FILLING, ktl::memory_order_acq_rel))
+			{
+				copy_name(cls.name, name);
+				cls.state.store(lockstat_class::READY, ktl::memory_order_release);
+				return &cls;
+			}
+
+			state = expected;
+		}
+
+		// another CPU is naming this slot, wait for it to decide whether it is ours
+		while (state == lockstat_class::FILLING)
+		{
+			arch::cpu_yield();
+			state = cls.state.load(ktl::memory_order_acquire);
+		}
+
+		if (name_equal(cls.name, name))
+		{
+			return &cls;
+		}
+	}
+
+	return &overflow_class;
+}
+
+void lock::lockstat_record_acquire(lockstat_class* cls, bool contended, uint64_t spin_cycles)
+{
+	cls->acquisitions.fetch_add(1, ktl::memory_order_relaxed);
+
+	if (contended)
+	{
+		cls->contentions.fetch_add(1, ktl::memory_order_relaxed);
+		cls->spin_cycles.fetch_add(spin_cycles, ktl::memory_order_relaxed);
+		update_max(cls->max_spin_cycles, spin_cycles);
+	}
+}
+
+void lock::lockstat_record_release(lockstat_class* cls, uint64_t hold_cycles)
+{
+	cls->hold_cycles.fetch_add(hold_cycles, ktl::memory_order_relaxed);
+	update_max(cls->max_hold_cycles, hold_cycles);
+}
+
+static inline void fill_record(lockstat_record* rec, const lockstat_class& cls, ktl::string_view name)
+{
+	copy_name(rec->name, name);
+
+	rec->acquisitions = cls.acquisitions.load(ktl::memory_order_relaxed);
+	rec->contentions = cls.contentions.load(ktl::memory_order_relaxed);
+	rec->spin_cycles = cls.spin_cycles.load(ktl::memory_order_relaxed);
+	rec->max_spin_cycles = cls.max_spin_cycles.load(ktl::memory_order_relaxed);
+	rec->hold_cycles = cls.hold_cycles.load(ktl::memory_order_relaxed);
+	rec->max_hold_cycles = cls.max_hold_cycles.load(ktl::memory_order_relaxed);
+}
+
+static inline void reset_class(lockstat_class& cls)
+{
+	cls.acquisitions.store(0, ktl::memory_order_relaxed);
+	cls.contentions.store(0, ktl::memory_order_relaxed);
+	cls.spin_cycles.store(0, ktl::memory_order_relaxed);
+	cls.max_spin_cycles.store(0, ktl::memory_order_relaxed);
+	cls.hold_cycles.store(0, ktl::memory_order_relaxed);
+	cls.max_hold_cycles.store(0, ktl::memory_order_relaxed);
+}
+
+size_t lock::lockstat_read(lockstat_record* buf, size_t count)
+{
+	size_t total = 0;
+
+	for (auto& cls: classes)
+	{
+		if (cls.state.load(ktl::memory_order_acquire) != lockstat_class::READY)
+		{
+			continue;
+		}
+
+		if (total < count)
+		{
+			fill_record(&buf[total], cls, cls.name);
+		}
+		total++;
+	}
+
+	if (overflow_class.acquisitions.load(ktl::memory_order_relaxed))
+	{
+		if (total < count)
+		{
+			fill_record(&buf[total], overflow_class, "(other)");
+		}
+		total++;
+	}
+
+	return total;
+}
+
+void lock::lockstat_reset()
+{
+	for (auto& cls: classes)
+	{
+		reset_class(cls);
+	}
+
+	reset_class(overflow_class);
+}
+
+#endif
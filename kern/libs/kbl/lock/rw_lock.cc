@@ -0,0 +1,282 @@
+#include "kbl/lock/rw_lock.hpp"
+
+#include "kbl/lock/lock_guard.hpp"
+
+#include "task/thread/thread.hpp"
+
+#include "arch/amd64/cpu/intrinsics.hpp"
+
+using namespace task;
+
+// a writer that isn't on a CPU won't release soon, so there is no point spinning on it.
+// threads come from the kernel heap, which stays mapped, so a stale writer is harmless
+static inline bool writer_sleeping(thread* writer)
+{
+	return writer != nullptr && writer->state != thread::thread_states::RUNNING;
+}
+
+kbl::rw_lock::~rw_lock()
+{
+	KDEBUG_ASSERT(state_.load(ktl::memory_order_relaxed) == 0);
+}
+
+void kbl::rw_lock::lock() noexcept
+{
+	uint64_t expected = 0;
+	if (state_.compare_exchange_strong(expected, WRITER, ktl::memory_order_acquire, ktl::memory_order_relaxed))
+	{
+		writer_.store(cur_thread.get(), ktl::memory_order_relaxed);
+		return;
+	}
+
+	lock_slow();
+}
+
+bool kbl::rw_lock::try_lock() noexcept
+{
+	uint64_t expected = 0;
+	if (state_.compare_exchange_strong(expected, WRITER, ktl::memory_order_acquire, ktl::memory_order_relaxed))
+	{
+		writer_.store(cur_thread.get(), ktl::memory_order_relaxed);
+		return true;
+	}
+
+	return false;
+}
+
+void kbl::rw_lock::unlock() noexcept
+{
+	KDEBUG_ASSERT(holding());
+
+	writer_.store(nullptr, ktl::memory_order_relaxed);
+
+	uint64_t expected = WRITER;
+	if (state_.compare_exchange_strong(expected, 0, ktl::memory_order_release, ktl::memory_order_relaxed))
+	{
+		return;
+	}
+
+	release_slow(WRITER);
+}
+
+void kbl::rw_lock::lock_shared() noexcept
+{
+	auto state = state_.load(ktl::memory_order_relaxed);
+	if (!(state & (WRITER | HAS_WAITERS)) &&
+		state_.compare_exchange_strong(state, state + READER, ktl::memory_order_acquire, ktl::memory_order_relaxed))
+	{
+		return;
+	}
+
+	lock_shared_slow();
+}
+
+bool kbl::rw_lock::try_lock_shared() noexcept
+{
+	auto state = state_.load(ktl::memory_order_relaxed);
+	while (!(state & (WRITER | HAS_WAITERS)))
+	{
+		if (state_.compare_exchange_weak(state, state + READER, ktl::memory_order_acquire, ktl::memory_order_relaxed))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void kbl::rw_lock::unlock_shared() noexcept
+{
+	auto state = state_.load(ktl::memory_order_relaxed);
+	KDEBUG_ASSERT(state >= READER);
+
+	// the last reader out hands the lock over to the sleepers
+	while (!((state & HAS_WAITERS) && state / READER == 1))
+	{
+		if (state_.compare_exchange_weak(state, state - READER, ktl::memory_order_release, ktl::memory_order_relaxed))
+		{
+			return;
+		}
+	}
+
+	release_slow(READER);
+}
+
+bool kbl::rw_lock::holding() noexcept
+{
+	return (state_.load(ktl::memory_order_relaxed) & WRITER) &&
+		writer_.load(ktl::memory_order_relaxed) == cur_thread.get();
+}
+
+void kbl::rw_lock::lock_slow()
+{
+	auto self = cur_thread.get();
+	KDEBUG_ASSERT(writer_.load(ktl::memory_order_relaxed) != self);
+
+	auto start = arch::cycles();
+	for (;;)
+	{
+		auto state = state_.load(ktl::memory_order_relaxed);
+		if (state == 0)
+		{
+			if (state_.compare_exchange_weak(state, WRITER, ktl::memory_order_acquire, ktl::memory_order_relaxed))
+			{
+				writer_.store(self, ktl::memory_order_relaxed);
+				return;
+			}
+			continue;
+		}
+
+		if ((state & HAS_WAITERS) ||
+			((state & WRITER) && writer_sleeping(writer_.load(ktl::memory_order_relaxed))) ||
+			arch::cycles() - start > SPIN_CYCLES)
+		{
+			break;
+		}
+
+		arch::cpu_yield();
+	}
+
+	lock::lock_guard g{ global_thread_lock };
+
+	for (;;)
+	{
+		auto state = state_.load(ktl::memory_order_relaxed);
+		if (state == 0)
+		{
+			if (state_.compare_exchange_weak(state, WRITER, ktl::memory_order_acquire, ktl::memory_order_relaxed))
+			{
+				writer_.store(self, ktl::memory_order_relaxed);
+				return;
+			}
+			continue;
+		}
+
+		// holders can't release without global_thread_lock once this bit is set
+		if (!(state & HAS_WAITERS) &&
+			!state_.compare_exchange_weak(state, state | HAS_WAITERS, ktl::memory_order_relaxed))
+		{
+			continue;
+		}
+
+		[[maybe_unused]] auto err = wait_queue_.block(wait_queue::interruptible::No);
+		KDEBUG_ASSERT(err == ERROR_SUCCESS);
+
+		// the releaser made us the writer before waking us up
+		KDEBUG_ASSERT(holding());
+		return;
+	}
+}
+
+void kbl::rw_lock::lock_shared_slow()
+{
+	auto start = arch::cycles();
+	for (;;)
+	{
+		auto state = state_.load(ktl::memory_order_relaxed);
+		if (!(state & (WRITER | HAS_WAITERS)))
+		{
+			if (state_.compare_exchange_weak(state, state + READER, ktl::memory_order_acquire, ktl::memory_order_relaxed))
+			{
+				return;
+			}
+			continue;
+		}
+
+		if ((state & HAS_WAITERS) ||
+			writer_sleeping(writer_.load(ktl::memory_order_relaxed)) ||
+			arch::cycles() - start > SPIN_CYCLES)
+		{
+			break;
+		}
+
+		arch::cpu_yield();
+	}
+
+	lock::lock_guard g{ global_thread_lock };
+
+	for (;;)
+	{
+		auto state = state_.load(ktl::memory_order_relaxed);
+		if (!(state & (WRITER | HAS_WAITERS)))
+		{
+			if (state_.compare_exchange_weak(state, state + READER, ktl::memory_order_acquire, ktl::memory_order_relaxed))
+			{
+				return;
+			}
+			continue;
+		}
+
+		if (!(state & HAS_WAITERS) &&
+			!state_.compare_exchange_weak(state, state | HAS_WAITERS, ktl::memory_order_relaxed))
+		{
+			continue;
+		}
+
+		[[maybe_unused]] auto err = wait_queue_.block_etc(deadline::infinite(),
+			0,
+			wait_queue::resource_ownership::Reader,
+			wait_queue::interruptible::No);
+		KDEBUG_ASSERT(err == ERROR_SUCCESS);
+
+		// the releaser counted us in before waking us up
+		KDEBUG_ASSERT(reader_count() > 0);
+		return;
+	}
+}
+
+void kbl::rw_lock::release_slow(uint64_t held)
+{
+	lock::lock_guard g{ global_thread_lock };
+
+	if (held == READER)
+	{
+		// other readers may still be inside, and the last of them will hand it over
+		auto state = state_.load(ktl::memory_order_relaxed);
+		while (state / READER > 1)
+		{
+			if (state_.compare_exchange_weak(state, state - READER, ktl::memory_order_release, ktl::memory_order_relaxed))
+			{
+				return;
+			}
+		}
+	}
+
+	hand_over();
+}
+
+void kbl::rw_lock::hand_over()
+{
+	auto next = wait_queue_.peek();
+	if (next == nullptr)
+	{
+		writer_.store(nullptr, ktl::memory_order_relaxed);
+		state_.store(0, ktl::memory_order_release);
+		return;
+	}
+
+	// the lock stays marked as contended while it's being handed over, so no fast path gets in
+	if (next->state == thread::thread_states::BLOCKED_READ_LOCK)
+	{
+		// let in all the readers at the front together
+		writer_.store(nullptr, ktl::memory_order_relaxed);
+		state_.store(HAS_WAITERS, ktl::memory_order_relaxed);
+
+		while ((next = wait_queue_.peek()) != nullptr && next->state == thread::thread_states::BLOCKED_READ_LOCK)
+		{
+			state_.fetch_add(READER, ktl::memory_order_release);
+			wait_queue_.wake_one(false, ERROR_SUCCESS);
+		}
+	}
+	else
+	{
+		writer_.store(next, ktl::memory_order_relaxed);
+		state_.store(WRITER | HAS_WAITERS, ktl::memory_order_release);
+		wait_queue_.wake_one(false, ERROR_SUCCESS);
+	}
+
+	if (wait_queue_.empty())
+	{
+		state_.fetch_and(~HAS_WAITERS, ktl::memory_order_release);
+	}
+}
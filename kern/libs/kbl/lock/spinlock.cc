@@ -8,6 +8,11 @@
 #include "drivers/acpi/cpu.h"
 #include "debug/kdebug.h"
 #include "kbl/lock/spinlock.h"
+#include "kbl/lock/lockstat.hpp"
+
+#include "memory/tlb.hpp"
+
+#include "arch/amd64/cpu/intrinsics.hpp"
 
 #include "../../libs/basic_io/include/builtin_text_io.hpp"
 
@@ -32,6 +37,7 @@ using lock::spinlock_struct;
 		write_format("-> called by %s\n", caller);
 	}
 
+#ifdef _KERNEL_LOCK_DEBUG
 	{
 		size_t counter = 0;
 		for (auto cs: lock->pcs)
@@ -41,6 +47,9 @@ using lock::spinlock_struct;
 			if ((++counter) % 4 == 0)write_format("\n");
 		}
 	}
+#else
+	write_format("(not recorded, build with KERNEL_LOCK_DEBUG)");
+#endif
 
 	write_format("\nCall stack of panic:\n");
 
@@ -50,29 +59,85 @@ using lock::spinlock_struct;
 	for (;;);
 }
 
+// waiters spin with interrupts disabled, so they serve the shootdowns a holder may be waiting for
+// instead of the IPI handler
+static inline void arch_wait(lock::arch_spinlock* lk) TA_NO_THREAD_SAFETY_ANALYSIS
+{
+	lock::arch_spinlock_lock(lk, memory::tlb_shootdown_poll);
+}
+
+static inline void arch_acquire(lock::arch_spinlock* lk) TA_NO_THREAD_SAFETY_ANALYSIS
+{
+#ifdef _KERNEL_LOCKSTAT
+	auto start = arch::cycles();
+
+	bool contended = lock::arch_spinlock_try_lock(lk);
+	if (contended)
+	{
+		arch_wait(lk);
+	}
+
+	auto now = arch::cycles();
+
+	if (!lk->stat)
+	{
+		// locks made without a name are counted together
+		lk->stat = lock::lockstat_class_of(lk->name != nullptr ? lk->name : "(unnamed)");
+	}
+
+	lk->acquired_at = now;
+	lock::lockstat_record_acquire(lk->stat, contended, now - start);
+#else
+	arch_wait(lk);
+#endif
+}
+
+static inline void arch_release(lock::arch_spinlock* lk) TA_NO_THREAD_SAFETY_ANALYSIS
+{
+#ifdef _KERNEL_LOCKSTAT
+	auto stat = lk->stat;
+	auto held = arch::cycles() - lk->acquired_at;
+
+	lock::arch_spinlock_unlock(lk);
+
+	lock::lockstat_record_release(stat, held);
+#else
+	lock::arch_spinlock_unlock(lk);
+#endif
+}
+
 void lock::spinlock_initialize_lock(spinlock_struct* lk, const char* name)
 {
 	lk->arch.name = name;
+	lk->arch.tickets = 0;
 	lk->arch.value = 0;
+#ifdef _KERNEL_LOCKSTAT
+	lk->arch.stat = nullptr;
+#endif
+#ifdef _KERNEL_LOCK_DEBUG
 	lk->arch.pcs[0] = 0;
+#endif
 }
 
 void lock::spinlock_acquire(spinlock_struct* lock, bool pres_intr) TA_NO_THREAD_SAFETY_ANALYSIS
 {
+#ifdef _KERNEL_LOCK_DEBUG
 	if (spinlock_holding(lock))
 	{
 		dump_lock_panic(&lock->arch, __FUNCTION__);
 	}
 
 	kdebug::kdebug_get_backtrace(lock->arch.pcs);
+#endif
 
 	if (pres_intr)lock->intr = arch_interrupt_save();
 
-	arch_spinlock_lock(&lock->arch);
+	arch_acquire(&lock->arch);
 }
 
 void lock::spinlock_release(spinlock_struct* lock, bool pres_intr) TA_NO_THREAD_SAFETY_ANALYSIS
 {
+#ifdef _KERNEL_LOCK_DEBUG
 	if (!spinlock_holding(lock))
 	{
 		KDEBUG_RICHPANIC("Release a not-held spinlock_struct.\n",
@@ -82,8 +147,9 @@ void lock::spinlock_release(spinlock_struct* lock, bool pres_intr) TA_NO_THREAD_
 	}
 
 	lock->arch.pcs[0] = 0;
+#endif
 
-	arch_spinlock_unlock(&lock->arch);
+	arch_release(&lock->arch);
 
 	if (pres_intr)arch_interrupt_restore(lock->intr);
 }
@@ -98,20 +164,24 @@ void lock::spinlock::lock() noexcept
 {
 	state_ = arch_interrupt_save();
 
+#ifdef _KERNEL_LOCK_DEBUG
 	assert_not_held();
 
 	kdebug::kdebug_get_backtrace(spinlock_.pcs);
+#endif
 
-	arch_spinlock_lock(&spinlock_);
+	arch_acquire(&spinlock_);
 }
 
 void lock::spinlock::unlock() noexcept
 {
+#ifdef _KERNEL_LOCK_DEBUG
 	assert_held();
 
-	arch_spinlock_unlock(&spinlock_);
-
 	spinlock_.pcs[0] = 0;
+#endif
+
+	arch_release(&spinlock_);
 
 	arch_interrupt_restore(state_);
 }
@@ -22,12 +22,15 @@
 #include "system/pmm.h"
 
 #include "drivers/console/console.h"
+#include "drivers/acpi/cpu.h"
 #include "debug/kdebug.h"
 
 #include "memory/pmm.hpp"
 
 #include "kbl/lock/lock_guard.hpp"
 
+#include "ktl/algorithm.hpp"
+
 #include <cstring>
 
 using namespace memory;
@@ -56,6 +59,9 @@ spinlock cache_head_lock{ "kmem_cache_head" };
 
 kmem_cache* sized_caches[KMEM_SIZED_CACHE_COUNT];
 kmem_cache cache_cache;
+kmem_cache* magazine_cache;
+
+static_assert(KMEM_CPU_CACHE_COUNT == CPU_COUNT_LIMIT);
 
 static inline constexpr size_t cache_obj_count(kmem_cache* cache, size_t obj_size)
 {
@@ -142,30 +148,179 @@ static inline void slab_destory(kmem_cache* cache, slab* slb)
 //	free_page((page*)(pmm::va_to_page(va)));
 }
 
-// ATTENTION: BE CAUTIOUS FOR RACE CONDITION
-// This function should not be a critial section because there's no modifying
+// a slab occupies exactly one page with its header at the beginning,
+// so the owner of an object is found from the page descriptor in constant time
 static inline slab* slab_find(kmem_cache* cache, void* obj)
 {
-	list_head* heads[] = { &cache->partial, &cache->full };
-	slab* slb = nullptr;
+	auto slb = reinterpret_cast<slab*>(pmm::page_to_va(pmm::va_to_page((uintptr_t)obj)));
+
+	KDEBUG_ASSERT(slb->cache == cache);
+	KDEBUG_ASSERT(((uintptr_t)obj) >= ((uintptr_t)slb->obj_ptr) &&
+		((uintptr_t)obj) < ((uintptr_t)slb->obj_ptr) + cache->obj_size * cache->obj_count);
+
+	return slb;
+}
+
+static inline void depot_init(kmem_depot* depot)
+{
+	list_init(&depot->full);
+	list_init(&depot->empty);
+	depot->full_count = 0;
+	depot->empty_count = 0;
+}
+
+static inline bool cache_use_magazine(kmem_cache* cache)
+{
+	// magazines are per-cpu, so they are not usable before cpu local storage is prepared.
+	return !(cache->flags & KMEM_CACHE_NOMAGAZINE) && cpu.is_valid();
+}
+
+static inline void* slab_alloc(kmem_cache* cache);
+static inline void slab_free(kmem_cache* cache, void* obj);
+
+// Precondition: interrupts are disabled
+static inline void* magazine_alloc(kmem_cache* cache)
+{
+	auto cc = &cache->cpu_caches[cpu->id];
+
+	if (cc->loaded && cc->loaded->rounds > 0)
+	{
+		return cc->loaded->objs[--cc->loaded->rounds];
+	}
+
+	if (cc->previous && cc->previous->rounds > 0)
+	{
+		ktl::swap(cc->loaded, cc->previous);
+		return cc->loaded->objs[--cc->loaded->rounds];
+	}
+
+	// both magazines are empty, exchange with the depot.
+	lock_guard g{ cache->depot.lock };
+
+	if (list_empty(&cache->depot.full))
+	{
+		return nullptr;
+	}
+
+	auto full = list_entry(cache->depot.full.next, kmem_magazine, magazine_link);
+	list_remove(&full->magazine_link);
+	cache->depot.full_count--;
+
+	if (cc->previous)
+	{
+		list_add(&cc->previous->magazine_link, &cache->depot.empty);
+		cache->depot.empty_count++;
+	}
+
+	cc->previous = cc->loaded;
+	cc->loaded = full;
+
+	return cc->loaded->objs[--cc->loaded->rounds];
+}
+
+// Precondition: interrupts are disabled
+static inline bool magazine_free(kmem_cache* cache, void* obj)
+{
+	auto cc = &cache->cpu_caches[cpu->id];
+
+	if (cc->loaded && cc->loaded->rounds < KMEM_MAGAZINE_SIZE)
+	{
+		cc->loaded->objs[cc->loaded->rounds++] = obj;
+		return true;
+	}
+
+	if (cc->previous && cc->previous->rounds == 0)
+	{
+		ktl::swap(cc->loaded, cc->previous);
+		cc->loaded->objs[cc->loaded->rounds++] = obj;
+		return true;
+	}
+
+	// both magazines are full, exchange with the depot.
+	kmem_magazine* empty = nullptr;
+	{
+		lock_guard g{ cache->depot.lock };
+		if (!list_empty(&cache->depot.empty))
+		{
+			empty = list_entry(cache->depot.empty.next, kmem_magazine, magazine_link);
+			list_remove(&empty->magazine_link);
+			cache->depot.empty_count--;
+		}
+	}
+
+	if (empty == nullptr)
+	{
+		// magazine_cache never uses magazines, so there is no recursion
+		empty = reinterpret_cast<kmem_magazine*>(slab_alloc(magazine_cache));
+		if (empty == nullptr)
+		{
+			return false;
+		}
+	}
+
+	empty->rounds = 0;
+
+	if (cc->previous)
+	{
+		lock_guard g{ cache->depot.lock };
+		list_add(&cc->previous->magazine_link, &cache->depot.full);
+		cache->depot.full_count++;
+	}
+
+	cc->previous = cc->loaded;
+	cc->loaded = empty;
+
+	cc->loaded->objs[cc->loaded->rounds++] = obj;
+	return true;
+}
+
+static inline void magazine_destroy(kmem_cache* cache, kmem_magazine* mag)
+{
+	for (size_t i = 0; i < mag->rounds; i++)
+	{
+		slab_free(cache, mag->objs[i]);
+	}
+
+	mag->rounds = 0;
+	slab_free(magazine_cache, mag);
+}
+
+// return all objects held by the depot to slabs
+// Precondition: the depot lock must NOT be held
+static inline size_t depot_drain(kmem_cache* cache)
+{
+	list_head drained{};
+	list_init(&drained);
 
-	for (auto head : heads)
 	{
-		list_head* iter = nullptr;
-		list_for(iter, head)
+		lock_guard g{ cache->depot.lock };
+
+		list_head* heads[] = { &cache->depot.full, &cache->depot.empty };
+		for (auto head : heads)
 		{
-			slab* s = list_entry(iter, slab, slab_link);
-			uintptr_t begin = (uintptr_t)s->obj_ptr;
-			uintptr_t end = (uintptr_t)(((char*)s->obj_ptr) + cache->obj_size * cache->obj_count);
-			if (((uintptr_t)obj) >= begin && ((uintptr_t)obj) < end)
+			while (!list_empty(head))
 			{
-				slb = s;
-				break;
+				auto entry = head->next;
+				list_remove(entry);
+				list_add(entry, &drained);
 			}
 		}
+
+		cache->depot.full_count = 0;
+		cache->depot.empty_count = 0;
 	}
 
-	return slb;
+	size_t count = 0;
+	while (!list_empty(&drained))
+	{
+		auto mag = list_entry(drained.next, kmem_magazine, magazine_link);
+		list_remove(&mag->magazine_link);
+
+		magazine_destroy(cache, mag);
+		count++;
+	}
+
+	return count;
 }
 
 void memory::kmem::kmem_init()
@@ -174,6 +329,7 @@ void memory::kmem::kmem_init()
 	cache_cache.obj_count = cache_obj_count(&cache_cache, cache_cache.obj_size);
 	cache_cache.ctor = nullptr;
 	cache_cache.dtor = nullptr;
+	cache_cache.flags = KMEM_CACHE_NOMAGAZINE;
 
 	auto cache_cache_name = "cache_cache";
 	strncpy(cache_cache.name, cache_cache_name, KMEM_CACHE_NAME_MAXLEN);
@@ -181,10 +337,17 @@ void memory::kmem::kmem_init()
 	list_init(&cache_cache.full);
 	list_init(&cache_cache.partial);
 	list_init(&cache_cache.free);
+	depot_init(&cache_cache.depot);
 
 	list_init(&cache_head);
 	list_add(&cache_cache.cache_link, &cache_head);
 
+	magazine_cache = kmem_cache_create("magazine_cache",
+		sizeof(kmem_magazine),
+		nullptr,
+		nullptr,
+		KMEM_CACHE_NOMAGAZINE);
+
 	char sized_cache_name[KMEM_CACHE_NAME_MAXLEN];
 	size_t sized_cache_count = 0;
 	for (size_t sz = KMEM_MIN_SIZED_CACHE_SIZE; sz <= KMEM_MAX_SIZED_CACHE_SIZE; sz *= 2)
@@ -230,6 +393,7 @@ kmem_cache* memory::kmem::kmem_cache_create(const char* name,
 		list_init(&ret->full);
 		list_init(&ret->partial);
 		list_init(&ret->free);
+		depot_init(&ret->depot);
 
 		{
 			lock_guard gcache{ cache_head_lock };
@@ -247,6 +411,23 @@ kmem_cache* memory::kmem::kmem_cache_create(const char* name,
 }
 
 void* memory::kmem::kmem_cache_alloc(kmem_cache* cache)
+{
+	if (cache_use_magazine(cache))
+	{
+		auto state = arch_interrupt_save();
+		void* ret = magazine_alloc(cache);
+		arch_interrupt_restore(state);
+
+		if (ret != nullptr)
+		{
+			return ret;
+		}
+	}
+
+	return slab_alloc(cache);
+}
+
+static inline void* slab_alloc(kmem_cache* cache)
 {
 	lock_guard g1{ cache->lock };
 
@@ -295,9 +476,34 @@ void* memory::kmem::kmem_cache_alloc(kmem_cache* cache)
 
 void memory::kmem::kmem_cache_destroy(kmem_cache* cache)
 {
+	// it can't be found by kmem_cache_reap any more
+	{
+		lock_guard g{ cache_head_lock };
+		list_remove(&cache->cache_link);
+	}
+
+	// the cache is quiescent, so the magazines of other CPUs can be drained from here
+	for (auto& cc : cache->cpu_caches)
+	{
+		kmem_magazine* mags[] = { cc.loaded, cc.previous };
+		for (auto mag : mags)
+		{
+			if (mag)
+			{
+				magazine_destroy(cache, mag);
+			}
+		}
+		cc.loaded = cc.previous = nullptr;
+	}
+
+	depot_drain(cache);
+
 	{
 		lock_guard g1{ cache->lock };
 
+		// an object still in use, or one freed to a magazine meanwhile, means the cache wasn't quiescent
+		KDEBUG_ASSERT(list_empty(&cache->full) && list_empty(&cache->partial));
+
 		list_head* heads[] = { &cache->full, &cache->partial, &cache->free };
 		for (auto head : heads)
 		{
@@ -318,13 +524,31 @@ void memory::kmem::kmem_cache_free(kmem_cache* cache, void* obj)
 {
 	KDEBUG_ASSERT(obj != nullptr && cache != nullptr);
 
+	if (cache_use_magazine(cache))
+	{
+		auto state = arch_interrupt_save();
+		bool freed = magazine_free(cache, obj);
+		arch_interrupt_restore(state);
+
+		if (freed)
+		{
+			return;
+		}
+	}
+
+	slab_free(cache, obj);
+}
+
+static inline void slab_free(kmem_cache* cache, void* obj)
+{
 	slab* slb = slab_find(cache, obj);
 	KDEBUG_ASSERT(slb != nullptr);
-	lock_guard g{ slb->lock };
 
 	size_t offset = (((uintptr_t)obj) - ((uintptr_t)slb->obj_ptr)) / cache->obj_size;
 
+	// same order as slab_alloc
 	lock_guard g1{ cache->lock };
+	lock_guard g{ slb->lock };
 
 	list_remove(&slb->slab_link);
 	slb->freelist[offset] = slb->next_free;
@@ -344,6 +568,10 @@ void memory::kmem::kmem_cache_free(kmem_cache* cache, void* obj)
 
 size_t memory::kmem::kmem_cache_shrink(kmem_cache* cache)
 {
+	// objects cached in the depot keep their slabs busy, so give them back first.
+	// magazines loaded by CPUs are left untouched.
+	depot_drain(cache);
+
 	lock_guard g1{ cache->lock };
 
 	size_t count = 0;
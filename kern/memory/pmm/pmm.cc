@@ -1,7 +1,10 @@
 #include "memory/pmm.hpp"
+#include "memory/tlb.hpp"
 
 #include "arch/amd64/cpu/x86.h"
 
+#include "drivers/acpi/cpu.h"
+
 #include "system/mmu.h"
 #include "system/pmm.h"
 
@@ -11,6 +14,7 @@
 
 #include <algorithm>
 #include <utility>
+#include <cstring>
 
 #include <gsl/util>
 
@@ -19,6 +23,11 @@ using namespace lock;
 
 using namespace pmm;
 
+// linked list
+using namespace kbl;
+
+static_assert(physical_memory_manager::CPU_CACHE_COUNT == CPU_COUNT_LIMIT);
+
 physical_memory_manager* physical_memory_manager::instance()
 {
 	static physical_memory_manager inst;
@@ -28,6 +37,12 @@ physical_memory_manager* physical_memory_manager::instance()
 memory::physical_memory_manager::physical_memory_manager()
 	: provider_()
 {
+	for (auto& c : cpu_caches_)
+	{
+		list_init(&c.pages);
+	}
+
+	list_init(&zeroed_pages_);
 }
 
 void memory::physical_memory_manager::setup_for_base(page* base, size_t n)
@@ -58,13 +73,115 @@ page* physical_memory_manager::allocate()
 
 page* memory::physical_memory_manager::allocate(size_t n)
 {
+	if (n == 1 && cpu.is_valid())
+	{
+		if (auto pg = cpu_cache_allocate();pg != nullptr)
+		{
+			return pg;
+		}
+	}
+
 	lock_guard g{ lock_ };
 	return allocate_locked(n);
 }
 
 page* physical_memory_manager::allocate_locked(size_t n)
 {
-	return provider_.allocate(n);
+	auto ret = provider_.allocate(n);
+
+	// the pre-zeroed pages are the last resort
+	if (ret == nullptr && n == 1 && zeroed_count_ != 0)
+	{
+		ret = list_entry(zeroed_pages_.next, page, page_link);
+		list_remove(&ret->page_link);
+		zeroed_count_--;
+	}
+
+	return ret;
+}
+
+page* physical_memory_manager::allocate_zeroed()
+{
+	{
+		lock_guard g{ lock_ };
+		if (zeroed_count_ != 0)
+		{
+			auto ret = list_entry(zeroed_pages_.next, page, page_link);
+			list_remove(&ret->page_link);
+			zeroed_count_--;
+
+			return ret;
+		}
+	}
+
+	auto ret = allocate();
+	if (ret != nullptr)
+	{
+		memset(reinterpret_cast<void*>(page_to_va(ret)), 0, PAGE_SIZE);
+	}
+
+	return ret;
+}
+
+bool physical_memory_manager::zero_idle_pages()
+{
+	small_frames_.prezero(ZEROED_SMALL_BUDGET);
+
+	page* pg = nullptr;
+	size_t offset = 0;
+	{
+		lock_guard g{ lock_ };
+
+		// pick up the page left zeroed in part, or start a new one if the pool is short
+		pg = zeroing_page_;
+		offset = zeroing_offset_;
+		zeroing_page_ = nullptr;
+
+		if (pg == nullptr && zeroed_count_ >= ZEROED_POOL_TARGET)
+		{
+			return false;
+		}
+	}
+
+	if (pg == nullptr)
+	{
+		pg = allocate();
+		if (pg == nullptr)
+		{
+			return false;
+		}
+
+		offset = 0;
+	}
+
+	// a bounded piece a time, so that the idle loop checks for work in between
+	memset(reinterpret_cast<void*>(page_to_va(pg) + offset), 0, ZEROED_CHUNK_SIZE);
+	offset += ZEROED_CHUNK_SIZE;
+
+	{
+		lock_guard g{ lock_ };
+
+		if (offset >= PAGE_SIZE)
+		{
+			list_add(&pg->page_link, &zeroed_pages_);
+			zeroed_count_++;
+
+			return zeroed_count_ < ZEROED_POOL_TARGET;
+		}
+
+		if (zeroing_page_ == nullptr)
+		{
+			zeroing_page_ = pg;
+			zeroing_offset_ = offset;
+
+			return true;
+		}
+	}
+
+	// another idle CPU started one meanwhile, and only one is kept zeroed in part
+	free(pg);
+
+	return true;
 }
 
 void physical_memory_manager::free(page* base)
@@ -74,14 +191,130 @@ void physical_memory_manager::free(page* base)
 
 void memory::physical_memory_manager::free(page* base, size_t n)
 {
+	if (n == 1 && cpu.is_valid())
+	{
+		cpu_cache_free(base);
+		return;
+	}
+
 	lock_guard g{ lock_ };
 	return provider_.free(base, n);
 }
 
 size_t memory::physical_memory_manager::free_count() const
+{
+	size_t cached = 0;
+	for (const auto& c : cpu_caches_)
+	{
+		cached += __atomic_load_n(&c.count, __ATOMIC_RELAXED);
+	}
+
+	lock_guard g{ lock_ };
+	return provider_.free_count() + cached + zeroed_count_;
+}
+
+void physical_memory_manager::set_cpu_cache_watermark(size_t high, size_t low, size_t batch)
+{
+	KDEBUG_ASSERT(low <= high);
+	KDEBUG_ASSERT(batch > 0);
+
+	lock_guard g{ lock_ };
+
+	cpu_cache_high_ = high;
+	cpu_cache_low_ = low;
+	cpu_cache_batch_ = batch;
+}
+
+physical_memory_manager::cpu_page_cache physical_memory_manager::cpu_cache_statistics(size_t cpu_id) const
+{
+	KDEBUG_ASSERT(cpu_id < CPU_CACHE_COUNT);
+
+	auto state = arch_interrupt_save();
+	auto ret = cpu_caches_[cpu_id];
+	arch_interrupt_restore(state);
+
+	// the list head is meaningless for a copy
+	list_init(&ret.pages);
+	return ret;
+}
+
+page* physical_memory_manager::cpu_cache_allocate()
+{
+	auto state = arch_interrupt_save();
+
+	auto cache = &cpu_caches_[cpu->id];
+	if (cache->count == 0)
+	{
+		cpu_cache_refill(cache);
+	}
+
+	page* ret = nullptr;
+	if (cache->count != 0)
+	{
+		ret = list_entry(cache->pages.next, page, page_link);
+		list_remove(&ret->page_link);
+		cache->count--;
+		cache->alloc_hits++;
+	}
+
+	arch_interrupt_restore(state);
+	return ret;
+}
+
+void physical_memory_manager::cpu_cache_free(page* pg)
+{
+	auto state = arch_interrupt_save();
+
+	auto cache = &cpu_caches_[cpu->id];
+
+	list_add(&pg->page_link, &cache->pages);
+	cache->count++;
+	cache->free_hits++;
+
+	if (cache->count > cpu_cache_high_)
+	{
+		cpu_cache_drain(cache, cpu_cache_low_);
+	}
+
+	arch_interrupt_restore(state);
+}
+
+// Precondition: interrupts are disabled
+void physical_memory_manager::cpu_cache_refill(cpu_page_cache* cache)
+{
+	lock_guard g{ lock_ };
+
+	for (size_t i = 0; i < cpu_cache_batch_; i++)
+	{
+		auto pg = allocate_locked(1);
+		if (pg == nullptr)
+		{
+			break;
+		}
+
+		list_add_tail(&pg->page_link, &cache->pages);
+		cache->count++;
+	}
+
+	cache->refills++;
+}
+
+// Precondition: interrupts are disabled
+void physical_memory_manager::cpu_cache_drain(cpu_page_cache* cache, size_t target)
 {
 	lock_guard g{ lock_ };
-	return provider_.free_count();
+
+	// the coldest pages go back first
+	while (cache->count > target)
+	{
+		auto pg = list_entry(cache->pages.prev, page, page_link);
+		list_remove(&pg->page_link);
+		cache->count--;
+
+		provider_.free(pg, 1);
+	}
+
+	cache->drains++;
 }
 
 bool memory::physical_memory_manager::is_well_constructed() const
@@ -154,30 +387,143 @@ error_code_with_result<page*> physical_memory_manager::allocate(uintptr_t va,
 	return page;
 }
 
-error_code physical_memory_manager::insert_page(page* page,
+uintptr_t physical_memory_manager::allocate_small()
+{
+	return small_frames_.allocate();
+}
+
+error_code_with_result<uintptr_t> physical_memory_manager::allocate_small(uintptr_t va,
+	uint64_t perm,
+	vmm::pde_ptr_t pgdir,
+	bool rewrite_if_exist)
+{
+	KDEBUG_ASSERT(pgdir != nullptr);
+	KDEBUG_ASSERT(va != 0);
+
+	auto pa = small_frames_.allocate();
+	if (pa == 0)
+	{
+		return -ERROR_MEMORY_ALLOC;
+	}
+
+	auto ret = insert_small_page(pa, va, perm, pgdir, rewrite_if_exist);
+
+	// insert_small_page holds its own reference
+	small_frames_.put(pa);
+
+	if (ret != ERROR_SUCCESS)
+	{
+		return ret;
+	}
+
+	return pa;
+}
+
+void physical_memory_manager::get_small(uintptr_t pa)
+{
+	small_frames_.get(pa);
+}
+
+size_t physical_memory_manager::put_small(uintptr_t pa)
+{
+	return small_frames_.put(pa);
+}
+
+size_t physical_memory_manager::small_ref(uintptr_t pa) const
+{
+	return small_frames_.ref(pa);
+}
+
+error_code physical_memory_manager::insert_small_page(uintptr_t pa,
 	uintptr_t va,
 	uint64_t perm,
 	vmm::pde_ptr_t pgdir,
 	bool allow_rewrite)
 {
-	auto pde = vmm::walk_pgdir(pgdir, va, true);
-	if (pde == nullptr)
+	if (auto pde = vmm::walk_pgdir(pgdir, va, false);pde != nullptr && vmm::pde_is_large(pde))
+	{
+		return -ERROR_REWRITE;
+	}
+
+	auto pte = vmm::walk_pgdir_small(pgdir, va, true);
+	if (pte == nullptr)
 	{
 		return -ERROR_MEMORY_ALLOC;
 	}
 
-	++page->ref;
+	small_frames_.get(pa);
 
-	if (*pde != 0)
+	// not-present entries are never cached, and a stale entry with fewer rights only faults again
+	bool flush = false;
+	if (*pte & PG_P)
 	{
-		if ((!allow_rewrite) && (pde_to_page(pde) != page))
+		auto old = vmm::pde_to_pa(pte);
+		if (old == pa)
+		{
+			small_frames_.put(pa);
+			flush = ((*pte) & (PG_W | PG_U) & ~perm) != 0;
+		}
+		else if (!allow_rewrite)
 		{
+			small_frames_.put(pa);
 			return -ERROR_REWRITE;
 		}
+		else
+		{
+			*pte = pa | PG_P | perm;
+
+			// no CPU should reach the old frame when it is freed
+			flush_tlb(pgdir, va);
+			small_frames_.put(old);
+
+			return ERROR_SUCCESS;
+		}
+	}
+
+	*pte = pa | PG_P | perm;
+
+	if (flush)
+	{
+		flush_tlb(pgdir, va);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+error_code physical_memory_manager::insert_page(page* page,
+	uintptr_t va,
+	uint64_t perm,
+	vmm::pde_ptr_t pgdir,
+	bool allow_rewrite)
+{
+	auto pde = vmm::walk_pgdir(pgdir, va, true);
+	if (pde == nullptr)
+	{
+		return -ERROR_MEMORY_ALLOC;
+	}
+
+	if (vmm::pde_is_table(pde))
+	{
+		// small pages are mapped here
+		return -ERROR_REWRITE;
+	}
+
+	if (*pde != 0 && !allow_rewrite && pde_to_page(pde) != page)
+	{
+		return -ERROR_REWRITE;
+	}
 
+	page_ref_get(page);
+
+	// as for small pages, only a present entry losing rights needs flushing here,
+	// and remove_from_pgdir flushes the replaced ones itself
+	bool flush = false;
+	if (*pde != 0)
+	{
 		if ((*pde & PG_P) && pde_to_page(pde) == page)
 		{
-			--page->ref;
+			page_ref_put(page);
+			flush = ((*pde) & (PG_W | PG_U) & ~perm) != 0;
 		}
 		else
 		{
@@ -186,17 +532,18 @@ error_code physical_memory_manager::insert_page(page* page,
 	}
 
 	*pde = page_to_pa(page) | PG_PS | PG_P | perm;
-	memory::physical_memory_manager::instance()->flush_tlb(pgdir, va);
+
+	if (flush)
+	{
+		flush_tlb(pgdir, va);
+	}
 
 	return ERROR_SUCCESS;
 }
 
 void physical_memory_manager::flush_tlb(vmm::pde_ptr_t pgdir, uintptr_t va)
 {
-	if (rcr3() == V2P((uintptr_t)pgdir))
-	{
-		invlpg((void*)va);
-	}
+	tlb_shootdown(pgdir, &va, 1);
 }
 
 void physical_memory_manager::remove_from_pgdir(vmm::pde_ptr_t pde, vmm::pde_ptr_t pgdir, uintptr_t va)
@@ -204,20 +551,39 @@ void physical_memory_manager::remove_from_pgdir(vmm::pde_ptr_t pde, vmm::pde_ptr
 	if ((*pde) & PG_P)
 	{
 		auto page = pmm::pde_to_page(pde);
-		if ((--page->ref) == 0)
-		{
-			physical_memory_manager::instance()->free(page);
-		}
 		*pde = 0;
 
+		// no CPU should reach the page when it is freed
 		memory::physical_memory_manager::instance()->flush_tlb(pgdir, va);
+
+		if (page_ref_put(page) == 0)
+		{
+			physical_memory_manager::instance()->free(page);
+		}
 	}
 }
 
 void physical_memory_manager::remove_page(uintptr_t va, vmm::pde_ptr_t pgdir)
 {
 	auto pde = vmm::walk_pgdir(pgdir, va, false);
-	if (pde != nullptr)
+	if (pde == nullptr)
+	{
+		return;
+	}
+
+	if (vmm::pde_is_table(pde))
+	{
+		auto pte = vmm::walk_pgdir_small(pgdir, va, false);
+		if (pte != nullptr && ((*pte) & PG_P))
+		{
+			auto pa = vmm::pde_to_pa(pte);
+			*pte = 0;
+
+			flush_tlb(pgdir, va);
+			small_frames_.put(pa);
+		}
+	}
+	else
 	{
 		remove_from_pgdir(pde, pgdir, va);
 	}
@@ -0,0 +1,302 @@
+// Copyright (c) 2021 SmartPolarBear
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "memory/small_frame_provider.hpp"
+#include "memory/pmm.hpp"
+
+#include "system/memlayout.h"
+#include "system/mmu.h"
+#include "system/pmm.h"
+
+#include "debug/kdebug.h"
+
+#include "kbl/lock/lock_guard.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+using namespace memory;
+using namespace lock;
+
+// linked list
+using namespace kbl;
+
+memory::small_frame_provider::small_frame_provider()
+{
+	list_init(&partial_);
+}
+
+small_frame_provider::block* memory::small_frame_provider::block_of(uintptr_t pa)
+{
+	return reinterpret_cast<block*>(P2V(rounddown(pa, PAGE_SIZE)));
+}
+
+size_t memory::small_frame_provider::index_of(uintptr_t pa)
+{
+	return (pa % PAGE_SIZE) / SMALL_PAGE_SIZE;
+}
+
+uintptr_t memory::small_frame_provider::claim_locked(block* blk, size_t index)
+{
+	auto bit = 1ull << (index % BITMAP_WORD_BITS);
+
+	blk->bitmap[index / BITMAP_WORD_BITS] |= bit;
+	blk->refs[index] = 1;
+
+	if (blk->zeroed[index / BITMAP_WORD_BITS] & bit)
+	{
+		blk->zeroed[index / BITMAP_WORD_BITS] &= ~bit;
+		zeroed_count_--;
+	}
+
+	if (--blk->free_count == 0)
+	{
+		list_remove(&blk->block_link);
+	}
+	free_count_--;
+
+	return pmm::page_to_pa(blk->backing) + index * SMALL_PAGE_SIZE;
+}
+
+page* memory::small_frame_provider::release_locked(block* blk, size_t index)
+{
+	blk->refs[index] = 0;
+	blk->bitmap[index / BITMAP_WORD_BITS] &= ~(1ull << (index % BITMAP_WORD_BITS));
+
+	if (blk->free_count++ == 0)
+	{
+		list_add(&blk->block_link, &partial_);
+	}
+	free_count_++;
+
+	if (blk->free_count != FRAMES_PER_PAGE - 1)
+	{
+		return nullptr;
+	}
+
+	// the whole page is free, give it back
+	list_remove(&blk->block_link);
+	free_count_ -= blk->free_count;
+
+	for (auto w : blk->zeroed)
+	{
+		zeroed_count_ -= __builtin_popcountll(w);
+	}
+
+	page_clear_flag(blk->backing, PHYSICAL_PAGE_FLAG_SPLIT);
+	return blk->backing;
+}
+
+small_frame_provider::block* memory::small_frame_provider::grow_locked()
+{
+	auto pg = physical_memory_manager::instance()->allocate();
+	if (pg == nullptr)
+	{
+		return nullptr;
+	}
+
+	page_set_flag(pg, PHYSICAL_PAGE_FLAG_SPLIT);
+
+	auto blk = reinterpret_cast<block*>(pmm::page_to_va(pg));
+	memset(blk, 0, sizeof(block));
+
+	blk->backing = pg;
+
+	// the first frame holds the header
+	blk->bitmap[0] = 1;
+	blk->free_count = FRAMES_PER_PAGE - 1;
+
+	list_add(&blk->block_link, &partial_);
+	free_count_ += blk->free_count;
+
+	return blk;
+}
+
+uintptr_t memory::small_frame_provider::allocate()
+{
+	uintptr_t pa = 0;
+	bool zeroed = false;
+	{
+		lock_guard g{ lock_ };
+
+		block* blk = nullptr;
+		if (!list_empty(&partial_))
+		{
+			blk = list_entry(partial_.next, block, block_link);
+		}
+		else if ((blk = grow_locked()) == nullptr)
+		{
+			return 0;
+		}
+
+		// prefer a frame which is zeroed in advance
+		size_t index = 0;
+		for (size_t w = 0; w < FRAMES_PER_PAGE / BITMAP_WORD_BITS; w++)
+		{
+			if (blk->zeroed[w] != 0)
+			{
+				index = w * BITMAP_WORD_BITS + __builtin_ctzll(blk->zeroed[w]);
+				zeroed = true;
+				break;
+			}
+		}
+
+		for (size_t w = 0; index == 0 && w < FRAMES_PER_PAGE / BITMAP_WORD_BITS; w++)
+		{
+			if (blk->bitmap[w] != ~0ull)
+			{
+				index = w * BITMAP_WORD_BITS + __builtin_ctzll(~blk->bitmap[w]);
+				break;
+			}
+		}
+
+		KDEBUG_ASSERT(index != 0);
+
+		pa = claim_locked(blk, index);
+	}
+
+	if (!zeroed)
+	{
+		memset(reinterpret_cast<void*>(P2V(pa)), 0, SMALL_PAGE_SIZE);
+	}
+
+	return pa;
+}
+
+void memory::small_frame_provider::get(uintptr_t pa)
+{
+	lock_guard g{ lock_ };
+
+	auto blk = block_of(pa);
+	KDEBUG_ASSERT(page_has_flag(blk->backing, PHYSICAL_PAGE_FLAG_SPLIT));
+	KDEBUG_ASSERT(blk->refs[index_of(pa)] != 0);
+
+	blk->refs[index_of(pa)]++;
+}
+
+size_t memory::small_frame_provider::put(uintptr_t pa)
+{
+	page* release = nullptr;
+	size_t ret = 0;
+	{
+		lock_guard g{ lock_ };
+
+		auto blk = block_of(pa);
+		auto index = index_of(pa);
+
+		KDEBUG_ASSERT(page_has_flag(blk->backing, PHYSICAL_PAGE_FLAG_SPLIT));
+		KDEBUG_ASSERT(blk->refs[index] != 0);
+
+		if ((ret = --blk->refs[index]) != 0)
+		{
+			return ret;
+		}
+
+		release = release_locked(blk, index);
+	}
+
+	if (release != nullptr)
+	{
+		physical_memory_manager::instance()->free(release);
+	}
+
+	return ret;
+}
+
+size_t memory::small_frame_provider::ref(uintptr_t pa) const
+{
+	lock_guard g{ lock_ };
+	return block_of(pa)->refs[index_of(pa)];
+}
+
+size_t memory::small_frame_provider::free_count() const
+{
+	lock_guard g{ lock_ };
+	return free_count_;
+}
+
+size_t memory::small_frame_provider::prezero(size_t budget)
+{
+	uintptr_t frames[PREZERO_BATCH]{};
+	size_t count = 0;
+
+	budget = std::min(budget, PREZERO_BATCH);
+
+	// take the frames as if they were allocated, so that nobody gets them while they are zeroed
+	{
+		lock_guard g{ lock_ };
+
+		for (auto iter = partial_.next; iter != &partial_ && count < budget;)
+		{
+			auto blk = list_entry(iter, block, block_link);
+
+			// claiming the last free frame takes the block off the list
+			iter = iter->next;
+
+			for (size_t w = 0; w < FRAMES_PER_PAGE / BITMAP_WORD_BITS && count < budget; w++)
+			{
+				uint64_t todo = ~(blk->bitmap[w] | blk->zeroed[w]);
+				for (; todo != 0 && count < budget; todo &= todo - 1)
+				{
+					frames[count++] = claim_locked(blk, w * BITMAP_WORD_BITS + __builtin_ctzll(todo));
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		memset(reinterpret_cast<void*>(P2V(frames[i])), 0, SMALL_PAGE_SIZE);
+	}
+
+	// publish them as free and zeroed
+	page* release[PREZERO_BATCH]{};
+	size_t release_count = 0;
+	{
+		lock_guard g{ lock_ };
+
+		for (size_t i = 0; i < count; i++)
+		{
+			auto blk = block_of(frames[i]);
+			auto index = index_of(frames[i]);
+
+			blk->zeroed[index / BITMAP_WORD_BITS] |= (1ull << (index % BITMAP_WORD_BITS));
+			zeroed_count_++;
+
+			if (auto pg = release_locked(blk, index);pg != nullptr)
+			{
+				release[release_count++] = pg;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < release_count; i++)
+	{
+		physical_memory_manager::instance()->free(release[i]);
+	}
+
+	return count;
+}
+
+size_t memory::small_frame_provider::zeroed_count() const
+{
+	lock_guard g{ lock_ };
+	return zeroed_count_;
+}
@@ -20,10 +20,18 @@
 
 #include "memory/address_space.hpp"
 #include "memory/pmm.hpp"
+#include "memory/tlb.hpp"
 
 #include "system/memlayout.h"
+#include "system/pmm.h"
 #include "system/mmu.h"
 
+#include "arch/amd64/cpu/x86.h"
+#include "arch/amd64/cpu/interrupt.h"
+
+#include "fs/vfs/vfs.hpp"
+
+#include <algorithm>
 #include <utility>
 
 #include "kbl/checker/allocate_checker.hpp"
@@ -34,29 +42,45 @@ using namespace vmm;
 using namespace kbl;
 using namespace lock;
 
-address_space_segment::address_space_segment(uintptr_t vm_start, uintptr_t vm_end, uint64_t vm_flags)
-	: start_(vm_start), end_(vm_end), flags_(vm_flags)
+address_space_segment::address_space_segment(uintptr_t vm_start,
+	uintptr_t vm_end,
+	uint64_t vm_flags,
+	file_system::vnode_base* file,
+	size_t file_offset)
+	: start_(vm_start), end_(vm_end), flags_(vm_flags), file_(file), file_offset_(file_offset)
 {
 	KDEBUG_ASSERT(start_ < end_);
+
+	// the file stays open as long as some segment maps it, so that it can't be unlinked and freed
+	if (file_ != nullptr)
+	{
+		file_->increase_open_count();
+	}
 }
 
 address_space_segment::address_space_segment(address_space_segment&& another)
 	: start_(std::exchange(another.start_, 0)),
 	  end_(std::exchange(another.end_, 0)),
-	  flags_(std::exchange(another.flags_, 0))
+	  flags_(std::exchange(another.flags_, 0)),
+	  file_(std::exchange(another.file_, nullptr)),
+	  file_offset_(std::exchange(another.file_offset_, 0))
 {
 	KDEBUG_ASSERT(start_ < end_);
 }
 
 address_space_segment::~address_space_segment()
 {
+	if (file_ != nullptr)
+	{
+		file_->decrease_open_count();
+	}
 }
 
 error_code address_space_segment::resize(uintptr_t start, uintptr_t end)
 {
 	lock_guard g{ lock_ };
 
-	if ((start % PAGE_SIZE) != 0 || (end % PAGE_SIZE) != 0)
+	if ((start % SMALL_PAGE_SIZE) != 0 || (end % SMALL_PAGE_SIZE) != 0)
 	{
 		return -ERROR_INVALID;
 	}
@@ -71,12 +95,99 @@ error_code address_space_segment::resize(uintptr_t start, uintptr_t end)
 		return -ERROR_INVALID;
 	}
 
+	// the pages left keep their place in the file
+	file_offset_ += start - start_;
+
 	start_ = start;
 	end_ = end;
 
 	return ERROR_SUCCESS;
 }
 
+bool address_space_segment::large_page_fit(uintptr_t addr) const
+{
+	// stacks grow a little at a time, and files are cached in small pages
+	if ((flags_ & VM_STACK) || file_ != nullptr)
+	{
+		return false;
+	}
+
+	uintptr_t block = rounddown(addr, PAGE_SIZE);
+	return start_ <= block && block + PAGE_SIZE <= end_;
+}
+
+size_t address_space_segment::fault_around(uintptr_t addr)
+{
+	lock_guard g{ lock_ };
+
+	uintptr_t page = rounddown(addr, SMALL_PAGE_SIZE);
+
+	// the window doubles on sequential faults, and shrinks back on random ones
+	if (page == next_fault_)
+	{
+		fault_around_ = std::min(fault_around_ * 2, FAULT_AROUND_MAX);
+	}
+	else
+	{
+		fault_around_ = 1;
+	}
+
+	// don't cross the vma, or the page table
+	uintptr_t limit = std::min(end_, rounddown(page, PAGE_SIZE) + PAGE_SIZE);
+	size_t count = std::min(fault_around_, (limit - page) / SMALL_PAGE_SIZE);
+
+	next_fault_ = page + count * SMALL_PAGE_SIZE;
+
+	return count;
+}
+
+// share or move pages in [send_base, send_base+size) of from to receive_base of to
+static inline void transfer_fpage(pde_ptr_t from,
+	pde_ptr_t to,
+	uintptr_t send_base,
+	uintptr_t receive_base,
+	size_t size,
+	bool grant)
+{
+	auto pmm_instance = memory::physical_memory_manager::instance();
+
+	for (uintptr_t offset = 0; offset < size;)
+	{
+		uintptr_t src = send_base + offset, dst = receive_base + offset;
+
+		auto pde = vmm::walk_pgdir(from, src, false);
+		if (pde != nullptr && vmm::pde_is_large(pde))
+		{
+			if (src % PAGE_SIZE == 0 && dst % PAGE_SIZE == 0 && offset + PAGE_SIZE <= size)
+			{
+				// the new mapping holds a reference of its own, and a grant drops the one of the source.
+				// A copy-on-write page stays so, or the receiver would write to a page it shares
+				auto perm = (*pde) & (PG_W | PG_U | PG_COW);
+				if (pmm_instance->insert_page(pmm::pde_to_page(pde), dst, perm, to, true) == ERROR_SUCCESS && grant)
+				{
+					pmm_instance->remove_page(src, from);
+				}
+			}
+
+			// a large page can't be transferred in part
+			offset += rounddown(src, PAGE_SIZE) + PAGE_SIZE - src;
+			continue;
+		}
+
+		auto pte = vmm::walk_pgdir_small(from, src, false);
+		if (pte != nullptr && ((*pte) & PG_P))
+		{
+			auto perm = (*pte) & (PG_W | PG_U | PG_COW);
+			if (pmm_instance->insert_small_page(vmm::pde_to_pa(pte), dst, perm, to, true) == ERROR_SUCCESS && grant)
+			{
+				pmm_instance->remove_page(src, from);
+			}
+		}
+
+		offset += SMALL_PAGE_SIZE;
+	}
+}
+
 address_space::address_space()
 {
 }
@@ -84,24 +195,64 @@ address_space::address_space()
 address_space::address_space(address_space&& another)
 	: uheap_begin_(std::exchange(another.uheap_begin_, 0)),
 	  uheap_end_(std::exchange(another.uheap_end_, 0)),
-	  pgdir_(std::exchange(another.pgdir_, nullptr))
+	  pgdir_(std::exchange(another.pgdir_, nullptr)),
+	  segment_index_(std::move(another.segment_index_))
 {
-	for (auto& seg:another.segments)
+	segments.splice(another.segments);
+}
+
+address_space::~address_space()
+{
+	// moved from, or never initialized
+	if (pgdir_ == nullptr)
 	{
-		segments.push_back(seg);
+		return;
 	}
 
-	another.segments.clear();
+	// no thread runs in it any more, so only the pages and tables are left to free
+	for (segment_list_type::iterator_type iter = segments.begin(); iter != segments.end();)
+	{
+		auto& entry = *iter;
+		iter++;
+
+		[[maybe_unused]] auto err = vmm::unmap_range(pgdir_, entry.start(), entry.end());
+
+		remove_vma_locked(&entry);
+		delete &entry;
+	}
+
+	vmm::free_range(pgdir_, 0, USER_TOP + 1);
+
+	// the CPU dropping the last reference may be the last one that ran in it
+	auto state = arch_interrupt_save();
+	if (rcr3() == V2P((uintptr_t)pgdir_))
+	{
+		memory::tlb_activate(vmm::g_kpml4t);
+		vmm::install_kernel_pml4t();
+	}
+	arch_interrupt_restore(state);
+
+	vmm::pgdir_entry_free(pgdir_);
 }
 
-address_space::~address_space()
+error_code_with_result<address_space_segment*> address_space::map(uintptr_t addr, size_t len, uint64_t flags)
 {
+	return map(addr, len, flags, nullptr, 0);
 }
 
-error_code_with_result<address_space_segment*> address_space::map(uintptr_t addr, size_t len, uint64_t flags)
+error_code_with_result<address_space_segment*> address_space::map(uintptr_t addr,
+	size_t len,
+	uint64_t flags,
+	file_system::vnode_base* file,
+	size_t offset)
 {
+	// pages of the file are mapped as a whole
+	if (file != nullptr && (addr - offset) % SMALL_PAGE_SIZE != 0)
+	{
+		return -ERROR_INVALID;
+	}
 
-	uintptr_t start = rounddown(addr, PAGE_SIZE), end = roundup(addr + len, PAGE_SIZE);
+	uintptr_t start = rounddown(addr, SMALL_PAGE_SIZE), end = roundup(addr + len, SMALL_PAGE_SIZE);
 
 	end = std::min(end, USER_TOP);
 
@@ -113,17 +264,25 @@ error_code_with_result<address_space_segment*> address_space::map(uintptr_t addr
 	lock_guard g{ lock_ };
 
 	address_space_segment* vma = nullptr;
-	if ((vma = find_vma_locked(start)) != nullptr && end > vma->start())
+	if ((vma = upper_vma_locked(start)) != nullptr && end > vma->start())
 	{
 		// the vma exists
 		return -ERROR_ALREADY_EXIST;
 	}
 	else
 	{
-		flags &= ~VM_SHARE;
+		// file pages are private. Only segments asking for it, which are channel rings, stay shared across fork
+		if (file != nullptr)
+		{
+			flags &= ~VM_SHARE;
+		}
 
 		kbl::allocate_checker ck{};
-		vma = new(&ck) address_space_segment(start, end, flags);
+		vma = new(&ck) address_space_segment(start,
+			end,
+			flags,
+			file,
+			file != nullptr ? offset - (addr - start) : 0);
 
 		KDEBUG_ASSERT(uintptr_t(& vma) != uintptr_t (&ck));
 
@@ -132,8 +291,11 @@ error_code_with_result<address_space_segment*> address_space::map(uintptr_t addr
 			return -ERROR_MEMORY_ALLOC;
 		}
 
-		insert_vma_locked(vma);
-
+		if (auto ret = insert_vma_locked(vma);ret != ERROR_SUCCESS)
+		{
+			delete vma;
+			return ret;
+		}
 	}
 
 	return vma;
@@ -143,8 +305,8 @@ error_code_with_result<address_space_segment*> address_space::mm_fpage_map(addre
 	const task::ipc::fpage& send,
 	const task::ipc::fpage& receive)
 {
-
-	uint32_t flags = VM_SHARE;
+	// the pages are shared with the sender, but fork copies them like any private memory
+	uint32_t flags = 0;
 
 	if (send.check_rights(task::ipc::AR_W))flags |= VM_WRITE;
 	if (send.check_rights(task::ipc::AR_R))flags |= VM_READ;
@@ -162,17 +324,12 @@ error_code_with_result<address_space_segment*> address_space::mm_fpage_map(addre
 	lock_guard g1{ lock_ };
 	lock_guard g2{ to->lock_ };
 
-	for (auto start = send.get_base_address(); start + PAGE_SIZE <= send.get_base_address() + send.get_size();
-	     start += PAGE_SIZE)
-	{
-		auto pde = vmm::walk_pgdir(pgdir_, start, false);
-
-		auto to_pde = vmm::walk_pgdir(to->pgdir_, start - send.get_base_address() + receive.get_base_address(), true);
-
-		*to_pde = *pde;
-
-		memory::physical_memory_manager::instance()->flush_tlb(to->pgdir_, start);
-	}
+	transfer_fpage(pgdir_,
+		to->pgdir_,
+		send.get_base_address(),
+		receive.get_base_address(),
+		send.get_size(),
+		false);
 
 	return ERROR_SUCCESS;
 }
@@ -181,7 +338,8 @@ error_code_with_result<address_space_segment*> address_space::fpage_grant(addres
 	const task::ipc::fpage& send,
 	const task::ipc::fpage& receive)
 {
-	uint32_t flags = VM_SHARE;
+	// as for map, only channel rings stay shared across fork
+	uint32_t flags = 0;
 	if (send.check_rights(task::ipc::AR_W))flags |= VM_WRITE;
 	if (send.check_rights(task::ipc::AR_R))flags |= VM_READ;
 	if (send.check_rights(task::ipc::AR_X))flags |= VM_EXEC;
@@ -193,31 +351,23 @@ error_code_with_result<address_space_segment*> address_space::fpage_grant(addres
 		return get_error_code(ret);
 	}
 
-	// Remove the vma from the source
-	ret = unmap(send.get_base_address(), send.get_size());
-	if (has_error(ret))
+	// move the pages before the vma is removed, otherwise they are released by unmap
 	{
-		return get_error_code(ret);
+		lock_guard g1{ lock_ };
+		lock_guard g2{ to->lock_ };
+
+		transfer_fpage(pgdir_,
+			to->pgdir_,
+			send.get_base_address(),
+			receive.get_base_address(),
+			send.get_size(),
+			true);
 	}
 
-	// do real map and unmap
-	lock_guard g1{ lock_ };
-	lock_guard g2{ to->lock_ };
-
-	for (auto start = send.get_base_address(); start + PAGE_SIZE <= send.get_base_address() + send.get_size();
-	     start += PAGE_SIZE)
+	// Remove the vma from the source
+	if (auto err = unmap(send.get_base_address(), send.get_size());err != ERROR_SUCCESS)
 	{
-		auto pde = vmm::walk_pgdir(pgdir_, start, false);
-
-		auto to_pde = vmm::walk_pgdir(to->pgdir_, start - send.get_base_address() + receive.get_base_address(), true);
-
-		*to_pde = *pde;
-
-		*pde = 0;
-
-		memory::physical_memory_manager::instance()->flush_tlb(pgdir_, start);
-
-		memory::physical_memory_manager::instance()->flush_tlb(to->pgdir_, start);
+		return err;
 	}
 
 	return ERROR_SUCCESS;
@@ -227,7 +377,7 @@ error_code_with_result<address_space_segment*> address_space::fpage_grant(addres
 error_code address_space::unmap(uintptr_t addr, size_t len)
 {
 
-	uintptr_t start = PAGE_ROUNDDOWN(addr), end = PAGE_ROUNDUP(addr + len);
+	uintptr_t start = SMALL_PAGE_ROUNDDOWN(addr), end = SMALL_PAGE_ROUNDUP(addr + len);
 	if (!VALID_USER_REGION(start, end))
 	{
 		return -ERROR_INVALID;
@@ -235,8 +385,13 @@ error_code address_space::unmap(uintptr_t addr, size_t len)
 
 	lock_guard g{ lock_ };
 
-	auto vma = find_vma_locked(start);
-	if (vma == nullptr || end < vma->start_)
+	return unmap_locked(start, end);
+}
+
+error_code address_space::unmap_locked(uintptr_t start, uintptr_t end)
+{
+	auto vma = upper_vma_locked(start);
+	if (vma == nullptr || end <= vma->start_)
 	{
 		return ERROR_SUCCESS; // no need to remove
 	}
@@ -250,7 +405,7 @@ error_code address_space::unmap(uintptr_t addr, size_t len)
 		//                   |
 		//                 unmap
 		kbl::allocate_checker ck{};
-		auto new_vma = new(&ck) address_space_segment(vma->start_, start, vma->flags_);
+		auto new_vma = new(&ck) address_space_segment(vma->start_, start, vma->flags_, vma->file_, vma->file_offset_);
 
 		KDEBUG_ASSERT(uintptr_t(& new_vma) != uintptr_t (&ck));
 
@@ -259,60 +414,64 @@ error_code address_space::unmap(uintptr_t addr, size_t len)
 			return -ERROR_MEMORY_ALLOC;
 		}
 
+		// the end of the old one, which is the key, doesn't change
 		auto ret = vma->resize(end, vma->end_);
 		if (ret != ERROR_SUCCESS)
 		{
+			delete new_vma;
 			return ret;
 		}
 
-		insert_vma_locked(new_vma);
-
-		unmap_range(pgdir_, start, end);
+		if ((ret = insert_vma_locked(new_vma)) != ERROR_SUCCESS)
+		{
+			vma->start_ = new_vma->start_;
+			vma->file_offset_ = new_vma->file_offset_;
+			delete new_vma;
+			return ret;
+		}
 
-		return ERROR_SUCCESS;
+		return unmap_range(pgdir_, start, end);
 	}
 
-	segment_list_type freelist{};
-
-	for (segment_list_type::iterator_type iter{ &vma->link_ }; iter != segments.end(); iter++)
+	error_code err = ERROR_SUCCESS;
+	for (segment_list_type::iterator_type iter{ &vma->link_ }; iter != segments.end();)
 	{
-		if (iter->start_ >= end)
+		auto& entry = *iter;
+		iter++;
+
+		if (entry.start_ >= end)
 		{
 			break;
 		}
 
-		freelist.push_back(&(*iter));
-	}
-
-	for (auto& entry:freelist)
-	{
-		segments.remove(entry);
-
 		uintptr_t unmap_start = entry.start(), unmap_end = entry.end();
 
 		if (entry.start() < start)
 		{
+			// it stays between its neighbours, so the index is updated in place
 			unmap_start = start;
+			auto updated = segment_index_.update_key(entry.end_, start);
+			KDEBUG_ASSERT(updated);
 			entry.resize(entry.start_, start);
-			insert_vma_locked(&entry);
+		}
+		else if (end < entry.end())
+		{
+			unmap_end = end;
+			entry.resize(end, entry.end());
 		}
 		else
 		{
-			if (end < entry.end())
-			{
-				unmap_end = end;
-				entry.resize(end, entry.end());
-				insert_vma_locked(&entry);
-			}
-			else
-			{
-				delete &entry;
-			}
+			remove_vma_locked(&entry);
+			delete &entry;
+		}
+
+		if (auto unmap_err = unmap_range(pgdir_, unmap_start, unmap_end);unmap_err != ERROR_SUCCESS)
+		{
+			err = unmap_err;
 		}
-		unmap_range(pgdir_, unmap_start, unmap_end);
 	}
 
-	return ERROR_SUCCESS;
+	return err;
 }
 
 error_code_with_result<address_space*> address_space::duplicate()
@@ -328,9 +487,23 @@ error_code_with_result<address_space*> address_space::duplicate()
 		return -ERROR_MEMORY_ALLOC;
 	}
 
+	if (auto ret = to->initialize();ret != ERROR_SUCCESS)
+	{
+		delete to;
+		return ret;
+	}
+
+	lock_guard g2{ to->lock_ };
+
+	to->uheap_ = uheap_;
+	to->uheap_begin_ = uheap_begin_;
+	to->uheap_end_ = uheap_end_;
+
+	// pages are shared copy-on-write unless the segment is shared,
+	// so the cost is proportional to pages written afterwards
 	for (auto& seg:segments)
 	{
-		auto new_seg = new(&ck) address_space_segment(seg.start_, seg.end_, seg.flags_);
+		auto new_seg = new(&ck) address_space_segment(seg.start_, seg.end_, seg.flags_, seg.file_, seg.file_offset_);
 		KDEBUG_ASSERT(uintptr_t(& ck)!=uintptr_t(new_seg));
 
 		if (!ck.check())
@@ -338,9 +511,13 @@ error_code_with_result<address_space*> address_space::duplicate()
 			return -ERROR_MEMORY_ALLOC;
 		}
 
-		to->insert_vma_locked(new_seg);
+		if (auto ret = to->insert_vma_locked(new_seg);ret != ERROR_SUCCESS)
+		{
+			delete new_seg;
+			return ret;
+		}
 
-		copy_range(pgdir_, to->pgdir_, seg.start_, seg.end_);
+		copy_range(pgdir_, to->pgdir_, seg.start_, seg.end_, seg.flags_ & VM_SHARE);
 	}
 
 	return to;
@@ -353,11 +530,11 @@ error_code address_space::resize(uintptr_t addr, size_t len)
 
 }
 
-void address_space::insert_vma(address_space_segment* vma)
+error_code address_space::insert_vma(address_space_segment* vma)
 {
 	lock_guard g{ lock_ };
 
-	insert_vma_locked(vma);
+	return insert_vma_locked(vma);
 }
 
 address_space_segment* address_space::find_vma(uintptr_t addr)
@@ -371,7 +548,7 @@ address_space_segment* address_space::intersect_vma(uintptr_t start, uintptr_t e
 {
 	lock_guard g{ lock_ };
 
-	auto vma = find_vma_locked(start);
+	auto vma = upper_vma_locked(start);
 	if (vma != nullptr && end <= vma->start_)
 	{
 		return nullptr;
@@ -404,65 +581,61 @@ error_code address_space::initialize()
 	return ERROR_SUCCESS;
 }
 
-void address_space::insert_vma_locked(address_space_segment* vma)
+error_code address_space::insert_vma_locked(address_space_segment* vma)
 {
-	if (segments.empty())
+	auto next = upper_vma_locked(vma->start_);
+	auto prev = next == nullptr ? segments.back_ptr() : next->link_.prev_->parent_;
+
+	assert_segment_overlap(prev, vma);
+	assert_segment_overlap(vma, next);
+
+	if (!segment_index_.insert(vma->end_, vma))
 	{
-		segments.push_back(vma);
-		return;
+		return -ERROR_MEMORY_ALLOC;
 	}
 
-	address_space_segment* prev = nullptr;
-	segment_list_type::iterator_type prev_iter;
-	for (auto iter = segments.begin(); iter != segments.end(); iter++)
+	if (next == nullptr)
 	{
-		if (iter->start_ > vma->start_)
-		{
-			break;
-		}
-		prev = &(*iter);
-		prev_iter = iter;
+		segments.push_back(vma);
+	}
+	else
+	{
+		segments.insert(segment_list_type::iterator_type{ next->link_.prev_ }, vma);
 	}
 
-	auto next = prev->link_.next_->parent_;
+	vma->parent_ = this;
 
-	assert_segment_overlap(prev, vma);
-	assert_segment_overlap(vma, next);
+	return ERROR_SUCCESS;
+}
 
-	segments.insert(prev_iter, vma);
+void address_space::remove_vma_locked(address_space_segment* vma)
+{
+	segment_index_.remove(vma->end_);
+	segments.remove(vma);
 
-	vma->parent_ = this;
+	vma->parent_ = nullptr;
 }
 
-address_space_segment* address_space::find_vma_locked(uintptr_t addr)
+address_space_segment* address_space::upper_vma_locked(uintptr_t addr)
 {
-	auto ret = search_cache_;
-
-	if (!(ret != nullptr &&
-		ret->start() <= addr &&
-		ret->end() > addr))
-	{
-		ret = nullptr;
-		for (auto& seg:segments)
-		{
-			if (seg.start() <= addr && seg.end() > addr)
-			{
-				ret = &seg;
-				break;
-			}
-		}
-	}
+	auto ret = segment_index_.upper_bound(addr);
+	return ret == nullptr ? nullptr : *ret;
+}
 
-	if (ret != nullptr)
+address_space_segment* address_space::find_vma_locked(uintptr_t addr)
+{
+	auto vma = upper_vma_locked(addr);
+	if (vma == nullptr || vma->start_ > addr)
 	{
-		search_cache_ = ret;
+		return nullptr;
 	}
 
-	return ret;
+	return vma;
 }
+
 error_code address_space::resize_locked(uintptr_t addr, size_t len) TA_ASSERT(lock_)
 {
-	uintptr_t start = PAGE_ROUNDDOWN(addr), end = PAGE_ROUNDUP((addr + len));
+	uintptr_t start = SMALL_PAGE_ROUNDDOWN(addr), end = SMALL_PAGE_ROUNDUP((addr + len));
 	if (!VALID_USER_REGION(start, end))
 	{
 		return -ERROR_INVALID;
@@ -470,7 +643,7 @@ error_code address_space::resize_locked(uintptr_t addr, size_t len) TA_ASSERT(lo
 
 	error_code ret = ERROR_SUCCESS;
 
-	if ((ret = unmap(start, end - start)) != ERROR_SUCCESS)
+	if ((ret = unmap_locked(start, end)) != ERROR_SUCCESS)
 	{
 		return ret;
 	}
@@ -478,8 +651,11 @@ error_code address_space::resize_locked(uintptr_t addr, size_t len) TA_ASSERT(lo
 	constexpr auto VM_FLAGS = VM_READ | VM_WRITE;
 
 	auto vma = find_vma_locked(start - 1);
-	if (vma != nullptr && vma->end_ == start && vma->flags_ == VM_FLAGS)
+	if (vma != nullptr && vma->end_ == start && vma->flags_ == VM_FLAGS && vma->file_ == nullptr)
 	{
+		auto updated = segment_index_.update_key(vma->end_, end);
+		KDEBUG_ASSERT(updated);
+
 		vma->end_ = end;
 		return ERROR_SUCCESS;
 	}
@@ -495,7 +671,11 @@ error_code address_space::resize_locked(uintptr_t addr, size_t len) TA_ASSERT(lo
 		return -ERROR_MEMORY_ALLOC;
 	}
 
-	insert_vma_locked(vma);
+	if ((ret = insert_vma_locked(vma)) != ERROR_SUCCESS)
+	{
+		delete vma;
+		return ret;
+	}
 
 	return ERROR_SUCCESS;
 }
@@ -40,58 +40,348 @@
 #include "task/process/process.hpp"
 #include "task/thread//thread.hpp"
 
+#include "fs/vfs/vfs.hpp"
+
 #include <cstring>
 #include <algorithm>
 
 using namespace vmm;
 using namespace memory;
 
-static inline error_code page_fault_impl(size_t err, uintptr_t addr)
+// break the sharing of a copy-on-write page on write
+static inline error_code cow_fault(vmm::pde_ptr_t pgdir, uintptr_t addr)
 {
-	auto proc = cur_proc.get();
-	auto vma = proc->address_space()->find_vma(addr);
-	if (vma == nullptr || vma->start() > addr)
+	auto pmm_instance = memory::physical_memory_manager::instance();
+
+	auto pde = vmm::walk_pgdir(pgdir, addr, false);
+	if (pde == nullptr || !((*pde) & PG_P))
+	{
+		return -ERROR_UNKOWN;
+	}
+
+	if (vmm::pde_is_large(pde))
+	{
+		uintptr_t va = rounddown(addr, PAGE_SIZE);
+
+		if (!((*pde) & PG_COW))
+		{
+			if ((*pde) & PG_W)
+			{
+				// another fault broke it first, and only our TLB entry is stale
+				invlpg((void*)va);
+				return ERROR_SUCCESS;
+			}
+
+			return -ERROR_UNKOWN;
+		}
+
+		auto old = pmm::pde_to_page(pde);
+
+		if (page_ref_count(old) == 1)
+		{
+			// we are the last one, so reuse it. Other CPUs gaining the right fault and see it is done
+			*pde = ((*pde) & ~PG_COW) | PG_W;
+			invlpg((void*)va);
+			return ERROR_SUCCESS;
+		}
+
+		auto pg = pmm_instance->allocate();
+		if (pg == nullptr)
+		{
+			return -ERROR_MEMORY_ALLOC;
+		}
+
+		memmove((void*)pmm::page_to_va(pg), (void*)pmm::page_to_va(old), PAGE_SIZE);
+
+		auto perm = ((*pde) & (PG_U | PG_PWT | PG_PCD)) | PG_W;
+		if (auto ret = pmm_instance->insert_page(pg, va, perm, pgdir, true);ret != ERROR_SUCCESS)
+		{
+			pmm_instance->free(pg);
+			return ret;
+		}
+
+		return ERROR_SUCCESS;
+	}
+
+	auto pte = vmm::walk_pgdir_small(pgdir, addr, false);
+	if (pte == nullptr || !((*pte) & PG_P))
 	{
-		return -ERROR_VMA_NOT_FOUND;
+		return -ERROR_UNKOWN;
 	}
 
-	switch (err & 0b11)
+	uintptr_t va = rounddown(addr, SMALL_PAGE_SIZE);
+
+	if (!((*pte) & PG_COW))
 	{
-	default:
-	case 0b10: // write, not persent
-		if (!(vma->flags() & VM_WRITE))
+		if ((*pte) & PG_W)
 		{
-			return -ERROR_PAGE_NOT_PRESENT;
+			invlpg((void*)va);
+			return ERROR_SUCCESS;
 		}
-		break;
-	case 0b01: // read, persent
+
 		return -ERROR_UNKOWN;
-		break;
-	case 0b00: // read not persent
-		if (!(vma->flags() & (VM_READ | VM_EXEC)))
+	}
+	auto old = vmm::pde_to_pa(pte);
+
+	if (pmm_instance->small_ref(old) == 1)
+	{
+		*pte = ((*pte) & ~PG_COW) | PG_W;
+		invlpg((void*)va);
+		return ERROR_SUCCESS;
+	}
+
+	auto pa = pmm_instance->allocate_small();
+	if (pa == 0)
+	{
+		return -ERROR_MEMORY_ALLOC;
+	}
+
+	memmove((void*)P2V(pa), (void*)P2V(old), SMALL_PAGE_SIZE);
+
+	auto perm = ((*pte) & PG_U) | PG_W;
+	auto ret = pmm_instance->insert_small_page(pa, va, perm, pgdir, true);
+
+	// insert_small_page holds its own reference
+	pmm_instance->put_small(pa);
+
+	return ret;
+}
+
+// whether addr is still mapped from the same place of file after the lock was dropped
+static inline bool file_still_mapped(memory::address_space* as,
+	file_system::vnode_base* file,
+	uintptr_t addr,
+	size_t file_pos) TA_REQ(as->fault_lock())
+{
+	auto vma = as->find_vma_locked(addr);
+	return vma != nullptr &&
+		   vma->start() <= addr &&
+		   vma->file() == file &&
+		   addr - vma->start() + vma->file_offset() == file_pos;
+}
+
+// map pages of the file from its page cache. They are private to the address space, so a write
+// gets a copy of its own, and writable pages are otherwise shared copy-on-write.
+// Reading the cache may sleep, so fault_lock is only held to check and fill each entry
+static inline error_code file_fault(memory::address_space* as,
+	vmm::pde_ptr_t pgdir,
+	file_system::vnode_base* file,
+	uintptr_t addr,
+	size_t file_pos,
+	uint64_t shared_perm,
+	size_t count,
+	bool write)
+{
+	auto pmm_instance = memory::physical_memory_manager::instance();
+	auto cache = file->get_page_cache();
+
+	uintptr_t va = rounddown(addr, SMALL_PAGE_SIZE);
+	file_pos = rounddown(file_pos, SMALL_PAGE_SIZE);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		uintptr_t around = va + i * SMALL_PAGE_SIZE;
+
+		auto page_ret = cache->get_page((file_pos + i * SMALL_PAGE_SIZE) / SMALL_PAGE_SIZE);
+		if (has_error(page_ret))
+		{
+			// pages around are only a guess
+			return i == 0 ? get_error_code(page_ret) : ERROR_SUCCESS;
+		}
+
+		auto pa = get_result(page_ret);
+		uintptr_t copy = 0;
+
+		if (write && i == 0)
+		{
+			copy = pmm_instance->allocate_small();
+			if (copy == 0)
+			{
+				pmm_instance->put_small(pa);
+				return -ERROR_MEMORY_ALLOC;
+			}
+
+			memmove((void*)P2V(copy), (void*)P2V(pa), SMALL_PAGE_SIZE);
+		}
+
+		error_code ret = ERROR_SUCCESS;
+		{
+			lock::lock_guard g{ as->fault_lock() };
+
+			// the segment may have been unmapped, or the page mapped by another fault, meanwhile.
+			// The faulting access is simply retried then
+			if (file_still_mapped(as, file, around, file_pos + i * SMALL_PAGE_SIZE))
+			{
+				auto pte = vmm::walk_pgdir_small(pgdir, around, false);
+				if (pte == nullptr || !((*pte) & PG_P))
+				{
+					ret = copy != 0 ?
+						  pmm_instance->insert_small_page(copy, around, PG_U | PG_W, pgdir, false) :
+						  pmm_instance->insert_small_page(pa, around, shared_perm, pgdir, false);
+				}
+			}
+		}
+
+		// the mapping holds its own reference
+		if (copy != 0)
+		{
+			pmm_instance->put_small(copy);
+		}
+		pmm_instance->put_small(pa);
+
+		if (ret != ERROR_SUCCESS)
 		{
-			return -ERROR_PAGE_NOT_PRESENT;
+			return i == 0 ? ret : ERROR_SUCCESS;
 		}
-		break;
 	}
 
+	return ERROR_SUCCESS;
+}
+
+// map anonymous memory of vma
+static inline error_code anonymous_fault(vmm::pde_ptr_t pgdir, address_space_segment* vma, uintptr_t addr)
+{
 	size_t page_perm = PG_U;
 	if (vma->flags() & VM_WRITE)
 	{
 		page_perm |= PG_W;
 	}
 
-	addr = rounddown(addr, PAGE_SIZE);
+	// use a large page only if it's inside the vma and nothing has been mapped around
+	bool use_large = vma->large_page_fit(addr);
+	if (use_large)
+	{
+		auto pde = vmm::walk_pgdir(pgdir, addr, false);
+		use_large = pde == nullptr || !vmm::pde_is_table(pde);
+	}
+
+	auto pmm_instance = memory::physical_memory_manager::instance();
+
+	if (use_large)
+	{
+		auto pde = vmm::walk_pgdir(pgdir, addr, false);
+		if (pde != nullptr && ((*pde) & PG_P))
+		{
+			// another fault has mapped it
+			return ERROR_SUCCESS;
+		}
+
+		auto pg = pmm_instance->allocate_zeroed();
+		if (pg == nullptr)
+		{
+			return -ERROR_MEMORY_ALLOC;
+		}
 
-	auto page_ret =
-		memory::physical_memory_manager::instance()->allocate(addr, page_perm, proc->address_space()->pgdir(), true);
-	if (has_error(page_ret)) // map to any free space
+		if (auto ret = pmm_instance->insert_page(pg, rounddown(addr, PAGE_SIZE), page_perm, pgdir, false);
+			ret != ERROR_SUCCESS)
+		{
+			pmm_instance->free(pg);
+			return ret;
+		}
+	}
+	else
 	{
-		return get_error_code(page_ret);
+		uintptr_t va = rounddown(addr, SMALL_PAGE_SIZE);
+
+		auto pte = vmm::walk_pgdir_small(pgdir, va, false);
+		if (pte == nullptr || !((*pte) & PG_P))
+		{
+			auto frame_ret = pmm_instance->allocate_small(va, page_perm, pgdir, false);
+			if (has_error(frame_ret))
+			{
+				return get_error_code(frame_ret);
+			}
+		}
+
+		// map the following pages as well if the vma is accessed sequentially
+		auto count = vma->fault_around(addr);
+		for (size_t i = 1; i < count; i++)
+		{
+			uintptr_t around = va + i * SMALL_PAGE_SIZE;
+
+			pte = vmm::walk_pgdir_small(pgdir, around, false);
+			if (pte != nullptr && ((*pte) & PG_P))
+			{
+				continue;
+			}
+
+			if (has_error(pmm_instance->allocate_small(around, page_perm, pgdir, false)))
+			{
+				break;
+			}
+		}
 	}
 
 	return ERROR_SUCCESS;
+}
+
+static inline error_code page_fault_impl(memory::address_space* as, size_t err, uintptr_t addr)
+{
+	// pgdir() takes the same lock
+	auto pgdir = as->pgdir();
+
+	file_system::vnode_base* file = nullptr;
+	size_t file_pos = 0, count = 0;
+	uint64_t shared_perm = PG_U;
+
+	{
+		// faults on the same page may race to map or copy it, and the vma may be unmapped meanwhile
+		lock::lock_guard g{ as->fault_lock() };
+
+		auto vma = as->find_vma_locked(addr);
+		if (vma == nullptr || vma->start() > addr)
+		{
+			return -ERROR_VMA_NOT_FOUND;
+		}
+
+		switch (err & 0b11)
+		{
+		case 0b11: // write, present
+			if (!(vma->flags() & VM_WRITE))
+			{
+				return -ERROR_PAGE_NOT_PRESENT;
+			}
+			return cow_fault(pgdir, addr);
+		default:
+		case 0b10: // write, not persent
+			if (!(vma->flags() & VM_WRITE))
+			{
+				return -ERROR_PAGE_NOT_PRESENT;
+			}
+			break;
+		case 0b01: // read, persent
+			return -ERROR_UNKOWN;
+		case 0b00: // read not persent
+			if (!(vma->flags() & (VM_READ | VM_EXEC)))
+			{
+				return -ERROR_PAGE_NOT_PRESENT;
+			}
+			break;
+		}
+
+		if (vma->file() == nullptr)
+		{
+			return anonymous_fault(pgdir, vma, addr);
+		}
+
+		// the segment holds the file open, and so does the fault until it's done
+		file = vma->file();
+		file->increase_open_count();
+
+		file_pos = addr - vma->start() + vma->file_offset();
+		count = vma->fault_around(addr);
+
+		if (vma->flags() & VM_WRITE)
+		{
+			shared_perm |= PG_COW;
+		}
+	}
+
+	auto ret = file_fault(as, pgdir, file, addr, file_pos, shared_perm, count, err & 0b10);
+
+	file->decrease_open_count();
 
+	return ret;
 }
 
 error_code handle_pgfault([[maybe_unused]] trap::trap_frame info)
@@ -110,7 +400,7 @@ error_code handle_pgfault([[maybe_unused]] trap::trap_frame info)
 			cpu->id);
 	}
 
-	error_code ret = page_fault_impl(info.err, addr);
+	error_code ret = page_fault_impl(cur_proc->address_space(), info.err, addr);
 
 	if (ret == -ERROR_VMA_NOT_FOUND)
 	{
@@ -135,4 +425,96 @@ error_code handle_pgfault([[maybe_unused]] trap::trap_frame info)
 	}
 
 	return ret;
-}
\ No newline at end of file
+}
+// the entry mapping va, either a large page or a small page. nullptr if not present
+static inline vmm::pde_ptr_t user_page_entry(vmm::pde_ptr_t pgdir, uintptr_t va)
+{
+	auto pde = vmm::walk_pgdir(pgdir, va, false);
+	if (pde == nullptr || !((*pde) & PG_P))
+	{
+		return nullptr;
+	}
+
+	if (vmm::pde_is_large(pde))
+	{
+		return pde;
+	}
+
+	auto pte = vmm::walk_pgdir_small(pgdir, va, false);
+	if (pte == nullptr || !((*pte) & PG_P))
+	{
+		return nullptr;
+	}
+
+	return pte;
+}
+
+error_code vmm::handle_user_fault(memory::address_space* as, uintptr_t addr, bool write)
+{
+	size_t err = write ? 0b10 : 0b00;
+	if (user_page_entry(as->pgdir(), addr) != nullptr)
+	{
+		err |= 0b01;
+	}
+
+	return page_fault_impl(as, err, addr);
+}
+
+error_code_with_result<uintptr_t> vmm::user_va_pin(memory::address_space* as, uintptr_t va, bool write)
+{
+	if (!VALID_USER_PTR(va))
+	{
+		return -ERROR_INVALID_ACCESS;
+	}
+
+	auto pmm_instance = memory::physical_memory_manager::instance();
+
+	for (bool faulted = false;; faulted = true)
+	{
+		auto pgdir = as->pgdir();
+
+		{
+			// look up and pin at once, so that the frame can't be unmapped and freed in between
+			lock::lock_guard g{ as->fault_lock() };
+
+			if (auto entry = user_page_entry(pgdir, va);entry != nullptr &&
+				((*entry) & PG_U) &&
+				(!write || ((*entry) & PG_W)))
+			{
+				if (vmm::pde_is_large(vmm::walk_pgdir(pgdir, va, false)))
+				{
+					page_ref_get(pmm::pde_to_page(entry));
+					return vmm::pde_to_pa(entry) + (va & (PAGE_SIZE - 1));
+				}
+
+				pmm_instance->get_small(vmm::pde_to_pa(entry));
+				return vmm::pde_to_pa(entry) + (va & (SMALL_PAGE_SIZE - 1));
+			}
+		}
+
+		if (faulted)
+		{
+			return -ERROR_INVALID_ACCESS;
+		}
+
+		if (auto err = handle_user_fault(as, va, write);err != ERROR_SUCCESS)
+		{
+			return err;
+		}
+	}
+}
+
+void vmm::user_pa_unpin(uintptr_t pa)
+{
+	auto pmm_instance = memory::physical_memory_manager::instance();
+
+	auto pg = pmm::pa_to_page(pa);
+	if (page_has_flag(pg, PHYSICAL_PAGE_FLAG_SPLIT))
+	{
+		pmm_instance->put_small(rounddown(pa, SMALL_PAGE_SIZE));
+	}
+	else if (page_ref_put(pg) == 0)
+	{
+		pmm_instance->free(pg);
+	}
+}
@@ -37,6 +37,7 @@
 #include "debug/kdebug.h"
 
 #include "memory/pmm.hpp"
+#include "memory/tlb.hpp"
 
 #include "ktl/span.hpp"
 
@@ -66,41 +67,88 @@ static inline constexpr size_t remove_flags(vmm::pde_t pde)
 	return (pde >> FLAGS_SHIFT) << FLAGS_SHIFT;
 }
 
-static inline void do_free_range_pgdir(pde_ptr_t pdpte)
+// the table an entry of an upper level points to
+static inline pde_ptr_t entry_table(pde_ptr_t entry)
 {
-	auto pgdir = reinterpret_cast<decltype(pdpte)>(P2V(remove_flags(*pdpte)));
+	return reinterpret_cast<pde_ptr_t>(P2V(vmm::pde_to_pa(entry)));
+}
 
-	*pgdir = 0;
-	vmm::pgdir_entry_free(pgdir);
+static inline bool table_empty(pde_ptr_t table)
+{
+	for (size_t i = 0; i < PGTABLE_SIZE / sizeof(vmm::pde_t); i++)
+	{
+		if (table[i] != 0)
+		{
+			return false;
+		}
+	}
+	return true;
 }
 
-static inline void do_free_range_pdpt(pde_ptr_t pml4e, uintptr_t st, uintptr_t ed)
+// the page tables under pdpte in [st, ed) are freed, and so is the page directory once it's empty
+static inline void do_free_range_pgdir(pde_ptr_t pdpte, uintptr_t st, uintptr_t ed, memory::tlb_batch& batch)
 {
-	auto pdpt = reinterpret_cast<decltype(pml4e)>(P2V(remove_flags(*pml4e)));
+	auto pgdir = entry_table(pdpte);
 
-	for (uintptr_t addr = st; addr <= ed; addr += PDPT_SIZE)
+	for (uintptr_t addr = st; addr < ed; addr = rounddown(addr, PAGE_SIZE) + PAGE_SIZE)
 	{
-		auto pdpte = &pdpt[P3X(addr)];
-		do_free_range_pgdir(pdpte);
+		auto pde = &pgdir[P2X(addr)];
+		if (vmm::pde_is_table(pde))
+		{
+			KDEBUG_ASSERT(table_empty(entry_table(pde)));
 
+			batch.release_table(entry_table(pde));
+			*pde = 0;
+		}
+	}
+
+	if (table_empty(pgdir))
+	{
+		batch.release_table(pgdir);
 		*pdpte = 0;
-		vmm::pgdir_entry_free(pdpte);
+	}
+}
+
+static inline void do_free_range_pdpt(pde_ptr_t pml4e, uintptr_t st, uintptr_t ed, memory::tlb_batch& batch)
+{
+	auto pdpt = entry_table(pml4e);
+
+	for (uintptr_t addr = st; addr < ed;)
+	{
+		uintptr_t next = std::min(rounddown(addr, PDPT_SIZE) + PDPT_SIZE, ed);
+
+		auto pdpte = &pdpt[P3X(addr)];
+		if (((*pdpte) & PG_P) && !((*pdpte) & PG_PS))
+		{
+			do_free_range_pgdir(pdpte, addr, next, batch);
+		}
+
+		addr = next;
+	}
+
+	if (table_empty(pdpt))
+	{
+		batch.release_table(pdpt);
+		*pml4e = 0;
 	}
 }
 
 static inline void do_free_range_pml4t(pde_ptr_t pml4t, uintptr_t st, uintptr_t ed)
 {
-// traversal all the pml4e concerned
-	for (uintptr_t addr = st; addr <= ed; addr += PML4T_SIZE)
+	memory::tlb_batch batch{ pml4t };
+
+	// traversal all the pml4e concerned
+	for (uintptr_t addr = st; addr < ed;)
 	{
+		uintptr_t next = std::min(rounddown(addr, PML4T_SIZE) + PML4T_SIZE, ed);
+
 		pde_ptr_t pml4e = &pml4t[P4X(addr)];
 		if ((*pml4e) & PG_P)
 		{
-			do_free_range_pdpt(pml4e, st, ed);
-
-			*pml4e = 0;
-			vmm::pgdir_entry_free(pml4e);
+			do_free_range_pdpt(pml4e, addr, next, batch);
 		}
+
+		addr = next;
 	}
 }
 
@@ -204,6 +252,97 @@ static inline pde_ptr_t walk_pgdir(const pde_ptr_t pml4t,
 	return pde;
 }
 
+// find the pte of a small page corresponding to the given va
+static inline pde_ptr_t walk_pgtable(const pde_ptr_t pml4t,
+	uintptr_t vaddr,
+	bool create_if_not_exist = false,
+	size_t perm = 0)
+{
+	auto pde = walk_pgdir(pml4t, vaddr, create_if_not_exist, perm);
+	if (pde == nullptr)
+	{
+		return nullptr;
+	}
+
+	pde_ptr_t pgtable = nullptr;
+	if (!(*pde & PG_P))
+	{
+		if (!create_if_not_exist)
+		{
+			return nullptr;
+		}
+
+		pgtable = vmm::pgdir_entry_alloc();
+		if (pgtable == nullptr)
+		{
+			return nullptr;
+		}
+
+		memset(pgtable, 0, PGTABLE_SIZE);
+		*pde = ((V2P((uintptr_t)pgtable)) | PG_P | PG_U | perm);
+	}
+	else if (*pde & PG_PS)
+	{
+		// covered by a large page
+		return nullptr;
+	}
+	else
+	{
+		pgtable = reinterpret_cast<decltype(pgtable)>(P2V(remove_flags(*pde)));
+	}
+
+	return &pgtable[P1X(vaddr)];
+}
+
+// replace a large page with small frames holding a copy of its content,
+// so that part of it can be unmapped
+static inline error_code demote_large_page(pde_ptr_t pgdir, pde_ptr_t pde, uintptr_t va)
+{
+	KDEBUG_ASSERT(vmm::pde_is_large(pde));
+
+	auto pmm_instance = memory::physical_memory_manager::instance();
+
+	auto large = pmm::pde_to_page(pde);
+	auto perm = (*pde) & (PG_W | PG_U | PG_PWT | PG_PCD);
+	auto source = reinterpret_cast<uint8_t*>(pmm::page_to_va(large));
+
+	auto pgtable = vmm::pgdir_entry_alloc();
+	if (pgtable == nullptr)
+	{
+		return -ERROR_MEMORY_ALLOC;
+	}
+
+	memset(pgtable, 0, PGTABLE_SIZE);
+
+	for (size_t i = 0; i < PTENTRIES_COUNT; i++)
+	{
+		auto pa = pmm_instance->allocate_small();
+		if (pa == 0)
+		{
+			for (size_t j = 0; j < i; j++)
+			{
+				pmm_instance->put_small(vmm::pde_to_pa(&pgtable[j]));
+			}
+
+			vmm::pgdir_entry_free(pgtable);
+			return -ERROR_MEMORY_ALLOC;
+		}
+
+		memmove(reinterpret_cast<void*>(P2V(pa)), source + i * SMALL_PAGE_SIZE, SMALL_PAGE_SIZE);
+		pgtable[i] = pa | PG_P | perm;
+	}
+
+	*pde = ((V2P((uintptr_t)pgtable)) | PG_P | PG_U | PG_W);
+	pmm_instance->flush_tlb(pgdir, rounddown(va, PAGE_SIZE));
+
+	if (page_ref_put(large) == 0)
+	{
+		pmm_instance->free(large);
+	}
+
+	return ERROR_SUCCESS;
+}
+
 // this method maps the specific va
 static inline error_code map_page(pde_ptr_t pml4, uintptr_t va, uintptr_t pa, size_t perm)
 {
@@ -265,44 +404,127 @@ void vmm::pgdir_entry_free(vmm::pde_ptr_t entry)
 	kmem_cache_free(pgdir_cache, entry);
 }
 
-void vmm::unmap_range(pde_ptr_t pgdir, uintptr_t start, uintptr_t end)
+error_code vmm::unmap_range(pde_ptr_t pgdir, uintptr_t start, uintptr_t end)
 {
-	KDEBUG_ASSERT(start % PAGE_SIZE == 0 && end % PAGE_SIZE == 0);
+	KDEBUG_ASSERT(start % SMALL_PAGE_SIZE == 0 && end % SMALL_PAGE_SIZE == 0);
 	KDEBUG_ASSERT(VALID_USER_REGION(start, end));
 
-	for (uintptr_t addr = start; addr <= end; addr += PAGE_SIZE)
+	// frames are released after all CPUs dropped their translations
+	memory::tlb_batch batch{ pgdir };
+
+	for (uintptr_t addr = start; addr < end;)
 	{
-		auto pte = walk_pgdir(pgdir, addr, false);
+		uintptr_t block = rounddown(addr, PAGE_SIZE), block_end = std::min(block + PAGE_SIZE, end);
+
+		auto pde = walk_pgdir(pgdir, addr, false);
+		if (pde == nullptr || !((*pde) & PG_P))
+		{
+			addr = block + PAGE_SIZE;
+			continue;
+		}
 
-		if ((*pte) & PG_P)
+		if (vmm::pde_is_large(pde))
 		{
-			*pte = 0;
-			memory::physical_memory_manager::instance()->flush_tlb(pgdir, addr);
+			if (addr == block && block_end == block + PAGE_SIZE)
+			{
+				batch.release_page(pmm::pde_to_page(pde));
+				*pde = 0;
+				batch.invalidate(block);
+
+				addr = block_end;
+				continue;
+			}
+
+			// only a part of the large page is unmapped
+			if (auto ret = demote_large_page(pgdir, pde, block);ret != ERROR_SUCCESS)
+			{
+				return ret;
+			}
+		}
+
+		for (; addr < block_end; addr += SMALL_PAGE_SIZE)
+		{
+			auto pte = walk_pgtable(pgdir, addr, false);
+			if (pte != nullptr && ((*pte) & PG_P))
+			{
+				batch.release_small(vmm::pde_to_pa(pte));
+				*pte = 0;
+				batch.invalidate(addr);
+			}
+		}
+
+		// a table with nothing left to map is freed, so that a long-lived address space doesn't pile them up
+		if (vmm::pde_is_table(pde) && table_empty(entry_table(pde)))
+		{
+			batch.release_table(entry_table(pde));
+			*pde = 0;
+			batch.invalidate(block);
 		}
 	}
+
+	return ERROR_SUCCESS;
 }
 
-// the range must be unmapped
+// the range must be unmapped. The end may be just above USER_TOP to free all of them
 void vmm::free_range(pde_ptr_t pml4t, uintptr_t start, uintptr_t end)
 {
 	KDEBUG_ASSERT(start % PAGE_SIZE == 0 && end % PAGE_SIZE == 0);
-	KDEBUG_ASSERT(VALID_USER_REGION(start, end));
+	KDEBUG_ASSERT(start < end && end - 1 <= USER_TOP);
 
 	do_free_range_pml4t(pml4t, start, end);
 }
 
-void vmm::copy_range(pde_ptr_t from, pde_ptr_t to, uintptr_t start, uintptr_t end)
+void vmm::copy_range(pde_ptr_t from, pde_ptr_t to, uintptr_t start, uintptr_t end, bool share)
 {
-	for (uintptr_t addr = start; addr <= end; addr += PAGE_SIZE)
+	auto pmm_instance = memory::physical_memory_manager::instance();
+
+	// write-protect the entry in the source, and get the permission for both
+	auto make_cow = [pmm_instance, from, share](pde_ptr_t entry, uintptr_t va)
 	{
-		auto pte = walk_pgdir(from, addr, false);
+	  if (share)
+	  {
+		  return *entry & (PG_U | PG_W);
+	  }
+
+	  if ((*entry) & PG_W)
+	  {
+		  *entry = ((*entry) & ~PG_W) | PG_COW;
+		  pmm_instance->flush_tlb(from, va);
+	  }
+	  return *entry & (PG_U | PG_COW);
+	};
+
+	for (uintptr_t addr = start; addr < end;)
+	{
+		uintptr_t block = rounddown(addr, PAGE_SIZE), block_end = std::min(block + PAGE_SIZE, end);
+
+		auto pde = walk_pgdir(from, addr, false);
+		if (pde == nullptr || !((*pde) & PG_P))
+		{
+			addr = block + PAGE_SIZE;
+			continue;
+		}
 
-		if ((*pte) & PG_P)
+		if (vmm::pde_is_large(pde))
 		{
-			auto perm = *pte & (PG_P | PG_W | PG_U);
+			auto perm = make_cow(pde, block);
 
-			memory::physical_memory_manager::instance()->insert_page(pmm::pde_to_page(pte), addr, perm, to, true);
-//			pmm::page_insert(to, true, pmm::pde_to_page(pte), addr, perm);
+			pmm_instance->insert_page(pmm::pde_to_page(pde), block, perm, to, true);
+//			pmm::page_insert(to, true, pmm::pde_to_page(pde), addr, perm);
+
+			addr = block + PAGE_SIZE;
+			continue;
+		}
+
+		for (; addr < block_end; addr += SMALL_PAGE_SIZE)
+		{
+			auto pte = walk_pgtable(from, addr, false);
+			if (pte != nullptr && ((*pte) & PG_P))
+			{
+				auto perm = make_cow(pte, addr);
+
+				pmm_instance->insert_small_page(vmm::pde_to_pa(pte), addr, perm, to, true);
+			}
 		}
 	}
 }
@@ -332,8 +554,9 @@ void vmm::duplicate_kernel_pml4t(OUT pde_ptr_t pml4t)
 
 uintptr_t vmm::pde_to_pa(pde_ptr_t pde)
 {
-	constexpr size_t FLAGS_SHIFT = 8;
-	return ((((*pde) >> FLAGS_SHIFT) << FLAGS_SHIFT) & (~PG_PS));
+	// bits above the flags may be used by software, such as PG_COW
+	constexpr uintptr_t ADDRESS_MASK = 0x000F'FFFF'FFFF'F000;
+	return (*pde) & ADDRESS_MASK;
 }
 
 pde_ptr_t vmm::walk_pgdir(pde_ptr_t pgdir, size_t va, bool create)
@@ -341,6 +564,21 @@ pde_ptr_t vmm::walk_pgdir(pde_ptr_t pgdir, size_t va, bool create)
 	return ::walk_pgdir(pgdir, va, create, PG_U | PG_W);
 }
 
+pde_ptr_t vmm::walk_pgdir_small(pde_ptr_t pgdir, size_t va, bool create)
+{
+	return ::walk_pgtable(pgdir, va, create, PG_U | PG_W);
+}
+
+bool vmm::pde_is_large(pde_ptr_t pde)
+{
+	return ((*pde) & PG_P) && ((*pde) & PG_PS);
+}
+
+bool vmm::pde_is_table(pde_ptr_t pde)
+{
+	return ((*pde) & PG_P) && !((*pde) & PG_PS);
+}
+
 // When called by pmm, first map [0,2GiB] to [KERNEL_VIRTUALBASE,KERNEL_VIRTUALEND]
 // and then map all the memories to PHYREMAP_VIRTUALBASE
 
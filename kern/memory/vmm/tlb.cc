@@ -0,0 +1,271 @@
+// Copyright (c) 2021 SmartPolarBear
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "memory/tlb.hpp"
+#include "memory/pmm.hpp"
+
+#include "system/memlayout.h"
+#include "system/mmu.h"
+#include "system/pmm.h"
+
+#include "arch/amd64/cpu/x86.h"
+#include "arch/amd64/cpu/intrinsics.hpp"
+
+#include "drivers/acpi/cpu.h"
+#include "drivers/apic/apic.h"
+#include "drivers/apic/local_apic.hpp"
+
+#include "debug/kdebug.h"
+
+#include "arch/amd64/lock/arch_spinlock.hpp"
+
+using namespace memory;
+
+// the pgdir each CPU has loaded
+static vmm::pde_ptr_t active_pgdirs[CPU_COUNT_LIMIT]{};
+
+// only one shootdown is in flight at a time
+static struct
+{
+	vmm::pde_ptr_t pgdir;
+	const uintptr_t* vas;
+	size_t count;
+
+	size_t pending; // count of CPUs which haven't acknowledged
+} request;
+
+static bool request_pending[CPU_COUNT_LIMIT]{};
+static size_t shootdown_in_flight{ 0 };
+
+// taken with interrupts disabled by ourselves, so the arch lock is enough
+static lock::arch_spinlock shootdown_lock = lock::ARCH_SPINLOCK_INITIAL;
+
+static inline void flush_local(vmm::pde_ptr_t pgdir, const uintptr_t* vas, size_t count)
+{
+	if (pgdir != vmm::g_kpml4t && rcr3() != V2P((uintptr_t)pgdir))
+	{
+		return;
+	}
+
+	if (vas == nullptr)
+	{
+		lcr3(rcr3());
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		invlpg((void*)vas[i]);
+	}
+}
+
+void memory::tlb_activate(vmm::pde_ptr_t pgdir)
+{
+	__atomic_store_n(&active_pgdirs[cpu->id], pgdir, __ATOMIC_SEQ_CST);
+}
+
+void memory::tlb_shootdown_poll()
+{
+	if (__atomic_load_n(&shootdown_in_flight, __ATOMIC_ACQUIRE) == 0 || !cpu.is_valid())
+	{
+		return;
+	}
+
+	if (!__atomic_exchange_n(&request_pending[cpu->id], false, __ATOMIC_ACQ_REL))
+	{
+		return;
+	}
+
+	flush_local(request.pgdir, request.vas, request.count);
+
+	__atomic_fetch_sub(&request.pending, 1, __ATOMIC_RELEASE);
+}
+
+error_code memory::tlb_shootdown_handle([[maybe_unused]] trap::trap_frame info)
+{
+	tlb_shootdown_poll();
+	return ERROR_SUCCESS;
+}
+
+void memory::tlb_shootdown(vmm::pde_ptr_t pgdir, const uintptr_t* vas, size_t count) TA_NO_THREAD_SAFETY_ANALYSIS
+{
+	// stay on this CPU
+	auto state = arch_interrupt_save();
+
+	flush_local(pgdir, vas, count);
+
+	if (!cpu.is_valid() || valid_cpus.size() <= 1)
+	{
+		arch_interrupt_restore(state);
+		return;
+	}
+
+	// the entries are modified before the active pgdirs are read,
+	// so a CPU loading pgdir later sees the new entries
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	bool targets[CPU_COUNT_LIMIT]{};
+	size_t target_count = 0;
+	for (auto& c : valid_cpus)
+	{
+		if (c.id == cpu->id || !c.started)
+		{
+			continue;
+		}
+
+		if (pgdir == vmm::g_kpml4t || __atomic_load_n(&active_pgdirs[c.id], __ATOMIC_SEQ_CST) == pgdir)
+		{
+			targets[c.id] = true;
+			target_count++;
+		}
+	}
+
+	// the address space is only active here, the local flush is all it takes
+	if (target_count == 0)
+	{
+		arch_interrupt_restore(state);
+		return;
+	}
+
+	// others may be waiting for us to acknowledge their shootdown
+	while (lock::arch_spinlock_try_lock(&shootdown_lock))
+	{
+		tlb_shootdown_poll();
+		arch::cpu_yield();
+	}
+
+	request.pgdir = pgdir;
+	request.vas = vas;
+	request.count = count;
+	__atomic_store_n(&request.pending, target_count, __ATOMIC_RELEASE);
+
+	__atomic_fetch_add(&shootdown_in_flight, 1, __ATOMIC_ACQ_REL);
+
+	for (auto& c : valid_cpus)
+	{
+		if (targets[c.id])
+		{
+			__atomic_store_n(&request_pending[c.id], true, __ATOMIC_RELEASE);
+			apic::local_apic::apic_send_ipi(c.apicid,
+				apic::local_apic::DLM_FIXED,
+				trap::IRQ_TO_TRAPNUM(trap::IRQ_TLB_SHOOTDOWN));
+		}
+	}
+
+	// interrupts stay disabled while waiting, so whatever is pending for this CPU is served here
+	while (__atomic_load_n(&request.pending, __ATOMIC_ACQUIRE) != 0)
+	{
+		tlb_shootdown_poll();
+		arch::cpu_yield();
+	}
+
+	__atomic_fetch_sub(&shootdown_in_flight, 1, __ATOMIC_ACQ_REL);
+
+	lock::arch_spinlock_unlock(&shootdown_lock);
+
+	arch_interrupt_restore(state);
+}
+
+memory::tlb_batch::tlb_batch(vmm::pde_ptr_t pgdir)
+	: pgdir_(pgdir)
+{
+}
+
+memory::tlb_batch::~tlb_batch()
+{
+	flush();
+}
+
+void memory::tlb_batch::invalidate(uintptr_t va)
+{
+	if (va_count_ < MAX_PAGES)
+	{
+		vas_[va_count_++] = va;
+	}
+	else
+	{
+		full_flush_ = true;
+	}
+}
+
+void memory::tlb_batch::release_small(uintptr_t pa)
+{
+	if (small_count_ == MAX_RELEASES)
+	{
+		flush();
+	}
+
+	smalls_[small_count_++] = pa;
+}
+
+void memory::tlb_batch::release_page(page* pg)
+{
+	if (page_count_ == MAX_RELEASES)
+	{
+		flush();
+	}
+
+	pages_[page_count_++] = pg;
+}
+
+void memory::tlb_batch::release_table(vmm::pde_ptr_t table)
+{
+	if (table_count_ == MAX_RELEASES)
+	{
+		flush();
+	}
+
+	tables_[table_count_++] = table;
+}
+
+void memory::tlb_batch::flush()
+{
+	if (va_count_ != 0 || full_flush_ || table_count_ != 0)
+	{
+		// invalidating any address drops the cached paging structures as well
+		tlb_shootdown(pgdir_, (full_flush_ || va_count_ == 0) ? nullptr : vas_, va_count_);
+
+		va_count_ = 0;
+		full_flush_ = false;
+	}
+
+	// no CPU can reach them now
+	auto pmm_instance = physical_memory_manager::instance();
+	for (size_t i = 0; i < small_count_; i++)
+	{
+		pmm_instance->put_small(smalls_[i]);
+	}
+	small_count_ = 0;
+
+	for (size_t i = 0; i < page_count_; i++)
+	{
+		if (page_ref_put(pages_[i]) == 0)
+		{
+			pmm_instance->free(pages_[i]);
+		}
+	}
+	page_count_ = 0;
+
+	for (size_t i = 0; i < table_count_; i++)
+	{
+		vmm::pgdir_entry_free(tables_[i]);
+	}
+	table_count_ = 0;
+}
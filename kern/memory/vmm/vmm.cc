@@ -37,6 +37,8 @@
 #include "drivers/console/console.h"
 #include "debug/kdebug.h"
 
+#include "memory/tlb.hpp"
+
 #include <cstring>
 #include <algorithm>
 
@@ -74,6 +76,10 @@ void vmm::init_vmm(void)
 	trap::trap_handle_register(trap::TRAP_PGFLT, trap::trap_handle{
 		.handle = handle_pgfault,
 		.enable = true });
+
+	trap::trap_handle_register(trap::IRQ_TO_TRAPNUM(trap::IRQ_TLB_SHOOTDOWN), trap::trap_handle{
+		.handle = memory::tlb_shootdown_handle,
+		.enable = true });
 }
 
 //bool vmm::check_user_memory(IN mm_struct* mm, uintptr_t addr, size_t len, bool writable)
@@ -2,6 +2,10 @@
 
 #include "task/process/process.hpp"
 
+#include "system/kmalloc.hpp"
+
+#include "arch/amd64/cpu/intrinsics.hpp"
+
 using namespace object;
 using namespace lock;
 
@@ -13,53 +17,87 @@ handle_table::handle_table() : local_{ true }, parent_{ nullptr }
 handle_table::handle_table(global_handle_table_tag)
 	: local_{ false }, parent_{ nullptr }
 {
-	table_cache_ = memory::kmem::kmem_cache_create("handle_table", sizeof(table));
+	table_cache_ = memory::kmem::kmem_cache_create("handle_table", sizeof(slot_page));
 
 	initialize_table();
 }
 
 handle_table::handle_table(dispatcher* parent) : local_{ true }, parent_{ parent }
 {
-	table_cache_ = memory::kmem::kmem_cache_create("handle_table", sizeof(table));
+	table_cache_ = memory::kmem::kmem_cache_create("handle_table", sizeof(slot_page));
 
 	initialize_table();
 }
 
 void handle_table::initialize_table()
 {
-	root_.next[0] = new(memory::kmem::kmem_cache_alloc(table_cache_)) table{};
-	root_.next[0]->next[0] = new(memory::kmem::kmem_cache_alloc(table_cache_)) table{};
-	root_.next[0]->next[0]->next[0] = new(memory::kmem::kmem_cache_alloc(table_cache_)) table{};
-	root_.next[0]->next[0]->next[0]->entry[0] = nullptr;
+	auto mem = memory::kmem::kmem_cache_alloc(table_cache_);
+
+	free_head_ = NO_SLOT;
+	high_water_.store(0, ktl::memory_order_relaxed);
 
-	memset(&next_, 0, sizeof(next_));
+	reverse_capacity_ = REVERSE_INDEX_MIN_CAPACITY;
+	reverse_count_ = 0;
+	reverse_ = static_cast<reverse_entry*>(memory::kmalloc(sizeof(reverse_entry) * reverse_capacity_, 0));
+
+	if (!mem || !reverse_)
+	{
+		KDEBUG_GENERALPANIC("Cannot allocate the handle table");
+	}
+
+	directory_ = new(mem) directory{};
+
+	memset(reverse_, 0, sizeof(reverse_entry) * reverse_capacity_);
 }
 
-error_code_with_result<std::tuple<size_t, size_t, size_t, size_t>> handle_table::first_free()
+handle_table::slot* handle_table::slot_at(uint32_t index) const
 {
-	for (size_t l1 = 0; l1 <= next_.l1; l1++)
+	return &directory_->pages[index / SLOTS_PER_PAGE]->slots[index % SLOTS_PER_PAGE];
+}
+
+error_code_with_result<uint32_t> handle_table::allocate_slot()
+{
+	if (free_head_ != NO_SLOT)
 	{
-		for (size_t l2 = 0; l2 <= next_.l2; l2++)
-		{
-			for (size_t l3 = 0; l3 <= next_.l3; l3++)
-			{
-				for (size_t l4 = 0; l4 < next_.l4; l4++)
-				{
-					if (!root_.next[l1]->next[l2]->next[l3]->entry[l4])
-					{
-						return std::make_tuple(l1, l2, l3, l4);
-					}
-				}
-			}
-		}
+		auto index = free_head_;
+		free_head_ = slot_at(index)->next_free;
+		return index;
+	}
+
+	auto index = high_water_.load(ktl::memory_order_relaxed);
+	if (index >= MAX_HANDLE_PER_TABLE)
+	{
+		return -ERROR_TOO_MANY_HANDLES;
 	}
-	auto[l1, l2, l3, l4]=next_;
-	if (auto err = increase_next();err != ERROR_SUCCESS)
+
+	auto& page = directory_->pages[index / SLOTS_PER_PAGE];
+	if (!page)
 	{
-		return err;
+		auto mem = memory::kmem::kmem_cache_alloc(table_cache_);
+		if (!mem)
+		{
+			return -ERROR_MEMORY_ALLOC;
+		}
+
+		page = new(mem) slot_page{};
 	}
 
-	return std::make_tuple(l1, l2, l3, l4);
+	high_water_.store(index + 1, ktl::memory_order_release);
+	return index;
+}
+
+void handle_table::free_slot(uint32_t index)
+{
+	auto s = slot_at(index);
+
+	s->object.store(nullptr, ktl::memory_order_relaxed);
+	s->entry.store(nullptr, ktl::memory_order_relaxed);
+
+	auto generation = s->generation.load(ktl::memory_order_relaxed);
+	s->generation.store((generation + 1) & ((1u << HANDLE_GENERATION_BITS) - 1), ktl::memory_order_seq_cst);
+
+	s->next_free = free_head_;
+	free_head_ = index;
 }
 
 handle_type handle_table::add_handle(handle_entry_owner owner)
@@ -89,50 +127,64 @@ handle_type handle_table::add_handle_locked(handle_entry_owner owner)
 	else attr |= HATTR_GLOBAL;
 	KDEBUG_ASSERT(owner.get());
 
-	handle_entry* ptr = nullptr;
-	if (auto local_value = local_get_locked(owner.get());!local_value)
+	if (auto existing = local_get_locked(owner.get());existing)
 	{
-		ptr = owner.release();
+		// the object is already in this table, hand out the handle it already has.
+		// the new entry isn't needed, and its reference to the object is dropped with it
+		return MAKE_HANDLE(attr, *existing, slot_at(*existing)->generation.load(ktl::memory_order_relaxed));
+	}
 
-		if (auto find_res = allocate_slot();!has_error(find_res))
-		{
-			auto[l1, l2, l3, l4]= get_result(find_res);
-			root_.next[l1]->next[l2]->next[l3]->entry[l4] = ptr;
-			ptr->value_ = MAKE_HANDLE(attr, l1, l2, l3, l4);
-		}
-		else
-		{
-			KDEBUG_GERNERALPANIC_CODE(get_error_code(find_res));
-		}
+	auto find_res = allocate_slot();
+	if (has_error(find_res))
+	{
+		KDEBUG_GERNERALPANIC_CODE(get_error_code(find_res));
 	}
-	else
+
+	auto index = get_result(find_res);
+	if (auto err = reverse_insert(owner->ptr_, index);err != ERROR_SUCCESS)
 	{
-		ptr = owner.release();
+		free_slot(index);
+		KDEBUG_GERNERALPANIC_CODE(err);
 	}
 
+	auto ptr = owner.release();
+	auto s = slot_at(index);
+
+	ptr->value_ = MAKE_HANDLE(attr, index, s->generation.load(ktl::memory_order_relaxed));
+
+	s->entry.store(ptr, ktl::memory_order_release);
+	s->object.store(ptr->ptr_, ktl::memory_order_release);
+
 	return ptr->value_;
 }
 
 handle_type handle_table::entry_to_handle(handle_entry* ptr) const
 {
-//	uint16_t attr = 0;
-//
-//	if (local_)attr |= HATTR_LOCAL_PROC;
-//	else attr |= HATTR_GLOBAL;
-//	return MAKE_HANDLE(attr, (uintptr_t)&ptr->link_);
 	return ptr->value_;
 }
 
 handle_entry_owner handle_table::remove_handle(handle_type h)
 {
-	lock::lock_guard g{ lock_ };
-	return remove_handle_locked(h);
+	handle_entry_owner ret{ nullptr };
+	{
+		lock::lock_guard g{ lock_ };
+		ret = remove_handle_locked(h);
+	}
+
+	wait_for_readers();
+	return ret;
 }
 
 handle_entry_owner handle_table::remove_handle(handle_entry* e)
 {
-	lock::lock_guard g{ lock_ };
-	return remove_handle_locked(e);
+	handle_entry_owner ret{ nullptr };
+	{
+		lock::lock_guard g{ lock_ };
+		ret = remove_handle_locked(e);
+	}
+
+	wait_for_readers();
+	return ret;
 }
 
 handle_entry_owner handle_table::remove_handle_locked(handle_type h)
@@ -148,31 +200,16 @@ handle_entry_owner handle_table::remove_handle_locked(handle_type h)
 
 handle_entry_owner handle_table::remove_handle_locked(handle_entry* e)
 {
-
-	if (!local_exist_locked(e))
+	auto index = local_get_locked(e);
+	if (!index)
 	{
 		return handle_entry_owner(e);
 	}
 
-	for (size_t l1 = 0; l1 <= next_.l1; l1++)
-	{
-		for (size_t l2 = 0; l2 <= next_.l2; l2++)
-		{
-			for (size_t l3 = 0; l3 <= next_.l3; l3++)
-			{
-				for (size_t l4 = 0; l4 < next_.l4; l4++)
-				{
-					auto slot = root_.next[l1]->next[l2]->next[l3]->entry[l4];
-					if (slot && slot->ptr_ == e->ptr_)
-					{
-						root_.next[l1]->next[l2]->next[l3]->entry[l4] = nullptr;
-					}
-				}
-			}
-		}
-	}
-
-//	handles_.remove(e);
+	// a lockless lookup may still be taking a reference to the object through the slot.
+	// the caller waits for it with the lock dropped before it drops the entry's reference
+	reverse_erase(e->ptr_);
+	free_slot(*index);
 
 	e->owner_process_id = -1;
 	e->parent_ = nullptr;
@@ -189,88 +226,122 @@ handle_entry* handle_table::get_handle_entry(handle_type h)
 
 handle_entry* handle_table::get_handle_entry_locked(handle_type h)
 {
-	auto[attr, l1, l2, l3, l4] = DISASSEMBLE_HANDLE(h);
+	auto[attr, index, generation] = DISASSEMBLE_HANDLE(h);
 
 	if ((attr & HATTR_GLOBAL) && local_)return nullptr;
 
-	KDEBUG_ASSERT(l1 <= next_.l1);
-	KDEBUG_ASSERT(l2 <= next_.l2);
-	KDEBUG_ASSERT(l3 <= next_.l3);
-	KDEBUG_ASSERT(l4 <= next_.l4);
+	if (index >= high_water_.load(ktl::memory_order_relaxed))
+	{
+		return nullptr;
+	}
+
+	auto s = slot_at(index);
+
+	// the slot was freed, and possibly reused, since this handle was made
+	if (s->generation.load(ktl::memory_order_relaxed) != generation)
+	{
+		return nullptr;
+	}
 
-	return root_.next[l1]->next[l2]->next[l3]->entry[l4];
+	return s->entry.load(ktl::memory_order_relaxed);
 }
 
-bool handle_table::local_exist_locked(handle_entry* owner) TA_REQ(lock_)
+dispatcher* handle_table::reference_object(handle_type h)
 {
-	for (size_t l1 = 0; l1 <= next_.l1; l1++)
+	auto[attr, index, generation] = DISASSEMBLE_HANDLE(h);
+
+	if ((attr & HATTR_GLOBAL) && local_)return nullptr;
+
+	// the reader count pairs with wait_for_readers: either we see the generation bumped by
+	// free_slot, or the remover sees us and keeps the entry's reference alive until we leave
+	auto intr = arch_interrupt_save();
+	auto& readers = readers_[cpu.is_valid() ? cpu->id : 0].count;
+	readers.fetch_add(1, ktl::memory_order_seq_cst);
+
+	dispatcher* obj = nullptr;
+	bool stale = false;
+
+	if (index < high_water_.load(ktl::memory_order_seq_cst))
 	{
-		for (size_t l2 = 0; l2 <= next_.l2; l2++)
+		auto s = slot_at(index);
+		if (s->generation.load(ktl::memory_order_seq_cst) == generation)
 		{
-			for (size_t l3 = 0; l3 <= next_.l3; l3++)
+			obj = s->object.load(ktl::memory_order_acquire);
+			if (obj && !obj->try_add_ref())
 			{
-				for (size_t l4 = 0; l4 < next_.l4; l4++)
-				{
-					auto slot = root_.next[l1]->next[l2]->next[l3]->entry[l4];
-					if (slot && slot->ptr_ == owner->ptr_)
-					{
-						return true;
-					}
-				}
+				obj = nullptr;
 			}
 		}
+
+		// the slot may have been freed and refilled between the two generation loads
+		stale = obj && s->generation.load(ktl::memory_order_acquire) != generation;
+	}
+
+	readers.fetch_sub(1, ktl::memory_order_release);
+	arch_interrupt_restore(intr);
+
+	if (stale)
+	{
+		if (obj->release())
+		{
+			delete obj;
+		}
+		return nullptr;
 	}
 
-	return false;
+	return obj;
 }
 
-std::optional<std::tuple<size_t, size_t, size_t, size_t>> handle_table::local_get_locked(handle_entry* owner) TA_REQ(
-	lock_)
+void handle_table::wait_for_readers() const
 {
-	for (size_t l1 = 0; l1 <= next_.l1; l1++)
+	// a lookup starting after the scan of its CPU sees the slot already freed
+	for (auto& r : readers_)
 	{
-		for (size_t l2 = 0; l2 <= next_.l2; l2++)
+		while (r.count.load(ktl::memory_order_seq_cst) != 0)
 		{
-			for (size_t l3 = 0; l3 <= next_.l3; l3++)
-			{
-				for (size_t l4 = 0; l4 < next_.l4; l4++)
-				{
-					auto slot = root_.next[l1]->next[l2]->next[l3]->entry[l4];
-					if (slot && slot->ptr_ == owner->ptr_)
-					{
-						return std::make_tuple(l1, l2, l3, l4);
-					}
-				}
-			}
+			arch::cpu_yield();
 		}
 	}
+}
+
+bool handle_table::local_exist_locked(handle_entry* owner) TA_REQ(lock_)
+{
+	return reverse_find(owner->ptr_).has_value();
+}
+
+std::optional<uint32_t> handle_table::local_get_locked(handle_entry* owner) TA_REQ(lock_)
+{
+	if (auto pos = reverse_find(owner->ptr_);pos)
+	{
+		return reverse_[*pos].index;
+	}
 
 	return std::nullopt;
 }
 
 void handle_table::clear()
 {
+	auto count = high_water_.exchange(0, ktl::memory_order_seq_cst);
+	wait_for_readers();
 
-	for (size_t l1 = 0; l1 <= next_.l1; l1++)
+	for (uint32_t i = 0; i < count; i++)
 	{
-		for (size_t l2 = 0; l2 <= next_.l2; l2++)
+		handle_entry_owner discard{ slot_at(i)->entry.load(ktl::memory_order_relaxed) };
+		// the deleter is called
+	}
+
+	for (auto page: directory_->pages)
+	{
+		if (page)
 		{
-			for (size_t l3 = 0; l3 <= next_.l3; l3++)
-			{
-				for (size_t l4 = 0; l4 < next_.l4; l4++)
-				{
-					auto slot = root_.next[l1]->next[l2]->next[l3]->entry[l4];
-					handle_entry_owner discard{ slot };
-					// the deleter is called
-				}
-				memory::kmem::kmem_cache_free(table_cache_, root_.next[l1]->next[l2]->next[l3]);
-			}
-			memory::kmem::kmem_cache_free(table_cache_, root_.next[l1]->next[l2]);
+			memory::kmem::kmem_cache_free(table_cache_, page);
 		}
-		memory::kmem::kmem_cache_free(table_cache_, root_.next[l1]);
 	}
 
-	initialize_table(); // reinitialize the first slot
+	memory::kmem::kmem_cache_free(table_cache_, directory_);
+	memory::kfree(reverse_);
+
+	initialize_table(); // reinitialize the empty table
 }
 
 handle_entry* handle_table::query_handle_by_name(ktl::string_view name)
@@ -281,87 +352,116 @@ handle_entry* handle_table::query_handle_by_name(ktl::string_view name)
 
 handle_entry* handle_table::query_handle_by_name_locked(ktl::string_view name) TA_REQ(lock_)
 {
-
-	for (size_t l1 = 0; l1 <= next_.l1; l1++)
+	return query_handle_locked([&name](const handle_entry& h)
 	{
-		for (size_t l2 = 0; l2 <= next_.l2; l2++)
-		{
-			for (size_t l3 = 0; l3 <= next_.l3; l3++)
-			{
-				for (size_t l4 = 0; l4 < next_.l4; l4++)
-				{
-					auto slot = root_.next[l1]->next[l2]->next[l3]->entry[l4];
-					if (slot && name.compare(slot->name_.data()) == 0)
-					{
-						return slot;
-					}
-				}
-			}
-		}
-	}
-
-	return nullptr;
+	  return name.compare(h.name_.data()) == 0;
+	});
 }
 
-std::tuple<int, int> handle_table::increase_next_cur(size_t value)
+size_t handle_table::reverse_hash(const dispatcher* key, size_t capacity)
 {
-	auto new_value = value + 1;
-	return { new_value >= MAX_HANDLE_PER_TABLE, new_value % MAX_HANDLE_PER_TABLE };
+	return (((uintptr_t)key * 0x9E3779B97F4A7C15ull) >> 32u) & (capacity - 1);
 }
 
-error_code handle_table::increase_next()
+std::optional<size_t> handle_table::reverse_find(const dispatcher* key) const TA_REQ(lock_)
 {
-	if (auto[c4, v4] = increase_next_cur(next_.l4);c4)
+	auto mask = reverse_capacity_ - 1;
+	for (auto i = reverse_hash(key, reverse_capacity_); reverse_[i].key; i = (i + 1) & mask)
 	{
-		if (auto[c3, v3]=increase_next_cur(next_.l3);c3)
+		if (reverse_[i].key == key)
 		{
-			if (auto[c2, v2]=increase_next_cur(next_.l2);c2)
-			{
-				if (auto[c1, v1]=increase_next_cur(next_.l1);c1)
-				{
-					next_.l1 = v1;
-					return -ERROR_TOO_MANY_HANDLES;
-				}
-				else
-				{
-					next_.l1 = v1;
-				}
-				next_.l2 = v2;
-			}
-			else
-			{
-				next_.l2 = v2;
-			}
-			next_.l3 = v3;
+			return i;
 		}
-		else
+	}
+
+	return std::nullopt;
+}
+
+error_code handle_table::reverse_insert(dispatcher* key, uint32_t index) TA_REQ(lock_)
+{
+	// keep the load factor at or below one half so probe sequences stay short
+	if ((reverse_count_ + 1) * 2 > reverse_capacity_)
+	{
+		if (auto err = reverse_rehash(reverse_capacity_ * 2);err != ERROR_SUCCESS)
 		{
-			next_.l3 = v3;
+			return err;
 		}
-		next_.l4 = v4;
 	}
-	else
+
+	auto mask = reverse_capacity_ - 1;
+	auto i = reverse_hash(key, reverse_capacity_);
+	while (reverse_[i].key)
 	{
-		next_.l4 = v4;
+		i = (i + 1) & mask;
 	}
 
+	reverse_[i] = reverse_entry{ key, index };
+	reverse_count_++;
+
 	return ERROR_SUCCESS;
 }
-error_code_with_result<std::tuple<size_t, size_t, size_t, size_t>> handle_table::allocate_slot()
+
+void handle_table::reverse_erase(const dispatcher* key) TA_REQ(lock_)
 {
-	auto free = first_free();
-	if (has_error(free))
+	auto pos = reverse_find(key);
+	if (!pos)
 	{
-		return free;
+		return;
 	}
 
-	if (auto err = increase_next();err != ERROR_SUCCESS)
+	// backward-shift deletion: pull later members of the probe run into the hole so that
+	// lookups never need tombstones
+	auto mask = reverse_capacity_ - 1;
+	auto hole = *pos;
+	for (auto i = (hole + 1) & mask; reverse_[i].key; i = (i + 1) & mask)
 	{
-		return err;
+		auto home = reverse_hash(reverse_[i].key, reverse_capacity_);
+
+		bool stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+		if (stays)
+		{
+			continue;
+		}
+
+		reverse_[hole] = reverse_[i];
+		hole = i;
 	}
 
-	return free;
+	reverse_[hole] = reverse_entry{ nullptr, 0 };
+	reverse_count_--;
 }
 
+error_code handle_table::reverse_rehash(size_t new_capacity) TA_REQ(lock_)
+{
+	auto table = static_cast<reverse_entry*>(memory::kmalloc(sizeof(reverse_entry) * new_capacity, 0));
+	if (!table)
+	{
+		return -ERROR_MEMORY_ALLOC;
+	}
+
+	memset(table, 0, sizeof(reverse_entry) * new_capacity);
+
+	auto mask = new_capacity - 1;
+	for (size_t i = 0; i < reverse_capacity_; i++)
+	{
+		if (!reverse_[i].key)
+		{
+			continue;
+		}
 
+		auto pos = reverse_hash(reverse_[i].key, new_capacity);
+		while (table[pos].key)
+		{
+			pos = (pos + 1) & mask;
+		}
+
+		table[pos] = reverse_[i];
+	}
 
+	memory::kfree(reverse_);
+
+	reverse_ = table;
+	reverse_capacity_ = new_capacity;
+
+	return ERROR_SUCCESS;
+}
@@ -78,3 +78,18 @@ handle_entry* object_manager::get_global_handle_entry(handle_type handle)
 	handle = get_global_handle(handle);
 	return global_handle_table_->get_handle_entry(handle);
 }
+
+dispatcher_ref<dispatcher> object_manager::reference_object(handle_type handle)
+{
+	if (HANDLE_HAS_ATTRIBUTE(handle, HATTR_LOCAL_PROC))
+	{
+		if (!cur_proc.is_valid() || cur_proc == nullptr)
+		{
+			return {};
+		}
+
+		return dispatcher_ref<dispatcher>{ cur_proc->handle_table()->reference_object(handle) };
+	}
+
+	return dispatcher_ref<dispatcher>{ global_handle_table_->reference_object(handle) };
+}
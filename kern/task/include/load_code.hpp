@@ -6,8 +6,15 @@
 
 #include "task/process/process.hpp"
 
+#include "fs/vfs/vfs.hpp"
+
 
 error_code load_binary(IN task::process* proc,
 	IN uint8_t* bin,
 	IN size_t bin_sz,
-	OUT uintptr_t* entry_addr);
\ No newline at end of file
+	OUT uintptr_t* entry_addr);
+
+/// \brief load an ELF binary from a file. Read-only segments are mapped from the page cache of the file
+error_code load_binary(IN task::process* proc,
+	IN file_system::vnode_base* file,
+	OUT uintptr_t* entry_addr);
@@ -41,5 +41,19 @@ DEF_SYSCALL_HANDLE(sys_ipc_receive);
 DEF_SYSCALL_HANDLE(sys_ipc_store);
 DEF_SYSCALL_HANDLE(sys_ipc_accept);
 DEF_SYSCALL_HANDLE(sys_ipc_wait);
+DEF_SYSCALL_HANDLE(sys_ipc_call);
+DEF_SYSCALL_HANDLE(sys_ipc_reply_wait);
+DEF_SYSCALL_HANDLE(sys_ipc_call_short);
+DEF_SYSCALL_HANDLE(sys_ipc_reply_wait_short);
+
+// task/ipc/syscall/channel.cc
+DEF_SYSCALL_HANDLE(sys_channel_create);
+DEF_SYSCALL_HANDLE(sys_channel_map);
+DEF_SYSCALL_HANDLE(sys_channel_wait);
+DEF_SYSCALL_HANDLE(sys_channel_notify);
+
+// user/syscall/implements/lockstat.cc
+DEF_SYSCALL_HANDLE(sys_lockstat_read);
+DEF_SYSCALL_HANDLE(sys_lockstat_reset);
 
 #undef DEF_SYSCALL_HANDLE
\ No newline at end of file
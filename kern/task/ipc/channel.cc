@@ -0,0 +1,165 @@
+#include "task/ipc/channel.hpp"
+
+#include "task/thread/thread.hpp"
+
+#include "system/memlayout.h"
+#include "system/mmu.h"
+#include "system/kmalloc.hpp"
+
+#include "memory/pmm.hpp"
+
+#include "kbl/lock/lock_guard.hpp"
+#include "kbl/checker/allocate_checker.hpp"
+
+#include <cstring>
+
+using namespace task;
+using namespace task::ipc;
+
+using namespace lock;
+
+error_code_with_result<channel*> task::ipc::channel::create(size_t capacity)
+{
+	if (capacity < CAPACITY_MIN || capacity > CAPACITY_MAX || (capacity & (capacity - 1)) != 0)
+	{
+		return -ERROR_INVALID;
+	}
+
+	kbl::allocate_checker ck{};
+	auto ret = new(&ck) channel{ capacity };
+	if (!ck.check())
+	{
+		return -ERROR_MEMORY_ALLOC;
+	}
+
+	auto frames = static_cast<uintptr_t*>(memory::kmalloc(sizeof(uintptr_t) * ret->frame_count_, 0));
+	if (frames == nullptr)
+	{
+		delete ret;
+		return -ERROR_MEMORY_ALLOC;
+	}
+
+	memset(frames, 0, sizeof(uintptr_t) * ret->frame_count_);
+	ret->frames_ = frames;
+
+	auto pmm_instance = memory::physical_memory_manager::instance();
+	for (size_t i = 0; i < ret->frame_count_; i++)
+	{
+		ret->frames_[i] = pmm_instance->allocate_small();
+		if (ret->frames_[i] == 0)
+		{
+			delete ret;
+			return -ERROR_MEMORY_ALLOC;
+		}
+	}
+
+	// frames are zeroed, so only the capacity and the sequence numbers are to be set
+	auto header = reinterpret_cast<channel_header*>(P2V(ret->frames_[0]));
+	header->capacity = capacity;
+
+	for (size_t i = 0; i < capacity; i++)
+	{
+		auto offset = CHANNEL_HEADER_SIZE + i * sizeof(channel_slot);
+		auto slot = reinterpret_cast<channel_slot*>(P2V(ret->frames_[offset / SMALL_PAGE_SIZE]) +
+			offset % SMALL_PAGE_SIZE);
+		slot->sequence = i;
+	}
+
+	return ret;
+}
+
+task::ipc::channel::channel(size_t capacity)
+	: capacity_(capacity),
+	  frame_count_(roundup(channel_size(capacity), SMALL_PAGE_SIZE) / SMALL_PAGE_SIZE)
+{
+}
+
+task::ipc::channel::~channel()
+{
+	if (frames_ == nullptr)
+	{
+		return;
+	}
+
+	// address spaces mapping the ring hold references of their own
+	auto pmm_instance = memory::physical_memory_manager::instance();
+	for (size_t i = 0; i < frame_count_; i++)
+	{
+		if (frames_[i] != 0)
+		{
+			pmm_instance->put_small(frames_[i]);
+		}
+	}
+
+	memory::kfree(frames_);
+}
+
+error_code task::ipc::channel::map(memory::address_space* as, uintptr_t addr)
+{
+	if (addr % SMALL_PAGE_SIZE != 0)
+	{
+		return -ERROR_INVALID;
+	}
+
+	auto size = frame_count_ * SMALL_PAGE_SIZE;
+	if (!VALID_USER_PTR(addr) || !VALID_USER_PTR(addr + size - 1))
+	{
+		return -ERROR_INVALID_ACCESS;
+	}
+
+	if (auto ret = as->map(addr, size, memory::VM_READ | memory::VM_WRITE | memory::VM_SHARE);has_error(ret))
+	{
+		return get_error_code(ret);
+	}
+
+	auto pmm_instance = memory::physical_memory_manager::instance();
+	for (size_t i = 0; i < frame_count_; i++)
+	{
+		if (auto err = pmm_instance->insert_small_page(frames_[i],
+				addr + i * SMALL_PAGE_SIZE,
+				PG_U | PG_W,
+				as->pgdir(),
+				false);
+			err != ERROR_SUCCESS)
+		{
+			as->unmap(addr, size);
+			return err;
+		}
+	}
+
+	return ERROR_SUCCESS;
+}
+
+bool task::ipc::channel::empty_locked() const
+{
+	auto header = reinterpret_cast<channel_header*>(P2V(frames_[0]));
+	auto head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+	auto offset = CHANNEL_HEADER_SIZE + (head & (capacity_ - 1)) * sizeof(channel_slot);
+	auto slot = reinterpret_cast<channel_slot*>(P2V(frames_[offset / SMALL_PAGE_SIZE]) + offset % SMALL_PAGE_SIZE);
+
+	return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != head + 1;
+}
+
+error_code task::ipc::channel::wait(const deadline& ddl)
+{
+	lock_guard g{ global_thread_lock };
+
+	// notify() takes the same lock, so a message sent after this check can't be missed
+	while (empty_locked())
+	{
+		if (auto err = waiters_.block(wait_queue::interruptible::Yes, ddl);err != ERROR_SUCCESS)
+		{
+			return err;
+		}
+	}
+
+	return ERROR_SUCCESS;
+}
+
+void task::ipc::channel::notify()
+{
+	lock_guard g{ global_thread_lock };
+
+	waiters_.wake_all(true, ERROR_SUCCESS);
+}
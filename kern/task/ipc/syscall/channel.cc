@@ -0,0 +1,122 @@
+#include "syscall.h"
+#include "syscall/syscall_args.hpp"
+#include "syscall/args_validation.hpp"
+
+#include "system/mmu.h"
+#include "system/syscall.h"
+#include "system/memlayout.h"
+
+#include "debug/kdebug.h"
+
+#include "task/process/process.hpp"
+#include "task/thread/thread.hpp"
+#include "task/ipc/channel.hpp"
+
+#include "object/handle_table.hpp"
+#include "object/handle_entry.hpp"
+#include "object/object_manager.hpp"
+
+using namespace task;
+using namespace syscall;
+using namespace object;
+
+error_code sys_channel_create(const syscall_regs* regs)
+{
+	auto out = args_get<handle_type*, 0>(regs);
+	auto capacity = args_get<size_t, 1>(regs);
+
+	if (!arg_valid_pointer(out))
+	{
+		return -ERROR_INVALID;
+	}
+
+	auto ret = ipc::channel::create(capacity);
+	if (has_error(ret))
+	{
+		return get_error_code(ret);
+	}
+
+	auto chan = get_result(ret);
+
+	auto handle = handle_entry::create("channel", chan);
+	if (!handle)
+	{
+		delete chan;
+		return -ERROR_MEMORY_ALLOC;
+	}
+
+	auto local_handle = handle_entry::duplicate(handle.get());
+
+	object_manager::global_handles()->add_handle(std::move(handle));
+	*out = object_manager::get_global_handle(cur_proc->handle_table()->add_handle(std::move(local_handle)));
+
+	if (*out == INVALID_HANDLE_VALUE)
+	{
+		return -ERROR_INVALID;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+error_code sys_channel_map(const syscall_regs* regs)
+{
+	auto h = args_get<handle_type, 0>(regs);
+	auto addr = args_get<uintptr_t, 1>(regs);
+	auto capacity_out = args_get<size_t*, 2>(regs);
+
+	if (capacity_out != nullptr && !arg_valid_pointer(capacity_out))
+	{
+		return -ERROR_INVALID;
+	}
+
+	auto chan = object_manager::reference_object<ipc::channel>(h);
+	if (!chan)
+	{
+		return -ERROR_INVALID;
+	}
+
+	if (auto err = chan->map(cur_proc->address_space(), addr);err != ERROR_SUCCESS)
+	{
+		return err;
+	}
+
+	if (capacity_out != nullptr)
+	{
+		*capacity_out = chan->capacity();
+	}
+
+	return ERROR_SUCCESS;
+}
+
+error_code sys_channel_wait(const syscall_regs* regs)
+{
+	auto h = args_get<handle_type, 0>(regs);
+	auto timeout = args_get<time_type, 1>(regs);
+
+	auto chan = object_manager::reference_object<ipc::channel>(h);
+	if (!chan)
+	{
+		return -ERROR_INVALID;
+	}
+
+	global_thread_lock.assert_not_held();
+
+	return chan->wait(deadline::after(timeout));
+}
+
+error_code sys_channel_notify(const syscall_regs* regs)
+{
+	auto h = args_get<handle_type, 0>(regs);
+
+	auto chan = object_manager::reference_object<ipc::channel>(h);
+	if (!chan)
+	{
+		return -ERROR_INVALID;
+	}
+
+	global_thread_lock.assert_not_held();
+
+	chan->notify();
+
+	return ERROR_SUCCESS;
+}
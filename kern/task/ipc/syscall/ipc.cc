@@ -30,9 +30,7 @@ error_code sys_ipc_load_message(const syscall_regs* regs)
 
 	global_thread_lock.assert_not_held();
 
-	cur_thread->get_ipc_state()->load_message(msg);
-
-	return ERROR_SUCCESS;
+	return cur_thread->get_ipc_state()->load_message(msg);
 }
 
 error_code sys_ipc_send(const syscall_regs* regs)
@@ -43,21 +41,18 @@ error_code sys_ipc_send(const syscall_regs* regs)
 	auto proc = cur_proc.get();
 	auto thrd = cur_thread.get();
 
-	auto handle_entry = object::object_manager::get_global_handle_entry(target_handle);
-
-	if (auto ret = object::object_manager::object_from_handle<thread>(handle_entry);has_error(ret))
+	if (auto target = object::object_manager::reference_object<thread>(target_handle);!target)
 	{
-		return get_error_code(ret);
+		return -ERROR_INVALID;
 	}
 	else
 	{
-		auto target = get_result(ret);
 
 		KDEBUG_ASSERT(target->get_koid() != thrd->get_koid());
 
 		global_thread_lock.assert_not_held();
 
-		auto err = thrd->get_ipc_state()->send(target, deadline::after(timeout));
+		auto err = thrd->get_ipc_state()->send(target.get(), deadline::after(timeout));
 		if (err != ERROR_SUCCESS)
 		{
 			KDEBUG_GERNERALPANIC_CODE(err);
@@ -76,18 +71,16 @@ error_code sys_ipc_receive(const syscall_regs* regs)
 
 	auto proc = cur_proc.get();
 
-	auto handle_entry = object::object_manager::get_global_handle_entry(from_handle);
-	if (auto ret = object::object_manager::object_from_handle<thread>(handle_entry);has_error(ret))
+	if (auto from = object::object_manager::reference_object<thread>(from_handle);!from)
 	{
-		return get_error_code(ret);
+		return -ERROR_INVALID;
 	}
 	else
 	{
-		auto from = get_result(ret);
 
 		global_thread_lock.assert_not_held();
 
-		auto err = cur_thread->get_ipc_state()->receive(from, deadline::after(timeout));
+		auto err = cur_thread->get_ipc_state()->receive(from.get(), deadline::after(timeout));
 		if (err != ERROR_SUCCESS)
 		{
 			KDEBUG_GERNERALPANIC_CODE(err); //FIXME
@@ -143,3 +136,206 @@ error_code sys_ipc_wait(const syscall_regs* regs)
 
 	return err;
 }
+
+error_code sys_ipc_call(const syscall_regs* regs)
+{
+	auto target_handle = args_get<object::handle_type, 0>(regs);
+	auto msg = args_get<task::ipc::message*, 1>(regs);
+	auto timeout = args_get<time_type, 2>(regs);
+
+	if (!VALID_USER_PTR(reinterpret_cast<uintptr_t>(msg)))
+	{
+		return -ERROR_INVALID;
+	}
+
+	if (auto target = object::object_manager::reference_object<thread>(target_handle);!target)
+	{
+		return -ERROR_INVALID;
+	}
+	else
+	{
+		auto state = cur_thread->get_ipc_state();
+
+		global_thread_lock.assert_not_held();
+
+		if (auto err = state->load_message(msg);err != ERROR_SUCCESS)
+		{
+			return err;
+		}
+
+		if (auto err = state->call(target.get(), deadline::after(timeout));err != ERROR_SUCCESS)
+		{
+			return err;
+		}
+
+		state->store_message(msg, false);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+error_code sys_ipc_reply_wait(const syscall_regs* regs)
+{
+	auto msg = args_get<task::ipc::message*, 0>(regs);
+	auto from = args_get<object::koid_type*, 1>(regs);
+	auto timeout = args_get<time_type, 2>(regs);
+
+	if (!VALID_USER_PTR(reinterpret_cast<uintptr_t>(msg)))
+	{
+		return -ERROR_INVALID;
+	}
+
+	if (from != nullptr && !VALID_USER_PTR(reinterpret_cast<uintptr_t>(from)))
+	{
+		return -ERROR_INVALID;
+	}
+
+	auto state = cur_thread->get_ipc_state();
+
+	global_thread_lock.assert_not_held();
+
+	if (auto err = state->load_message(msg);err != ERROR_SUCCESS)
+	{
+		return err;
+	}
+
+	if (auto err = state->reply_wait(deadline::after(timeout));err != ERROR_SUCCESS)
+	{
+		return err;
+	}
+
+	state->store_message(msg, false);
+
+	if (from != nullptr)
+	{
+		*from = state->get_sender()->get_koid();
+	}
+
+	return ERROR_SUCCESS;
+}
+
+// registers carrying a short message, which are restored to the user by syscall_x64_entry
+static constexpr uint64_t syscall_regs::* SHORT_MESSAGE_REGS[] = {
+	&syscall_regs::r10, // tag
+	&syscall_regs::r8,
+	&syscall_regs::r9,
+	&syscall_regs::r12,
+	&syscall_regs::r13,
+	&syscall_regs::r14,
+	&syscall_regs::r15,
+};
+
+static_assert(sizeof(SHORT_MESSAGE_REGS) / sizeof(SHORT_MESSAGE_REGS[0]) == ipc::SHORT_MESSAGE_ITEMS_MAX + 1);
+
+static error_code load_short_message(const syscall_regs* regs)
+{
+	ipc::message_register_type mrs[ipc::SHORT_MESSAGE_ITEMS_MAX + 1]{};
+
+	for (size_t i = 0; i <= ipc::SHORT_MESSAGE_ITEMS_MAX; i++)
+	{
+		mrs[i] = regs->*SHORT_MESSAGE_REGS[i];
+	}
+
+	auto tag = static_cast<ipc::message_tag>(mrs[0]);
+	if (tag.typed_count() != 0 || tag.untyped_count() > ipc::SHORT_MESSAGE_ITEMS_MAX)
+	{
+		return -ERROR_INVALID;
+	}
+
+	return cur_thread->get_ipc_state()->load_short_message(mrs);
+}
+
+/// \brief store the received message to registers, or to msg if it doesn't fit in
+static void store_short_message(const syscall_regs* regs, task::ipc::message* msg)
+{
+	auto state = cur_thread->get_ipc_state();
+	auto out = const_cast<syscall_regs*>(regs);
+
+	ipc::message_register_type mrs[ipc::SHORT_MESSAGE_ITEMS_MAX + 1]{};
+	if (!state->store_short_message(mrs))
+	{
+		state->store_message(msg, false);
+	}
+
+	// the tag is always passed back, so the user knows where to find the items
+	for (size_t i = 0; i <= ipc::SHORT_MESSAGE_ITEMS_MAX; i++)
+	{
+		out->*SHORT_MESSAGE_REGS[i] = mrs[i];
+	}
+}
+
+error_code sys_ipc_call_short(const syscall_regs* regs)
+{
+	auto target_handle = args_get<object::handle_type, 0>(regs);
+	auto msg = args_get<task::ipc::message*, 1>(regs);
+	auto timeout = args_get<time_type, 2>(regs);
+
+	if (!VALID_USER_PTR(reinterpret_cast<uintptr_t>(msg)))
+	{
+		return -ERROR_INVALID;
+	}
+
+	if (auto target = object::object_manager::reference_object<thread>(target_handle);!target)
+	{
+		return -ERROR_INVALID;
+	}
+	else
+	{
+
+		global_thread_lock.assert_not_held();
+
+		if (auto err = load_short_message(regs);err != ERROR_SUCCESS)
+		{
+			return err;
+		}
+
+		if (auto err = cur_thread->get_ipc_state()->call(target.get(), deadline::after(timeout));err != ERROR_SUCCESS)
+		{
+			return err;
+		}
+
+		store_short_message(regs, msg);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+error_code sys_ipc_reply_wait_short(const syscall_regs* regs)
+{
+	auto msg = args_get<task::ipc::message*, 0>(regs);
+	auto from = args_get<object::koid_type*, 1>(regs);
+	auto timeout = args_get<time_type, 2>(regs);
+
+	if (!VALID_USER_PTR(reinterpret_cast<uintptr_t>(msg)))
+	{
+		return -ERROR_INVALID;
+	}
+
+	if (from != nullptr && !VALID_USER_PTR(reinterpret_cast<uintptr_t>(from)))
+	{
+		return -ERROR_INVALID;
+	}
+
+	auto state = cur_thread->get_ipc_state();
+
+	global_thread_lock.assert_not_held();
+
+	if (auto err = load_short_message(regs);err != ERROR_SUCCESS)
+	{
+		return err;
+	}
+
+	if (auto err = state->reply_wait(deadline::after(timeout));err != ERROR_SUCCESS)
+	{
+		return err;
+	}
+
+	store_short_message(regs, msg);
+
+	if (from != nullptr)
+	{
+		*from = state->get_sender()->get_koid();
+	}
+
+	return ERROR_SUCCESS;
+}
@@ -15,6 +15,9 @@
 
 #include "memory/pmm.hpp"
 
+#include "fs/vfs/vfs.hpp"
+
+#include <algorithm>
 #include <utility>
 
 using namespace executable;
@@ -25,17 +28,17 @@ static inline auto parse_ph_flags(const Elf64_Phdr& prog_header)
 {
 	size_t vm_flags = 0, perms = PG_U;
 
-	if (prog_header.p_type & PF_X)
+	if (prog_header.p_flags & PF_X)
 	{
 		vm_flags |= VM_EXEC;
 	}
 
-	if (prog_header.p_type & PF_R)
+	if (prog_header.p_flags & PF_R)
 	{
 		vm_flags |= VM_READ;
 	}
 
-	if (prog_header.p_type & PF_W)
+	if (prog_header.p_flags & PF_W)
 	{
 		vm_flags |= VM_WRITE;
 		perms |= PG_W;
@@ -44,8 +47,100 @@ static inline auto parse_ph_flags(const Elf64_Phdr& prog_header)
 	return std::make_pair(vm_flags, perms);
 }
 
+// where the content of segments comes from: a binary in memory, or a file through its page cache
+struct binary_source
+{
+	const uint8_t* data{ nullptr };
+	file_system::vnode_base* file{ nullptr };
+};
+
+static inline error_code copy_from_source(const binary_source& src, uint8_t* dst, size_t offset, size_t len)
+{
+	if (src.file != nullptr)
+	{
+		return src.file->get_page_cache()->read(offset, dst, len);
+	}
+
+	memmove(dst, src.data + offset, len);
+	return ERROR_SUCCESS;
+}
+
+// map [va, va+memsz) with large pages where they fit and small pages elsewhere,
+// zero it and copy filesz bytes at offset of src. Pages already mapped are reused.
+static error_code populate_range(IN task::process* proc,
+	uintptr_t va,
+	size_t memsz,
+	uint64_t perms,
+	IN const binary_source* src,
+	size_t offset,
+	size_t filesz)
+{
+	auto pgdir = proc->address_space()->pgdir();
+	auto pmm_instance = physical_memory_manager::instance();
+
+	const uintptr_t end = va + memsz;
+
+	for (uintptr_t addr = SMALL_PAGE_ROUNDDOWN(va); addr < end;)
+	{
+		uint8_t* frame = nullptr;
+		size_t frame_size = SMALL_PAGE_SIZE;
+
+		auto pde = vmm::walk_pgdir(pgdir, addr, false);
+		if (pde != nullptr && vmm::pde_is_large(pde))
+		{
+			frame_size = PAGE_SIZE;
+			addr = rounddown(addr, PAGE_SIZE);
+			frame = (uint8_t*)pmm::page_to_va(pmm::pde_to_page(pde));
+		}
+		else if (auto pte = vmm::walk_pgdir_small(pgdir, addr, false);pte != nullptr && ((*pte) & PG_P))
+		{
+			frame = (uint8_t*)P2V(vmm::pde_to_pa(pte));
+		}
+		else if (addr % PAGE_SIZE == 0 && addr + PAGE_SIZE <= end && (pde == nullptr || !vmm::pde_is_table(pde)))
+		{
+			auto alloc_ret = pmm_instance->allocate(addr, perms, pgdir, false);
+			if (has_error(alloc_ret))
+			{
+				return get_error_code(alloc_ret);
+			}
+
+			frame_size = PAGE_SIZE;
+			frame = (uint8_t*)pmm::page_to_va(get_result(alloc_ret));
+		}
+		else
+		{
+			auto alloc_ret = pmm_instance->allocate_small(addr, perms, pgdir, false);
+			if (has_error(alloc_ret))
+			{
+				return get_error_code(alloc_ret);
+			}
+
+			frame = (uint8_t*)P2V(get_result(alloc_ret));
+		}
+
+		// the part of the segment inside this frame
+		uintptr_t copy_start = std::max(addr, va), copy_end = std::min(addr + frame_size, end);
+		memset(frame + (copy_start - addr), 0, copy_end - copy_start);
+
+		if (src != nullptr && copy_start < va + filesz)
+		{
+			if (auto err = copy_from_source(*src,
+					frame + (copy_start - addr),
+					offset + (copy_start - va),
+					std::min(copy_end, va + filesz) - copy_start);err != ERROR_SUCCESS)
+			{
+				return err;
+			}
+		}
+
+		addr += frame_size;
+	}
+
+	return ERROR_SUCCESS;
+}
+
 static error_code load_ph(IN const Elf64_Phdr& prog_header,
-	IN const uint8_t* bin,
+	IN const binary_source& bin,
 	IN task::process* proc)
 {
 	auto[vm_flags, perms] = parse_ph_flags(prog_header);
@@ -60,7 +155,15 @@ static error_code load_ph(IN const Elf64_Phdr& prog_header,
 //	}
 
 
-	auto map_ret = as->map(prog_header.p_vaddr, prog_header.p_memsz, vm_flags);
+	// read-only segments of a file are mapped from its page cache, so every process running it shares them
+	bool map_file = bin.file != nullptr &&
+		!(vm_flags & VM_WRITE) &&
+		prog_header.p_filesz == prog_header.p_memsz &&
+		(prog_header.p_vaddr - prog_header.p_offset) % SMALL_PAGE_SIZE == 0;
+
+	auto map_ret = map_file ?
+	               as->map(prog_header.p_vaddr, prog_header.p_memsz, vm_flags, bin.file, prog_header.p_offset) :
+	               as->map(prog_header.p_vaddr, prog_header.p_memsz, vm_flags);
 	if (has_error(map_ret))
 	{
 		return get_error_code(map_ret);
@@ -77,26 +180,20 @@ static error_code load_ph(IN const Elf64_Phdr& prog_header,
 		as->set_heap_begin(prog_header.p_vaddr + prog_header.p_memsz);
 	}
 
-	// ph->p_filesz <= ph->p_memsz
-	size_t page_count = PAGE_ROUNDUP(prog_header.p_memsz) / PAGE_SIZE;
-
-	auto alloc_ret =
-		physical_memory_manager::instance()->allocate(prog_header.p_vaddr,
-			page_count,
-			perms,
-			as->pgdir(),
-			false);
-
-	if (has_error(alloc_ret))
+	if (map_file)
 	{
-		return get_error_code(alloc_ret);
+		// pages are brought in by page faults
+		return ERROR_SUCCESS;
 	}
 
-	auto pages = get_result(alloc_ret);
-	memset((uint8_t*)pmm::page_to_va(pages), 0, page_count * PAGE_SIZE);
-	memmove((uint8_t*)pmm::page_to_va(pages), bin + prog_header.p_offset, prog_header.p_filesz);
-
-	return ERROR_SUCCESS;
+	// ph->p_filesz <= ph->p_memsz
+	return populate_range(proc,
+		prog_header.p_vaddr,
+		prog_header.p_memsz,
+		perms,
+		&bin,
+		prog_header.p_offset,
+		prog_header.p_filesz);
 }
 
 static inline auto parse_sh_flags(const Elf64_Shdr& shdr)
@@ -149,30 +246,21 @@ static error_code alloc_sh(IN const Elf64_Shdr& shdr,
 		proc->address_space()->set_heap_begin(shdr.sh_addr + shdr.sh_size);
 	}
 
-	size_t page_count = PAGE_ROUNDUP(shdr.sh_size) / PAGE_SIZE;
-
 //	auto alloc_ret =
 //		physical_memory_manager::instance()->allocate(shdr.sh_addr, page_count, perms, proc_mm->pgdir, true);
-	auto alloc_ret =
-		physical_memory_manager::instance()->allocate(shdr.sh_addr,
-			page_count,
-			perms,
-			proc->address_space()->pgdir(),
-			true);
 
-	if (has_error(alloc_ret))
+	// set to zero
+	if ((ret = populate_range(proc, shdr.sh_addr, shdr.sh_size, perms, nullptr, 0, 0)) != ERROR_SUCCESS)
 	{
-		return get_error_code(alloc_ret);
+		return ret;
 	}
 
-	// set to zero
-	memset((uint8_t*)pmm::page_to_va(get_result(alloc_ret)), 0, page_count * PAGE_SIZE);
-
 	return ret;
 }
 
 error_code load_elf_binary(IN task::process* proc,
-	const elf_executable& elf)
+	const elf_executable& elf,
+	const binary_source& source)
 {
 	Elf64_Phdr* prog_header = nullptr;
 	size_t count = 0;
@@ -191,7 +279,7 @@ error_code load_elf_binary(IN task::process* proc,
 	{
 		if (prog_header[i].p_type == PT_LOAD)
 		{
-			ret = load_ph(prog_header[i], (uint8_t*)data, proc);
+			ret = load_ph(prog_header[i], source, proc);
 
 			if (ret != ERROR_SUCCESS)
 			{
@@ -216,8 +304,8 @@ error_code load_elf_binary(IN task::process* proc,
 		}
 	}
 
-	proc->address_space()->set_heap_begin(PAGE_ROUNDUP(proc->address_space()->heap_begin()));
-	proc->address_space()->set_heap(PAGE_ROUNDUP(proc->address_space()->heap_begin()));
+	proc->address_space()->set_heap_begin(SMALL_PAGE_ROUNDUP(proc->address_space()->heap_begin()));
+	proc->address_space()->set_heap(SMALL_PAGE_ROUNDUP(proc->address_space()->heap_begin()));
 
 //	proc_mm->brk_start = proc_mm->brk = PAGE_ROUNDUP(proc_mm->brk_start);
 
@@ -238,8 +326,77 @@ error_code load_binary(IN task::process* proc,
 		elf.get_elf_header(&elf_header);
 		*entry_addr = elf_header->e_entry;
 
-		return load_elf_binary(proc, elf);
+		return load_elf_binary(proc, elf, binary_source{ .data=bin });
 	}
 
 	return -ERROR_INVALID;
 }
+
+error_code load_binary(IN task::process* proc,
+	IN file_system::vnode_base* file,
+	OUT uintptr_t* entry_addr)
+{
+	file_system::file_status st{};
+	if (auto ret = file->stat(&st);ret != ERROR_SUCCESS)
+	{
+		return ret;
+	}
+
+	auto cache = file->get_page_cache();
+
+	Elf64_Ehdr elf_header{};
+	if (st.size < sizeof(elf_header))
+	{
+		return -ERROR_INVALID;
+	}
+
+	if (auto ret = cache->read(0, &elf_header, sizeof(elf_header));ret != ERROR_SUCCESS)
+	{
+		return ret;
+	}
+
+	const size_t ph_size = elf_header.e_phnum * sizeof(Elf64_Phdr);
+	const size_t sh_size = elf_header.e_shnum * sizeof(Elf64_Shdr);
+
+	if ((elf_header.e_phnum != 0 && elf_header.e_phentsize != sizeof(Elf64_Phdr)) ||
+		(elf_header.e_shnum != 0 && elf_header.e_shentsize != sizeof(Elf64_Shdr)) ||
+		elf_header.e_phoff + ph_size > st.size ||
+		elf_header.e_shoff + sh_size > st.size)
+	{
+		return -ERROR_INVALID;
+	}
+
+	// only the headers are read in, packed one after another, and the rest is taken from the page cache
+	const size_t headers_size = sizeof(elf_header) + ph_size + sh_size;
+	auto headers = new(std::nothrow) uint8_t[headers_size];
+	if (headers == nullptr)
+	{
+		return -ERROR_MEMORY_ALLOC;
+	}
+
+	auto packed = reinterpret_cast<Elf64_Ehdr*>(headers);
+	*packed = elf_header;
+	packed->e_phoff = sizeof(elf_header);
+	packed->e_shoff = sizeof(elf_header) + ph_size;
+
+	error_code ret = cache->read(elf_header.e_phoff, headers + packed->e_phoff, ph_size);
+	if (ret == ERROR_SUCCESS)
+	{
+		ret = cache->read(elf_header.e_shoff, headers + packed->e_shoff, sh_size);
+	}
+
+	if (ret == ERROR_SUCCESS)
+	{
+		elf_executable elf{};
+		ret = elf.parse(binary{ .size=headers_size, .data=headers });
+
+		if (ret == ERROR_SUCCESS)
+		{
+			*entry_addr = elf_header.e_entry;
+			ret = load_elf_binary(proc, elf, binary_source{ .file=file });
+		}
+	}
+
+	delete[] headers;
+	return ret;
+}
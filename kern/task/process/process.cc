@@ -58,9 +58,10 @@ error_code_with_result<void*> task::process_user_stack_state::make_next_user_sta
 	auto as = parent_->address_space();
 	KDEBUG_ASSERT(as != nullptr);
 
+	// stack pages are populated on fault with small pages
 	auto ret = as->map(current_top - USTACK_TOTAL_SIZE - 1, //TODO -1?
 		USTACK_TOTAL_SIZE,
-		VM_STACK);
+		VM_STACK | VM_READ | VM_WRITE);
 
 	if (has_error(ret))
 	{
@@ -77,35 +78,6 @@ error_code_with_result<void*> task::process_user_stack_state::make_next_user_sta
 //		return -ERROR_MEMORY_ALLOC;
 //	}
 
-	// allocate an stack
-	for (size_t i = 0;
-	     i < USTACK_PAGES_PER_THREAD; // do not allocate the guard page
-	     i++)
-	{
-		uintptr_t va = current_top - USTACK_USABLE_SIZE_PER_THREAD + i * PAGE_SIZE;
-
-		auto alloc_ret = memory::physical_memory_manager::instance()->allocate(va,
-			PG_W | PG_U | PG_PS | PG_P,
-			as->pgdir(),
-			true);
-
-		if (has_error(alloc_ret))
-		{
-			return get_error_code(alloc_ret);
-		}
-	}
-
-	auto guard_page_ret =
-		memory::physical_memory_manager::instance()->allocate(current_top - USTACK_TOTAL_PAGES_PER_THREAD,
-			PG_U | PG_PS | PG_P,
-			as->pgdir(),
-			true);
-
-	if (has_error(guard_page_ret))
-	{
-		return get_error_code(guard_page_ret);
-	}
-
 	return (void*)(current_top - USTACK_USABLE_SIZE_PER_THREAD);
 }
 
@@ -206,6 +178,8 @@ void task::process_init()
 			KDEBUG_GERNERALPANIC_CODE(ERROR_MEMORY_ALLOC);
 		}
 	}
+
+	scheduler::init_reschedule_ipi();
 }
 
 error_code_with_result<process*> process::create(const char* name,
@@ -256,10 +230,48 @@ error_code_with_result<process*> task::process::create(const char* name,
 		return ret;
 	}
 
+	if (auto ret = proc->start_main_thread(name, entry_addr);ret != ERROR_SUCCESS)
+	{
+		return ret;
+	}
+
+	return proc;
+}
+
+error_code_with_result<process*> task::process::create(const char* name,
+	file_system::vnode_base* file,
+	const ktl::shared_ptr<job>& parent)
+{
+	process* proc{ nullptr };
+	if (auto ret = task::process::create(name, parent);has_error(ret))
+	{
+		return get_error_code(ret);
+	}
+	else
+	{
+		proc = get_result(ret);
+	}
+
+	uintptr_t entry_addr = 0;
+	if (auto ret = load_binary(proc, file, &entry_addr);ret != ERROR_SUCCESS)
+	{
+		return ret;
+	}
+
+	if (auto ret = proc->start_main_thread(name, entry_addr);ret != ERROR_SUCCESS)
+	{
+		return ret;
+	}
+
+	return proc;
+}
+
+error_code task::process::start_main_thread(const char* name, uintptr_t entry_addr)
+{
 	thread* main_thread = nullptr;
 
 	// name the main thread with the parent_'s name
-	if (auto ret = thread::create(proc, name, (task::thread_routine_type)entry_addr, nullptr);has_error(ret))
+	if (auto ret = thread::create(this, name, (task::thread_routine_type)entry_addr, nullptr);has_error(ret))
 	{
 		return get_error_code(ret);
 	}
@@ -276,9 +288,9 @@ error_code_with_result<process*> task::process::create(const char* name,
 		scheduler::current::unblock(main_thread);
 	}
 
-	proc->add_child_thread(main_thread);
+	add_child_thread(main_thread);
 
-	return proc;
+	return ERROR_SUCCESS;
 }
 
 task::process::process(std::span<char> name,
@@ -490,9 +502,9 @@ error_code task::process::resize_heap(IN OUT uintptr_t* heap_ptr)
 	}
 	else
 	{
-		uintptr_t new_heap = PAGE_ROUNDUP(heap), old_heap = as->heap();
+		uintptr_t new_heap = SMALL_PAGE_ROUNDUP(heap), old_heap = as->heap();
 
-		if ((old_heap % PAGE_SIZE) != 0)
+		if ((old_heap % SMALL_PAGE_SIZE) != 0)
 		{
 			return -ERROR_INVALID;
 		}
@@ -525,7 +537,7 @@ error_code task::process::resize_heap(IN OUT uintptr_t* heap_ptr)
 //					*heap_ptr = mm->brk_start;
 //				}
 //			}
-			if (as->intersect_vma(old_heap, new_heap + PAGE_SIZE) != nullptr)
+			if (as->intersect_vma(old_heap, new_heap + SMALL_PAGE_SIZE) != nullptr)
 			{
 				*heap_ptr = as->heap_begin();
 			}
@@ -4,7 +4,13 @@
 
 #include "system/scheduler.h"
 
-#include "drivers/cmos/rtc.hpp"
+#include "drivers/apic/timer.h"
+#include "drivers/apic/traps.h"
+#include "drivers/apic/local_apic.hpp"
+
+#include "arch/amd64/cpu/intrinsics.hpp"
+
+#include "memory/pmm.hpp"
 
 #include "kbl/lock/lock_guard.hpp"
 
@@ -15,8 +21,6 @@
 using namespace lock;
 using namespace trap;
 
-// TODO: cpu scheduler ( load balance )
-
 
 // Helpers to interact with scheduler class
 
@@ -42,29 +46,137 @@ task::thread* task::scheduler::fetch()
 	return scheduler_class.fetch();
 }
 
-task::thread* task::scheduler::steal()
+task::thread* task::scheduler::steal(cpu_struct* stealer)
+{
+	return scheduler_class.steal(stealer);
+}
+
+void task::scheduler::post(task::thread* t)
+{
+	auto head = __atomic_load_n(&inbox_, __ATOMIC_RELAXED);
+	do
+	{
+		t->inbox_next_ = head;
+	}
+	while (!__atomic_compare_exchange_n(&inbox_, &head, t, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	if (owner_cpu != cpu.get())
+	{
+		apic::local_apic::apic_send_ipi(owner_cpu->apicid,
+			apic::local_apic::DLM_FIXED,
+			trap::IRQ_TO_TRAPNUM(trap::IRQ_RESCHEDULE));
+	}
+}
+
+void task::scheduler::drain_inbox()
+{
+	KDEBUG_ASSERT(cpu->id == owner_cpu->id);
+
+	auto list = __atomic_exchange_n(&inbox_, nullptr, __ATOMIC_ACQUIRE);
+
+	// the inbox is LIFO, so reverse it to keep the order of posting
+	thread* ordered = nullptr;
+	while (list != nullptr)
+	{
+		auto next = list->inbox_next_;
+		list->inbox_next_ = ordered;
+		ordered = list;
+		list = next;
+	}
+
+	while (ordered != nullptr)
+	{
+		auto next = ordered->inbox_next_;
+		ordered->inbox_next_ = nullptr;
+
+		enqueue(ordered);
+		ordered = next;
+	}
+}
+
+static error_code reschedule_ipi_handle([[maybe_unused]] trap::trap_frame info) TA_NO_THREAD_SAFETY_ANALYSIS
 {
-	return scheduler_class.steal(cpu.get());
+	cpu->scheduler->drain_inbox();
+
+	task::cur_thread->get_scheduler_state()->set_need_reschedule(true);
+
+	return ERROR_SUCCESS;
+}
+
+void task::scheduler::init_reschedule_ipi()
+{
+	trap::trap_handle_register(trap::IRQ_TO_TRAPNUM(trap::IRQ_RESCHEDULE), trap::trap_handle{
+		.handle = reschedule_ipi_handle,
+		.enable = true });
 }
 
 // Scheduler timer implementation
 
-void task::scheduler::check_timers_locked()
+void task::scheduler::expire_timers(time_type now)
+{
+	{
+		lock_guard g{ timer_lock };
+		if (now < timers_.next_event())
+		{
+			return;
+		}
+	}
+
+	// callbacks run with global_thread_lock held, which is also held to cancel timers,
+	// so a timer is never cancelled half-way through its callback
+	lock_guard g{ global_thread_lock };
+
+	scheduler_timer* expired = nullptr;
+	{
+		lock_guard g2{ timer_lock };
+		expired = timers_.advance(now);
+
+		for (auto t = expired; t != nullptr; t = t->next_)
+		{
+			t->owner_ = nullptr;
+		}
+	}
+
+	while (expired != nullptr)
+	{
+		// the callback may free the timer
+		auto next = expired->next_;
+		expired->next_ = nullptr;
+
+		expired->callback(expired, now, expired->arg);
+
+		expired = next;
+	}
+}
+
+void task::scheduler::arm_next_event()
 {
-	if (timer_list.empty())return;
+	KDEBUG_ASSERT(arch_ints_disabled());
 
-	auto timer = timer_list.front_ptr();
-	--timer->expires;
+	time_type when = TIME_INFINITE;
+	{
+		lock_guard g{ timer_lock };
+		when = timers_.next_event();
+	}
 
-	while (!timer->expires)
+	if (cur_thread.get() != cpu->idle)
 	{
-		auto next = timer->link.next_->parent_;
+		when = ktl::min(when, next_tick_);
+	}
 
-		timer->callback(timer, cmos::cmos_read_rtc_timestamp(), timer->arg);
+	armed_ = when;
+	timer::program_event(when);
+}
 
-		remove_timer(timer);
-		if (!next) break;
-		timer = next;
+void task::scheduler::start_tick()
+{
+	KDEBUG_ASSERT(arch_ints_disabled());
+
+	next_tick_ = time_add_duration(timer::now(), timer::TICK_PERIOD);
+	if (next_tick_ < armed_)
+	{
+		armed_ = next_tick_;
+		timer::program_event(next_tick_);
 	}
 }
 
@@ -72,52 +184,69 @@ void task::scheduler::timer_tick_handle()
 {
 	timer_lock.assert_not_held();
 
+	auto now = timer::now();
+
+	expire_timers(now);
+
+	if (now >= next_tick_)
 	{
-		lock_guard g2{ timer_lock };
-		check_timers_locked();
+		next_tick_ = time_add_duration(now, timer::TICK_PERIOD);
+		tick(cur_thread.get());
 	}
 
-	tick(cur_thread.get());
+	arm_next_event();
 }
 
-void task::scheduler::add_timer(task::scheduler_timer* timer)
+void task::scheduler::add_timer(task::scheduler_timer* timer, const deadline& ddl)
 {
-	lock_guard g{ timer_lock };
+	KDEBUG_ASSERT(cpu->id == owner_cpu->id);
+	KDEBUG_ASSERT(timer->owner_ == nullptr);
+	KDEBUG_ASSERT(arch_ints_disabled());
 
-	auto iter = timer_list.begin();
-	while (iter != timer_list.end())
+	time_type when = TIME_INFINITE;
 	{
-		if (timer->expires < iter->expires)
-		{
-			iter->expires -= timer->expires;
-			break;
-		}
+		lock_guard g{ timer_lock };
+		when = timers_.insert(timer, ddl.earliest(), ddl.latest(), timer::now());
+		timer->owner_ = this;
+	}
+
+	if (when < armed_)
+	{
+		armed_ = when;
+		timer::program_event(when);
+	}
+}
 
-		timer->expires -= iter->expires;
-		iter++;
+bool task::scheduler::remove_timer(task::scheduler_timer* timer)
+{
+	auto owner = timer->owner_;
+	if (owner == nullptr)
+	{
+		return false;
 	}
 
-	if (iter != timer_list.begin())iter--;
+	// the owner's timer isn't reprogrammed, it may just fire once for nothing
+	lock_guard g{ owner->timer_lock };
+	owner->timers_.remove(timer);
+	timer->owner_ = nullptr;
 
-	timer_list.insert(iter, timer);
+	return true;
 }
 
-void task::scheduler::remove_timer(task::scheduler_timer* timer)
+void task::scheduler::idle_wait()
 {
-	lock_guard g{ timer_lock };
+	KDEBUG_ASSERT(cpu->id == owner_cpu->id);
 
-	if (timer_list.empty())return;
+	auto state = arch_interrupt_save();
 
-	if (timer->expires != 0)
+	if (__atomic_load_n(&inbox_, __ATOMIC_RELAXED) == nullptr && workload_size() == 0)
 	{
-		auto next = timer->link.next_->parent_;
-		if (next != nullptr)
-		{
-			next->expires += timer->expires;
-		}
+		arm_next_event();
+
+		arch::wait_for_interrupt();
 	}
 
-	timer_list.remove(timer);
+	arch_interrupt_restore(state);
 }
 
 
@@ -125,20 +254,21 @@ void task::scheduler::remove_timer(task::scheduler_timer* timer)
 
 void task::scheduler::insert(task::thread* t)
 {
-	lock_guard g{ global_thread_lock };
-	insert_locked(t);
+	auto state = arch_interrupt_save();
+	enqueue(t);
+	arch_interrupt_restore(state);
 }
 
 void task::scheduler::tick(task::thread* t)
 {
-	lock_guard g{ global_thread_lock };
-
 	auto state = arch_interrupt_save();
 	auto _ = gsl::finally([&state]()
 	{
 	  arch_interrupt_restore(state);
 	});
 
+	drain_inbox();
+
 	if (t != cpu->idle)
 	{
 		scheduler_class.tick();
@@ -148,31 +278,41 @@ void task::scheduler::tick(task::thread* t)
 		t->scheduler_state_.set_need_reschedule(true);
 	}
 
+	if ((++ticks_) % BALANCE_INTERVAL == 0)
+	{
+		balance();
+	}
+}
+
+void task::scheduler::balance()
+{
 	// Push migrating approach to load balancing
 	cpu_struct* max_cpu = &(*valid_cpus.begin()), * min_cpu = &(*valid_cpus.begin());
+	size_type max_size = max_cpu->scheduler->workload_size(), min_size = max_size;
 
 	for (auto& c: valid_cpus)
 	{
-		if (c.scheduler->workload_size_locked() > max_cpu->scheduler->workload_size_locked())
+		auto size = c.scheduler->workload_size();
+		if (size > max_size)
 		{
 			max_cpu = &c;
+			max_size = size;
 		}
 
-		if (c.scheduler->workload_size_locked() < min_cpu->scheduler->workload_size_locked())
+		if (size < min_size)
 		{
 			min_cpu = &c;
+			min_size = size;
 		}
 	}
 
-	if (max_cpu != min_cpu
-		&& max_cpu->scheduler->workload_size_locked() > min_cpu->scheduler->workload_size_locked() + 1)
+	if (max_cpu != min_cpu && max_size > min_size + 1)
 	{
-		if (auto victim = max_cpu->scheduler->steal();victim != nullptr)
+		if (auto victim = max_cpu->scheduler->steal(min_cpu);victim != nullptr)
 		{
-			min_cpu->scheduler->enqueue(victim);
+			min_cpu->scheduler->post(victim);
 		}
 	}
-
 }
 
 void task::scheduler::reschedule()
@@ -225,20 +365,38 @@ void task::scheduler::unblock_locked(task::thread* t)
 	enqueue(t);
 }
 
-void task::scheduler::insert_locked(task::thread* t) TA_REQ(global_thread_lock)
+void task::scheduler::handoff_locked(task::thread* next)
 {
 	KDEBUG_ASSERT(cpu->id == owner_cpu->id);
+	KDEBUG_ASSERT(global_thread_lock.holding());
+	KDEBUG_ASSERT(next != cpu->idle);
 
-	enqueue(t);
+	auto state = arch_interrupt_save();
+
+	auto cur = cur_thread.get();
+
+	cur->scheduler_state_.set_need_reschedule(false);
+
+	cur->scheduler_state_.on_tick();
+
+	if (cur->state == thread::thread_states::RUNNING)
+	{
+		cur->state = thread::thread_states::READY;
+		enqueue(cur);
+	}
+
+	next->state = thread::thread_states::READY;
+	next->switch_to(state);
 }
 
-task::scheduler::size_type task::scheduler::workload_size() const
+void task::scheduler::insert_locked(task::thread* t) TA_REQ(global_thread_lock)
 {
-	lock_guard g{ global_thread_lock };
-	return workload_size_locked();
+	KDEBUG_ASSERT(cpu->id == owner_cpu->id);
+
+	enqueue(t);
 }
 
-task::scheduler::size_type task::scheduler::workload_size_locked() const
+task::scheduler::size_type task::scheduler::workload_size() const
 {
 	return scheduler_class.workload_size();
 }
@@ -249,39 +407,53 @@ error_code task::scheduler::idle(void* arg __UNUSED) TA_NO_THREAD_SAFETY_ANALYSI
 	{
 		auto this_cpu = cpu.get();
 
-		// Pull migration approach to load balancing
-
-		lock_guard g2{ global_thread_lock };
+		// nothing else to do, prepare zeroed pages for page faults
+		bool zeroing = memory::physical_memory_manager::instance()->zero_idle_pages();
 
-		auto intr = arch_ints_disabled();
-
-		if (!intr)
+		// Pull migration approach to load balancing, only run queues are locked
+		if (this_cpu->scheduler->workload_size() == 0)
 		{
-			cli();
-		}
+			auto state = arch_interrupt_save();
 
-		cpu_struct* max_cpu = &valid_cpus[0];
+			cpu_struct* max_cpu = nullptr;
+			size_type max_size = 0;
 
-		for (auto& c: valid_cpus)
-		{
-			if (c.scheduler->workload_size_locked() > max_cpu->scheduler->workload_size_locked() &&
-				this_cpu != &c)
+			for (auto& c: valid_cpus)
+			{
+				if (this_cpu == &c)
+				{
+					continue;
+				}
+
+				if (auto size = c.scheduler->workload_size();size > max_size)
+				{
+					max_cpu = &c;
+					max_size = size;
+				}
+			}
+
+			if (max_cpu != nullptr)
 			{
-				max_cpu = &c;
+				if (auto t = max_cpu->scheduler->steal(this_cpu);t != nullptr)
+				{
+					this_cpu->scheduler->enqueue(t);
+				}
 			}
+
+			arch_interrupt_restore(state);
 		}
 
-		if (auto t = max_cpu->scheduler->steal();t != nullptr)
 		{
-			this_cpu->scheduler->enqueue(t);
+			lock_guard g2{ global_thread_lock };
+
+			scheduler::current::reschedule_locked();
 		}
 
-		if (!intr)
+		// zeroing goes on piece by piece, with a reschedule in between, until it is done
+		if (!zeroing)
 		{
-			sti();
+			this_cpu->scheduler->idle_wait();
 		}
-
-		scheduler::current::reschedule_locked();
 	}
 
 	// assert no return
@@ -306,24 +478,30 @@ void task::scheduler::current::yield()
 bool task::scheduler::current::unblock(task::thread* t)
 {
 
-	if (t->scheduler_state_.affinity()->cpu != CPU_NUM_INVALID)
+	auto target = t->scheduler_state_.affinity()->cpu;
+	if (target != CPU_NUM_INVALID && target != cpu->id)
 	{
-		KDEBUG_ASSERT(t->scheduler_state_.affinity()->cpu < valid_cpus.size());
-		valid_cpus[t->scheduler_state_.affinity()->cpu].scheduler->unblock_locked(t);
+		KDEBUG_ASSERT(target < valid_cpus.size());
 
-		return t->scheduler_state_.affinity()->cpu == cpu->id;
+		// a remote wakeup doesn't touch the run queue of others
+		t->state = thread::thread_states::READY;
+		valid_cpus[target].scheduler->post(t);
+
+		return false;
 	}
 
 	cpu->scheduler->unblock_locked(t);
-	return false;
+	return target == cpu->id;
 }
 
 void task::scheduler::current::insert(task::thread* t)
 {
-	if (t->scheduler_state_.affinity()->cpu != CPU_NUM_INVALID)
+	auto target = t->scheduler_state_.affinity()->cpu;
+	if (target != CPU_NUM_INVALID && target != cpu->id)
 	{
-		KDEBUG_ASSERT(t->scheduler_state_.affinity()->cpu < valid_cpus.size());
-		valid_cpus[t->scheduler_state_.affinity()->cpu].scheduler->insert(t);
+		KDEBUG_ASSERT(target < valid_cpus.size());
+		valid_cpus[target].scheduler->post(t);
+		return;
 	}
 
 	cpu->scheduler->insert(t);
@@ -347,6 +525,21 @@ void task::scheduler::current::block_locked()
 	cpu->scheduler->reschedule_locked();
 }
 
+void task::scheduler::current::handoff_locked(task::thread* next)
+{
+	auto affinity = next->scheduler_state_.affinity();
+	if (affinity->type == cpu_affinity_type::HARD &&
+		affinity->cpu != CPU_NUM_INVALID &&
+		affinity->cpu != cpu->id)
+	{
+		scheduler::current::unblock(next);
+		scheduler::current::block_locked();
+		return;
+	}
+
+	cpu->scheduler->handoff_locked(next);
+}
+
 bool task::scheduler::current::unblock_locked(wait_queue::wait_queue_list_type threads)
 {
 	KDEBUG_ASSERT(global_thread_lock.holding());
@@ -381,6 +574,8 @@ void task::scheduler::schedule()
 
 	cur->scheduler_state_.on_tick();
 
+	drain_inbox();
+
 	if (cur->state == thread::thread_states::READY)
 	{
 		enqueue(cur);
@@ -400,6 +595,11 @@ void task::scheduler::schedule()
 
 	if (next != cur)
 	{
+		if (cur == cpu->idle)
+		{
+			start_tick();
+		}
+
 		next->switch_to(state);
 	}
 
@@ -0,0 +1,245 @@
+#include "task/scheduler/timer_wheel.hpp"
+
+#include "debug/kdebug.h"
+
+#include "ktl/algorithm.hpp"
+
+using namespace task;
+
+static constexpr uint64_t JIFFY_MASK = (1ull << timer_wheel::JIFFY_SHIFT) - 1;
+
+static inline uint64_t jiffy_floor(time_type t)
+{
+	return t <= 0 ? 0 : (uint64_t)t >> timer_wheel::JIFFY_SHIFT;
+}
+
+static inline uint64_t jiffy_ceil(time_type t)
+{
+	return t <= 0 ? 0 : ((uint64_t)t + JIFFY_MASK) >> timer_wheel::JIFFY_SHIFT;
+}
+
+static inline time_type jiffy_to_time(uint64_t jiffy)
+{
+	if (jiffy >= ((uint64_t)TIME_INFINITE >> timer_wheel::JIFFY_SHIFT))
+	{
+		return TIME_INFINITE;
+	}
+	return (time_type)(jiffy << timer_wheel::JIFFY_SHIFT);
+}
+
+/// \brief the jiffy in [lo, hi] with the most trailing zeros, or lo if the range is empty
+static inline uint64_t coarsest_in(uint64_t lo, uint64_t hi)
+{
+	if (lo >= hi)
+	{
+		return lo;
+	}
+
+	// lo and hi share every bit above the highest differing one,
+	// so hi with everything below that bit cleared is the best candidate above lo
+	auto bit = 63 - __builtin_clzll(lo ^ hi);
+	if ((lo & ((2ull << bit) - 1)) == 0)
+	{
+		return lo;
+	}
+
+	return hi & ~((1ull << bit) - 1);
+}
+
+/// \brief distance from index "from" to the next set bit, going around the level
+static inline uint64_t circular_distance(uint64_t bitmap, size_t from)
+{
+	auto rotated = from == 0 ? bitmap : (bitmap >> from) | (bitmap << (timer_wheel::LEVEL_SIZE - from));
+	return __builtin_ctzll(rotated);
+}
+
+time_type timer_wheel::insert(scheduler_timer* timer, time_type earliest, time_type latest, time_type now)
+{
+	KDEBUG_ASSERT(timer->pprev_ == nullptr);
+
+	// nothing is hashed against the old clock, so it can catch up for free
+	if (count_ == 0)
+	{
+		clock_ = ktl::max(clock_, jiffy_floor(now));
+	}
+
+	auto jiffy = coarsest_in(jiffy_ceil(earliest), jiffy_floor(latest));
+	timer->jiffy_ = ktl::max(jiffy, clock_);
+	timer->expires = jiffy_to_time(timer->jiffy_);
+
+	enqueue(timer);
+	count_++;
+
+	return timer->expires;
+}
+
+void timer_wheel::remove(scheduler_timer* timer)
+{
+	KDEBUG_ASSERT(timer->pprev_ != nullptr);
+
+	unlink(timer);
+	count_--;
+}
+
+void timer_wheel::enqueue(scheduler_timer* timer)
+{
+	auto delta = timer->jiffy_ - clock_;
+
+	uint32_t slot = OVERFLOW_SLOT;
+	if (delta < (1ull << (LEVEL_BITS * LEVEL_COUNT)))
+	{
+		size_t level = 0;
+		while (delta >= (1ull << (LEVEL_BITS * (level + 1))))
+		{
+			level++;
+		}
+
+		auto index = (timer->jiffy_ >> (LEVEL_BITS * level)) & LEVEL_MASK;
+		slot = level * LEVEL_SIZE + index;
+		pending_[level] |= 1ull << index;
+	}
+
+	auto& head = slots_[slot];
+
+	timer->slot_ = slot;
+	timer->next_ = head;
+	if (head != nullptr)
+	{
+		head->pprev_ = &timer->next_;
+	}
+	head = timer;
+	timer->pprev_ = &head;
+}
+
+void timer_wheel::unlink(scheduler_timer* timer)
+{
+	*timer->pprev_ = timer->next_;
+	if (timer->next_ != nullptr)
+	{
+		timer->next_->pprev_ = timer->pprev_;
+	}
+
+	if (timer->slot_ != OVERFLOW_SLOT && slots_[timer->slot_] == nullptr)
+	{
+		pending_[timer->slot_ / LEVEL_SIZE] &= ~(1ull << (timer->slot_ & LEVEL_MASK));
+	}
+
+	timer->next_ = nullptr;
+	timer->pprev_ = nullptr;
+}
+
+void timer_wheel::cascade(uint32_t slot)
+{
+	auto list = slots_[slot];
+
+	slots_[slot] = nullptr;
+	if (slot != OVERFLOW_SLOT)
+	{
+		pending_[slot / LEVEL_SIZE] &= ~(1ull << (slot & LEVEL_MASK));
+	}
+
+	while (list != nullptr)
+	{
+		auto next = list->next_;
+		enqueue(list);
+		list = next;
+	}
+}
+
+uint64_t timer_wheel::next_event_jiffy() const
+{
+	uint64_t best = UINT64_MAX;
+
+	// the lowest level holds exact expiries
+	if (pending_[0])
+	{
+		best = clock_ + circular_distance(pending_[0], clock_ & LEVEL_MASK);
+	}
+
+	// upper levels are due when the clock reaches the start of their slot
+	auto refill = [this](size_t shift, uint64_t bitmap)
+	{
+	  auto block = (clock_ >> shift) + ((clock_ & ((1ull << shift) - 1)) ? 1 : 0);
+	  block += circular_distance(bitmap, block & LEVEL_MASK);
+	  return block << shift;
+	};
+
+	for (size_t level = 1; level < LEVEL_COUNT; level++)
+	{
+		if (pending_[level])
+		{
+			best = ktl::min(best, refill(LEVEL_BITS * level, pending_[level]));
+		}
+	}
+
+	if (slots_[OVERFLOW_SLOT] != nullptr)
+	{
+		best = ktl::min(best, refill(LEVEL_BITS * LEVEL_COUNT, 1));
+	}
+
+	return best;
+}
+
+time_type timer_wheel::next_event() const
+{
+	if (count_ == 0)
+	{
+		return TIME_INFINITE;
+	}
+
+	return jiffy_to_time(next_event_jiffy());
+}
+
+scheduler_timer* timer_wheel::advance(time_type now)
+{
+	scheduler_timer* expired = nullptr;
+
+	auto target = jiffy_floor(now);
+	while (clock_ <= target)
+	{
+		// skip the jiffies in which nothing happens
+		auto next = count_ == 0 ? UINT64_MAX : next_event_jiffy();
+		if (next > target)
+		{
+			clock_ = target + 1;
+			break;
+		}
+
+		clock_ = next;
+
+		// refill from upper levels when a round of the lower one completes
+		if ((clock_ & LEVEL_MASK) == 0)
+		{
+			size_t level = 1;
+			for (; level < LEVEL_COUNT; level++)
+			{
+				auto index = (clock_ >> (LEVEL_BITS * level)) & LEVEL_MASK;
+				cascade(level * LEVEL_SIZE + index);
+
+				if (index != 0)
+				{
+					break;
+				}
+			}
+
+			if (level == LEVEL_COUNT)
+			{
+				cascade(OVERFLOW_SLOT);
+			}
+		}
+
+		auto index = clock_ & LEVEL_MASK;
+		while (auto timer = slots_[index])
+		{
+			unlink(timer);
+			count_--;
+
+			timer->next_ = expired;
+			expired = timer;
+		}
+
+		clock_++;
+	}
+
+	return expired;
+}
@@ -11,7 +11,8 @@ using namespace ktl;
 
 void task::ule_scheduler_state_base::on_tick()
 {
-	run_time_++;
+	// it's scheduled out, refresh the cached score
+	interactivity_ = interactivity_score();
 }
 
 void task::ule_scheduler_state_base::on_sleep()
@@ -23,6 +24,35 @@ void task::ule_scheduler_state_base::on_wakeup()
 {
 	sleep_time_ += timer::get_ticks() - sleep_tick_;
 	sleep_tick_ = 0;
+
+	decay_history();
+}
+
+void task::ule_scheduler_state_base::set_nice(int32_t nice)
+{
+	nice_ = min(max(nice, NICE_MIN), NICE_MAX);
+}
+
+bool task::ule_scheduler_state_base::charge_tick()
+{
+	run_time_++;
+	decay_history();
+
+	if (slice_left_ != 0)
+	{
+		slice_left_--;
+	}
+
+	return slice_left_ == 0;
+}
+
+void task::ule_scheduler_state_base::decay_history()
+{
+	if (run_time_ + sleep_time_ > ule_scheduler_class::HISTORY_MAX)
+	{
+		run_time_ /= 2;
+		sleep_time_ /= 2;
+	}
 }
 
 task::ule_scheduler_state_base::interactivity_score_type task::ule_scheduler_state_base::interactivity_score() const
@@ -50,7 +80,43 @@ task::ule_scheduler_state_base::interactivity_score_type task::ule_scheduler_sta
 	return 0;
 }
 
+bool task::ule_scheduler_state_base::interactive() const
+{
+	return interactivity_score() < ule_scheduler_class::INTERACT_THRESHOLD;
+}
+
 task::ule_scheduler_state_base::priority_type task::ule_scheduler_state_base::priority() const
 {
-	return 0;
+	auto score = interactivity_score();
+
+	// interactive threads are ordered by the score
+	if (score < ule_scheduler_class::INTERACT_THRESHOLD)
+	{
+		return ule_scheduler_class::PRIORITY_INTERACT_MIN +
+			score * (ule_scheduler_class::PRIORITY_BATCH_MIN - ule_scheduler_class::PRIORITY_INTERACT_MIN)
+				/ ule_scheduler_class::INTERACT_THRESHOLD;
+	}
+
+	// batch threads are ordered by nice, and slightly by the score
+	constexpr priority_type range = ule_scheduler_class::PRIORITY_COUNT - ule_scheduler_class::PRIORITY_BATCH_MIN;
+	constexpr priority_type nice_range = NICE_MAX - NICE_MIN + 1;
+
+	priority_type ret = ule_scheduler_class::PRIORITY_BATCH_MIN + (nice_ - NICE_MIN) * range / nice_range;
+	ret += (priority_type)((score - ule_scheduler_class::INTERACT_THRESHOLD) * (range / 8)
+		/ (ule_scheduler_class::INTERACT_MAX - ule_scheduler_class::INTERACT_THRESHOLD));
+
+	return min(ret, (priority_type)ule_scheduler_class::PRIORITY_COUNT - 1);
+}
+
+size_t task::ule_scheduler_state_base::time_slice() const
+{
+	if (interactive())
+	{
+		return ule_scheduler_class::SLICE_MIN;
+	}
+
+	// less nice threads run longer
+	int64_t slice = (int64_t)ule_scheduler_class::SLICE_DEFAULT - nice_ / 2;
+	return (size_t)min(max(slice, (int64_t)ule_scheduler_class::SLICE_MIN),
+		(int64_t)ule_scheduler_class::SLICE_MAX);
 }
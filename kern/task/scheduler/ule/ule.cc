@@ -1,31 +1,220 @@
+#include "internals/thread.hpp"
+
 #include "task/scheduler/ule/ule.hpp"
 
+#include "task/scheduler/scheduler.hpp"
+#include "task/thread/thread.hpp"
+
+#include "drivers/acpi/cpu.h"
+
+#include "system/scheduler.h"
+
+#include "kbl/lock/lock_guard.hpp"
+#include "ktl/algorithm.hpp"
+
+using namespace kbl;
+using namespace lock;
+
+void task::ule_scheduler_class::push_locked(size_t queue, task::thread* t)
+{
+	auto state = &t->scheduler_state_;
+	auto priority = state->priority();
+
+	KDEBUG_ASSERT(priority >= 0 && (size_t)priority < PRIORITY_COUNT);
+
+	auto& rq = queues_[queue];
+	rq.lists[priority].push_back(t);
+	rq.bitmap |= (1ull << priority);
+	rq.count++;
+
+	state->queue_ = queue;
+	state->queued_priority_ = priority;
+}
+
+void task::ule_scheduler_class::remove_locked(task::thread* t)
+{
+	auto state = &t->scheduler_state_;
+	if (state->queue_ == ule_scheduler_state_base::QUEUE_NONE)
+	{
+		return;
+	}
+
+	auto& rq = queues_[state->queue_];
+	auto priority = state->queued_priority_;
+
+	rq.lists[priority].remove(t);
+	if (rq.lists[priority].empty())
+	{
+		rq.bitmap &= ~(1ull << priority);
+	}
+	rq.count--;
+
+	state->queue_ = ule_scheduler_state_base::QUEUE_NONE;
+}
+
 task::scheduler_class::size_type task::ule_scheduler_class::workload_size() const
 {
-	return 0;
+	lock_guard lk_this{ lock_ };
+
+	size_type ret = 0;
+	for (const auto& rq : queues_)
+	{
+		ret += rq.count;
+	}
+
+	return ret;
 }
 
 void task::ule_scheduler_class::enqueue(task::thread* t)
 {
+	KDEBUG_ASSERT(cpu->id == parent_->owner_cpu->id);
+
+	lock_guard lk_this{ lock_ };
+
+	if (t->state == thread::thread_states::DYING)
+	{
+		zombie_queue_.push_back(t);
+		return;
+	}
+
+	auto state = &t->scheduler_state_;
 
+	bool expired = false;
+	if (state->slice_left_ == 0)
+	{
+		state->slice_left_ = state->time_slice();
+		expired = true;
+	}
+
+	// interactive threads and the preempted ones stay in the current queue,
+	// while ones used up their slice wait for the next round
+	size_t queue = current_ ^ 1;
+	if (state->interactive())
+	{
+		queue = current_;
+	}
+	else if (state->nice_ == ule_scheduler_state_base::NICE_MAX)
+	{
+		queue = QUEUE_IDLE;
+	}
+	else if (!expired)
+	{
+		queue = current_;
+	}
+
+	push_locked(queue, t);
 }
 
 void task::ule_scheduler_class::dequeue(task::thread* t)
 {
+	KDEBUG_ASSERT(cpu->id == parent_->owner_cpu->id);
+
+	lock_guard lk_this{ lock_ };
 
+	KDEBUG_ASSERT(t->run_queue_link.is_valid());
+
+	if (!t->run_queue_link.is_empty_or_detached())
+	{
+		remove_locked(t);
+	}
 }
 
 task::thread* task::ule_scheduler_class::fetch()
 {
-	return nullptr;
+	KDEBUG_ASSERT(cpu->id == parent_->owner_cpu->id);
+
+	lock_guard lk_this{ lock_ };
+
+	if (queues_[current_].count == 0)
+	{
+		current_ ^= 1;
+	}
+
+	auto rq = &queues_[current_];
+	if (rq->count == 0)
+	{
+		rq = &queues_[QUEUE_IDLE];
+	}
+
+	if (rq->count == 0)
+	{
+		return nullptr;
+	}
+
+	auto ret = rq->lists[__builtin_ctzll(rq->bitmap)].front_ptr();
+	remove_locked(ret);
+
+	return ret;
 }
 
 void task::ule_scheduler_class::tick()
 {
+	KDEBUG_ASSERT(cpu->id == parent_->owner_cpu->id);
 
+	lock_guard lk_this{ lock_ };
+
+	while (!zombie_queue_.empty())
+	{
+		auto t = zombie_queue_.front_ptr();
+		zombie_queue_.pop_front();
+
+		t->finish_dead_transition();
+	}
+
+	auto cur = cur_thread.get();
+	auto state = &cur->scheduler_state_;
+
+	if (state->charge_tick())
+	{
+		state->set_need_reschedule(true);
+		return;
+	}
+
+	// preempt it if a more important thread is waiting
+	auto bitmap = queues_[current_].bitmap;
+	if (bitmap != 0 && __builtin_ctzll(bitmap) < state->priority())
+	{
+		state->set_need_reschedule(true);
+	}
 }
 
 task::thread* task::ule_scheduler_class::steal(cpu_struct* stealer_cpu)
 {
-	return scheduler_class::steal(stealer_cpu);
+	lock_guard lk_this{ lock_ };
+
+	auto can_steal = [stealer_cpu](thread& t)
+	{
+	  if (cur_thread.get() == &t ||
+		  t.state != thread::thread_states::READY ||
+		  (t.flags_ & thread::thread_flags::FLAG_IDLE) != 0 ||
+		  (t.flags_ & thread::thread_flags::FLAG_INIT) != 0)
+	  {
+		  return false;
+	  }
+
+	  return t.scheduler_state_.affinity()->cpu == stealer_cpu->id ||
+		  t.scheduler_state_.affinity()->type == cpu_affinity_type::SOFT;
+	};
+
+	// the least important threads of the next round go first
+	for (size_t queue : { current_ ^ 1, current_ })
+	{
+		auto& rq = queues_[queue];
+		for (auto bitmap = rq.bitmap; bitmap != 0;)
+		{
+			size_t priority = 63 - __builtin_clzll(bitmap);
+			bitmap &= ~(1ull << priority);
+
+			for (auto& t : rq.lists[priority])
+			{
+				if (can_steal(t))
+				{
+					remove_locked(&t);
+					return &t;
+				}
+			}
+		}
+	}
+
+	return nullptr;
 }
@@ -1,6 +1,6 @@
 #include "system/deadline.hpp"
 
-#include "drivers/cmos/rtc.hpp"
+#include "drivers/apic/timer.h"
 
 #include "debug/kdebug.h"
 
@@ -10,7 +10,7 @@ const deadline deadline::infinite_{ TIME_INFINITE, timer_slack::none() };
 
 deadline deadline::after(duration_type after, timer_slack slack)
 {
-	auto timestamp = time_add_duration(cmos::cmos_read_rtc_timestamp(), after);
+	auto timestamp = time_add_duration(timer::now(), after);
 	return deadline(timestamp, slack);
 }
 
@@ -19,11 +19,11 @@ time_type deadline::latest() const
 	switch (slack_.mode())
 	{
 	case TIMER_SLACK_CENTER:
-		return time_sub_duration(when_, slack_.amount());
+		return time_add_duration(when_, slack_.amount());
 	case TIMER_SLACK_LATE:
-		return when_;
+		return time_add_duration(when_, slack_.amount());
 	case TIMER_SLACK_EARLY:
-		return time_sub_duration(when_, slack_.amount());
+		return when_;
 	default:
 		KDEBUG_RICHPANIC("invalid timer mode\n", "Deadline", false, "slack mode :%u\n", slack_.mode());
 	}
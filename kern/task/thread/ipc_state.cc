@@ -5,6 +5,7 @@
 #include "task/process/process.hpp"
 #include "task/scheduler/scheduler.hpp"
 
+#include "system/memlayout.h"
 #include "system/mmu.h"
 #include "system/vmm.h"
 #include "system/kmalloc.hpp"
@@ -15,6 +16,8 @@
 
 #include "kbl/lock/lock_guard.hpp"
 
+#include "ktl/algorithm.hpp"
+
 #include <gsl/util>
 
 #include <utility>
@@ -27,40 +30,67 @@ using namespace ipc;
 
 void task::ipc_state::copy_mrs_to_locked(thread* another, size_t st, size_t cnt)
 {
+	if (st >= MR_SIZE)
+	{
+		return;
+	}
+
+	cnt = std::min(cnt, MR_SIZE - st);
 	memmove(&another->ipc_state_.mr_[st], &mr_[st], sizeof(message_register_type) * cnt);
 }
 
 void task::ipc_state::load_mrs_locked(size_t start, ktl::span<ipc::message_register_type> mrs)
 {
-	memmove(&mr_[start], mrs.data(), sizeof(message_register_type) * mrs.size());
+	if (start >= MR_SIZE)
+	{
+		return;
+	}
+
+	auto cnt = std::min(mrs.size(), MR_SIZE - start);
+	memmove(&mr_[start], mrs.data(), sizeof(message_register_type) * cnt);
 }
 
-error_code ipc_state::copy_string_locked(thread* from_t, uintptr_t from, thread* to_t, uintptr_t to, size_t len) TA_REQ(
-	lock_)
+error_code ipc_state::copy_string(thread* from_t, uintptr_t from, thread* to_t, uintptr_t to, size_t len)
 {
-	lock_guard g{ to_t->ipc_state_.lock_ };
+	auto from_as = from_t->address_space();
+	auto to_as = to_t->address_space();
 
-	if (!VALID_USER_PTR(from))
+	// neither address space has to be the current one, so copy page by page through the direct map
+	while (len > 0)
 	{
-		return -ERROR_INVALID_ACCESS;
-	}
+		// the frames are pinned while they are copied, for either side may unmap them meanwhile
+		auto src = vmm::user_va_pin(from_as, from, false);
+		if (has_error(src))
+		{
+			return get_error_code(src);
+		}
 
-	if (!VALID_USER_PTR(to))
-	{
-		return -ERROR_INVALID_ACCESS;
-	}
+		auto dst = vmm::user_va_pin(to_as, to, true);
+		if (has_error(dst))
+		{
+			vmm::user_pa_unpin(get_result(src));
+			return get_error_code(dst);
+		}
 
-	if (!VALID_USER_PTR(from + len - sizeof(uint8_t)))
-	{
-		return -ERROR_INVALID_ACCESS;
-	}
+		size_t chunk = ktl::min({ len,
+		                          SMALL_PAGE_SIZE - (from & (SMALL_PAGE_SIZE - 1)),
+		                          SMALL_PAGE_SIZE - (to & (SMALL_PAGE_SIZE - 1)) });
 
-	if (!VALID_USER_PTR(to + len - sizeof(uint8_t)))
-	{
-		return -ERROR_INVALID_ACCESS;
-	}
+		memmove((void*)P2V(get_result(dst)), (void*)P2V(get_result(src)), chunk);
+
+		vmm::user_pa_unpin(get_result(dst));
+		vmm::user_pa_unpin(get_result(src));
 
-	memmove((void*)to, (void*)from, len);
+		from += chunk;
+		to += chunk;
+		len -= chunk;
+
+		// a long string shouldn't hold the CPU
+		if (len > 0 && cur_thread->get_scheduler_state()->need_reschedule())
+		{
+			scheduler::current::reschedule();
+		}
+	}
 
 	return ERROR_SUCCESS;
 }
@@ -105,7 +135,7 @@ error_code task::ipc_state::send_extended_items(thread* to)
 
 	uint64_t br_index = 1;
 
-	for (size_t idx = tag.untyped_count() + 1; idx < tag.typed_count();)
+	for (size_t idx = tag.untyped_count() + 1; idx < tag.untyped_count() + tag.typed_count() + 1;)
 	{
 		auto mr = from->ipc_state_.get_mr(idx);
 
@@ -152,34 +182,45 @@ error_code task::ipc_state::send_extended_items(thread* to)
 			}
 
 			auto src_item = from->ipc_state_.get_typed_item<ipc::string_item>(idx);
+			idx += 2;
 
+			// the receiver offers its buffers in pairs of address and descriptor
+			if (br_index + 1 >= BR_SIZE)
 			{
-				lock_guard g{ lock_ };
-
-				auto dst_br = get_br(br_index);
-				br_index += 2;
+				return -ERROR_INVALID;
+			}
 
-				if (static_cast<ipc::message_item_types>(get_br(br_index + 1) & 0xF) != ipc::message_item_types::STRING)
-				{
-					return -ERROR_INVALID;
-				}
+			auto receiver = &to->ipc_state_;
+			ipc::buffer_register_type dst_addr = 0, dst_desc = 0;
+			{
+				lock_guard g{ receiver->lock_ };
+				dst_addr = receiver->get_br(br_index);
+				dst_desc = receiver->get_br(br_index + 1);
+			}
 
-				if (static_cast<size_t>(get_br(br_index + 1) >> 10ull) < src_item.length())
-				{
-					return -ERROR_INVALID;
-				}
+			if (static_cast<ipc::message_item_types>(dst_desc & 0xF) != ipc::message_item_types::STRING)
+			{
+				return -ERROR_INVALID;
+			}
 
-				if (auto err = copy_string_locked(from, src_item.address(), to, (uintptr_t)dst_br, src_item.length());
-					err != ERROR_SUCCESS)
-				{
-					return err;
-				}
+			if (static_cast<size_t>(dst_desc >> 10ull) < src_item.length())
+			{
+				return -ERROR_INVALID;
+			}
 
-				decltype(get_br(br_index + 1)) new_br = src_item.length() << 10ull;
-				new_br |= (get_br(br_index + 1) & 0x3FF);
+			// no lock is held here, so that the copy can fault and be preempted
+			if (auto err = copy_string(from, src_item.address(), to, dst_addr, src_item.length());
+				err != ERROR_SUCCESS)
+			{
+				return err;
+			}
 
-				set_br(br_index + 1, new_br);
+			{
+				lock_guard g{ receiver->lock_ };
+				receiver->set_br(br_index + 1, (src_item.length() << 10ull) | (dst_desc & 0x3FF));
 			}
+
+			br_index += 2;
 		}
 		else
 		{
@@ -202,16 +243,18 @@ error_code task::ipc_state::send(thread* to, const deadline& ddl)
 
 		to->ipc_state_.sender_ = parent_;
 
-		copy_mrs_to_locked(to, 0, task::ipc_state::MR_SIZE);
-
-		if (auto err = send_extended_items(to);err != ERROR_SUCCESS)
-		{
-			return err;
-		}
+		auto tag = get_message_tag();
+		copy_mrs_to_locked(to, 0, tag.untyped_count() + tag.typed_count() + 1);
+	}
 
-		to->get_ipc_state()->f_.signal();
+	// extended items take locks of their own
+	if (auto err = send_extended_items(to);err != ERROR_SUCCESS)
+	{
+		return err;
 	}
 
+	to->get_ipc_state()->f_.signal();
+
 	return ERROR_SUCCESS;
 }
 
@@ -239,18 +282,246 @@ error_code task::ipc_state::receive(thread* from, const deadline& ddl)
 	return ERROR_SUCCESS;
 }
 
-void task::ipc_state::load_message(ipc::message* msg)
+void task::ipc_state::transfer_mrs_locked(thread* to) TA_REQ(global_thread_lock)
+{
+	// the receiver is blocked and claimed by us, so nobody else touches its registers
+	auto tag = get_message_tag();
+	auto cnt = std::min(tag.untyped_count() + tag.typed_count() + 1, MR_SIZE);
+	memmove(to->ipc_state_.mr_, mr_, sizeof(message_register_type) * cnt);
+
+	to->ipc_state_.sender_ = parent_;
+}
+
+error_code_with_result<thread*> task::ipc_state::claim_receiver_locked(thread* to, const deadline& ddl) TA_REQ(
+	global_thread_lock)
+{
+	auto target = &to->ipc_state_;
+
+	for (;;)
+	{
+		if (target->wait_state_ == wait_states::RECEIVING)
+		{
+			// it may have just been woken by a timeout and not yet run
+			if (auto receiver = target->ipc_wait_queue_.take_one(ERROR_SUCCESS);receiver != nullptr)
+			{
+				target->wait_state_ = wait_states::NONE;
+				return receiver;
+			}
+		}
+
+		if (auto err = target->callers_.block(wait_queue::interruptible::Yes, ddl);err != ERROR_SUCCESS)
+		{
+			return err;
+		}
+	}
+}
+
+thread* task::ipc_state::claim_caller_locked() TA_REQ(global_thread_lock)
+{
+	auto caller = caller_;
+	caller_ = nullptr;
+
+	if (caller == nullptr || caller->ipc_state_.wait_state_ != wait_states::CALLING ||
+		caller->ipc_state_.callee_ != parent_)
+	{
+		return nullptr;
+	}
+
+	auto ret = caller->ipc_state_.ipc_wait_queue_.take_one(ERROR_SUCCESS);
+	if (ret != nullptr)
+	{
+		caller->ipc_state_.wait_state_ = wait_states::NONE;
+		caller->ipc_state_.callee_ = nullptr;
+	}
+
+	return ret;
+}
+
+error_code task::ipc_state::wait_reply_locked(thread* receiver, thread* to, const deadline& ddl) TA_REQ(
+	global_thread_lock)
+{
+	wait_state_ = wait_states::CALLING;
+	callee_ = to;
+
+	auto err = ipc_wait_queue_.block_and_switch(receiver, wait_queue::interruptible::Yes, ddl);
+
+	if (wait_state_ == wait_states::CALLING)
+	{
+		// no reply has arrived. make sure the callee won't reply to a stale caller
+		if (to->ipc_state_.caller_ == parent_)
+		{
+			to->ipc_state_.caller_ = nullptr;
+		}
+
+		wait_state_ = wait_states::NONE;
+		callee_ = nullptr;
+	}
+
+	if (err == ERROR_SUCCESS)
+	{
+		err = transfer_error_;
+	}
+	transfer_error_ = ERROR_SUCCESS;
+
+	return err;
+}
+
+error_code task::ipc_state::wait_call_locked(thread* next, const deadline& ddl) TA_REQ(global_thread_lock)
+{
+	wait_state_ = wait_states::RECEIVING;
+
+	// callers that found us busy can try again
+	callers_.wake_all(false, ERROR_SUCCESS);
+
+	error_code err = ERROR_SUCCESS;
+	if (next != nullptr)
+	{
+		err = ipc_wait_queue_.block_and_switch(next, wait_queue::interruptible::Yes, ddl);
+	}
+	else
+	{
+		err = ipc_wait_queue_.block(wait_queue::interruptible::Yes, ddl);
+	}
+
+	wait_state_ = wait_states::NONE;
+
+	if (err == ERROR_SUCCESS)
+	{
+		err = transfer_error_;
+	}
+	transfer_error_ = ERROR_SUCCESS;
+
+	return err;
+}
+
+error_code task::ipc_state::call(thread* to, const deadline& ddl) TA_REQ(!global_thread_lock)
+{
+	if (to == parent_)
+	{
+		return -ERROR_INVALID;
+	}
+
+	thread* receiver = nullptr;
+
+	{
+		lock_guard g{ global_thread_lock };
+
+		auto ret = claim_receiver_locked(to, ddl);
+		if (has_error(ret))
+		{
+			return get_error_code(ret);
+		}
+
+		receiver = get_result(ret);
+
+		transfer_mrs_locked(to);
+		to->ipc_state_.caller_ = parent_;
+
+		// fast path: nothing but registers, switch to the receiver right away
+		if (get_message_tag().typed_count() == 0)
+		{
+			return wait_reply_locked(receiver, to, ddl);
+		}
+	}
+
+	// extended items touch address spaces, so transfer them without the global lock.
+	// the receiver stays blocked because it's no longer on any queue.
+	auto err = send_extended_items(to);
+
+	lock_guard g{ global_thread_lock };
+
+	to->ipc_state_.transfer_error_ = err;
+
+	return wait_reply_locked(receiver, to, ddl);
+}
+
+error_code task::ipc_state::reply_wait(const deadline& ddl) TA_REQ(!global_thread_lock)
+{
+	thread* caller = nullptr;
+
+	{
+		lock_guard g{ global_thread_lock };
+
+		caller = claim_caller_locked();
+		if (caller == nullptr)
+		{
+			return wait_call_locked(nullptr, ddl);
+		}
+
+		transfer_mrs_locked(caller);
+
+		if (get_message_tag().typed_count() == 0)
+		{
+			return wait_call_locked(caller, ddl);
+		}
+	}
+
+	auto err = send_extended_items(caller);
+
+	lock_guard g{ global_thread_lock };
+
+	caller->ipc_state_.transfer_error_ = err;
+
+	return wait_call_locked(caller, ddl);
+}
+
+error_code task::ipc_state::load_message(ipc::message* msg)
 {
 	auto tag = msg->get_tag();
 
+	// each count of the tag may exceed the registers on its own
+	if (tag.untyped_count() + tag.typed_count() + 1 > MR_SIZE)
+	{
+		return -ERROR_INVALID;
+	}
+
+	lock::lock_guard g{ lock_ };
+
+	set_message_tag_locked(&tag);
+
+	load_mrs_locked(1, msg->get_items_span(tag));
+
+	return ERROR_SUCCESS;
+}
+
+error_code task::ipc_state::load_short_message(ktl::span<ipc::message_register_type> regs)
+{
+	auto tag = static_cast<ipc::message_tag>(regs[0]);
+
+	if (tag.untyped_count() + tag.typed_count() + 1 > MR_SIZE)
+	{
+		return -ERROR_INVALID;
+	}
+
+	KDEBUG_ASSERT(tag.typed_count() == 0 && tag.untyped_count() < regs.size());
+
 	lock::lock_guard g{ lock_ };
 
 	set_message_tag_locked(&tag);
 
-	load_mrs_locked(1, msg->get_items_span());
+	load_mrs_locked(1, regs.subspan(1, tag.untyped_count()));
+
+	return ERROR_SUCCESS;
 }
 
-void task::ipc_state::store_message(message* msg)
+bool task::ipc_state::store_short_message(ktl::span<ipc::message_register_type> regs)
+{
+	lock_guard g{ lock_ };
+
+	auto tag = get_message_tag();
+	regs[0] = tag.raw();
+
+	if (tag.typed_count() != 0 || tag.untyped_count() >= regs.size())
+	{
+		return false;
+	}
+
+	store_mrs_locked(1, regs.subspan(1, tag.untyped_count()));
+
+	return true;
+}
+
+void task::ipc_state::store_message(message* msg, bool allow_next_sender)
 {
 	{
 		lock_guard g{ lock_ };
@@ -260,7 +531,10 @@ void task::ipc_state::store_message(message* msg)
 		store_mrs_locked(1, msg->get_items_span(get_message_tag()));
 	}
 
-	e_.signal(); // allow next sender to send
+	if (allow_next_sender)
+	{
+		e_.signal(); // allow next sender to send
+	}
 }
 
 error_code ipc_state::wait(const deadline& ddl) TA_REQ(!global_thread_lock)
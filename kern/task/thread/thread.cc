@@ -13,6 +13,8 @@
 
 #include "object/object_manager.hpp"
 
+#include "memory/tlb.hpp"
+
 #include "drivers/acpi/cpu.h"
 
 #include "kbl/lock/lock_guard.hpp"
@@ -245,10 +247,13 @@ void thread::switch_to(interrupt_saved_state_type state_to_restore) TA_REQ(globa
 
 	if (parent_)
 	{
-		lcr3(V2P((uintptr_t)address_space()->pgdir()));
+		auto pgdir = address_space()->pgdir();
+		memory::tlb_activate(pgdir);
+		lcr3(V2P((uintptr_t)pgdir));
 	}
 	else // it's a kernel thread
 	{
+		memory::tlb_activate(vmm::g_kpml4t);
 		lcr3(V2P((uintptr_t)vmm::g_kpml4t));
 	}
 
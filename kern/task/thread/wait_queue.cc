@@ -7,7 +7,7 @@
 
 #include "system/deadline.hpp"
 
-#include "drivers/cmos/rtc.hpp"
+#include "drivers/apic/timer.h"
 
 #include "ktl/move.hpp"
 
@@ -34,7 +34,11 @@ error_code wait_queue::unblock_thread(thread* t, error_code code) TA_REQ(global_
 	}
 
 	auto wq = t->wait_queue_state_.blocking_on_;
-	KDEBUG_ASSERT(wq != nullptr);
+	if (wq == nullptr)
+	{
+		// it has been taken off the queue by someone who will wake it
+		return ERROR_SUCCESS;
+	}
 	KDEBUG_ASSERT(t->wait_queue_state_.holding());
 
 	wq->dequeue(t, code);
@@ -63,14 +67,42 @@ error_code wait_queue::block_etc(const deadline& ddl,
 	interruptible intr) TA_REQ(
 	global_thread_lock)
 {
+	return block_internal(ddl, signal_mask, reason, intr, nullptr);
+}
+
+error_code wait_queue::block_and_switch(thread* next, wait_queue::interruptible intr, const deadline& ddl) TA_REQ(
+	global_thread_lock)
+{
+	KDEBUG_ASSERT(next != nullptr);
+	KDEBUG_ASSERT(next->state == thread::thread_states::BLOCKED);
+
+	return block_internal(ddl, 0, resource_ownership::Normal, intr, next);
+}
+
+error_code wait_queue::block_internal(const deadline& ddl,
+	uint32_t signal_mask,
+	resource_ownership reason,
+	interruptible intr,
+	thread* next) TA_REQ(global_thread_lock)
+{
+	// the thread to switch to must not be lost if we don't block at all
+	auto wake_next = [next]()
+	{
+	  if (next != nullptr)
+	  {
+		  scheduler::current::unblock(next);
+	  }
+	};
+
 	auto current_thread = cur_thread.get();
 	current_thread->scheduler_state_.on_sleep();
 
 	KDEBUG_ASSERT(arch_ints_disabled());
 	KDEBUG_ASSERT(current_thread->state == thread::thread_states::RUNNING);
 
-	if (ddl.when() != TIME_INFINITE && ddl.when() < (time_type)cmos::cmos_read_rtc_timestamp())
+	if (ddl.when() != TIME_INFINITE && ddl.when() <= timer::now())
 	{
+		wake_next();
 		return ERROR_TIMEOUT;
 	}
 
@@ -78,10 +110,12 @@ error_code wait_queue::block_etc(const deadline& ddl,
 	{
 		if (cur_thread->signals_ & thread::SIGNAL_KILLED)
 		{
+			wake_next();
 			return ERROR_INTERNAL_INTR_KILLED;
 		}
 		else if (cur_thread->signals_ & thread::SIGNAL_SUSPEND)
 		{
+			wake_next();
 			return ERROR_INTERNAL_INTR_RETRY;
 		}
 	}
@@ -102,18 +136,30 @@ error_code wait_queue::block_etc(const deadline& ddl,
 	cur_thread->wait_queue_state_.blocking_on_ = this;
 	cur_thread->wait_queue_state_.block_code_ = ERROR_SUCCESS;
 
-	if (ddl.when() != TIME_INFINITE)
+	// the timer lives on this stack, so it must be cancelled before returning
+	scheduler_timer timer{};
+	bool timed = ddl.when() != TIME_INFINITE;
+	if (timed)
 	{
-		scheduler_timer timer;
-
 		timer.arg = current_thread;
 		timer.callback = timeout_handle;
-		timer.expires = ddl.when() - cmos::cmos_read_rtc_timestamp();
 
-		cpu->scheduler->add_timer(&timer);
+		cpu->scheduler->add_timer(&timer, ddl);
 	}
 
-	scheduler::current::block_locked();
+	if (next != nullptr)
+	{
+		scheduler::current::handoff_locked(next);
+	}
+	else
+	{
+		scheduler::current::block_locked();
+	}
+
+	if (timed)
+	{
+		scheduler::remove_timer(&timer);
+	}
 
 	current_thread->wait_queue_state_.interruptible_ = interruptible::No;
 
@@ -131,6 +177,22 @@ thread* wait_queue::peek() TA_REQ(global_thread_lock)
 	return t;
 }
 
+thread* wait_queue::take_one(error_code code) TA_REQ(global_thread_lock)
+{
+	KDEBUG_ASSERT(arch_ints_disabled());
+	KDEBUG_ASSERT(global_thread_lock.holding());
+
+	auto t = peek();
+	if (t)
+	{
+		dequeue(t, code);
+
+		t->scheduler_state_.on_wakeup();
+	}
+
+	return t;
+}
+
 bool wait_queue::wake_one(bool reschedule, error_code code) TA_REQ(global_thread_lock)
 {
 	bool woke = false;
@@ -198,15 +260,26 @@ void wait_queue::dequeue(thread* t, error_code err) TA_REQ(global_thread_lock)
 	t->wait_queue_state_.blocking_on_ = nullptr;
 }
 
-void wait_queue::timeout_handle(scheduler_timer* timer, [[maybe_unused]] time_type time, void* arg)
+void wait_queue::timeout_handle([[maybe_unused]] scheduler_timer* timer, [[maybe_unused]] time_type now, void* arg)
 {
 	auto t = reinterpret_cast<thread*>(arg);
 
-	cpu->scheduler->remove_timer(timer);
+	auto wq = t->wait_queue_state_.blocking_on_;
+	if (wq == nullptr)
+	{
+		// it has been taken off the queue by someone who will wake it
+		return;
+	}
+
+	wq->dequeue(t, ERROR_TIMEOUT);
 
-	unblock_thread(t, ERROR_TIMEOUT);
+	t->scheduler_state_.on_wakeup();
 
-	global_thread_lock.unlock();
+	// it's in an interrupt, so leave switching to the return path
+	if (scheduler::current::unblock(t))
+	{
+		cur_thread->scheduler_state_.set_need_reschedule(true);
+	}
 }
 
 wait_queue::~wait_queue()
@@ -0,0 +1,63 @@
+#include "syscall.h"
+#include "syscall/syscall_args.hpp"
+
+#include "system/memlayout.h"
+#include "system/syscall.h"
+
+#include "kbl/lock/lockstat.hpp"
+
+using namespace syscall;
+
+/// \brief copy the statistics of at most count lock classes to buf
+/// \param buf lockstat_record[count]
+/// \param count capacity of buf
+/// \param total_out the number of lock classes, which can exceed count
+error_code sys_lockstat_read(const syscall_regs* regs)
+{
+#ifdef _KERNEL_LOCKSTAT
+	auto buf = args_get<lock::lockstat_record*, 0>(regs);
+	auto count = args_get<size_t, 1>(regs);
+	auto total_out = args_get<size_t*, 2>(regs);
+
+	// no more records than that are ever written, and a huge count would wrap the region below
+	count = count < lock::LOCKSTAT_RECORD_MAX ? count : lock::LOCKSTAT_RECORD_MAX;
+
+	size_t size = 0;
+	if (__builtin_mul_overflow(count, sizeof(lock::lockstat_record), &size) ||
+		reinterpret_cast<uintptr_t>(buf) + size < reinterpret_cast<uintptr_t>(buf))
+	{
+		return -ERROR_INVALID;
+	}
+
+	if (count != 0 && !VALID_USER_REGION(reinterpret_cast<uintptr_t>(buf), reinterpret_cast<uintptr_t>(buf) + size))
+	{
+		return -ERROR_INVALID;
+	}
+
+	if (total_out != nullptr && !VALID_USER_PTR(total_out))
+	{
+		return -ERROR_INVALID;
+	}
+
+	auto total = lock::lockstat_read(buf, count);
+
+	if (total_out != nullptr)
+	{
+		*total_out = total;
+	}
+
+	return ERROR_SUCCESS;
+#else
+	return -ERROR_UNSUPPORTED;
+#endif
+}
+
+error_code sys_lockstat_reset([[maybe_unused]] const syscall_regs* regs)
+{
+#ifdef _KERNEL_LOCKSTAT
+	lock::lockstat_reset();
+	return ERROR_SUCCESS;
+#else
+	return -ERROR_UNSUPPORTED;
+#endif
+}
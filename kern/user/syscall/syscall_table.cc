@@ -64,6 +64,18 @@ extern "C" syscall_entry syscall_table[SYSCALL_COUNT_MAX + 1] = {
 	[SYS_ipc_accept] =sys_ipc_accept,
 	[SYS_ipc_store] = sys_ipc_store,
 	[SYS_ipc_wait]= sys_ipc_wait,
+	[SYS_ipc_call] = sys_ipc_call,
+	[SYS_ipc_reply_wait] = sys_ipc_reply_wait,
+	[SYS_ipc_call_short] = sys_ipc_call_short,
+	[SYS_ipc_reply_wait_short] = sys_ipc_reply_wait_short,
+
+	[SYS_channel_create] = sys_channel_create,
+	[SYS_channel_map] = sys_channel_map,
+	[SYS_channel_wait] = sys_channel_wait,
+	[SYS_channel_notify] = sys_channel_notify,
+
+	[SYS_lockstat_read] = sys_lockstat_read,
+	[SYS_lockstat_reset] = sys_lockstat_reset,
 };
 
 #pragma clang diagnostic pop
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "system/types.h"
+#include "system/error.hpp"
+#include "system/time.hpp"
+
+#include "messages.hpp"
+#include "task/ipc/public/channel.hpp"
+#include "handle_type.hpp"
+
+#include "compiler/compiler_extensions.hpp"
+
+#include "dionysus_api.hpp"
+
+DIONYSUS_API error_code channel_create(OUT object::handle_type* out, size_t capacity);
+
+/// \brief map the ring of a channel
+/// \param addr where to map, which must be page-aligned and have task::ipc::channel_size(capacity) bytes free
+/// \param capacity the capacity of the channel, can be null
+DIONYSUS_API error_code channel_map(object::handle_type h, void* addr, OUT size_t* capacity);
+
+DIONYSUS_API error_code channel_wait(object::handle_type h, time_type timeout);
+
+DIONYSUS_API error_code channel_notify(object::handle_type h);
+
+/// \brief enqueue a message with no typed items, and notify the consumer only if it's waiting
+/// \return -ERROR_BUSY if the ring is full
+DIONYSUS_API error_code channel_send(object::handle_type h, task::ipc::channel_ring* ring, task::ipc::message* msg);
+
+/// \brief take all the messages available up to max, waiting only if there is none
+/// \param received count of messages taken
+DIONYSUS_API error_code channel_receive(object::handle_type h,
+	task::ipc::channel_ring* ring,
+	task::ipc::message* msgs,
+	size_t max,
+	OUT size_t* received,
+	time_type timeout);
@@ -7,10 +7,14 @@
 
 #include "ipc.hpp"
 
+#include "channel.hpp"
+
 #include "process.hpp"
 
 #include "thread.hpp"
 
+#include "lockstat.hpp"
+
 DIONYSUS_API error_code terminate(error_code e);
 DIONYSUS_API error_code set_heap_size(uintptr_t* size);
 
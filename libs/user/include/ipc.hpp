@@ -7,6 +7,7 @@
 
 #include "messages.hpp"
 #include "handle_type.hpp"
+#include "kernel_object.hpp"
 
 #include "dionysus_api.hpp"
 
@@ -22,3 +23,10 @@ DIONYSUS_API error_code ipc_accept(task::ipc::message_acceptor* acc);
 
 DIONYSUS_API error_code ipc_wait(time_type timeout);
 
+
+/// \brief send msg to target and wait for its reply, which is stored back to msg
+DIONYSUS_API error_code ipc_call(object::handle_type target, task::ipc::message* msg, time_type timeout);
+
+/// \brief reply msg to the last caller if it's waiting, then wait for the next call and store it to msg
+/// \param from koid of the caller, can be null
+DIONYSUS_API error_code ipc_reply_wait(task::ipc::message* msg, object::koid_type* from, time_type timeout);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "system/types.h"
+#include "system/error.hpp"
+
+#include "debug/public/lockstat.hpp"
+
+#include "compiler/compiler_extensions.hpp"
+
+#include "dionysus_api.hpp"
+
+/// \brief read kernel lock contention statistics. fails with -ERROR_UNSUPPORTED if the
+/// kernel isn't built with KERNEL_LOCKSTAT
+/// \param total the number of lock classes, which may exceed count. can be null
+DIONYSUS_API error_code lockstat_read(OUT lock::lockstat_record* buf, size_t count, OUT size_t* total);
+
+DIONYSUS_API error_code lockstat_reset();
@@ -0,0 +1,95 @@
+#include "channel.hpp"
+#include "syscall_client.hpp"
+
+DIONYSUS_API error_code channel_create(OUT object::handle_type* out, size_t capacity)
+{
+	return make_syscall(syscall::SYS_channel_create, out, capacity);
+}
+
+DIONYSUS_API error_code channel_map(object::handle_type h, void* addr, OUT size_t* capacity)
+{
+	return make_syscall(syscall::SYS_channel_map, h, addr, capacity);
+}
+
+DIONYSUS_API error_code channel_wait(object::handle_type h, time_type timeout)
+{
+	return make_syscall(syscall::SYS_channel_wait, h, timeout);
+}
+
+DIONYSUS_API error_code channel_notify(object::handle_type h)
+{
+	return make_syscall(syscall::SYS_channel_notify, h);
+}
+
+DIONYSUS_API error_code channel_send(object::handle_type h, task::ipc::channel_ring* ring, task::ipc::message* msg)
+{
+	auto tag = msg->get_tag();
+	if (tag.typed_count() != 0 || tag.untyped_count() >= task::ipc::CHANNEL_SLOT_REGS)
+	{
+		return -ERROR_INVALID;
+	}
+
+	if (!ring->try_send(tag, msg->get_items_span().data()))
+	{
+		return -ERROR_BUSY;
+	}
+
+	if (ring->should_notify())
+	{
+		return channel_notify(h);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+DIONYSUS_API error_code channel_receive(object::handle_type h,
+	task::ipc::channel_ring* ring,
+	task::ipc::message* msgs,
+	size_t max,
+	OUT size_t* received,
+	time_type timeout)
+{
+	size_t count = 0;
+
+	for (;;)
+	{
+		task::ipc::message_register_type regs[task::ipc::CHANNEL_SLOT_REGS]{};
+		while (count < max && ring->try_receive(regs))
+		{
+			// the ring is shared with the sender, so a slot it filled is checked like channel_send would
+			task::ipc::message_tag tag{ regs[0] };
+			if (tag.typed_count() != 0 || tag.untyped_count() >= task::ipc::CHANNEL_SLOT_REGS)
+			{
+				continue;
+			}
+
+			msgs[count].set_tag(tag);
+
+			auto items = msgs[count].get_items_span();
+			for (size_t i = 0; i < items.size() && i < task::ipc::CHANNEL_SLOT_REGS - 1; i++)
+			{
+				items[i] = regs[i + 1];
+			}
+
+			count++;
+		}
+
+		if (count != 0 || max == 0)
+		{
+			break;
+		}
+
+		// only enter the kernel if nothing arrives after the producers are told to notify
+		if (ring->prepare_wait())
+		{
+			if (auto err = channel_wait(h, timeout);err != ERROR_SUCCESS)
+			{
+				*received = 0;
+				return err;
+			}
+		}
+	}
+
+	*received = count;
+	return ERROR_SUCCESS;
+}
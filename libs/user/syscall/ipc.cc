@@ -1,6 +1,67 @@
 #include "ipc.hpp"
 #include "syscall_client.hpp"
 
+/// \brief make a syscall with a short message in registers. see task::ipc::SHORT_MESSAGE_ITEMS_MAX
+/// the received message comes back in registers too, unless it's too long and has been stored to msg
+static inline error_code make_short_message_syscall(uint64_t syscall_number,
+	task::ipc::message* msg,
+	uint64_t arg0,
+	uint64_t arg1,
+	uint64_t arg2)
+{
+	auto tag = msg->get_tag();
+	auto items = msg->get_items_span();
+
+	uint64_t mrs[task::ipc::SHORT_MESSAGE_ITEMS_MAX]{};
+	for (size_t i = 0; i < tag.untyped_count(); i++)
+	{
+		mrs[i] = items[i];
+	}
+
+	register uint64_t r10 asm("r10") = tag.raw();
+	register uint64_t r8 asm("r8") = mrs[0];
+	register uint64_t r9 asm("r9") = mrs[1];
+	register uint64_t r12 asm("r12") = mrs[2];
+	register uint64_t r13 asm("r13") = mrs[3];
+	register uint64_t r14 asm("r14") = mrs[4];
+	register uint64_t r15 asm("r15") = mrs[5];
+
+	error_code ret = 0;
+
+	// rcx and r11 are used by syscall instruction and therefore should be protected
+	asm volatile ("syscall"
+	: "=a"(ret), "+r"(r10), "+r"(r8), "+r"(r9), "+r"(r12), "+r"(r13), "+r"(r14), "+r"(r15)
+	: "a"(syscall_number), "D"(arg0), "S"(arg1), "d"(arg2)
+	: "rcx", "r11", "rbx", "cc", "memory");
+
+	if (ret != ERROR_SUCCESS)
+	{
+		return ret;
+	}
+
+	task::ipc::message_tag received{ r10 };
+	if (received.typed_count() == 0 && received.untyped_count() <= task::ipc::SHORT_MESSAGE_ITEMS_MAX)
+	{
+		uint64_t received_mrs[] = { r8, r9, r12, r13, r14, r15 };
+
+		msg->set_tag(received);
+
+		auto received_items = msg->get_items_span();
+		for (size_t i = 0; i < received.untyped_count(); i++)
+		{
+			received_items[i] = received_mrs[i];
+		}
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static inline bool is_short_message(task::ipc::message* msg)
+{
+	auto tag = msg->get_tag();
+	return tag.typed_count() == 0 && tag.untyped_count() <= task::ipc::SHORT_MESSAGE_ITEMS_MAX;
+}
+
 DIONYSUS_API error_code ipc_load_message(task::ipc::message* msg)
 {
 	return make_syscall(syscall::SYS_ipc_load_message, msg);
@@ -30,3 +91,31 @@ error_code ipc_wait(time_type timeout)
 {
 	return make_syscall(syscall::SYS_ipc_wait, timeout);
 }
+
+DIONYSUS_API error_code ipc_call(object::handle_type target, task::ipc::message* msg, time_type timeout)
+{
+	if (is_short_message(msg))
+	{
+		return make_short_message_syscall(syscall::SYS_ipc_call_short,
+			msg,
+			target,
+			reinterpret_cast<uint64_t>(msg),
+			timeout);
+	}
+
+	return make_syscall(syscall::SYS_ipc_call, target, msg, timeout);
+}
+
+DIONYSUS_API error_code ipc_reply_wait(task::ipc::message* msg, object::koid_type* from, time_type timeout)
+{
+	if (is_short_message(msg))
+	{
+		return make_short_message_syscall(syscall::SYS_ipc_reply_wait_short,
+			msg,
+			reinterpret_cast<uint64_t>(msg),
+			reinterpret_cast<uint64_t>(from),
+			timeout);
+	}
+
+	return make_syscall(syscall::SYS_ipc_reply_wait, msg, from, timeout);
+}
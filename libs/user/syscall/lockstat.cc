@@ -0,0 +1,12 @@
+#include "lockstat.hpp"
+#include "syscall_client.hpp"
+
+DIONYSUS_API error_code lockstat_read(OUT lock::lockstat_record* buf, size_t count, OUT size_t* total)
+{
+	return make_syscall(syscall::SYS_lockstat_read, buf, count, total);
+}
+
+DIONYSUS_API error_code lockstat_reset()
+{
+	return make_syscall(syscall::SYS_lockstat_reset);
+}